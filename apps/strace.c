@@ -119,6 +119,9 @@ const char * syscall_names[] = {
 	[SYS_GETSOCKNAME]  = "getsockname",
 	[SYS_GETPEERNAME]  = "getpeername",
 	[SYS_GETPPID]      = "getppid",
+	[SYS_MMAP]         = "mmap",
+	[SYS_MUNMAP]       = "munmap",
+	[SYS_MPROTECT]     = "mprotect",
 };
 
 char syscall_mask[] = {
@@ -210,6 +213,9 @@ char syscall_mask[] = {
 	[SYS_GETSOCKNAME]  = 1,
 	[SYS_GETPEERNAME]  = 1,
 	[SYS_GETPPID]      = 1,
+	[SYS_MMAP]         = 1,
+	[SYS_MUNMAP]       = 1,
+	[SYS_MPROTECT]     = 1,
 };
 
 static const int syscall_set_net[] = {
@@ -233,7 +239,7 @@ static const int syscall_set_desc[] = {
 };
 
 static const int syscall_set_memory[] = {
-	SYS_SBRK, SYS_SHM_OBTAIN, SYS_SHM_RELEASE, 0
+	SYS_SBRK, SYS_SHM_OBTAIN, SYS_SHM_RELEASE, SYS_MMAP, SYS_MUNMAP, SYS_MPROTECT, 0
 };
 
 static const int syscall_set_ipc[] = {
@@ -864,6 +870,18 @@ static void handle_syscall(pid_t pid, struct URegs * r) {
 		case SYS_SBRK:
 			uint_arg(uregs_syscall_arg1(r));
 			break;
+		case SYS_MMAP:
+			pointer_arg(uregs_syscall_arg1(r));
+			break;
+		case SYS_MUNMAP:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r));
+			break;
+		case SYS_MPROTECT:
+			pointer_arg(uregs_syscall_arg1(r)); COMMA;
+			uint_arg(uregs_syscall_arg2(r)); COMMA;
+			int_arg(uregs_syscall_arg3(r));
+			break;
 		case SYS_SEEK:
 			fd_arg(pid, uregs_syscall_arg1(r)); COMMA;
 			int_arg(uregs_syscall_arg2(r)); COMMA;
@@ -1179,6 +1197,10 @@ static void finish_syscall(pid_t pid, int syscall, struct URegs * r) {
 		case SYS_SBRK:
 			fprintf(logfile, ") = %#zx\n", uregs_syscall_result(r));
 			break;
+		case SYS_MMAP:
+			if ((intptr_t)uregs_syscall_result(r) < 0) maybe_errno(r);
+			else fprintf(logfile, ") = %#zx\n", uregs_syscall_result(r));
+			break;
 		case SYS_EXECVE:
 			if (r == NULL) fprintf(logfile, ") = 0\n");
 			else maybe_errno(r);
@@ -0,0 +1,109 @@
+/**
+ * @brief Quick spot check of mmap, munmap and mprotect
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define SIZE 0x3000
+
+static int check(const char * what, unsigned char * buf, size_t len, unsigned char expected) {
+	for (size_t i = 0; i < len; ++i) {
+		if (buf[i] != expected) {
+			fprintf(stderr, "%s: byte %zu was %#x, expected %#x\n", what, i, (unsigned int)buf[i], (unsigned int)expected);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	/* Anonymous memory starts out zeroed */
+	unsigned char * anon = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (anon == MAP_FAILED) {
+		perror("mmap anonymous");
+		return 1;
+	}
+	if (check("anonymous", anon, SIZE, 0)) return 1;
+	memset(anon, 0x11, SIZE);
+	if (munmap(anon, SIZE)) {
+		perror("munmap");
+		return 1;
+	}
+
+	int fd = open("test.file", O_RDWR | O_CREAT, 0644);
+	unsigned char buf[SIZE];
+	memset(buf, 0xAA, SIZE);
+	pwrite(fd, buf, SIZE, 0);
+
+	/* Private file mappings see the file, but writes stay in this process */
+	unsigned char * priv = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (priv == MAP_FAILED) {
+		perror("mmap private");
+		return 1;
+	}
+	if (check("private", priv, SIZE, 0xAA)) return 1;
+	memset(priv, 0x55, SIZE);
+	munmap(priv, SIZE);
+	pread(fd, buf, SIZE, 0);
+	if (check("file after private write", buf, SIZE, 0xAA)) return 1;
+
+	/* Shared file mappings write through to the file, including from children */
+	unsigned char * shared = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared == MAP_FAILED) {
+		perror("mmap shared");
+		return 1;
+	}
+	pid_t child = fork();
+	if (!child) {
+		memset(shared, 0x77, SIZE);
+		return 0;
+	}
+	waitpid(child, NULL, 0);
+	if (check("shared after child write", shared, SIZE, 0x77)) return 1;
+	munmap(shared, SIZE);
+	pread(fd, buf, SIZE, 0);
+	if (check("file after shared write", buf, SIZE, 0x77)) return 1;
+
+	/* Read-only memory can't be written */
+	unsigned char * ro = mmap(NULL, SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	ro[0] = 1;
+	if (mprotect(ro, SIZE, PROT_READ)) {
+		perror("mprotect");
+		return 1;
+	}
+	child = fork();
+	if (!child) {
+		ro[0] = 2;
+		return 0;
+	}
+	int status;
+	waitpid(child, &status, 0);
+	if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGSEGV) {
+		fprintf(stderr, "write to read-only mapping did not fault\n");
+		return 1;
+	}
+
+	/* ...until it is made writable again, without losing what was there */
+	mprotect(ro, SIZE, PROT_READ | PROT_WRITE);
+	if (ro[0] != 1) {
+		fprintf(stderr, "mprotect lost the contents of the page\n");
+		return 1;
+	}
+	ro[0] = 3;
+
+	unlink("test.file");
+	fprintf(stderr, "ok\n");
+	return 0;
+}
@@ -0,0 +1,208 @@
+/**
+ * @brief Network latency and packet rate test
+ *
+ * Pings a host back-to-back and reports the spread of round trip
+ * times, then sends UDP datagrams at it as fast as it can for a while
+ * and reports the packet rate. Interrupts taken along the way are read
+ * from /proc/e1000, if it's there. Under QEMU's user networking the
+ * default host, 10.0.2.2, answers pings and discards the datagrams.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+struct ICMP_Header {
+	uint8_t type, code;
+	uint16_t checksum;
+	uint16_t identifier;
+	uint16_t sequence_number;
+	uint8_t payload[];
+};
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Total interrupts over every e1000 interface, or 0 if the driver isn't loaded. */
+static unsigned long interrupts(void) {
+	FILE * f = fopen("/proc/e1000", "r");
+	if (!f) return 0;
+	unsigned long total = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		if (!strncmp(line, "Interrupts:", 11)) total += strtoul(line + 11, NULL, 10);
+	}
+	fclose(f);
+	return total;
+}
+
+static int compare(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+static int latency(struct sockaddr_in * dest, int count) {
+	int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	uint64_t * times = malloc(sizeof(uint64_t) * count);
+	int received = 0;
+	char ping_buf[64] = {0};
+	struct ICMP_Header * ping = (void*)ping_buf;
+	ping->type = 8;
+
+	unsigned long ints = interrupts();
+	for (int i = 0; i < count; ++i) {
+		ping->sequence_number = htons(i + 1);
+		uint64_t sent_at = now_us();
+		if (sendto(sock, ping_buf, sizeof(ping_buf), 0, (struct sockaddr*)dest, sizeof(*dest)) < 0) {
+			perror("sendto");
+			return 1;
+		}
+
+		/* Wait for this ping's reply, skipping any to earlier pings that timed out. */
+		while (1) {
+			struct pollfd fds[1] = {{ .fd = sock, .events = POLLIN }};
+			if (poll(fds, 1, 1000) <= 0) break;
+
+			char data[256];
+			struct sockaddr_in source;
+			struct iovec iov = { data, sizeof(data) };
+			struct msghdr msg = {
+				.msg_name = &source,
+				.msg_namelen = sizeof(source),
+				.msg_iov = &iov,
+				.msg_iovlen = 1,
+			};
+			ssize_t len = recvmsg(sock, &msg, 0);
+			struct ICMP_Header * reply = (void*)data;
+			if (len >= (ssize_t)sizeof(struct ICMP_Header) && reply->type == 0 && ntohs(reply->sequence_number) == i + 1) {
+				times[received++] = now_us() - sent_at;
+				break;
+			}
+		}
+	}
+	ints = interrupts() - ints;
+	close(sock);
+
+	if (!received) {
+		fprintf(stderr, "no replies from %s\n", inet_ntoa(dest->sin_addr));
+		return 1;
+	}
+
+	qsort(times, received, sizeof(uint64_t), compare);
+	uint64_t total = 0;
+	for (int i = 0; i < received; ++i) total += times[i];
+
+	printf("ping: %d/%d replies, round trip us: min %llu median %llu avg %llu p99 %llu max %llu\n",
+		received, count,
+		(unsigned long long)times[0],
+		(unsigned long long)times[received / 2],
+		(unsigned long long)(total / received),
+		(unsigned long long)times[(received * 99) / 100],
+		(unsigned long long)times[received - 1]);
+	printf("ping: %lu interrupts\n", ints);
+	free(times);
+	return 0;
+}
+
+static int rate(struct sockaddr_in * dest, int port, int seconds, size_t size) {
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in to = *dest;
+	to.sin_port = htons(port);
+
+	char * buf = calloc(1, size);
+	unsigned long sent = 0;
+	unsigned long ints = interrupts();
+	uint64_t start = now_us();
+	uint64_t deadline = start + (uint64_t)seconds * 1000000;
+	uint64_t now = start;
+
+	while (now < deadline) {
+		for (int i = 0; i < 64; ++i) {
+			if (sendto(sock, buf, size, 0, (struct sockaddr*)&to, sizeof(to)) < 0) {
+				perror("sendto");
+				return 1;
+			}
+			sent++;
+		}
+		now = now_us();
+	}
+
+	uint64_t elapsed = now - start;
+	ints = interrupts() - ints;
+	close(sock);
+
+	printf("udp: %lu datagrams of %zu bytes in %llu ms: %llu packets/s, %llu KiB/s\n",
+		sent, size, (unsigned long long)(elapsed / 1000),
+		(unsigned long long)sent * 1000000 / elapsed,
+		(unsigned long long)sent * size * 1000000 / 1024 / elapsed);
+	printf("udp: %lu interrupts", ints);
+	if (ints) printf(", %lu packets per interrupt", sent / ints);
+	printf("\n");
+	free(buf);
+	return 0;
+}
+
+static int usage(char * argv[]) {
+	fprintf(stderr, "usage: %s [-n pings] [-t seconds] [-s size] [-p port] [host]\n", argv[0]);
+	return 1;
+}
+
+int main(int argc, char * argv[]) {
+	int count = 1000;
+	int seconds = 5;
+	size_t size = 64;
+	int port = 9;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "n:t:s:p:")) != -1) {
+		switch (opt) {
+			case 'n': count = atoi(optarg); break;
+			case 't': seconds = atoi(optarg); break;
+			case 's': size = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			default: return usage(argv);
+		}
+	}
+	if (count < 1 || seconds < 1 || size < 1 || size > 1472) return usage(argv);
+
+	const char * name = optind < argc ? argv[optind] : "10.0.2.2";
+	struct hostent * host = gethostbyname(name);
+	if (!host) {
+		fprintf(stderr, "%s: not found\n", name);
+		return 1;
+	}
+
+	struct sockaddr_in dest = {0};
+	dest.sin_family = AF_INET;
+	memcpy(&dest.sin_addr.s_addr, host->h_addr, host->h_length);
+
+	if (latency(&dest, count)) return 1;
+	return rate(&dest, port, seconds, size);
+}
@@ -0,0 +1,115 @@
+/**
+ * @brief Microbenchmark for TLB shootdowns.
+ *
+ * Starts a few threads that keep the address space busy on other
+ * cores, then repeatedly maps, touches, and unmaps a region and
+ * forks children that exit immediately. Both operations change
+ * mappings that the busy threads may have cached, so their cost
+ * is dominated by how TLB shootdowns are delivered.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/sysfunc.h>
+
+#define REGION_BASE 0x600000000000UL
+
+static volatile int done = 0;
+static volatile uint8_t shared[4096 * 16];
+
+static void * spinner(void * _unused) {
+	size_t i = 0;
+	while (!done) {
+		shared[(i * 4096) % sizeof(shared)]++;
+		i++;
+	}
+	return NULL;
+}
+
+static uint64_t now_us(void) {
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return (uint64_t)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+static void usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-t threads] [-i iterations] [-p pages]\n"
+		"\n"
+		" -t threads     \033[3mbusy threads sharing our address space (default 3)\033[0m\n"
+		" -i iterations  \033[3mmap/unmap and fork iterations (default 1000)\033[0m\n"
+		" -p pages       \033[3mpages mapped and unmapped per iteration (default 16)\033[0m\n",
+		argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	int threads = 3;
+	int iterations = 1000;
+	int pages = 16;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "t:i:p:h")) != -1) {
+		switch (opt) {
+			case 't': threads = atoi(optarg); break;
+			case 'i': iterations = atoi(optarg); break;
+			case 'p': pages = atoi(optarg); break;
+			case 'h':
+			default:
+				usage(argv);
+				return 1;
+		}
+	}
+
+	pthread_t * tids = calloc(threads, sizeof(pthread_t));
+	for (int i = 0; i < threads; ++i) {
+		pthread_create(&tids[i], NULL, spinner, NULL);
+	}
+
+	size_t size = (size_t)pages * 4096;
+	char * region = (char *)REGION_BASE;
+
+	uint64_t start = now_us();
+	for (int i = 0; i < iterations; ++i) {
+		char * args[] = {region, (char *)size};
+		if (sysfunc(TOARU_SYS_FUNC_MMAP, args)) {
+			fprintf(stderr, "%s: mmap failed\n", argv[0]);
+			done = 1;
+			return 1;
+		}
+		for (int p = 0; p < pages; ++p) {
+			region[p * 4096] = i;
+		}
+		sysfunc(TOARU_SYS_FUNC_MUNMAP, args);
+	}
+	uint64_t unmap_time = now_us() - start;
+
+	start = now_us();
+	for (int i = 0; i < iterations; ++i) {
+		pid_t child = fork();
+		if (!child) _exit(0);
+		waitpid(child, NULL, 0);
+	}
+	uint64_t fork_time = now_us() - start;
+
+	done = 1;
+	for (int i = 0; i < threads; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+
+	fprintf(stdout, "%d threads, %d iterations, %d pages\n", threads, iterations, pages);
+	fprintf(stdout, "map/unmap: %lu us total, %lu us/iteration\n",
+		(unsigned long)unmap_time, (unsigned long)(unmap_time / iterations));
+	fprintf(stdout, "fork/exit: %lu us total, %lu us/iteration\n",
+		(unsigned long)fork_time, (unsigned long)(fork_time / iterations));
+
+	return 0;
+}
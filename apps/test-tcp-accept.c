@@ -0,0 +1,124 @@
+/**
+ * @brief Loopback TCP connection load test
+ *
+ * Forks a client that opens and closes connections to a listening
+ * socket as fast as it can, and reports how long each connect() took.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <sys/fswait.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int client(struct sockaddr_in * addr, int count) {
+	uint64_t total = 0, worst = 0;
+	uint64_t start = now_us();
+
+	for (int i = 0; i < count; ++i) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0) {
+			perror("socket");
+			return 1;
+		}
+
+		uint64_t before = now_us();
+		if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) < 0) {
+			fprintf(stderr, "connect %d: ", i);
+			perror("");
+			return 1;
+		}
+		uint64_t took = now_us() - before;
+		total += took;
+		if (took > worst) worst = took;
+
+		close(fd);
+	}
+
+	uint64_t elapsed = now_us() - start;
+	if (!elapsed) elapsed = 1;
+	fprintf(stderr, "%d connections in %llu.%03llu ms (%llu per second)\n",
+		count, (unsigned long long)(elapsed / 1000), (unsigned long long)(elapsed % 1000),
+		(unsigned long long)count * 1000000 / elapsed);
+	fprintf(stderr, "connect: average %llu us, worst %llu us\n",
+		(unsigned long long)(total / count), (unsigned long long)worst);
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	int count = argc > 1 ? atoi(argv[1]) : 2000;
+	if (count < 1) count = 1;
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	if (listen(server, 64) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	socklen_t len = sizeof(addr);
+	getsockname(server, (struct sockaddr*)&addr, &len);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	pid_t pid = fork();
+	if (!pid) {
+		close(server);
+		return client(&addr, count);
+	}
+
+	int accepted = 0;
+	while (accepted < count) {
+		if (fswait2(1, &server, 5000) != 0) {
+			fprintf(stderr, "timed out waiting for connection %d\n", accepted);
+			kill(pid, SIGKILL);
+			break;
+		}
+		int fd = accept(server, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			break;
+		}
+		close(fd);
+		accepted++;
+	}
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+	close(server);
+
+	if (accepted != count) {
+		fprintf(stderr, "accepted %d of %d connections\n", accepted, count);
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
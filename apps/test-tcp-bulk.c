@@ -0,0 +1,160 @@
+/**
+ * @brief Loopback TCP bulk transfer test
+ *
+ * Forks a client that writes a number of megabytes to a listening
+ * socket, and reports how fast the server read them. The server peeks
+ * at the start of the stream first, and reads into two iovecs at once.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#define CHUNK 65536
+
+static uint64_t now_us(void) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int client(struct sockaddr_in * addr, size_t total) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("socket");
+		return 1;
+	}
+	if (connect(fd, (struct sockaddr*)addr, sizeof(*addr)) < 0) {
+		perror("connect");
+		return 1;
+	}
+
+	static unsigned char buf[CHUNK];
+	size_t sent = 0;
+	while (sent < total) {
+		size_t want = total - sent < CHUNK ? total - sent : CHUNK;
+		for (size_t i = 0; i < want; ++i) buf[i] = (sent + i) & 0xFF;
+		ssize_t r = write(fd, buf, want);
+		if (r <= 0) {
+			perror("write");
+			return 1;
+		}
+		sent += r;
+	}
+
+	close(fd);
+	return 0;
+}
+
+int main(int argc, char * argv[]) {
+	int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+	if (megabytes < 1) megabytes = 1;
+	size_t total = (size_t)megabytes * 1024 * 1024;
+
+	int server = socket(AF_INET, SOCK_STREAM, 0);
+	if (server < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	struct sockaddr_in addr = {0};
+	addr.sin_family = AF_INET;
+	addr.sin_port = 0;
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		perror("bind");
+		return 1;
+	}
+	if (listen(server, 1) < 0) {
+		perror("listen");
+		return 1;
+	}
+
+	socklen_t len = sizeof(addr);
+	getsockname(server, (struct sockaddr*)&addr, &len);
+	addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+
+	pid_t pid = fork();
+	if (!pid) {
+		close(server);
+		return client(&addr, total);
+	}
+
+	int fd = accept(server, NULL, NULL);
+	if (fd < 0) {
+		perror("accept");
+		return 1;
+	}
+
+	static unsigned char buf[CHUNK];
+	size_t received = 0;
+	int bad = 0;
+	uint64_t start = now_us();
+
+	ssize_t peeked = recv(fd, buf, 300, MSG_PEEK | MSG_WAITALL);
+	if (peeked != 300) {
+		fprintf(stderr, "peek returned %zd\n", peeked);
+		bad = 1;
+	}
+	for (ssize_t i = 0; i < peeked && !bad; ++i) {
+		if (buf[i] != (i & 0xFF)) {
+			fprintf(stderr, "bad peeked data at offset %zd\n", i);
+			bad = 1;
+		}
+	}
+
+	while (1) {
+		/* Split at an odd spot so both iovecs get used. */
+		struct iovec iov[2] = {
+			{ buf, 1001 },
+			{ buf + 1001, CHUNK - 1001 },
+		};
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = 2,
+		};
+		ssize_t r = recvmsg(fd, &msg, 0);
+		if (r < 0) {
+			perror("recvmsg");
+			break;
+		}
+		if (r == 0) break;
+		for (ssize_t i = 0; i < r && !bad; ++i) {
+			if (buf[i] != ((received + i) & 0xFF)) {
+				fprintf(stderr, "bad data at offset %zu\n", received + i);
+				bad = 1;
+			}
+		}
+		received += r;
+	}
+	uint64_t elapsed = now_us() - start;
+	if (!elapsed) elapsed = 1;
+
+	close(fd);
+	close(server);
+
+	int status = 0;
+	waitpid(pid, &status, 0);
+
+	fprintf(stderr, "%zu bytes in %llu.%03llu ms (%llu KiB/s)\n",
+		received, (unsigned long long)(elapsed / 1000), (unsigned long long)(elapsed % 1000),
+		(unsigned long long)received * 1000000 / 1024 / elapsed);
+
+	if (received != total || bad) {
+		fprintf(stderr, "expected %zu bytes\n", total);
+		return 1;
+	}
+	return WEXITSTATUS(status);
+}
@@ -1,16 +1,20 @@
 /**
  * @brief Kernel gzip decompressor
  *
- * This is a slimmed down version of libtoaru_inflate; it's an implementation
- * of the tinf algorithm for decompressing gzip/DEFLATE payloads, with a
+ * A table-driven decoder for gzip/DEFLATE payloads, with a
  * very straightforward API: Point @c gzip_inputPtr at your gzip data,
  * point @c gzip_outputPtr where you want the output to go, and then
  * run @c gzip_decompress().
+ *
+ * @c gzip_decompress_stream() does the same without the globals, and
+ * reports how much output is ready as it goes.
  */
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
 
 extern int gzip_decompress(void);
+extern int gzip_decompress_stream(uint8_t * input, uint8_t * output, void (*progress)(void * ctx, size_t written), void * ctx);
 extern uint8_t * gzip_inputPtr;
 extern uint8_t * gzip_outputPtr;
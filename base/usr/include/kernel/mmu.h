@@ -14,6 +14,8 @@
 #define USER_SHM_LOW      0x0000400100000000UL
 #define USER_SHM_HIGH     0x0000500000000000UL
 #define USER_DEVICE_MAP   0x0000400000000000UL
+#define USER_MMAP_LOW     0x0000500100000000UL
+#define USER_MMAP_HIGH    0x0000600000000000UL
 
 #define MMU_FLAG_KERNEL       0x01
 #define MMU_FLAG_WRITABLE     0x02
@@ -22,6 +24,9 @@
 #define MMU_FLAG_SPEC         0x10
 #define MMU_FLAG_WC           (MMU_FLAG_NOCACHE | MMU_FLAG_WRITETHROUGH | MMU_FLAG_SPEC)
 #define MMU_FLAG_NOEXECUTE    0x20
+#define MMU_FLAG_SHARED       0x40
+#define MMU_FLAG_COW          0x80
+#define MMU_FLAG_NOACCESS     0x100
 
 #define MMU_GET_MAKE 0x01
 
@@ -44,8 +49,16 @@ void mmu_set_directory(union PML * new_pml);
 void mmu_free(union PML * from);
 union PML * mmu_clone(union PML * from);
 void mmu_invalidate(uintptr_t addr);
+void mmu_invalidate_range(uintptr_t addr, size_t size);
 uintptr_t mmu_allocate_a_frame(void);
 uintptr_t mmu_allocate_n_frames(int n);
+uintptr_t mmu_try_allocate_n_frames(int n);
+int mmu_frame_ref(uintptr_t frame);
+void mmu_frame_unref(uintptr_t frame);
+int mmu_frame_unref_unshared(uintptr_t frame);
+int mmu_map_user_frame(uintptr_t address, uintptr_t frame, unsigned int flags);
+void mmu_unmap_user(uintptr_t addr, size_t size);
+void mmu_protect_user(uintptr_t addr, size_t size, unsigned int flags);
 union PML * mmu_get_kernel_directory(void);
 void * mmu_map_from_physical(uintptr_t frameaddress);
 void * mmu_map_mmio_region(uintptr_t physical_address, size_t size);
@@ -28,8 +28,8 @@
 
 #define E1000_REG_RXADDR     0x5400
 
-#define E1000_NUM_RX_DESC 512
-#define E1000_NUM_TX_DESC 512
+#define E1000_NUM_RX_DESC 1024
+#define E1000_NUM_TX_DESC 1024
 
 #define RCTL_EN                         (1 << 1)    /* Receiver Enable */
 #define RCTL_SBP                        (1 << 2)    /* Store Bad Packets */
@@ -76,6 +76,9 @@
 #define CMD_VLE                         (1 << 6)    /* VLAN Packet Enable */
 #define CMD_IDE                         (1 << 7)    /* Interrupt Delay Enable */
 
+#define TSTA_DD                         (1 << 0)    /* Descriptor Done */
+#define RSTA_DD                         (1 << 0)    /* Descriptor Done */
+
 #define ICR_TXDW   (1 << 0)
 #define ICR_TXQE   (1 << 1)  /* Transmit queue is empty */
 #define ICR_LSC    (1 << 2)  /* Link status changed */
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Headroom left in front of a new buffer's data, for the headers
+ * of the layers below to be pushed into without copying.
+ */
+#define NETBUF_HEADROOM 64
+
+/**
+ * A reference-counted packet buffer.
+ *
+ * Buffers big enough for an Ethernet frame come from a pool of pages
+ * and have a physical address that can be handed to a NIC. Larger ones,
+ * as used on the loopback interface, come from the heap and have none.
+ *
+ * The packet lives at @c data for @c len bytes. Only the holder of the
+ * sole reference may push or pull headers; once a buffer is shared,
+ * it should be treated as read-only.
+ */
+typedef struct netbuf {
+	uint8_t * data;
+	size_t len;
+	uint8_t * end;       /* End of the storage */
+	uintptr_t phys;      /* Physical address of the buffer, or 0 if it isn't from the pool */
+	volatile int refs;
+	struct netbuf * next;
+	uint8_t head[];
+} netbuf_t;
+
+/**
+ * Pool buffers are a page each, which leaves this much room after the headroom.
+ */
+#define NETBUF_POOL_SIZE 4096
+#define NETBUF_POOL_DATA (NETBUF_POOL_SIZE - sizeof(netbuf_t) - NETBUF_HEADROOM)
+
+extern netbuf_t * netbuf_alloc(size_t size);
+extern netbuf_t * netbuf_copy(const void * data, size_t len);
+extern void netbuf_get(netbuf_t * nb);
+extern void netbuf_put(netbuf_t * nb);
+extern void * netbuf_push(netbuf_t * nb, size_t len);
+extern void * netbuf_pull(netbuf_t * nb, size_t len);
+extern void * netbuf_append(netbuf_t * nb, size_t len);
+extern uintptr_t netbuf_dma(netbuf_t * nb);
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <kernel/vfs.h>
+#include <kernel/net/netbuf.h>
 #include <sys/socket.h>
 
 #define htonl(l)  ( (((l) & 0xFF) << 24) | (((l) & 0xFF00) << 8) | (((l) & 0xFF0000) >> 8) | (((l) & 0xFF000000) >> 24))
@@ -29,18 +30,20 @@ typedef struct SockData {
 	long (*sock_bind)(struct SockData * sock, const struct sockaddr *addr, socklen_t addrlen);
 	long (*sock_getsockname)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 	long (*sock_getpeername)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
+	long (*sock_listen)(struct SockData * sock, int backlog);
+	long (*sock_accept)(struct SockData * sock, struct sockaddr *addr, socklen_t *addrlen);
 
 	struct sockaddr dest;
 	uint32_t priv32[4];
 
-	size_t unread;
-	char * buf;
 	int nonblocking;
+
+	void * pcb; /* Protocol state that may outlive the socket */
 } sock_t;
 
 void net_sock_alert(sock_t * sock);
-void net_sock_add(sock_t * sock, void * frame, size_t size);
-void * net_sock_get(sock_t * sock);
+void net_sock_add(sock_t * sock, netbuf_t * nb);
+netbuf_t * net_sock_get(sock_t * sock);
 sock_t * net_sock_create(void);
 
 extern long net_socket(int,int,int);
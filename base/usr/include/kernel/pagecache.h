@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+
+/**
+ * How a filesystem moves file pages in and out of the page cache.
+ *
+ * All are called without any page cache locks held, and may sleep.
+ * They return 0, or a negative error number to pass on to the caller.
+ * Pages are identified by the filesystem's device pointer and inode
+ * number, which is what all of its nodes for the same file share.
+ */
+typedef struct pagecache_ops {
+	/* Fill @p page with page @p index of a file; bytes past the end of the file should be zero. */
+	int (*readpage)(void * device, uint64_t inode, uint64_t index, uint8_t * page);
+	/* Write page @p index of a file back to its backing store. */
+	int (*writepage)(void * device, uint64_t inode, uint64_t index, uint8_t * page);
+	/* Optional: set aside space for page @p index, up to the file's size or the end of a write still extending it, before it is written to, so writing it back can't run out. */
+	int (*reserve)(void * device, uint64_t inode, uint64_t index);
+} pagecache_ops_t;
+
+struct pagecache_stats {
+	size_t pages;
+	size_t dirty;
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t writebacks;
+};
+
+extern void pagecache_register(void * device, const pagecache_ops_t * ops);
+extern ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern ssize_t pagecache_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer);
+extern uintptr_t pagecache_share(fs_node_t * node, uint64_t index);
+extern void pagecache_truncate(void * device, uint64_t inode, uint64_t size);
+extern int pagecache_sync(void * device);
+extern void pagecache_get_stats(struct pagecache_stats * out);
@@ -28,6 +28,7 @@ typedef struct {
 	intptr_t refcount;
 	union PML * directory;
 	spin_lock_t lock;
+	list_t * areas; /* Demand-paged regions, see kernel/vm.h */
 } page_directory_t;
 
 typedef struct {
@@ -125,8 +126,8 @@ typedef struct process {
 
 	node_t sched_node;
 	node_t sleep_node;
-	node_t * timed_sleep_node;
-	node_t * timeout_node;
+	struct sleeper * timed_sleep_node;
+	struct sleeper * timeout_node;
 
 	struct timeval start;
 	int awoken_index;
@@ -164,11 +165,12 @@ typedef struct process {
 	sigset_t restored_signals;
 } process_t;
 
-typedef struct {
+typedef struct sleeper {
 	uint64_t end_tick;
 	uint64_t end_subtick;
 	process_t * process;
 	int is_fswait;
+	ssize_t index; /* Position in the sleep heap, or -1 once removed */
 } sleeper_t;
 
 struct ProcessorLocal {
@@ -267,11 +269,22 @@ extern int waitpid(int pid, int * status, int options);
 extern int exec(const char * path, int argc, char *const argv[], char *const env[], int interp_depth);
 extern void update_process_usage(uint64_t clock_ticks, uint64_t perf_scale);
 extern void update_process_times_on_exit(void);
+extern int process_ready_pending(void);
+
+struct runqueue_stats {
+	size_t length;       /* Processes currently waiting on this core */
+	uint64_t enqueued;   /* Total times a process was queued here */
+	uint64_t migrations; /* Processes that started running here after last running elsewhere */
+	uint64_t steals;     /* Processes this core took from another core's queue */
+	uint64_t stolen;     /* Processes other cores took from this core's queue */
+	uint64_t ipi_sent;   /* Wakeup IPIs this core sent to idle cores */
+	uint64_t ipi_avoided;/* Wakeups from this core that needed no IPI */
+};
+
+extern int process_runqueue_stats(int cpu, struct runqueue_stats * out);
 
 extern tree_t * process_tree;  /* Parent->Children tree */
 extern list_t * process_list;  /* Flat storage */
-extern list_t * process_queue; /* Ready queue */
-extern list_t * sleep_queue;
 
 extern void arch_enter_tasklet(void);
 extern __attribute__((noreturn)) void arch_resume_user(void);
@@ -283,6 +296,6 @@ extern void arch_set_kernel_stack(uintptr_t);
 extern void arch_enter_user(uintptr_t entrypoint, int argc, char * argv[], char * envp[], uintptr_t stack);
 __attribute__((noreturn))
 extern void arch_enter_signal_handler(uintptr_t,int,struct regs*);
-extern void arch_wakeup_others(void);
+extern void arch_wakeup_core(int cpu);
 extern int arch_return_from_signal_handler(struct regs *r);
 
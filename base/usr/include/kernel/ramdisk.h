@@ -5,3 +5,6 @@
 #include <kernel/vfs.h>
 
 extern fs_node_t * ramdisk_mount(uintptr_t, size_t);
+extern fs_node_t * ramdisk_mount_streaming(uintptr_t, size_t);
+extern void ramdisk_stream_advance(fs_node_t * ramdisk, size_t available);
+extern void ramdisk_stream_fail(fs_node_t * ramdisk);
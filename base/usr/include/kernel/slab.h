@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+
+#define SLAB_ALIGN_DEFAULT sizeof(void*)
+#define SLAB_ALIGN_CACHE   64
+
+typedef void (*slab_ctor_t)(void * obj);
+
+struct slab;
+
+typedef struct slab_cache {
+	const char * name;
+	size_t size;      /* Requested object size */
+	size_t stride;    /* Object size rounded up to the alignment */
+	size_t offset;    /* Offset of the first object in a slab page */
+	size_t per_slab;  /* Objects per slab page */
+	size_t link;      /* Offset of the free list link within an object */
+	slab_ctor_t ctor;
+
+	spin_lock_t lock;
+	struct slab * partial;
+	struct slab * full;
+	struct slab * empty;
+
+	size_t slabs;
+	size_t empty_slabs;
+	size_t active;
+	uint64_t allocs;
+	uint64_t frees;
+} slab_cache_t;
+
+extern list_t * slab_caches;
+
+extern slab_cache_t * slab_create(const char * name, size_t size, size_t align, slab_ctor_t ctor);
+extern void * slab_alloc(slab_cache_t * cache);
+extern void slab_free(slab_cache_t * cache, void * obj);
+extern void slab_destroy(slab_cache_t * cache);
+extern int slab_owns(void * obj);
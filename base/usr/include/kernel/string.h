@@ -35,4 +35,14 @@ extern void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size);
 extern void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size);
 extern void * __attribute__ ((malloc)) valloc(uintptr_t size);
 extern void free(void * ptr);
+
+struct klmalloc_cpu_stats {
+	uint64_t hits;           /* small allocations served from the local magazine */
+	uint64_t misses;         /* magazine was empty and had to be refilled */
+	uint64_t flushes;        /* magazine was full and had to be drained */
+	uint64_t lock_acquires;  /* magazine exchanges with the global heap */
+	uint64_t lock_contended; /* ... where the heap lock was already held */
+	uint64_t cached;         /* cells currently held in magazines */
+};
+extern int malloc_cpu_stats(int cpu, struct klmalloc_cpu_stats * out);
 extern uint8_t startswith(const char * str, const char * accept);
@@ -6,6 +6,20 @@
 
 fs_node_t * tmpfs_create(char * name);
 
+/**
+ * A physically contiguous run of pages backing part of a file,
+ * starting at file block @p block.
+ */
+struct tmpfs_extent {
+	size_t    block;
+	uintptr_t frame;
+	size_t    count;
+};
+
+/*
+ * Files and directories share everything up to and including
+ * the directory linkage, so entries can be handled as either.
+ */
 struct tmpfs_file {
 	spin_lock_t lock;
 	char * name;
@@ -17,10 +31,13 @@ struct tmpfs_file {
 	unsigned int mtime;
 	unsigned int ctime;
 	fs_node_t * mount;
+	struct tmpfs_file * hash_next; /* Next entry in the parent's hash bucket */
+	size_t slot;                   /* Position in the parent's readdir order */
 	size_t length;
 	size_t block_count;
-	size_t pointers;
-	uintptr_t * blocks;
+	size_t extent_count;
+	size_t extent_space;
+	struct tmpfs_extent * extents;
 	char * target;
 };
 
@@ -37,8 +54,23 @@ struct tmpfs_dir {
 	unsigned int mtime;
 	unsigned int ctime;
 	fs_node_t * mount;
-	list_t * files;
+	struct tmpfs_file * hash_next;
+	size_t slot;
+
+	/* Entries by name, chained through hash_next */
+	struct tmpfs_file ** buckets;
+	size_t bucket_count;
+
+	/* Entries in creation order; removed entries leave holes until the next compaction */
+	struct tmpfs_file ** slots;
+	size_t slot_count;
+	size_t slot_space;
+	size_t entries;
+
+	/* Where the last readdir left off, so listings resume instead of rescanning */
+	uint64_t cursor_index;
+	size_t cursor_slot;
+
 	struct tmpfs_dir * parent;
 	spin_lock_t nest_lock;
 };
-
@@ -53,6 +53,23 @@ typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *, size_t size);
 typedef int (*rename_type_t) (struct fs_node *, struct fs_node *, const char *, struct fs_node *, const char *);
 
+/**
+ * Directories whose lookups may be cached point at one of these, one
+ * per filesystem type, which also collects that filesystem's cache
+ * statistics. A filesystem that sets it promises that what finddir
+ * returns only changes through the VFS calls that update the cache:
+ * create, mkdir, symlink, unlink, rename, write, truncate, chmod, chown.
+ * Nodes are cached by copying the fs_node_t alone, so it also promises
+ * they aren't part of anything larger.
+ */
+struct dcache_class {
+	const char * name;
+	uint64_t hits;
+	uint64_t negative_hits;   /* Also hits; remembered names that don't exist */
+	uint64_t misses;
+	struct dcache_class * next;
+};
+
 typedef struct fs_node {
 	struct fs_node * mount;      /* Root fs_node_t entry of mountpoint. */
 	char name[256];         /* The filename. */
@@ -94,6 +111,8 @@ typedef struct fs_node {
 	selectwait_type_t selectwait;
 	chown_type_t chown;
 	rename_type_t rename;
+
+	struct dcache_class * dcache; /* Set on directories whose lookups can be cached */
 } fs_node_t;
 
 struct vfs_entry {
@@ -113,6 +132,7 @@ void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, unsigned long index);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
+fs_node_t *vfs_alloc_node(void);
 int mkdir_fs(char *name, mode_t permission);
 int create_file_fs(char *name, mode_t permission);
 fs_node_t *kopen(const char *filename, unsigned int flags);
@@ -128,6 +148,9 @@ int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
 int truncate_fs(fs_node_t * node, size_t size);
 
+struct dcache_class * dcache_classes(void);
+size_t dcache_entries(void);
+
 void vfs_install(void);
 void * vfs_mount(const char * path, fs_node_t * local_root, const char * type, const char * options);
 typedef fs_node_t * (*vfs_mount_callback)(const char * arg, const char * mount_point);
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/hashmap.h>
+#include <kernel/spinlock.h>
+#include <kernel/process.h>
+
+#define VM_AREA_WRITE    0x01
+#define VM_AREA_EXEC     0x02
+#define VM_AREA_SHARED   0x04  /* Writes are seen by other mappings and reach the file */
+#define VM_AREA_NONE     0x08  /* No access at all (PROT_NONE) */
+#define VM_AREA_MAYWRITE 0x10  /* Shared mapping of a file that was opened for writing */
+
+/**
+ * Pages of a shared mapping.
+ *
+ * Every MAP_SHARED region of the same file refers to the same object,
+ * so all of them see the same frames. Anonymous shared memory gets an
+ * object of its own which is inherited across fork.
+ */
+typedef struct vm_shared {
+	spin_lock_t lock;
+	int refs;
+	fs_node_t * file;     /* NULL for anonymous shared memory */
+	void * device;
+	uint64_t inode;
+	hashmap_t * pages;    /* File page index -> frame */
+} vm_shared_t;
+
+/**
+ * A lazily-populated range of a user address space.
+ *
+ * Pages in [start, end) are filled on first access. Bytes in
+ * [file_start, file_end) come from @c file starting at @c offset,
+ * everything else is zero.
+ */
+typedef struct vm_area {
+	uintptr_t start;      /* Page aligned */
+	uintptr_t end;        /* Page aligned, exclusive */
+	int flags;
+	fs_node_t * file;     /* Backing file, or NULL for anonymous memory */
+	uint64_t offset;      /* File offset of file_start */
+	uintptr_t file_start;
+	uintptr_t file_end;
+	vm_shared_t * shared; /* Set for VM_AREA_SHARED regions */
+} vm_area_t;
+
+extern vm_area_t * vm_area_create(list_t * areas, uintptr_t start, uintptr_t end, int flags,
+	fs_node_t * file, uint64_t offset, uintptr_t file_start, uintptr_t file_end);
+extern list_t * vm_areas_clone(list_t * areas);
+extern void vm_areas_free(list_t * areas);
+extern list_t * vm_areas_remove(list_t * areas, uintptr_t start, uintptr_t end);
+extern int vm_areas_protect(list_t * areas, uintptr_t start, uintptr_t end, int flags);
+extern int vm_areas_overlap(list_t * areas, uintptr_t start, uintptr_t end);
+extern void vm_areas_sync(page_directory_t * dir, uintptr_t start, uintptr_t end);
+extern int vm_area_fault(uintptr_t address);
@@ -27,6 +27,10 @@ _Begin_C_Header
 #define SO_REUSEADDR 2
 #define SO_BINDTODEVICE 3
 
+#define MSG_PEEK     0x02
+#define MSG_DONTWAIT 0x40
+#define MSG_WAITALL  0x100
+
 typedef size_t socklen_t;
 
 struct sockaddr {
@@ -89,3 +89,6 @@
 #define SYS_TRUNCATE 86
 #define SYS_FTRUNCATE 87
 #define SYS_GETPPID 88
+#define SYS_MMAP 89
+#define SYS_MUNMAP 90
+#define SYS_MPROTECT 91
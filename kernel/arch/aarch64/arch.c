@@ -282,14 +282,9 @@ void arch_fatal(void) {
 	}
 }
 
-void arch_wakeup_others(void) {
-	#if 1
-	for (int i = 0; i < processor_count; i++) {
-		if (i == this_core->cpu_id) continue;
-		if (!processor_local_data[i].current_process || (processor_local_data[i].current_process != processor_local_data[i].kernel_idle_task)) continue;
-		gic_send_sgi(1,i);
-	}
-	#endif
+void arch_wakeup_core(int cpu) {
+	if (cpu == this_core->cpu_id) return;
+	gic_send_sgi(1,cpu);
 }
 
 
@@ -126,8 +126,8 @@ void mmu_frame_release(uintptr_t frame_addr) {
 	spin_unlock(frame_alloc_lock);
 }
 
-uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
+static uintptr_t mmu_find_n_frames(int n) {
+	for (uint64_t i = 0; i + PAGE_SIZE * n <= nframes * PAGE_SIZE; i += PAGE_SIZE) {
 		int bad = 0;
 		for (int j = 0; j < n; ++j) {
 			if (mmu_frame_test(i + ram_starts_at + PAGE_SIZE * j)) {
@@ -137,8 +137,17 @@ uintptr_t mmu_first_n_frames(int n) {
 		if (!bad) {
 			return (i + ram_starts_at) / PAGE_SIZE;
 		}
+		/* Nothing starting before the last used frame can fit */
+		i += PAGE_SIZE * (bad - 1);
 	}
 
+	return (uintptr_t)-1;
+}
+
+uintptr_t mmu_first_n_frames(int n) {
+	uintptr_t index = mmu_find_n_frames(n);
+	if (index != (uintptr_t)-1) return index;
+
 	arch_fatal_prepare();
 	dprintf("Failed to allocate %d contiguous frames.\n", n);
 	arch_dump_traceback();
@@ -496,6 +505,18 @@ uintptr_t mmu_allocate_n_frames(int n) {
 	return index;
 }
 
+uintptr_t mmu_try_allocate_n_frames(int n) {
+	spin_lock(frame_alloc_lock);
+	uintptr_t index = mmu_find_n_frames(n);
+	if (index != (uintptr_t)-1) {
+		for (int i = 0; i < n; ++i) {
+			mmu_frame_set((index+i) << PAGE_SHIFT);
+		}
+	}
+	spin_unlock(frame_alloc_lock);
+	return index;
+}
+
 size_t mmu_count_user(union PML * from) {
 	/* We walk 'from' and count user pages */
 	size_t out = 0;
@@ -654,6 +675,35 @@ void mmu_set_directory(union PML * new_pml) {
 void mmu_invalidate(uintptr_t addr) {
 }
 
+/* Without COW reference counts, frames can't be shared between mappings. */
+int mmu_frame_ref(uintptr_t frame) {
+	return 1;
+}
+
+void mmu_frame_unref(uintptr_t frame) {
+	mmu_frame_release(frame << 12);
+}
+
+int mmu_frame_unref_unshared(uintptr_t frame) {
+	mmu_frame_release(frame << 12);
+	return 0;
+}
+
+int mmu_map_user_frame(uintptr_t address, uintptr_t frame, unsigned int flags) {
+	union PML * page = mmu_get_page(address, MMU_GET_MAKE);
+	if (page->bits.present) return 1;
+	page->bits.page = frame;
+	mmu_frame_allocate(page, flags & MMU_FLAG_WRITABLE);
+	return 0;
+}
+
+void mmu_invalidate_range(uintptr_t addr, size_t size) {
+}
+
+/* Pages are mapped eagerly with their final permissions here; mprotect only updates regions. */
+void mmu_protect_user(uintptr_t addr, size_t size, unsigned int flags) {
+}
+
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
 	/* This is all the same as x86, thankfully? */
 	uintptr_t realBits = virtAddr & CANONICAL_MASK;
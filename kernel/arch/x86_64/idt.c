@@ -24,6 +24,7 @@
 #include <kernel/module.h>
 #include <kernel/ksym.h>
 #include <kernel/mmu.h>
+#include <kernel/vm.h>
 #include <kernel/syscall.h>
 
 #include <sys/time.h>
@@ -511,6 +512,11 @@ static void _page_fault(struct regs * r) {
 		if (!mmu_copy_on_write(faulting_address)) return;
 	}
 
+	if (!(r->err_code & 1) && faulting_address < 0x800000000000 && this_core->current_process) {
+		/* Not present; maybe a demand-paged region that hasn't been touched yet. */
+		if (!vm_area_fault(faulting_address)) return;
+	}
+
 	/* Was this a kernel page fault? Those are always a panic. */
 	if (!this_core->current_process || r->cs == 0x08) {
 		panic("Page fault in kernel", r, faulting_address);
@@ -527,6 +533,8 @@ static void _page_fault(struct regs * r) {
 	send_signal(this_core->current_process->id, SIGSEGV, 1);
 }
 
+extern void arch_tlb_shootdown_handler(void);
+
 /**
  * @brief AP-local timer signal.
  *
@@ -627,10 +635,10 @@ void isr_handler_inner(struct regs * r) {
 
 		/* Local interrupts that make it here. */
 		case 123: _local_timer(r); return;
+		case 124: arch_tlb_shootdown_handler(); return;
 		case 127: syscall_handler(r); return;
 
 		/* Other interrupts that don't make it here:
-		 *   124: TLB shootdown, we just reload CR3 in the handler.
 		 *   125: Fatal signal, jumps straight to a cli/hlt loop, though I think this just yields an NMI instead?
 		 *   126: Quiet wakeup, do we even use this anymore?
 		 */
@@ -638,7 +646,7 @@ void isr_handler_inner(struct regs * r) {
 		default: panic("Unexpected interrupt",r,0);
 	}
 
-	if (this_core->current_process == this_core->kernel_idle_task && process_queue && process_queue->head) {
+	if (this_core->current_process == this_core->kernel_idle_task && process_ready_pending()) {
 		/* If this is kidle and we got here, instead of finishing the interrupt
 		 * we can just switch task and there will probably be something else
 		 * to run that was awoken by the interrupt. */
@@ -22,6 +22,7 @@
 #include <kernel/args.h>
 #include <kernel/ksym.h>
 #include <kernel/misc.h>
+#include <kernel/time.h>
 #include <kernel/version.h>
 #include <kernel/elf.h>
 
@@ -278,11 +279,46 @@ void fpu_initialize(void) {
 	: : : "rax");
 }
 
+struct ramdisk_inflate {
+	uintptr_t addr;
+	size_t len;
+	uint8_t * output;
+	uint32_t size;
+	fs_node_t * ramdisk;
+};
+
+static void ramdisk_progress(void * ctx, size_t written) {
+	ramdisk_stream_advance(ctx, written);
+}
+
+/**
+ * @brief Worker thread for initrd_stream: fill in an already-mounted ramdisk.
+ */
+static void ramdisk_inflate_thread(void * arg) {
+	struct ramdisk_inflate * job = arg;
+	uint64_t before = arch_perf_timer();
+
+	if (gzip_decompress_stream(mmu_map_from_physical(job->addr), job->output, ramdisk_progress, job->ramdisk)) {
+		dprintf("gzip: failed to decompress payload\n");
+		ramdisk_stream_fail(job->ramdisk);
+	} else {
+		dprintf("multiboot: Decompressed %lu kB to %u kB in %lu us.\n",
+			(job->len) / 1024,
+			(job->size) / 1024,
+			(arch_perf_timer() - before) / arch_cpu_mhz());
+		for (size_t j = job->addr; j < job->addr + job->len; j += 0x1000) {
+			mmu_frame_clear(j);
+		}
+	}
+
+	free(job);
+	task_exit(0);
+}
+
 static void mount_ramdisk(uintptr_t addr, size_t len) {
 	uint8_t * data = mmu_map_from_physical(addr);
 	if (data[0] == 0x1F && data[1] == 0x8B) {
 		/* Yes - decompress it first */
-		dprintf("multiboot: Decompressing initial ramdisk...\n");
 		uint32_t decompressedSize = *(uint32_t*)mmu_map_from_physical(addr + len - sizeof(uint32_t));
 		size_t pageCount = (((size_t)decompressedSize + 0xFFF) & ~(0xFFF)) >> 12;
 		uintptr_t physicalAddress = mmu_allocate_n_frames(pageCount) << 12;
@@ -291,6 +327,25 @@ static void mount_ramdisk(uintptr_t addr, size_t len) {
 			dprintf("gzip: failed to allocate pages\n");
 			return;
 		}
+
+		if (args_present("initrd_stream")) {
+			/*
+			 * Mount it now and decompress in the background; readers
+			 * only wait for the part of the ramdisk they need.
+			 */
+			dprintf("multiboot: Decompressing initial ramdisk in the background...\n");
+			struct ramdisk_inflate * job = malloc(sizeof(struct ramdisk_inflate));
+			job->addr = addr;
+			job->len = len;
+			job->output = mmu_map_from_physical(physicalAddress);
+			job->size = decompressedSize;
+			job->ramdisk = ramdisk_mount_streaming(physicalAddress, decompressedSize);
+			spawn_worker_thread(ramdisk_inflate_thread, "[initrd]", job);
+			return;
+		}
+
+		dprintf("multiboot: Decompressing initial ramdisk...\n");
+		uint64_t before = arch_perf_timer();
 		gzip_inputPtr = (void*)data;
 		gzip_outputPtr = mmu_map_from_physical(physicalAddress);
 		/* Do the deed */
@@ -299,9 +354,10 @@ static void mount_ramdisk(uintptr_t addr, size_t len) {
 			return;
 		}
 		ramdisk_mount(physicalAddress, decompressedSize);
-		dprintf("multiboot: Decompressed %lu kB to %u kB.\n",
+		dprintf("multiboot: Decompressed %lu kB to %u kB in %lu us.\n",
 			(len) / 1024,
-			(decompressedSize) / 1024);
+			(decompressedSize) / 1024,
+			(arch_perf_timer() - before) / arch_cpu_mhz());
 		/* Free the pages from the original mod */
 		for (size_t j = addr; j < addr + len; j += 0x1000) {
 			mmu_frame_clear(j);
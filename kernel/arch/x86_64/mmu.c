@@ -17,14 +17,21 @@
 #include <kernel/spinlock.h>
 #include <kernel/misc.h>
 #include <kernel/mmu.h>
+#include <kernel/vm.h>
 #include <kernel/arch/x86_64/pml.h>
 
-extern void arch_tlb_shootdown(uintptr_t);
+extern void arch_tlb_shootdown(uintptr_t vaddr, size_t size);
+void mmu_flush_tlb_range(uintptr_t start, uintptr_t end);
 
 /**
  * bitmap page allocator for 4KiB pages
+ *
+ * A second-level summary bitmap has one bit for every word of the
+ * frame bitmap, set when that word is completely allocated, so
+ * searches can skip 2048 allocated frames at a time.
  */
 static volatile uint32_t *frames;
+static volatile uint64_t *frame_summary;
 static size_t nframes;
 static size_t total_memory = 0;
 static size_t unavailable_memory = 0;
@@ -37,6 +44,8 @@ static uint8_t * mem_refcounts = NULL;
 
 #define LARGE_PAGE_SIZE 0x200000UL
 
+#define TLB_FLUSH_MAX_PAGES 32
+
 #define   USER_PML_ACCESS 0x07
 #define KERNEL_PML_ACCESS 0x03
 #define    LARGE_PAGE_BIT 0x80
@@ -52,6 +61,9 @@ static uint8_t * mem_refcounts = NULL;
 #define INDEX_FROM_BIT(b)  ((b) >> 5)
 #define OFFSET_FROM_BIT(b) ((b) & 0x1F)
 
+#define FRAME_CACHE_SIZE  64
+#define FRAME_CACHE_BATCH 32
+
 /**
  * @brief Mark a physical page frame as in use.
  *
@@ -66,6 +78,9 @@ void mmu_frame_set(uintptr_t frame_addr) {
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
 		frames[index]  |= ((uint32_t)1 << offset);
+		if (frame_summary && frames[index] == (uint32_t)-1) {
+			frame_summary[index >> 6] |= ((uint64_t)1 << (index & 63));
+		}
 		asm ("" ::: "memory");
 	}
 }
@@ -86,6 +101,9 @@ void mmu_frame_clear(uintptr_t frame_addr) {
 		uint64_t index  = INDEX_FROM_BIT(frame);
 		uint32_t offset = OFFSET_FROM_BIT(frame);
 		frames[index]  &= ~((uint32_t)1 << offset);
+		if (frame_summary) {
+			frame_summary[index >> 6] &= ~((uint64_t)1 << (index & 63));
+		}
 		asm ("" ::: "memory");
 		if (frame < lowest_available) lowest_available = frame;
 	}
@@ -111,30 +129,69 @@ static spin_lock_t kheap_lock = { 0 };
 static spin_lock_t mmio_space_lock = { 0 };
 static spin_lock_t module_space_lock = { 0 };
 
-void mmu_frame_release(uintptr_t frame_addr) {
-	spin_lock(frame_alloc_lock);
-	mmu_frame_clear(frame_addr);
-	spin_unlock(frame_alloc_lock);
-}
+/**
+ * Per-CPU stacks of free frames. Frames in these stacks are still
+ * marked in use in the bitmap; they let single-frame allocations
+ * and releases skip @c frame_alloc_lock most of the time.
+ */
+static struct frame_cache {
+	volatile int busy;
+	int count;
+	uintptr_t frames[FRAME_CACHE_SIZE];
+} frame_caches[32];
 
 /**
  * @brief Find the first range of @p n contiguous frames.
  *
- * If a large enough region could not be found, results are fatal.
+ * Fully allocated and fully free words of the bitmap are handled
+ * a word at a time, and fully allocated groups of words are
+ * skipped using the summary bitmap.
+ *
+ * @returns a frame index, or -1 if there is no such range.
  */
-uintptr_t mmu_first_n_frames(int n) {
-	for (uint64_t i = 0; i < nframes * PAGE_SIZE; i += PAGE_SIZE) {
-		int bad = 0;
-		for (int j = 0; j < n; ++j) {
-			if (mmu_frame_test(i + PAGE_SIZE * j)) {
-				bad = j + 1;
-			}
+static uintptr_t mmu_find_n_frames(int n) {
+	uintptr_t words = INDEX_FROM_BIT(nframes);
+	uintptr_t run = 0, start = 0;
+
+	for (uintptr_t i = 0; i < words; ) {
+		if (frame_summary && !(i & 63) && frame_summary[i >> 6] == (uint64_t)-1) {
+			run = 0;
+			i += 64;
+			continue;
 		}
-		if (!bad) {
-			return i / PAGE_SIZE;
+
+		uint32_t bits = frames[i];
+		if (bits == (uint32_t)-1) {
+			run = 0;
+		} else if (bits == 0) {
+			if (!run) start = i << 5;
+			run += 32;
+		} else {
+			for (uintptr_t j = 0; j < 32; ++j) {
+				if (bits & ((uint32_t)1 << j)) {
+					run = 0;
+				} else {
+					if (!run) start = (i << 5) + j;
+					if (++run >= (uintptr_t)n) return start;
+				}
+			}
 		}
+		if (run >= (uintptr_t)n) return start;
+		i++;
 	}
 
+	return (uintptr_t)-1;
+}
+
+/**
+ * @brief Find the first range of @p n contiguous frames.
+ *
+ * If a large enough region could not be found, results are fatal.
+ */
+uintptr_t mmu_first_n_frames(int n) {
+	uintptr_t index = mmu_find_n_frames(n);
+	if (index != (uintptr_t)-1) return index;
+
 	arch_fatal_prepare();
 	dprintf("Failed to allocate %d contiguous frames.\n", n);
 	arch_dump_traceback();
@@ -144,22 +201,44 @@ uintptr_t mmu_first_n_frames(int n) {
 
 /**
  * @brief Find the first available frame from the bitmap.
+ *
+ * @returns a frame index, or -1 if there are no free frames.
  */
-uintptr_t mmu_first_frame(void) {
-	uintptr_t i, j;
-	for (i = INDEX_FROM_BIT(lowest_available); i < INDEX_FROM_BIT(nframes); ++i) {
-		if (frames[i] != (uint32_t)-1) {
-			for (j = 0; j < (sizeof(uint32_t)*8); ++j) {
-				uint32_t testFrame = (uint32_t)1 << j;
-				if (!(frames[i] & testFrame)) {
-					uintptr_t out = (i << 5) + j;
-					lowest_available = out + 1;
-					return out;
-				}
+static uintptr_t mmu_find_frame(void) {
+	uintptr_t words = INDEX_FROM_BIT(nframes);
+	uintptr_t i = INDEX_FROM_BIT(lowest_available);
+
+	while (i < words) {
+		if (frame_summary) {
+			/* Treat words below our starting point as full. */
+			uint64_t full = frame_summary[i >> 6] | (((uint64_t)1 << (i & 63)) - 1);
+			if (full == (uint64_t)-1) {
+				i = (i | 63) + 1;
+				continue;
 			}
+			i = (i & ~(uintptr_t)63) + __builtin_ctzll(~full);
+			if (i >= words) break;
 		}
+		if (frames[i] != (uint32_t)-1) {
+			uintptr_t out = (i << 5) + __builtin_ctz(~frames[i]);
+			lowest_available = out + 1;
+			return out;
+		}
+		i++;
 	}
 
+	return (uintptr_t)-1;
+}
+
+/**
+ * @brief Find the first available frame from the bitmap.
+ *
+ * Running out of memory here is fatal.
+ */
+uintptr_t mmu_first_frame(void) {
+	uintptr_t out = mmu_find_frame();
+	if (out != (uintptr_t)-1) return out;
+
 	arch_fatal_prepare();
 	dprintf("Out of memory.\n");
 	arch_dump_traceback();
@@ -167,6 +246,46 @@ uintptr_t mmu_first_frame(void) {
 	return (uintptr_t)-1;
 }
 
+/**
+ * @brief Move a batch of frames from the bitmap to a per-CPU stack.
+ */
+static void frame_cache_refill(struct frame_cache * cache) {
+	spin_lock(frame_alloc_lock);
+	while (cache->count < FRAME_CACHE_BATCH) {
+		uintptr_t index = mmu_find_frame();
+		if (index == (uintptr_t)-1) break;
+		mmu_frame_set(index << PAGE_SHIFT);
+		cache->frames[cache->count++] = index;
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
+/**
+ * @brief Return half of a full per-CPU stack to the bitmap.
+ */
+static void frame_cache_drain(struct frame_cache * cache) {
+	spin_lock(frame_alloc_lock);
+	while (cache->count > FRAME_CACHE_SIZE - FRAME_CACHE_BATCH) {
+		mmu_frame_clear(cache->frames[--cache->count] << PAGE_SHIFT);
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
+void mmu_frame_release(uintptr_t frame_addr) {
+	struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+	if (!cache->busy && frame_addr < nframes * PAGE_SIZE) {
+		cache->busy = 1;
+		if (cache->count == FRAME_CACHE_SIZE) frame_cache_drain(cache);
+		cache->frames[cache->count++] = frame_addr >> PAGE_SHIFT;
+		cache->busy = 0;
+		return;
+	}
+
+	spin_lock(frame_alloc_lock);
+	mmu_frame_clear(frame_addr);
+	spin_unlock(frame_alloc_lock);
+}
+
 /**
  * @brief Set the flags for a page, and allocate a frame for it if needed.
  *
@@ -175,11 +294,7 @@ uintptr_t mmu_first_frame(void) {
  */
 void mmu_frame_allocate(union PML * page, unsigned int flags) {
 	if (page->bits.page == 0) {
-		spin_lock(frame_alloc_lock);
-		uintptr_t index = mmu_first_frame();
-		mmu_frame_set(index << PAGE_SHIFT);
-		page->bits.page     = index;
-		spin_unlock(frame_alloc_lock);
+		page->bits.page = mmu_allocate_a_frame();
 	}
 	page->bits.size     = 0;
 	page->bits.present  = 1;
@@ -321,10 +436,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 	/* Get the PML4 entry for this address */
 	if (!root[pml4_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		root[pml4_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -334,10 +446,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pdp[pdp_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pdp[pdp_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -352,10 +461,7 @@ union PML * mmu_get_page(uintptr_t virtAddr, int flags) {
 
 	if (!pd[pd_entry].bits.present) {
 		if (!(flags & MMU_GET_MAKE)) goto _noentry;
-		spin_lock(frame_alloc_lock);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		mmu_frame_set(newPage);
-		spin_unlock(frame_alloc_lock);
+		uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 		/* zero it */
 		memset(mmu_map_from_physical(newPage), 0, PAGE_SIZE);
 		pd[pd_entry].raw = (newPage) | USER_PML_ACCESS;
@@ -422,6 +528,93 @@ uint8_t refcount_dec(uintptr_t frame) {
 	return mem_refcounts[frame];
 }
 
+/**
+ * @brief Take an extra reference on a frame mapped read-only.
+ *
+ * Lets code outside of the page tables (eg. the text page cache) keep
+ * a shared frame alive.
+ *
+ * @param frame Physical page index
+ * @returns 0 on success, 1 if the frame can not take more references.
+ */
+int mmu_frame_ref(uintptr_t frame) {
+	spin_lock(frame_alloc_lock);
+	int out = refcount_inc(frame);
+	spin_unlock(frame_alloc_lock);
+	return out;
+}
+
+/**
+ * @brief Drop a reference taken with @ref mmu_frame_ref, freeing the frame if it was the last.
+ */
+void mmu_frame_unref(uintptr_t frame) {
+	spin_lock(frame_alloc_lock);
+	if (refcount_dec(frame) == 0) {
+		mmu_frame_clear(frame << PAGE_SHIFT);
+	}
+	spin_unlock(frame_alloc_lock);
+}
+
+/**
+ * @brief Drop a reference taken with @ref mmu_frame_ref, but only if it is the last one.
+ *
+ * @returns 0 if the frame was freed, 1 if it is still referenced elsewhere.
+ */
+int mmu_frame_unref_unshared(uintptr_t frame) {
+	spin_lock(frame_alloc_lock);
+	if (mem_refcounts[frame] > 1) {
+		spin_unlock(frame_alloc_lock);
+		return 1;
+	}
+	refcount_dec(frame);
+	mmu_frame_clear(frame << PAGE_SHIFT);
+	spin_unlock(frame_alloc_lock);
+	return 0;
+}
+
+/**
+ * @brief Map an existing frame at a user address in the current directory.
+ *
+ * Read-only mappings take a reference on the frame, like shared COW pages,
+ * so the frame is only released when its last mapping goes away. Writable
+ * mappings take ownership of the frame, unless @c MMU_FLAG_SHARED is set,
+ * in which case they are reference counted as well and writes are seen by
+ * every mapping of the frame. @c MMU_FLAG_COW maps the frame read-only and
+ * gives the mapping a private copy the first time it is written.
+ *
+ * @param address Virtual address to map.
+ * @param frame   Physical page index.
+ * @param flags   MMU_FLAG_WRITABLE, MMU_FLAG_SHARED, MMU_FLAG_COW or MMU_FLAG_NOEXECUTE.
+ * @returns 0 on success, 1 if the address was already mapped, -1 if the frame can not be shared.
+ */
+int mmu_map_user_frame(uintptr_t address, uintptr_t frame, unsigned int flags) {
+	union PML * page = mmu_get_page(address, MMU_GET_MAKE);
+	int counted = !(flags & MMU_FLAG_WRITABLE) || (flags & (MMU_FLAG_SHARED | MMU_FLAG_COW));
+
+	spin_lock(frame_alloc_lock);
+	if (page->bits.present) {
+		spin_unlock(frame_alloc_lock);
+		return 1;
+	}
+
+	if (counted && refcount_inc(frame)) {
+		spin_unlock(frame_alloc_lock);
+		return -1;
+	}
+
+	page->raw = 0;
+	page->bits.page     = frame;
+	page->bits.present  = 1;
+	page->bits.user     = 1;
+	page->bits.writable = ((flags & MMU_FLAG_WRITABLE) && !(flags & MMU_FLAG_COW)) ? 1 : 0;
+	page->bits.cow_pending = (flags & MMU_FLAG_COW) ? 1 : 0;
+	page->bits.shared   = (flags & MMU_FLAG_SHARED) ? 1 : 0;
+	page->bits.nx       = (flags & MMU_FLAG_NOEXECUTE) ? 1 : 0;
+	asm ("" ::: "memory");
+	spin_unlock(frame_alloc_lock);
+	return 0;
+}
+
 /**
  * @brief Handle user pages in mmu_clone
  *
@@ -442,8 +635,8 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 	/* Can we cow the current page? */
 	spin_lock(frame_alloc_lock);
 
-	/* Is the page writable? */
-	if (pt_in[l].bits.writable) {
+	/* Is the page writable (and not a shared mapping)? */
+	if (pt_in[l].bits.writable && !pt_in[l].bits.shared) {
 		/* Then we need to initialize the refcounts */
 		if (mem_refcounts[pt_in[l].bits.page] != 0) {
 			arch_fatal_prepare();
@@ -458,30 +651,42 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
 		pt_in[l].bits.cow_pending = 1;
 		pt_out[l].raw = pt_in[l].raw;
 		asm ("" ::: "memory");
-		mmu_invalidate(address);
+		/* Other cores are flushed once mmu_clone is done. */
+		mmu_flush_tlb_range(address, address + PAGE_SIZE);
 		spin_unlock(frame_alloc_lock);
 		return 0;
 	}
 
 	/* Can we make a new reference? */
-	if (refcount_inc(pt_in[l].bits.page)) {
-		/* There are too many references to fit in our refcount table, so just make a new page. */
-		char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
-		uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-		char * page_out = mmu_map_from_physical(newPage);
-		memcpy(page_out,page_in,PAGE_SIZE);
-		pt_out[l].raw = 0;
-		pt_out[l].bits.present = 1;
-		pt_out[l].bits.user = 1;
-		pt_out[l].bits.page = newPage >> PAGE_SHIFT;
-		pt_out[l].bits.writable = 1;
-		pt_out[l].bits.cow_pending = 0;
-		asm ("" ::: "memory");
-	} else {
+	if (!refcount_inc(pt_in[l].bits.page)) {
 		pt_out[l].raw = pt_in[l].raw;
+		spin_unlock(frame_alloc_lock);
+		return 0;
 	}
 
+	/*
+	 * There are too many references to fit in our refcount table, so just make a new page.
+	 * The allocator takes frame_alloc_lock itself; the source page is held by the
+	 * directory being cloned, so it can't go away in the meantime.
+	 */
 	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
+	char * page_in = mmu_map_from_physical((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
+	char * page_out = mmu_map_from_physical(newPage);
+	memcpy(page_out,page_in,PAGE_SIZE);
+
+	/*
+	 * The copy keeps the original's permissions. It isn't shared with anything,
+	 * so if the original was only read-only while waiting on COW, the copy
+	 * can be writable straight away.
+	 */
+	pt_out[l].raw = pt_in[l].raw;
+	pt_out[l].bits.page = newPage >> PAGE_SHIFT;
+	if (pt_in[l].bits.cow_pending) {
+		pt_out[l].bits.writable = 1;
+		pt_out[l].bits.cow_pending = 0;
+	}
+	asm ("" ::: "memory");
 	return 0;
 }
 
@@ -502,7 +707,7 @@ int copy_page_maybe(union PML * pt_in, union PML * pt_out, size_t l, uintptr_t a
  * @returns 0, generally
  */
 int free_page_maybe(union PML * pt_in, size_t l, uintptr_t address) {
-	if (pt_in[l].bits.writable) {
+	if (pt_in[l].bits.writable && !pt_in[l].bits.shared) {
 		assert(mem_refcounts[pt_in[l].bits.page] == 0);
 		mmu_frame_clear((uintptr_t)pt_in[l].bits.page << PAGE_SHIFT);
 		return 0;
@@ -532,10 +737,7 @@ union PML * mmu_clone(union PML * from) {
 	if (!from) from = this_core->current_pml;
 
 	/* First get a page for ourselves. */
-	spin_lock(frame_alloc_lock);
-	uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-	mmu_frame_set(newPage);
-	spin_unlock(frame_alloc_lock);
+	uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 	union PML * pml4_out = mmu_map_from_physical(newPage);
 
 	/* Zero bottom half */
@@ -548,10 +750,7 @@ union PML * mmu_clone(union PML * from) {
 	for (size_t i = 0; i < 256; ++i) {
 		if (from[i].bits.present) {
 			union PML * pdp_in = mmu_map_from_physical((uintptr_t)from[i].bits.page << PAGE_SHIFT);
-			spin_lock(frame_alloc_lock);
-			uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-			mmu_frame_set(newPage);
-			spin_unlock(frame_alloc_lock);
+			uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 			union PML * pdp_out = mmu_map_from_physical(newPage);
 			memset(pdp_out, 0, 512 * sizeof(union PML));
 			pml4_out[i].raw = (newPage) | USER_PML_ACCESS;
@@ -560,10 +759,7 @@ union PML * mmu_clone(union PML * from) {
 			for (size_t j = 0; j < 512; ++j) {
 				if (pdp_in[j].bits.present) {
 					union PML * pd_in = mmu_map_from_physical((uintptr_t)pdp_in[j].bits.page << PAGE_SHIFT);
-					spin_lock(frame_alloc_lock);
-					uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-					mmu_frame_set(newPage);
-					spin_unlock(frame_alloc_lock);
+					uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 					union PML * pd_out = mmu_map_from_physical(newPage);
 					memset(pd_out, 0, 512 * sizeof(union PML));
 					pdp_out[j].raw = (newPage) | USER_PML_ACCESS;
@@ -572,10 +768,7 @@ union PML * mmu_clone(union PML * from) {
 					for (size_t k = 0; k < 512; ++k) {
 						if (pd_in[k].bits.present) {
 							union PML * pt_in = mmu_map_from_physical((uintptr_t)pd_in[k].bits.page << PAGE_SHIFT);
-							spin_lock(frame_alloc_lock);
-							uintptr_t newPage = mmu_first_frame() << PAGE_SHIFT;
-							mmu_frame_set(newPage);
-							spin_unlock(frame_alloc_lock);
+							uintptr_t newPage = mmu_allocate_a_frame() << PAGE_SHIFT;
 							union PML * pt_out = mmu_map_from_physical(newPage);
 							memset(pt_out, 0, 512 * sizeof(union PML));
 							pd_out[k].raw = (newPage) | USER_PML_ACCESS;
@@ -585,7 +778,7 @@ union PML * mmu_clone(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user || pt_in[l].bits.prot_none) {
 										copy_page_maybe(pt_in, pt_out, l, address);
 									} else {
 										/* If it's not a user page, just copy directly */
@@ -600,6 +793,11 @@ union PML * mmu_clone(union PML * from) {
 		}
 	}
 
+	/* Writable pages in the source are now copy-on-write; other threads of it need to know. */
+	if (from == this_core->current_pml) {
+		arch_tlb_shootdown(0, USER_DEVICE_MAP);
+	}
+
 	return pml4_out;
 }
 
@@ -609,6 +807,18 @@ union PML * mmu_clone(union PML * from) {
  * @returns a frame index, not an address
  */
 uintptr_t mmu_allocate_a_frame(void) {
+	struct frame_cache * cache = &frame_caches[this_core->cpu_id];
+	if (!cache->busy) {
+		cache->busy = 1;
+		if (!cache->count) frame_cache_refill(cache);
+		if (cache->count) {
+			uintptr_t index = cache->frames[--cache->count];
+			cache->busy = 0;
+			return index;
+		}
+		cache->busy = 0;
+	}
+
 	spin_lock(frame_alloc_lock);
 	uintptr_t index = mmu_first_frame();
 	mmu_frame_set(index << PAGE_SHIFT);
@@ -631,6 +841,26 @@ uintptr_t mmu_allocate_n_frames(int n) {
 	return index;
 }
 
+/**
+ * @brief Allocate a number of contiguous physical pages, if there are any.
+ *
+ * Unlike @ref mmu_allocate_n_frames, running out of contiguous memory
+ * is not fatal; callers are expected to fall back to smaller runs.
+ *
+ * @returns a frame index, or -1 if no large enough range was free.
+ */
+uintptr_t mmu_try_allocate_n_frames(int n) {
+	spin_lock(frame_alloc_lock);
+	uintptr_t index = mmu_find_n_frames(n);
+	if (index != (uintptr_t)-1) {
+		for (int i = 0; i < n; ++i) {
+			mmu_frame_set((index+i) << PAGE_SHIFT);
+		}
+	}
+	spin_unlock(frame_alloc_lock);
+	return index;
+}
+
 /**
  * @brief Scans a directory to calculate how many user pages are in use.
  *
@@ -664,7 +894,7 @@ size_t mmu_count_user(union PML * from) {
 								uintptr_t address = ((i << (9 * 3 + 12)) | (j << (9*2 + 12)) | (k << (9 + 12)) | (l << PAGE_SHIFT));
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user || pt_in[l].bits.prot_none) {
 										out++;
 									}
 								}
@@ -736,14 +966,12 @@ size_t mmu_total_memory(void) {
  */
 size_t mmu_used_memory(void) {
 	size_t ret = 0;
-	size_t i, j;
-	for (i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
-		for (j = 0; j < 32; ++j) {
-			uint32_t testFrame = (uint32_t)0x1 << j;
-			if (frames[i] & testFrame) {
-				ret++;
-			}
-		}
+	for (size_t i = 0; i < INDEX_FROM_BIT(nframes); ++i) {
+		ret += __builtin_popcount(frames[i]);
+	}
+	/* Frames sitting in per-CPU stacks are free. */
+	for (int i = 0; i < processor_count; ++i) {
+		ret -= frame_caches[i].count;
 	}
 	return ret * 4 - unavailable_memory;
 }
@@ -778,7 +1006,7 @@ void mmu_free(union PML * from) {
 								if (address >= USER_DEVICE_MAP && address <= USER_SHM_HIGH) continue;
 								if (pt_in[l].bits.present) {
 									/* Free only user pages */
-									if (pt_in[l].bits.user) {
+									if (pt_in[l].bits.user || pt_in[l].bits.prot_none) {
 										free_page_maybe(pt_in,l,address);
 									}
 								}
@@ -823,6 +1051,28 @@ void mmu_set_directory(union PML * new_pml) {
 		: : "r"((uintptr_t)new_pml & PHYS_MASK));
 }
 
+/**
+ * @brief Flush a range of addresses from this core's TLB.
+ *
+ * Small ranges are flushed page by page; anything bigger than
+ * TLB_FLUSH_MAX_PAGES reloads CR3 instead.
+ */
+void mmu_flush_tlb_range(uintptr_t start, uintptr_t end) {
+	if (end - start > TLB_FLUSH_MAX_PAGES * PAGE_SIZE) {
+		asm volatile (
+			"mov %%cr3, %%rax\n"
+			"mov %%rax, %%cr3\n"
+			: : : "rax", "memory");
+		return;
+	}
+
+	for (uintptr_t a = start & PAGE_SIZE_MASK; a < end; a += PAGE_SIZE) {
+		asm volatile (
+			"invlpg (%0)"
+			: : "r"(a) : "memory");
+	}
+}
+
 /**
  * @brief Mark a virtual address's mappings as invalid in the TLB.
  *
@@ -833,10 +1083,21 @@ void mmu_set_directory(union PML * new_pml) {
  * @param addr Virtual address in the current address space to invalidate.
  */
 void mmu_invalidate(uintptr_t addr) {
-	asm volatile (
-		"invlpg (%0)"
-		: : "r"(addr));
-	arch_tlb_shootdown(addr);
+	mmu_invalidate_range(addr, PAGE_SIZE);
+}
+
+/**
+ * @brief Mark a range of virtual addresses as invalid in the TLB.
+ *
+ * Flushes the range locally and sends a single shootdown for
+ * the whole range to other cores using this address space.
+ *
+ * @param addr Start of the range in the current address space.
+ * @param size Size of the range in bytes.
+ */
+void mmu_invalidate_range(uintptr_t addr, size_t size) {
+	mmu_flush_tlb_range(addr, addr + size);
+	arch_tlb_shootdown(addr, size);
 }
 
 int mmu_get_page_deep(uintptr_t virtAddr, union PML ** pml4_out, union PML ** pdp_out, union PML ** pd_out, union PML ** pt_out) {
@@ -893,6 +1154,8 @@ static int maybe_release_directory(union PML * parent, union PML * child) {
 }
 
 void mmu_unmap_user(uintptr_t addr, size_t size) {
+	uintptr_t low = 0, high = 0;
+
 	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
 		union PML * pml4, * pdp, * pd, * pt;
 
@@ -901,15 +1164,15 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 
 		spin_lock(frame_alloc_lock);
 
-		if (pt && pt->bits.present && pt->bits.user) {
-			if (pt->bits.writable) {
+		if (pt && pt->bits.present && (pt->bits.user || pt->bits.prot_none)) {
+			if (pt->bits.writable && !pt->bits.shared) {
 				assert(mem_refcounts[pt->bits.page] == 0);
 				mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
 			} else if (refcount_dec(pt->bits.page) == 0) {
 				mmu_frame_clear((uintptr_t)pt->bits.page << PAGE_SHIFT);
 			}
-			pt->bits.present = 0;
-			pt->bits.writable = 0;
+			/* Don't leave the old frame behind for mmu_frame_allocate to pick up. */
+			pt->raw = 0;
 
 			if (maybe_release_directory(pd, pt)) {
 				if (maybe_release_directory(pdp, pd)) {
@@ -917,11 +1180,72 @@ void mmu_unmap_user(uintptr_t addr, size_t size) {
 				}
 			}
 
-			mmu_invalidate(a);
+			if (!high) low = a;
+			high = a + PAGE_SIZE;
+		}
+
+		spin_unlock(frame_alloc_lock);
+	}
+
+	/* One flush for everything we unmapped. */
+	if (high) mmu_invalidate_range(low, high - low);
+}
+
+/**
+ * @brief Change the access rights of the user pages in a range.
+ *
+ * Private pages that become writable are not made writable directly,
+ * as they may still be shared with other mappings; they are marked
+ * for copy-on-write instead, which hands them over without a copy if
+ * this was the last reference. Private pages that become read-only
+ * take a reference so they are released like any other read-only page.
+ *
+ * Pages in @c MMU_FLAG_NOACCESS ranges keep their frames but have their
+ * user bit cleared, so they can be brought back by a later call.
+ *
+ * @param addr  Start of the range, page aligned.
+ * @param size  Size of the range in bytes.
+ * @param flags MMU_FLAG_WRITABLE or MMU_FLAG_NOACCESS.
+ */
+void mmu_protect_user(uintptr_t addr, size_t size, unsigned int flags) {
+	uintptr_t low = 0, high = 0;
+
+	for (uintptr_t a = addr; a < addr + size; a += PAGE_SIZE) {
+		union PML * pml4, * pdp, * pd, * pt;
+
+		if (a >= USER_DEVICE_MAP && a <= USER_SHM_HIGH) continue;
+		if (mmu_get_page_deep(a, &pml4, &pdp, &pd, &pt)) continue;
+
+		spin_lock(frame_alloc_lock);
+
+		if (pt && pt->bits.present && (pt->bits.user || pt->bits.prot_none)) {
+			if (flags & MMU_FLAG_NOACCESS) {
+				pt->bits.user = 0;
+				pt->bits.prot_none = 1;
+			} else {
+				pt->bits.user = 1;
+				pt->bits.prot_none = 0;
+				if (pt->bits.shared) {
+					pt->bits.writable = (flags & MMU_FLAG_WRITABLE) ? 1 : 0;
+				} else if (flags & MMU_FLAG_WRITABLE) {
+					if (!pt->bits.writable) pt->bits.cow_pending = 1;
+				} else {
+					if (pt->bits.writable) {
+						refcount_inc(pt->bits.page);
+						pt->bits.writable = 0;
+					}
+					pt->bits.cow_pending = 0;
+				}
+			}
+
+			if (!high) low = a;
+			high = a + PAGE_SIZE;
 		}
 
 		spin_unlock(frame_alloc_lock);
 	}
+
+	if (high) mmu_invalidate_range(low, high - low);
 }
 
 
@@ -1052,6 +1376,16 @@ void mmu_init(size_t memsize, uintptr_t firstFreePage) {
 	size_t size_of_refcounts = (nframes & PAGE_LOW_MASK) ? (nframes + PAGE_SIZE - (nframes & PAGE_LOW_MASK)) : nframes;
 	mem_refcounts = sbrk(size_of_refcounts);
 	memset(mem_refcounts, 0, size_of_refcounts);
+
+	/* Build the summary bitmap now that the frame bitmap is settled. */
+	size_t words = INDEX_FROM_BIT(nframes);
+	size_t size_of_summary = (((words + 63) / 64) * sizeof(uint64_t) + PAGE_LOW_MASK) & PAGE_SIZE_MASK;
+	uint64_t * summary = sbrk(size_of_summary);
+	memset(summary, 0, size_of_summary);
+	for (size_t i = 0; i < words; ++i) {
+		if (frames[i] == (uint32_t)-1) summary[i >> 6] |= ((uint64_t)1 << (i & 63));
+	}
+	frame_summary = summary;
 }
 
 /**
@@ -1217,7 +1551,7 @@ int mmu_copy_on_write(uintptr_t address) {
 	union PML * page = mmu_get_page(address,0);
 
 	/* Was this address pending a cow? */
-	if (!page->bits.cow_pending) {
+	if (!page->bits.cow_pending || page->bits.prot_none) {
 		/* No, go back and trigger and a SIGSEGV */
 		return 1;
 	}
@@ -1286,7 +1620,12 @@ int mmu_validate_user_pointer(const void * addr, size_t size, int flags) {
 	for (uintptr_t page = page_base; page <= page_end; ++page) {
 		if ((page & 0xffff800000000) != 0 && (page & 0xffff800000000) != 0xffff800000000) return 0;
 		union PML * page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
-		if (!page_entry) return 0;
+		if (!page_entry || !page_entry->bits.present) {
+			/* Might be a demand-paged region that hasn't been touched yet. */
+			if (vm_area_fault(page << 12)) return 0;
+			page_entry = mmu_get_page_other(this_core->current_process->thread.page_directory->directory, page << 12);
+			if (!page_entry) return 0;
+		}
 		if (!page_entry->bits.present) return 0;
 		if (!page_entry->bits.user) return 0;
 		if (!page_entry->bits.writable && (flags & MMU_PTR_WRITE)) {
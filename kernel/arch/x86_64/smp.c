@@ -479,40 +479,88 @@ _pit_fallback:
 }
 
 /**
- * @brief Send a soft IPI to all other cores.
+ * @brief Send a soft IPI to one idle core.
  *
- * This is called by the scheduler when a process enters the ready queue,
- * to give other CPUs a chance to pick it up before their timer interrupt
- * fires. This is a soft interrupt: It should be ignored by the receiving
- * cores if they are busy with other things - we only want it to wake up
- * the HLT in the kernel idle task.
- *
- * TODO We could make this more fine-grained and deliver only to processors
- *      we think are ready, or to specific processors to aid in affinity?
+ * This is called by the scheduler when a process enters the ready queue
+ * and it has picked an idle core to run it, to get that core out of its
+ * HLT before its timer interrupt fires. This is a soft interrupt: it does
+ * nothing but wake up the HLT in the kernel idle task.
  */
-void arch_wakeup_others(void) {
-	if (!lapic_final || processor_count < 2) return;
-	/* Send broadcast IPI to others; this is a soft interrupt
-	 * that just nudges idle cores out of their HLT states.
-	 * It should be gentle enough that busy cores dont't care. */
-	lapic_send_ipi(0, 0x7E | (3 << 18));
+void arch_wakeup_core(int cpu) {
+	if (!lapic_final || cpu == this_core->cpu_id) return;
+	lapic_send_ipi(processor_local_data[cpu].lapic_id, 0x407E);
 }
 
+/**
+ * Pending shootdown ranges, one per receiving core. Senders merge their
+ * range into the target's mailbox and only send an IPI if the mailbox was
+ * empty; otherwise an IPI is already on its way and will pick up the
+ * merged range, so back-to-back unmaps are batched into one interrupt.
+ */
+static struct tlb_mailbox {
+	spin_lock_t lock;
+	uintptr_t start;
+	uintptr_t end; /* 0 when nothing is pending */
+} tlb_mailboxes[32];
+
+#define USER_SPACE_END 0x0000800000000000UL
+
+extern void mmu_flush_tlb_range(uintptr_t start, uintptr_t end);
+
 /**
  * @brief Trigger a TLB shootdown on other cores.
  *
- * XXX This is really dumb; we just send an IPI to everyone else
- *     and they reload CR3...
+ * User addresses are only flushed on cores that currently have this
+ * address space loaded; any other core will reload CR3 before it can
+ * touch these mappings again. Kernel addresses are flushed everywhere.
+ *
+ * The caller should already have updated the page tables and flushed
+ * its own TLB.
  *
- * @param vaddr Should have the address to flush, but not actually used.
+ * @param vaddr Start of the range to flush.
+ * @param size  Size of the range in bytes.
  */
-void arch_tlb_shootdown(uintptr_t vaddr) {
-	if (!lapic_final || processor_count < 2) return;
+void arch_tlb_shootdown(uintptr_t vaddr, size_t size) {
+	if (!lapic_final || processor_count < 2 || !size) return;
+
+	int kernel = vaddr >= USER_SPACE_END;
+	union PML * pml = this_core->current_pml;
+	uintptr_t end = vaddr + size;
+
+	/* Make sure our page table changes are visible before we look at what other cores have loaded. */
+	__sync_synchronize();
+
+	for (int i = 0; i < processor_count; ++i) {
+		if (i == this_core->cpu_id) continue;
+		if (!kernel && processor_local_data[i].current_pml != pml) continue;
+
+		struct tlb_mailbox * box = &tlb_mailboxes[i];
+		spin_lock(box->lock);
+		int pending = box->end != 0;
+		if (pending) {
+			if (vaddr < box->start) box->start = vaddr;
+			if (end > box->end) box->end = end;
+		} else {
+			box->start = vaddr;
+			box->end = end;
+		}
+		spin_unlock(box->lock);
 
-	/*
-	 * We should be checking if this address can be sensibly
-	 * mapped somewhere else before IPIing everyone...
-	 */
+		if (!pending) lapic_send_ipi(processor_local_data[i].lapic_id, 0x407C);
+	}
+}
 
-	lapic_send_ipi(0, 0x7C | (3 << 18));
+/**
+ * @brief Handle a TLB shootdown IPI.
+ */
+void arch_tlb_shootdown_handler(void) {
+	struct tlb_mailbox * box = &tlb_mailboxes[this_core->cpu_id];
+	spin_lock(box->lock);
+	uintptr_t start = box->start;
+	uintptr_t end = box->end;
+	box->start = 0;
+	box->end = 0;
+	spin_unlock(box->lock);
+
+	if (end) mmu_flush_tlb_range(start, end);
 }
@@ -21,6 +21,7 @@
 #include <kernel/vfs.h>
 #include <kernel/process.h>
 #include <kernel/mmu.h>
+#include <kernel/vm.h>
 #include <kernel/misc.h>
 #include <kernel/ksym.h>
 #include <kernel/module.h>
@@ -248,6 +249,41 @@ _unmap_module:
 	return -error;
 }
 
+/**
+ * @brief Load the part of a segment that falls within [from,to) right away.
+ */
+static void elf_load_pages(fs_node_t * file, Elf64_Phdr * phdr, uintptr_t from, uintptr_t to) {
+	if (from >= to) return;
+
+	for (uintptr_t i = from; i < to; i += 0x1000) {
+		union PML * page = mmu_get_page(i, MMU_GET_MAKE);
+		mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+	}
+
+	uintptr_t file_end = phdr->p_vaddr + phdr->p_filesz;
+	uintptr_t mem_end  = phdr->p_vaddr + phdr->p_memsz;
+	uintptr_t start = from > phdr->p_vaddr ? from : phdr->p_vaddr;
+
+	uintptr_t read_end = to < file_end ? to : file_end;
+	if (start < read_end) {
+		read_fs(file, phdr->p_offset + (start - phdr->p_vaddr), read_end - start, (void*)start);
+	}
+
+	uintptr_t zero_start = start > file_end ? start : file_end;
+	uintptr_t zero_end   = to < mem_end ? to : mem_end;
+	if (zero_start < zero_end) {
+		memset((void*)zero_start, 0, zero_end - zero_start);
+	}
+
+	#ifdef __aarch64__
+	extern void arch_clear_icache(uintptr_t,uintptr_t);
+	arch_clear_icache(from, to);
+	#endif
+}
+
+/* More program headers than any real executable has; the table is read into the heap. */
+#define ELF_MAX_PHNUM 256
+
 int elf_exec(const char * path, fs_node_t * file, int argc, const char *const argv[], const char *const env[], int interp) {
 	Elf64_Header header;
 
@@ -274,6 +310,20 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 		return -EINVAL;
 	}
 
+	if (header.e_phentsize != sizeof(Elf64_Phdr) || header.e_phnum > ELF_MAX_PHNUM) {
+		printf("(Bad program headers)\n");
+		close_fs(file);
+		return -EINVAL;
+	}
+
+	Elf64_Phdr * phdrs = malloc(sizeof(Elf64_Phdr) * header.e_phnum);
+	if (read_fs(file, header.e_phoff, sizeof(Elf64_Phdr) * header.e_phnum, (uint8_t*)phdrs) != (ssize_t)(sizeof(Elf64_Phdr) * header.e_phnum)) {
+		printf("(Truncated program headers)\n");
+		free(phdrs);
+		close_fs(file);
+		return -EINVAL;
+	}
+
 	if ((file->mask & S_ISUID) && !(this_core->current_process->flags & (PROC_FLAG_TRACE_SYSCALLS | PROC_FLAG_TRACE_SIGNALS))) {
 		/* setuid */
 		this_core->current_process->user = file->uid;
@@ -281,9 +331,8 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 
 	/* First check if it is dynamic and needs an interpreter */
 	for (int i = 0; i < header.e_phnum; ++i) {
-		Elf64_Phdr phdr;
-		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
-		if (phdr.p_type == PT_DYNAMIC) {
+		if (phdrs[i].p_type == PT_DYNAMIC) {
+			free(phdrs);
 			close_fs(file);
 			unsigned int nargc = argc + 3;
 			const char * args[nargc+1]; /* oh yeah, great, a stack-allocated dynamic array... wonderful... */
@@ -310,7 +359,9 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	this_core->current_process->thread.page_directory->refcount = 1;
 	spin_init(this_core->current_process->thread.page_directory->lock);
 	this_core->current_process->thread.page_directory->directory = mmu_clone(NULL);
+	this_core->current_process->thread.page_directory->areas = list_create("vm areas", NULL);
 	mmu_set_directory(this_core->current_process->thread.page_directory->directory);
+	vm_areas_sync(this_directory, 0, 0x800000000000UL);
 	process_release_directory(this_directory);
 	for (int i = 0; i < NUMSIGNALS; ++i) {
 		if (this_core->current_process->signals[i].handler != 1) {
@@ -320,23 +371,35 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	}
 
 	for (int i = 0; i < header.e_phnum; ++i) {
-		Elf64_Phdr phdr;
-		read_fs(file, header.e_phoff + header.e_phentsize * i, sizeof(Elf64_Phdr), (uint8_t*)&phdr);
+		Elf64_Phdr phdr = phdrs[i];
 		if (phdr.p_type == PT_LOAD) {
-			for (uintptr_t i = phdr.p_vaddr; i < phdr.p_vaddr + phdr.p_memsz; i += 0x1000) {
-				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
-				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
+			uintptr_t start = phdr.p_vaddr & ~0xFFFUL;
+			uintptr_t end   = (phdr.p_vaddr + phdr.p_memsz + 0xFFF) & ~0xFFFUL;
+
+#ifdef __x86_64__
+			/* Segments are filled in on first access, except for pages they share
+			 * with another segment, which can't be filled from just one of them. */
+			uintptr_t lazy_start = start, lazy_end = end;
+			for (int j = 0; j < header.e_phnum; ++j) {
+				if (j == i || phdrs[j].p_type != PT_LOAD) continue;
+				uintptr_t other_start = phdrs[j].p_vaddr & ~0xFFFUL;
+				uintptr_t other_end   = (phdrs[j].p_vaddr + phdrs[j].p_memsz + 0xFFF) & ~0xFFFUL;
+				if (start >= other_start && start < other_end) lazy_start = start + 0x1000;
+				if (end - 0x1000 >= other_start && end - 0x1000 < other_end) lazy_end = end - 0x1000;
 			}
 
-			read_fs(file, phdr.p_offset, phdr.p_filesz, (void*)phdr.p_vaddr);
-			for (size_t i = phdr.p_filesz; i < phdr.p_memsz; ++i) {
-				*(char*)(phdr.p_vaddr + i) = 0;
+			if (lazy_start < lazy_end) {
+				int flags = ((phdr.p_flags & PF_W) ? VM_AREA_WRITE : 0) | ((phdr.p_flags & PF_X) ? VM_AREA_EXEC : 0);
+				vm_area_create(this_core->current_process->thread.page_directory->areas,
+					lazy_start, lazy_end, flags, file, phdr.p_offset, phdr.p_vaddr, phdr.p_vaddr + phdr.p_filesz);
+				elf_load_pages(file, &phdr, start, lazy_start);
+				elf_load_pages(file, &phdr, lazy_end, end);
+			} else {
+				elf_load_pages(file, &phdr, start, end);
 			}
-
-			#ifdef __aarch64__
-			extern void arch_clear_icache(uintptr_t,uintptr_t);
-			arch_clear_icache(phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
-			#endif
+#else
+			elf_load_pages(file, &phdr, start, end);
+#endif
 
 			if (phdr.p_vaddr + phdr.p_memsz > heapBase) {
 				heapBase = phdr.p_vaddr + phdr.p_memsz;
@@ -352,6 +415,7 @@ int elf_exec(const char * path, fs_node_t * file, int argc, const char *const ar
 	this_core->current_process->image.heap  = (heapBase + 0xFFF) & (~0xFFF);
 	this_core->current_process->image.entry = header.e_entry;
 
+	free(phdrs);
 	close_fs(file);
 
 	// arch_set_...?
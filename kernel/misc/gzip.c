@@ -3,11 +3,17 @@
  * @brief Gzip/DEFLATE decompression.
  *
  * Provides decompression for ramdisks.
- * Based on the same approach to DEFLATE decompression as libraries
- * like "tinf", this is a slow-but-simple implementation of Huffman
- * decoding. The kernel version operates directly on two pointers,
- * @c gzip_inputPtr and @c gzip_outputPtr. For a more robust API,
- * see the userspace version.
+ *
+ * Input is pulled into a 64-bit bit buffer a byte at a time, so
+ * a whole length/distance pair can be decoded from one refill.
+ * Huffman codes are decoded with two-level lookup tables: the
+ * first few bits of a code index a root table, and the rare codes
+ * longer than that continue into a small subtable.
+ *
+ * The kernel version operates directly on two pointers,
+ * @c gzip_inputPtr and @c gzip_outputPtr; @ref gzip_decompress_stream
+ * also reports its progress, so the output can be used while it is
+ * still being produced. For a more robust API, see the userspace version.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -16,118 +22,201 @@
  */
 #include <stdint.h>
 #include <stddef.h>
-
-static uint8_t bit_buffer = 0;
-static char buffer_size = 0;
+#include <kernel/string.h>
+#include <kernel/gzip.h>
 
 uint8_t * gzip_inputPtr = NULL;
 uint8_t * gzip_outputPtr = NULL;
 
-__attribute__((always_inline))
-static inline uint8_t read_byte(void) {
-	return *gzip_inputPtr++;
-}
+/* Root table sizes, in bits; longer codes go through a subtable */
+#define LITLEN_ROOT 10
+#define DIST_ROOT   8
+#define CLEN_ROOT   7
 
-__attribute__((always_inline))
-static inline void _write(unsigned int sym) {
-	*gzip_outputPtr++ = sym;
-}
+/* Room for the root tables and the largest set of subtables a valid code can need */
+#define LITLEN_SIZE 2048
+#define DIST_SIZE   1024
+#define CLEN_SIZE   (1 << CLEN_ROOT)
 
-/**
- * Decoded Huffman table
+/*
+ * Table entries are (symbol << 16) | (flags << 8) | bits.
+ *
+ * For a subtable link, "symbol" is the index of the subtable,
+ * the low bits of the flags are its size in bits, and "bits" is
+ * the root size, which is consumed before indexing into it.
  */
-struct huff {
-	uint16_t counts[16];   /* Number of symbols of each length */
-	uint16_t symbols[288]; /* Ordered symbols */
+#define ENTRY_SUB 0x80
+#define ENTRY_BAD 0x40
+
+/* Report progress this often */
+#define PROGRESS_INTERVAL 0x10000
+
+struct inflate_state {
+	uint8_t * in;
+	uint8_t * out;
+	uint8_t * out_start;
+	uint64_t bits;
+	unsigned int count;
+
+	void (*progress)(void * ctx, size_t written);
+	void * ctx;
+	uint8_t * next_report;
+
+	uint32_t litlen[LITLEN_SIZE];
+	uint32_t dist[DIST_SIZE];
 };
 
 /**
- * Fixed Huffman code tables, generated later.
+ * Top up the bit buffer. Enough for any one length/distance pair
+ * with its extra bits, which take at most 48 bits.
  */
-struct huff fixed_lengths;
-struct huff fixed_dists;
+__attribute__((always_inline))
+static inline void refill(struct inflate_state * s) {
+	while (s->count <= 56) {
+		s->bits |= (uint64_t)*s->in++ << s->count;
+		s->count += 8;
+	}
+}
 
 /**
- * Read a little-endian short from the input.
+ * Take @p count bits, least significant first. Does not refill.
  */
-static uint16_t read_16le(void) {
-	uint16_t a, b;
-	a = read_byte();
-	b = read_byte();
-	return (a << 0) | (b << 8);
+__attribute__((always_inline))
+static inline uint32_t take_bits(struct inflate_state * s, unsigned int count) {
+	uint32_t out = s->bits & ((1ULL << count) - 1);
+	s->bits >>= count;
+	s->count -= count;
+	return out;
 }
 
 /**
- * Read a single bit from the source.
- * Fills the byte buffer with one byte when it runs out.
+ * Hand back whole bytes that were read into the bit buffer but
+ * not used, and drop any partial byte. Leaves the input pointer
+ * at the next byte boundary.
  */
-static _Bool read_bit(void) {
-
-	/* When we run out of bits... */
-	if (buffer_size == 0) {
-		/* Refill from the next input byte */
-		bit_buffer = read_byte();
-		/* And restore bit buffer size to 8 bits */
-		buffer_size = 8;
-	}
-
-	/* Get the next available bit */
-	int out = bit_buffer & 1;
-
-	/* Shift the bit buffer forward */
-	bit_buffer >>= 1;
-
-	/* There is now one less bit available */
-	buffer_size--;
-
-	return out;
+static void align_input(struct inflate_state * s) {
+	s->in -= s->count / 8;
+	s->bits = 0;
+	s->count = 0;
 }
 
 /**
- * Read multible bits, in bit order, from the source.
+ * Decode one symbol. The caller must have refilled.
+ *
+ * @returns the symbol, or -1 for a bit pattern no code uses.
  */
-static uint32_t read_bits(unsigned int count) {
+__attribute__((always_inline))
+static inline int decode(struct inflate_state * s, const uint32_t * table, unsigned int root) {
+	uint32_t entry = table[s->bits & ((1U << root) - 1)];
+	if (entry & (ENTRY_SUB << 8)) {
+		unsigned int sub = (entry >> 8) & 0x3F;
+		take_bits(s, root);
+		entry = table[(entry >> 16) + (s->bits & ((1U << sub) - 1))];
+	}
+	if (entry & (ENTRY_BAD << 8)) return -1;
+	take_bits(s, entry & 0xFF);
+	return entry >> 16;
+}
+
+static uint32_t reverse_bits(uint32_t code, unsigned int length) {
 	uint32_t out = 0;
-	for (unsigned int bit = 0; bit < count; bit++) {
-		/* Read one bit at a time, from least to most significant */
-		out |= (read_bit() << bit);
+	for (unsigned int i = 0; i < length; ++i) {
+		out = (out << 1) | (code & 1);
+		code >>= 1;
 	}
 	return out;
 }
 
 /**
- * Build a Huffman table from an array of lengths.
+ * Build a lookup table from an array of code lengths.
+ *
+ * Codes are assigned canonically, as in 3.2.2. Deflate sends codes
+ * most significant bit first, but the bit buffer yields bits in the
+ * order they arrived, so table indices are bit-reversed codes.
+ *
+ * @returns 0 on success, 1 if the lengths don't describe a usable code.
  */
-static void build_huffman(const uint8_t * lengths, size_t size, struct huff * out) {
-
+static int build_table(const uint8_t * lengths, unsigned int size, uint32_t * table, unsigned int capacity, unsigned int root) {
+	uint16_t count[16] = {0};
 	uint16_t offsets[16];
-	unsigned int count = 0;
-
-	/* Zero symbol counts */
-	for (unsigned int i = 0; i < 16; ++i) out->counts[i] = 0;
+	uint16_t sorted[320];
 
-	/* Count symbols */
-	for (unsigned int i = 0; i < size; ++i) out->counts[lengths[i]]++;
+	for (unsigned int i = 0; i < size; ++i) count[lengths[i]]++;
+	count[0] = 0;
 
-	/* Special case... */
-	out->counts[0] = 0;
-
-	/* Figure out offsets */
-	for (unsigned int i = 0; i < 16; ++i) {
-		offsets[i] = count;
-		count += out->counts[i];
+	/* More codes of some length than there is room for? */
+	int left = 1;
+	for (unsigned int len = 1; len < 16; ++len) {
+		left <<= 1;
+		left -= count[len];
+		if (left < 0) return 1;
 	}
 
-	/* Build symbol ordering */
+	offsets[1] = 0;
+	for (unsigned int len = 1; len < 15; ++len) offsets[len + 1] = offsets[len] + count[len];
 	for (unsigned int i = 0; i < size; ++i) {
-		if (lengths[i]) out->symbols[offsets[lengths[i]]++] = i;
+		if (lengths[i]) sorted[offsets[lengths[i]]++] = i;
+	}
+
+	/* Incomplete codes leave gaps, which should fail to decode */
+	for (unsigned int i = 0; i < (1U << root); ++i) table[i] = ENTRY_BAD << 8;
+
+	unsigned int used = 1U << root;
+	unsigned int mask = used - 1;
+	unsigned int sub_prefix = (unsigned int)-1;
+	unsigned int sub_start = 0, sub_bits = 0;
+	uint32_t code = 0;
+	unsigned int index = 0;
+
+	for (unsigned int len = 1; len < 16; ++len) {
+		for (; count[len]; count[len]--, code++, index++) {
+			uint32_t entry_symbol = (uint32_t)sorted[index] << 16;
+			uint32_t rev = reverse_bits(code, len);
+
+			if (len <= root) {
+				for (uint32_t i = rev; i < (1U << root); i += 1U << len) {
+					table[i] = entry_symbol | len;
+				}
+				continue;
+			}
+
+			if ((rev & mask) != sub_prefix) {
+				/*
+				 * Codes sharing a root prefix are consecutive, so the
+				 * subtable needs to be just big enough for the ones left,
+				 * shortest first, to fill it.
+				 */
+				sub_bits = len - root;
+				int room = 1 << sub_bits;
+				while (sub_bits + root < 15) {
+					room -= count[sub_bits + root];
+					if (room <= 0) break;
+					sub_bits++;
+					room <<= 1;
+				}
+
+				if (used + (1U << sub_bits) > capacity) return 1;
+				sub_prefix = rev & mask;
+				sub_start = used;
+				used += 1U << sub_bits;
+				for (unsigned int i = 0; i < (1U << sub_bits); ++i) table[sub_start + i] = ENTRY_BAD << 8;
+				table[sub_prefix] = (sub_start << 16) | ((ENTRY_SUB | sub_bits) << 8) | root;
+			}
+
+			for (uint32_t i = rev >> root; i < (1U << sub_bits); i += 1U << (len - root)) {
+				table[sub_start + i] = entry_symbol | (len - root);
+			}
+		}
+		code <<= 1;
 	}
+
+	return 0;
 }
 
 /**
  * Build the fixed Huffman tables
  */
-static void build_fixed(void) {
+static void build_fixed(struct inflate_state * s) {
 	/* From 3.2.6:
 	 * Lit Value    Bits        Codes
 	 * ---------    ----        -----
@@ -145,7 +234,7 @@ static void build_fixed(void) {
 	for (int i = 144; i < 256; ++i) lengths[i] = 9;
 	for (int i = 256; i < 280; ++i) lengths[i] = 7;
 	for (int i = 280; i < 288; ++i) lengths[i] = 8;
-	build_huffman(lengths, 288, &fixed_lengths);
+	build_table(lengths, 288, s->litlen, LITLEN_SIZE, LITLEN_ROOT);
 
 	/* Continued from 3.2.6:
 	 * Distance codes 0-31 are represented by (fixed-length) 5-bit
@@ -154,54 +243,13 @@ static void build_fixed(void) {
 	 * 31 will never actually occur in the compressed data.
 	 */
 	for (int i = 0; i < 30; ++i) lengths[i] = 5;
-	build_huffman(lengths, 30, &fixed_dists);
-}
-
-
-/**
- * Decode a symbol from the source using a Huffman table.
- */
-static int decode(const struct huff * huff) {
-	int count = 0, cur = 0;
-	for (int i = 1; cur >= 0; i++) {
-		cur = (cur << 1) | read_bit(); /* Shift */
-		count += huff->counts[i];
-		cur -= huff->counts[i];
-	}
-	return huff->symbols[count + cur];
-}
-
-struct huff_ring {
-	size_t pointer;
-	uint8_t data[32768];
-};
-
-static struct huff_ring data = {0, {0}};
-
-/**
- * Emit one byte to the output, maintaining the ringbuffer.
- * The ringbuffer ensures we can always look back 32K bytes
- * while keeping output streaming.
- */
-static void emit(unsigned char byte) {
-	data.data[data.pointer++] = byte;
-	data.pointer &= 0x7FFF;
-	_write(byte);
-}
-
-/**
- * Look backwards in the output ring buffer.
- */
-static void peek(unsigned int offset) {
-	data.data[data.pointer] = data.data[(data.pointer + 0x8000 - offset) & 0x7FFF];
-	_write(data.data[data.pointer++]);
-	data.pointer &= 0x7FFF;
+	build_table(lengths, 30, s->dist, DIST_SIZE, DIST_ROOT);
 }
 
 /**
  * Decompress a block of Huffman-encoded data.
  */
-static int inflate(const struct huff * huff_len, const struct huff * huff_dist) {
+static int inflate(struct inflate_state * s) {
 
 	/* These are the extra bits for lengths from the tables in section 3.2.5
 	 *           Extra               Extra               Extra
@@ -251,32 +299,52 @@ static int inflate(const struct huff * huff_len, const struct huff * huff_dist)
 		10, 11, 11, 12, 12, 13, 13
 	};
 
+	uint8_t * out = s->out;
+
 	while (1) {
-		unsigned int symbol = decode(huff_len);
+		refill(s);
+		int symbol = decode(s, s->litlen, LITLEN_ROOT);
+		if (symbol < 0) return 1;
+
 		if (symbol < 256) {
-			emit(symbol);
+			*out++ = symbol;
 		} else if (symbol == 256) {
 			/* "The literal/length symbol 256 (end of data), ..." */
 			break;
 		} else {
-			unsigned int length, distance, offset;
 			symbol -= 257;
-			length = read_bits(lext[symbol]) + lens[symbol];
-			distance = decode(huff_dist);
-			offset = read_bits(dext[distance]) + dists[distance];
-			for (unsigned int i = 0; i < length; ++i) {
-				peek(offset);
+			if (symbol >= 29) return 1;
+			unsigned int length = take_bits(s, lext[symbol]) + lens[symbol];
+
+			int distance = decode(s, s->dist, DIST_ROOT);
+			if (distance < 0 || distance >= 30) return 1;
+			size_t offset = take_bits(s, dext[distance]) + dists[distance];
+			if (offset > (size_t)(out - s->out_start)) return 1;
+
+			/* The output is one flat buffer, so matches copy straight out of it */
+			const uint8_t * from = out - offset;
+			if (offset >= length) {
+				memcpy(out, from, length);
+				out += length;
+			} else {
+				while (length--) *out++ = *from++;
 			}
 		}
+
+		if (out >= s->next_report) {
+			s->progress(s->ctx, out - s->out_start);
+			s->next_report = out + PROGRESS_INTERVAL;
+		}
 	}
 
+	s->out = out;
 	return 0;
 }
 
 /**
  * Decode a dynamic Huffman block.
  */
-static void decode_huffman(void) {
+static int decode_huffman(struct inflate_state * s) {
 
 	/* Ordering of code length codes:
 	 * (HCLEN + 4) x 3 bits: code lengths for the code length
@@ -289,17 +357,21 @@ static void decode_huffman(void) {
 	unsigned int literals, distances, clengths;
 	uint8_t lengths[320] = {0};
 
-	literals  = 257 + read_bits(5); /* 5 Bits: HLIT ... 257 */
-	distances = 1 + read_bits(5);   /* 5 Bits: HDIST ... 1 */
-	clengths  = 4 + read_bits(4);   /* 4 Bits: HCLEN ... 4 */
+	refill(s);
+	literals  = 257 + take_bits(s, 5); /* 5 Bits: HLIT ... 257 */
+	distances = 1 + take_bits(s, 5);   /* 5 Bits: HDIST ... 1 */
+	clengths  = 4 + take_bits(s, 4);   /* 4 Bits: HCLEN ... 4 */
+
+	if (literals > 286 || distances > 30) return 1;
 
 	/* (HCLEN + 4) x 3 bits... */
 	for (unsigned int i = 0; i < clengths; ++i) {
-		lengths[clens[i]] = read_bits(3);
+		refill(s);
+		lengths[clens[i]] = take_bits(s, 3);
 	}
 
-	struct huff codes;
-	build_huffman(lengths, 19, &codes);
+	uint32_t codes[CLEN_SIZE];
+	if (build_table(lengths, 19, codes, CLEN_SIZE, CLEN_ROOT)) return 1;
 
 	/* Decode symbols:
 	 * HLIT + 257 code lengths for the literal/length alphabet...
@@ -307,48 +379,50 @@ static void decode_huffman(void) {
 	 */
 	unsigned int count = 0;
 	while (count < literals + distances) {
-		int symbol = decode(&codes);
+		refill(s);
+		int symbol = decode(s, codes, CLEN_ROOT);
 		int rep = 0, length;
 		switch (symbol) {
 			case 16:
 				/* 16: Copy the previous code length 3-6 times */
+				if (!count) return 1;
 				rep = lengths[count-1];
-				length = read_bits(2) + 3; /* The next 2 bits indicate repeat length */
+				length = take_bits(s, 2) + 3; /* The next 2 bits indicate repeat length */
 				break;
 			case 17:
 				/* Repeat a code length of 0 for 3 - 10 times */
-				length = read_bits(3) + 3; /* 3 bits of length */
+				length = take_bits(s, 3) + 3; /* 3 bits of length */
 				break;
 			case 18:
 				/* Repeat a code length of 0 for 11 - 138 times */
-				length = read_bits(7) + 11; /* 7 bits of length */
+				length = take_bits(s, 7) + 11; /* 7 bits of length */
 				break;
+			case -1:
+				return 1;
 			default:
 				length = 1;
 				rep = symbol;
 				break;
 		}
+		if (count + length > literals + distances) return 1;
 		while (length--) {
 			lengths[count++] = rep;
 		}
 	}
 
-	/* Build tables from lenghts decoded above */
-	struct huff huff_len;
-	build_huffman(lengths, literals, &huff_len);
-	struct huff huff_dist;
-	build_huffman(lengths + literals, distances, &huff_dist);
+	/* Build tables from lengths decoded above */
+	if (build_table(lengths, literals, s->litlen, LITLEN_SIZE, LITLEN_ROOT)) return 1;
+	if (build_table(lengths + literals, distances, s->dist, DIST_SIZE, DIST_ROOT)) return 1;
 
-	inflate(&huff_len, &huff_dist);
+	return inflate(s);
 }
 
 /**
  * Decode an uncompressed block.
  */
-static int uncompressed(void) {
+static int uncompressed(struct inflate_state * s) {
 	/* Reset byte alignment */
-	bit_buffer = 0;
-	buffer_size = 0;
+	align_input(s);
 
 	/* "The rest of the block consists of the following information:"
 	 *    0   1   2   3   4...
@@ -356,17 +430,23 @@ static int uncompressed(void) {
 	 *  |  LEN  | NLEN  |... LEN bytes of literal data...|
 	 *  +---+---+---+---+================================+
 	 */
-	uint16_t len = read_16le(); /* "the number of data bytes in the block" */
-	uint16_t nlen = read_16le(); /* "the one's complement of LEN */
+	uint16_t len  = s->in[0] | (s->in[1] << 8); /* "the number of data bytes in the block" */
+	uint16_t nlen = s->in[2] | (s->in[3] << 8); /* "the one's complement of LEN */
+	s->in += 4;
 
 	/* Sanity check - does the ones-complement length actually match? */
 	if ((nlen & 0xFFFF) != (~len & 0xFFFF)) {
 		return 1;
 	}
 
-	/* Emit LEN bytes from the source to the output */
-	for (int i = 0; i < len; ++i) {
-		emit(read_byte());
+	/* Copy LEN bytes from the source to the output */
+	memcpy(s->out, s->in, len);
+	s->in  += len;
+	s->out += len;
+
+	if (s->out >= s->next_report) {
+		s->progress(s->ctx, s->out - s->out_start);
+		s->next_report = s->out + PROGRESS_INTERVAL;
 	}
 
 	return 0;
@@ -377,41 +457,41 @@ static int uncompressed(void) {
  */
 __attribute__((optimize("O2")))
 __attribute__((hot))
-int deflate_decompress(void) {
-	bit_buffer = 0;
-	buffer_size = 0;
-
-	build_fixed();
+static int deflate_decompress(struct inflate_state * s) {
+	s->bits = 0;
+	s->count = 0;
 
 	/* read compressed data */
 	while (1) {
-		/* Read bit */
-
-		int is_final = read_bit();
-		int type = read_bits(2);
+		refill(s);
+		int is_final = take_bits(s, 1);
+		int type = take_bits(s, 2);
+		int status;
 
 		switch (type) {
 			case 0x00: /* BTYPE=00 Non-compressed blocks */
-				uncompressed();
+				status = uncompressed(s);
 				break;
 			case 0x01: /* BYTPE=01 Compressed with fixed Huffman codes */
-				inflate(&fixed_lengths, &fixed_dists);
+				build_fixed(s);
+				status = inflate(s);
 				break;
 			case 0x02: /* BTYPE=02 Compression with dynamic Huffman codes */
-				decode_huffman();
+				status = decode_huffman(s);
 				break;
-			case 0x03:
-				return 1;
 			default:
-				__builtin_unreachable();
-				break;
+				return 1;
 		}
 
+		if (status) return status;
+
 		if (is_final) {
 			break;
 		}
 	}
 
+	/* Leave the input at the gzip trailer */
+	align_input(s);
 	return 0;
 }
 
@@ -421,70 +501,91 @@ int deflate_decompress(void) {
 #define GZIP_FLAG_NAME (1 << 3)
 #define GZIP_FLAG_COMM (1 << 4)
 
-static unsigned int read_32le(void) {
-	unsigned int a, b, c, d;
-	a = read_byte();
-	b = read_byte();
-	c = read_byte();
-	d = read_byte();
-
-	return (d << 24) | (c << 16) | (b << 8) | (a << 0);
-}
+static void no_progress(void * ctx, size_t written) { }
 
-int gzip_decompress(void) {
+static int gzip_run(struct inflate_state * s) {
+	uint8_t * in = s->in;
 
 	/* Read gzip headers */
-	if (read_byte() != 0x1F) return 1;
-	if (read_byte() != 0x8B) return 1;
+	if (in[0] != 0x1F) return 1;
+	if (in[1] != 0x8B) return 1;
 
-	unsigned int cm = read_byte();
+	unsigned int cm = in[2];
 	if (cm != 8) return 1;
 
-	unsigned int flags = read_byte();
-
-	/* Read mtime */
-	unsigned int mtime = read_32le();
-	(void)mtime;
-
-	/* Read extra flags */
-	unsigned int xflags = read_byte();
-	(void)xflags;
+	unsigned int flags = in[3];
 
-	/* Read and discord OS flag */
-	unsigned int os = read_byte();
-	(void)os;
+	/* Skip mtime, extra flags, and OS */
+	in += 10;
 
 	/* Extra bytes */
 	if (flags & GZIP_FLAG_EXTR) {
-		unsigned short size = read_16le();
-		for (unsigned int i = 0; i < size; ++i) read_byte();
+		unsigned short size = in[0] | (in[1] << 8);
+		in += 2 + size;
 	}
 
 	if (flags & GZIP_FLAG_NAME) {
-		unsigned int c;
-		while ((c = read_byte()) != 0);
+		while (*in++);
 	}
 
 	if (flags & GZIP_FLAG_COMM) {
-		unsigned int c;
-		while ((c = read_byte()) != 0);
+		while (*in++);
 	}
 
-	unsigned int crc16 = 0;
 	if (flags & GZIP_FLAG_HCRC) {
-		crc16 = read_16le();
+		in += 2;
 	}
-	(void)crc16;
 
-	int status = deflate_decompress();
+	s->in = in;
+	s->out_start = s->out;
+	if (!s->progress) s->progress = no_progress;
+	s->next_report = s->out + PROGRESS_INTERVAL;
+
+	int status = deflate_decompress(s);
+
+	/* Skip CRC and decompressed size at end of input */
+	s->in += 8;
+
+	if (!status) s->progress(s->ctx, s->out - s->out_start);
+
+	return status;
+}
+
+/**
+ * Decompress from @c gzip_inputPtr to @c gzip_outputPtr.
+ *
+ * Used early, before there is a heap, so the decoder state is static.
+ */
+int gzip_decompress(void) {
+	static struct inflate_state state;
 
-	/* Read CRC and decompressed size from end of input */
-	unsigned int crc32 = read_32le();
-	unsigned int dsize = read_32le();
+	state.in = gzip_inputPtr;
+	state.out = gzip_outputPtr;
+	state.progress = NULL;
+	state.ctx = NULL;
 
-	(void)crc32;
-	(void)dsize;
+	int status = gzip_run(&state);
 
+	gzip_inputPtr = state.in;
+	gzip_outputPtr = state.out;
 	return status;
 }
 
+/**
+ * Decompress @p input to @p output, calling @p progress with the
+ * number of bytes written so far every now and then, and once at
+ * the end. Safe to run on several threads at once.
+ */
+int gzip_decompress_stream(uint8_t * input, uint8_t * output, void (*progress)(void * ctx, size_t written), void * ctx) {
+	struct inflate_state * state = malloc(sizeof(struct inflate_state));
+
+	state->in = input;
+	state->out = output;
+	state->progress = progress;
+	state->ctx = ctx;
+
+	int status = gzip_run(state);
+
+	free(state);
+	return status;
+}
@@ -11,6 +11,10 @@
  * for making it thread-safe in userspace applications (not necessarily
  * tested in the kernel).
  *
+ * In the kernel, small allocations are fronted by per-CPU magazines so
+ * that the big lock is only taken when a core exchanges a batch of cells
+ * with the shared bins. Counters are available in /proc/kmalloc.
+ *
  * FIXME The heap allocator has long been lacking an ability to merge large
  *       freed blocks. There's #if 0'd code dating back over a decade in here.
  *
@@ -36,6 +40,7 @@
 #include <kernel/spinlock.h>
 #include <kernel/mmu.h>
 #include <kernel/misc.h>
+#include <kernel/slab.h>
 /* }}} */
 /* Definitions {{{ */
 
@@ -84,12 +89,16 @@ static void * __attribute__ ((malloc)) klrealloc(void * ptr, uintptr_t size);
 static void * __attribute__ ((malloc)) klcalloc(uintptr_t nmemb, uintptr_t size);
 static void * __attribute__ ((malloc)) klvalloc(uintptr_t size);
 static void klfree(void * ptr);
+static void * klmalloc_fast(uintptr_t size);
+static int klfree_fast(void * ptr);
 
 static spin_lock_t mem_lock =  { 0 };
 
 void * __attribute__ ((malloc)) malloc(uintptr_t size) {
+	void * out = klmalloc_fast(size);
+	if (out) return out;
 	spin_lock(mem_lock);
-	void * out = klmalloc(size);
+	out = klmalloc(size);
 	spin_unlock(mem_lock);
 	return out;
 }
@@ -102,8 +111,15 @@ void * __attribute__ ((malloc)) realloc(void * ptr, uintptr_t size) {
 }
 
 void * __attribute__ ((malloc)) calloc(uintptr_t nmemb, uintptr_t size) {
+	uintptr_t total;
+	if (__builtin_mul_overflow(nmemb, size, &total)) return NULL;
+	void * out = klmalloc_fast(total);
+	if (out) {
+		memset(out, 0x00, total);
+		return out;
+	}
 	spin_lock(mem_lock);
-	void * out = klcalloc(nmemb, size);
+	out = klcalloc(nmemb, size);
 	spin_unlock(mem_lock);
 	return out;
 }
@@ -116,13 +132,19 @@ void * __attribute__ ((malloc)) valloc(uintptr_t size) {
 }
 
 void free(void * ptr) {
-	spin_lock(mem_lock);
 #ifndef __aarch64__
 	if (ptr < (void*)0xffffff0000000000) {
 		printf("Invalid free detected (%p)\n", ptr);
 		while (1) {};
 	}
 #endif
+	/* Objects from the typed caches live in the physical mapping */
+	if (slab_owns(ptr)) {
+		slab_free(NULL, ptr);
+		return;
+	}
+	if (klfree_fast(ptr)) return;
+	spin_lock(mem_lock);
 	klfree(ptr);
 	spin_unlock(mem_lock);
 }
@@ -202,6 +224,139 @@ static struct _klmalloc_big_bins {
 static klmalloc_big_bin_header * klmalloc_newest_big = NULL;		/* Newest big bin */
 
 /* }}} Bin management */
+/* Per-CPU magazines {{{ */
+
+/*
+ * Each core keeps a small "magazine" of recently freed cells for every
+ * small bin. Allocations and frees of small objects are served from the
+ * local magazine without touching mem_lock; the lock is only taken when
+ * a magazine runs dry (refill) or overflows (flush), and then we move
+ * MAG_BATCH cells at once to amortize the cost of the exchange.
+ *
+ * The kernel does not preempt itself, so the only thing that can race
+ * with a core's magazine is an interrupt handler on that same core. The
+ * busy flag catches that case and sends the nested caller to the slow
+ * path instead.
+ */
+#define MAG_ROUNDS 32
+#define MAG_BATCH  (MAG_ROUNDS / 2)
+#define MAG_CORES  32
+
+struct klmalloc_magazine {
+	uintptr_t rounds;
+	void * objs[MAG_ROUNDS];
+};
+
+static struct klmalloc_cpu_cache {
+	struct klmalloc_magazine mags[NUM_BINS - 1];
+	volatile int busy;
+	struct klmalloc_cpu_stats stats;
+} klmalloc_cpu[MAG_CORES];
+
+static inline struct klmalloc_cpu_cache * klmalloc_this_cache(void) {
+	return &klmalloc_cpu[this_core->cpu_id];
+}
+
+/*
+ * Take the global lock, noting whether someone else already had it.
+ */
+#define klmalloc_lock(cache) do { \
+	(cache)->stats.lock_acquires++; \
+	if (mem_lock.latch[0]) (cache)->stats.lock_contended++; \
+	spin_lock(mem_lock); \
+} while (0)
+
+/*
+ * Pop a cell from this core's magazine for the given bin, refilling
+ * the magazine from the global bins if it is empty.
+ */
+static void * klmalloc_cache_alloc(struct klmalloc_cpu_cache * cache, uintptr_t bucket_id) {
+	struct klmalloc_magazine * mag = &cache->mags[bucket_id];
+	if (mag->rounds) {
+		cache->stats.hits++;
+		return mag->objs[--mag->rounds];
+	}
+
+	cache->stats.misses++;
+	uintptr_t size = 1UL << (SMALLEST_BIN_LOG + bucket_id);
+	klmalloc_lock(cache);
+	while (mag->rounds < MAG_BATCH) {
+		void * obj = klmalloc(size);
+		if (!obj) break;
+		mag->objs[mag->rounds++] = obj;
+	}
+	spin_unlock(mem_lock);
+
+	if (!mag->rounds) return NULL;
+	return mag->objs[--mag->rounds];
+}
+
+/*
+ * Push a cell into this core's magazine, flushing half of the
+ * magazine back to the global bins if it is full.
+ */
+static void klmalloc_cache_free(struct klmalloc_cpu_cache * cache, uintptr_t bucket_id, void * ptr) {
+	struct klmalloc_magazine * mag = &cache->mags[bucket_id];
+	if (mag->rounds == MAG_ROUNDS) {
+		cache->stats.flushes++;
+		klmalloc_lock(cache);
+		while (mag->rounds > MAG_ROUNDS - MAG_BATCH) {
+			klfree(mag->objs[--mag->rounds]);
+		}
+		spin_unlock(mem_lock);
+	}
+	mag->objs[mag->rounds++] = ptr;
+}
+
+/*
+ * Try to serve a small allocation from the local magazine.
+ * Returns NULL if the caller should use the locked path instead.
+ */
+static void * klmalloc_fast(uintptr_t size) {
+	if (!size || klmalloc_bin_size(size) >= BIG_BIN) return NULL;
+	struct klmalloc_cpu_cache * cache = klmalloc_this_cache();
+	if (cache->busy) return NULL;
+	cache->busy = 1;
+	void * out = klmalloc_cache_alloc(cache, klmalloc_bin_size(size));
+	cache->busy = 0;
+	return out;
+}
+
+/*
+ * Try to return a small cell to the local magazine.
+ * Returns 0 if the caller should use the locked path instead.
+ */
+static int klfree_fast(void * ptr) {
+	/*
+	 * Small bins never hand out page-aligned cells, and their headers
+	 * are never modified after creation, so we can safely peek at the
+	 * bin index without holding the lock.
+	 */
+	if (!((uintptr_t)ptr & PAGE_MASK)) return 0;
+	klmalloc_bin_header * header = (klmalloc_bin_header *)((uintptr_t)ptr & (uintptr_t)~PAGE_MASK);
+	if (header->bin_magic != BIN_MAGIC || header->size >= BIG_BIN) return 0;
+	struct klmalloc_cpu_cache * cache = klmalloc_this_cache();
+	if (cache->busy) return 0;
+	cache->busy = 1;
+	klmalloc_cache_free(cache, header->size, ptr);
+	cache->busy = 0;
+	return 1;
+}
+
+/*
+ * Snapshot of the per-CPU magazine counters, for /proc/kmalloc
+ */
+int malloc_cpu_stats(int cpu, struct klmalloc_cpu_stats * out) {
+	if (cpu < 0 || cpu >= MAG_CORES) return -1;
+	memcpy(out, &klmalloc_cpu[cpu].stats, sizeof(struct klmalloc_cpu_stats));
+	out->cached = 0;
+	for (unsigned int i = 0; i < NUM_BINS - 1; ++i) {
+		out->cached += klmalloc_cpu[cpu].mags[i].rounds;
+	}
+	return 0;
+}
+
+/* }}} Per-CPU magazines */
 /* Doubly-Linked List {{{ */
 
 /*
@@ -846,7 +1001,7 @@ static void * __attribute__ ((malloc)) klrealloc(void *ptr, uintptr_t size) {
 	 */
 	if (__builtin_expect(size == 0, 0))
 	{
-		free(ptr);
+		klfree(ptr);
 		return NULL;
 	}
 
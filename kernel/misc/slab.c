@@ -0,0 +1,264 @@
+/**
+ * @file  kernel/misc/slab.c
+ * @brief Typed object caches.
+ *
+ * Fixed-size object caches for structures the kernel allocates
+ * and releases constantly, like sleep queue entries, file nodes
+ * and page cache entries. Each slab is a single physical page accessed
+ * through the direct physical mapping, so objects never go through
+ * the general heap and allocation and release are both constant-time.
+ *
+ * Objects are handed out in their constructed state: the constructor,
+ * if any, runs once when a slab is carved up, and objects should be
+ * returned to the same state before they are freed. Caches with a
+ * constructor keep their free list links after the object so they
+ * don't clobber constructed fields.
+ *
+ * Because slab pages live in the physical mapping region, @c free
+ * can recognize slab objects and return them to their cache, so
+ * objects that escape to code which doesn't know where they came
+ * from (eg. file nodes released by @c close_fs) are still handled.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/slab.h>
+
+#define SLAB_PAGE_SIZE  0x1000
+#define SLAB_PAGE_MASK  (SLAB_PAGE_SIZE - 1)
+#define SLAB_MAGIC      0x51AB51AB51AB51ABUL
+#define SLAB_KEEP_EMPTY 2
+
+typedef struct slab {
+	uint64_t magic;
+	slab_cache_t * cache;
+	struct slab * next;
+	struct slab * prev;
+	void * free_list;
+	size_t inuse;
+	uintptr_t frame;
+} slab_t;
+
+list_t * slab_caches = NULL;
+static spin_lock_t slab_caches_lock = { 0 };
+
+static inline void ** slab_link(slab_cache_t * cache, void * obj) {
+	return (void **)((uintptr_t)obj + cache->link);
+}
+
+static void slab_list_remove(slab_t ** head, slab_t * slab) {
+	if (slab->prev) slab->prev->next = slab->next;
+	else *head = slab->next;
+	if (slab->next) slab->next->prev = slab->prev;
+	slab->next = NULL;
+	slab->prev = NULL;
+}
+
+static void slab_list_push(slab_t ** head, slab_t * slab) {
+	slab->prev = NULL;
+	slab->next = *head;
+	if (*head) (*head)->prev = slab;
+	*head = slab;
+}
+
+/**
+ * @brief Create a new object cache.
+ *
+ * @param name  Name shown in /proc/slabinfo; not copied.
+ * @param size  Size of each object.
+ * @param align Alignment of each object, 0 for pointer alignment.
+ * @param ctor  Optional constructor run when objects are first created.
+ * @returns the new cache, or NULL if objects are too big to fit in a slab.
+ */
+slab_cache_t * slab_create(const char * name, size_t size, size_t align, slab_ctor_t ctor) {
+	if (!align) align = SLAB_ALIGN_DEFAULT;
+	if (align & (align - 1)) return NULL;
+	if (size < sizeof(void*)) size = sizeof(void*);
+
+	/* Free list links go in the first word of an object, unless it has
+	 * a constructor, in which case they go in an extra trailing word. */
+	size_t link = 0;
+	if (ctor) {
+		link = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+		size = link + sizeof(void*);
+	}
+
+	size_t stride = (size + align - 1) & ~(align - 1);
+	size_t offset = (sizeof(slab_t) + align - 1) & ~(align - 1);
+	if (offset + stride > SLAB_PAGE_SIZE) return NULL;
+
+	slab_cache_t * cache = calloc(1, sizeof(slab_cache_t));
+	cache->name     = name;
+	cache->size     = ctor ? link : size;
+	cache->link     = link;
+	cache->stride   = stride;
+	cache->offset   = offset;
+	cache->per_slab = (SLAB_PAGE_SIZE - offset) / stride;
+	cache->ctor     = ctor;
+
+	spin_lock(slab_caches_lock);
+	if (!slab_caches) slab_caches = list_create("slab caches", NULL);
+	list_insert(slab_caches, cache);
+	spin_unlock(slab_caches_lock);
+
+	return cache;
+}
+
+/**
+ * @brief Obtain a fresh page and carve it into objects.
+ */
+static slab_t * slab_grow(slab_cache_t * cache) {
+	uintptr_t frame = mmu_allocate_a_frame() << 12;
+	slab_t * slab = mmu_map_from_physical(frame);
+
+	slab->magic = SLAB_MAGIC;
+	slab->cache = cache;
+	slab->next  = NULL;
+	slab->prev  = NULL;
+	slab->inuse = 0;
+	slab->free_list = NULL;
+	slab->frame = frame;
+
+	/* Build the free list back to front so objects are handed out in address order */
+	for (size_t i = cache->per_slab; i > 0; --i) {
+		void * obj = (void *)((uintptr_t)slab + cache->offset + (i - 1) * cache->stride);
+		if (cache->ctor) cache->ctor(obj);
+		*slab_link(cache, obj) = slab->free_list;
+		slab->free_list = obj;
+	}
+
+	return slab;
+}
+
+static void slab_release_page(slab_t * slab) {
+	slab->magic = 0;
+	mmu_frame_release(slab->frame);
+}
+
+/**
+ * @brief Allocate an object from a cache.
+ */
+void * slab_alloc(slab_cache_t * cache) {
+	spin_lock(cache->lock);
+
+	if (!cache->partial) {
+		if (cache->empty) {
+			slab_t * slab = cache->empty;
+			slab_list_remove(&cache->empty, slab);
+			slab_list_push(&cache->partial, slab);
+			cache->empty_slabs--;
+		} else {
+			/* Don't hold the cache lock while we go get memory. */
+			spin_unlock(cache->lock);
+			slab_t * slab = slab_grow(cache);
+			spin_lock(cache->lock);
+			slab_list_push(&cache->partial, slab);
+			cache->slabs++;
+		}
+	}
+
+	slab_t * slab = cache->partial;
+	void * obj = slab->free_list;
+	slab->free_list = *slab_link(cache, obj);
+	slab->inuse++;
+
+	if (!slab->free_list) {
+		slab_list_remove(&cache->partial, slab);
+		slab_list_push(&cache->full, slab);
+	}
+
+	cache->active++;
+	cache->allocs++;
+	spin_unlock(cache->lock);
+
+	return obj;
+}
+
+/**
+ * @brief Is this pointer a slab object?
+ */
+int slab_owns(void * obj) {
+	if ((uintptr_t)obj < HIGH_MAP_REGION || (uintptr_t)obj >= MODULE_BASE_START) return 0;
+	slab_t * slab = (slab_t *)((uintptr_t)obj & ~(uintptr_t)SLAB_PAGE_MASK);
+	return slab->magic == SLAB_MAGIC;
+}
+
+/**
+ * @brief Return an object to its cache.
+ *
+ * @param cache Owning cache, or NULL to look it up from the slab.
+ * @param obj   Object to release.
+ */
+void slab_free(slab_cache_t * cache, void * obj) {
+	if (!obj) return;
+
+	slab_t * slab = (slab_t *)((uintptr_t)obj & ~(uintptr_t)SLAB_PAGE_MASK);
+	if (slab->magic != SLAB_MAGIC) {
+		printf("slab: bad free of %p\n", obj);
+		return;
+	}
+
+	if (!cache) cache = slab->cache;
+
+	spin_lock(cache->lock);
+
+	int was_full = !slab->free_list;
+	*slab_link(cache, obj) = slab->free_list;
+	slab->free_list = obj;
+	slab->inuse--;
+
+	if (was_full) {
+		slab_list_remove(&cache->full, slab);
+		slab_list_push(&cache->partial, slab);
+	}
+
+	if (!slab->inuse) {
+		slab_list_remove(&cache->partial, slab);
+		if (cache->empty_slabs < SLAB_KEEP_EMPTY) {
+			slab_list_push(&cache->empty, slab);
+			cache->empty_slabs++;
+		} else {
+			cache->slabs--;
+			slab_release_page(slab);
+		}
+	}
+
+	cache->active--;
+	cache->frees++;
+	spin_unlock(cache->lock);
+}
+
+/**
+ * @brief Release a cache and all of its pages.
+ *
+ * Any objects still allocated from the cache become invalid.
+ */
+void slab_destroy(slab_cache_t * cache) {
+	spin_lock(slab_caches_lock);
+	node_t * node = list_find(slab_caches, cache);
+	if (node) {
+		list_delete(slab_caches, node);
+		free(node);
+	}
+	spin_unlock(slab_caches_lock);
+
+	slab_t ** lists[] = { &cache->partial, &cache->full, &cache->empty };
+	for (int i = 0; i < 3; ++i) {
+		while (*lists[i]) {
+			slab_t * slab = *lists[i];
+			slab_list_remove(lists[i], slab);
+			slab_release_page(slab);
+		}
+	}
+
+	free(cache);
+}
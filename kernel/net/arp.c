@@ -70,21 +70,23 @@ struct ArpCacheEntry * net_arp_cache_get(uint32_t addr) {
 
 void net_arp_ask(uint32_t addr, fs_node_t * fsnic) {
 	struct EthernetDevice * ethnic = fsnic->device;
-	struct arp_header arp_request = {0};
+	netbuf_t * nb = netbuf_alloc(sizeof(struct arp_header));
+	struct arp_header * arp_request = netbuf_append(nb, sizeof(struct arp_header));
+	memset(arp_request, 0, sizeof(struct arp_header));
 
-	arp_request.arp_htype = htons(1); /* Ethernet */
-	arp_request.arp_ptype = htons(ETHERNET_TYPE_IPV4);
-	arp_request.arp_hlen  = 6;
-	arp_request.arp_plen  = 4;
-	arp_request.arp_oper  = htons(1); /* Who is...? */
-	arp_request.arp_data.arp_eth_ipv4.arp_tpa = addr;
-	memcpy(arp_request.arp_data.arp_eth_ipv4.arp_sha, ethnic->mac, 6);
+	arp_request->arp_htype = htons(1); /* Ethernet */
+	arp_request->arp_ptype = htons(ETHERNET_TYPE_IPV4);
+	arp_request->arp_hlen  = 6;
+	arp_request->arp_plen  = 4;
+	arp_request->arp_oper  = htons(1); /* Who is...? */
+	arp_request->arp_data.arp_eth_ipv4.arp_tpa = addr;
+	memcpy(arp_request->arp_data.arp_eth_ipv4.arp_sha, ethnic->mac, 6);
 
 	if (ethnic->ipv4_addr) {
-		arp_request.arp_data.arp_eth_ipv4.arp_spa = ethnic->ipv4_addr;
+		arp_request->arp_data.arp_eth_ipv4.arp_spa = ethnic->ipv4_addr;
 	}
 
-	net_eth_send(ethnic, sizeof(struct arp_header), &arp_request, ETHERNET_TYPE_ARP, ETHERNET_BROADCAST_MAC);
+	net_eth_send(ethnic, nb, ETHERNET_TYPE_ARP, ETHERNET_BROADCAST_MAC);
 }
 
 void net_arp_handle(struct arp_header * packet, fs_node_t * nic) {
@@ -109,17 +111,19 @@ void net_arp_handle(struct arp_header * packet, fs_node_t * nic) {
 			if (eth_dev->ipv4_addr &&  packet->arp_data.arp_eth_ipv4.arp_tpa == eth_dev->ipv4_addr) {
 				printf("net: arp: that's us, we should reply...\n");
 
-				struct arp_header response = {0};
-				response.arp_htype = htons(1);
-				response.arp_ptype = htons(ETHERNET_TYPE_IPV4);
-				response.arp_hlen = 6;
-				response.arp_plen = 4;
-				response.arp_oper = htons(2);
-				memcpy(response.arp_data.arp_eth_ipv4.arp_sha, eth_dev->mac, 6);
-				memcpy(response.arp_data.arp_eth_ipv4.arp_tha, packet->arp_data.arp_eth_ipv4.arp_sha, 6);
-				response.arp_data.arp_eth_ipv4.arp_spa = eth_dev->ipv4_addr;
-				response.arp_data.arp_eth_ipv4.arp_tpa = packet->arp_data.arp_eth_ipv4.arp_spa;
-				net_eth_send(eth_dev, sizeof(struct arp_header), &response, ETHERNET_TYPE_ARP, packet->arp_data.arp_eth_ipv4.arp_sha);
+				netbuf_t * nb = netbuf_alloc(sizeof(struct arp_header));
+				struct arp_header * response = netbuf_append(nb, sizeof(struct arp_header));
+				memset(response, 0, sizeof(struct arp_header));
+				response->arp_htype = htons(1);
+				response->arp_ptype = htons(ETHERNET_TYPE_IPV4);
+				response->arp_hlen = 6;
+				response->arp_plen = 4;
+				response->arp_oper = htons(2);
+				memcpy(response->arp_data.arp_eth_ipv4.arp_sha, eth_dev->mac, 6);
+				memcpy(response->arp_data.arp_eth_ipv4.arp_tha, packet->arp_data.arp_eth_ipv4.arp_sha, 6);
+				response->arp_data.arp_eth_ipv4.arp_spa = eth_dev->ipv4_addr;
+				response->arp_data.arp_eth_ipv4.arp_tpa = packet->arp_data.arp_eth_ipv4.arp_spa;
+				net_eth_send(eth_dev, nb, ETHERNET_TYPE_ARP, packet->arp_data.arp_eth_ipv4.arp_sha);
 			}
 		} else if (ntohs(packet->arp_oper) == 2) {
 			char spa[17];
@@ -28,53 +28,69 @@
 
 extern spin_lock_t net_raw_sockets_lock;
 extern list_t * net_raw_sockets_list;
-extern void net_ipv4_handle(void * packet, fs_node_t * nic, size_t);
+extern void net_ipv4_handle(netbuf_t * nb, fs_node_t * nic);
 extern void net_arp_handle(void * packet, fs_node_t * nic);
 
-void net_eth_handle(struct ethernet_packet * frame, fs_node_t * nic, size_t size) {
+/**
+ * Handle a received frame. The caller keeps its reference to @p nb,
+ * and anything that wants the packet after this returns takes its own.
+ */
+void net_eth_handle(netbuf_t * nb, fs_node_t * nic) {
 	struct EthernetDevice * nic_eth = nic->device;
+	struct ethernet_packet * frame = (struct ethernet_packet*)nb->data;
 
-	if (size < sizeof(struct ethernet_packet)) {
+	if (nb->len < sizeof(struct ethernet_packet)) {
 		dprintf("eth: %s: invalid ethernet frame (too small)\n",
 			nic_eth->if_name);
 		return;
 	}
 
+	/* Raw sockets see the whole frame, so they get their own copy before we start taking it apart. */
 	spin_lock(net_raw_sockets_lock);
 	foreach(node, net_raw_sockets_list) {
 		sock_t * sock = node->value;
 		if (!sock->_fnode.device || sock->_fnode.device == nic) {
-			net_sock_add(sock, frame, size);
+			netbuf_t * copy = netbuf_copy(nb->data, nb->len);
+			net_sock_add(sock, copy);
+			netbuf_put(copy);
 		}
 	}
 	spin_unlock(net_raw_sockets_lock);
 
 	if (!memcmp(frame->destination, nic_eth->mac, 6) || !memcmp(frame->destination, ETHERNET_BROADCAST_MAC, 6)) {
+		netbuf_pull(nb, sizeof(struct ethernet_packet));
 		/* Now pass the frame to the appropriate handler... */
 		switch (ntohs(frame->type)) {
 			case ETHERNET_TYPE_ARP:
-				net_arp_handle(&frame->payload, nic);
+				net_arp_handle(nb->data, nic);
 				break;
 			case ETHERNET_TYPE_IPV4: {
-				struct ipv4_packet * packet = (struct ipv4_packet*)&frame->payload;
+				struct ipv4_packet * packet = (struct ipv4_packet*)nb->data;
 				printf("net: eth: %s: rx ipv4 packet\n", nic->name);
-				if (packet->source != 0xFFFFFFFF) {
+				if (nb->len >= sizeof(struct ipv4_packet) && packet->source != 0xFFFFFFFF) {
 					net_arp_cache_add(nic->device, packet->source, frame->source, 0);
 				}
-				net_ipv4_handle(packet, nic, size - sizeof(struct ethernet_packet));
+				net_ipv4_handle(nb, nic);
 				break;
 			}
 		}
 	}
 }
 
-void net_eth_send(struct EthernetDevice * nic, size_t len, void* data, uint16_t type, uint8_t * dest) {
-	size_t total_size = sizeof(struct ethernet_packet) + len;
-	struct ethernet_packet * packet = malloc(total_size);
-	memcpy(packet->payload, data, len);
+/**
+ * Send the packet in @p nb, which this consumes, with an Ethernet
+ * header pushed in front of it.
+ */
+void net_eth_send(struct EthernetDevice * nic, netbuf_t * nb, uint16_t type, uint8_t * dest) {
+	struct ethernet_packet * packet = netbuf_push(nb, sizeof(struct ethernet_packet));
 	memcpy(packet->destination, dest, 6);
 	memcpy(packet->source, nic->mac, 6);
 	packet->type = htons(type);
-	write_fs(nic->device_node, 0, total_size, (uint8_t*)packet);
-	free(packet);
+
+	if (nic->xmit) {
+		nic->xmit(nic, nb);
+	} else {
+		write_fs(nic->device_node, 0, nb->len, nb->data);
+		netbuf_put(nb);
+	}
 }
@@ -30,7 +30,7 @@
 //#define printf(...)
 #endif
 
-#define DEFAULT_TCP_WINDOW_SIZE 65535
+#define DEFAULT_TCP_WINDOW_SIZE 65535 /* Largest window we can advertise, without window scaling */
 
 static int _debug __attribute__((unused)) = 0;
 
@@ -70,55 +70,45 @@ uint16_t calculate_ipv4_checksum(struct ipv4_packet * p) {
 	return ~(sum & 0xFFFF) & 0xFFFF;
 }
 
-uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, void * d, size_t payload_size) {
-	uint32_t sum = 0;
-	uint16_t * s = (uint16_t *)p;
-
-	/* TODO: Checksums for options? */
-	for (int i = 0; i < 6; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+/**
+ * Add up a buffer for an Internet checksum. The sum is kept in network
+ * byte order, a word at a time, and only folded at the end.
+ */
+static uint64_t checksum_add(uint64_t sum, const void * data, size_t len) {
+	const uint32_t * w = data;
+	while (len >= 4) {
+		sum += *w++;
+		len -= 4;
 	}
-
-	s = (uint16_t *)h;
-	for (int i = 0; i < 10; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+	const uint8_t * b = (const uint8_t *)w;
+	if (len >= 2) {
+		sum += *(const uint16_t *)b;
+		b += 2;
+		len -= 2;
 	}
-
-	uint16_t d_words = payload_size / 2;
-
-	s = (uint16_t *)d;
-	for (unsigned int i = 0; i < d_words; ++i) {
-		sum += ntohs(s[i]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+	if (len) {
+		uint8_t tmp[2] = { *b, 0 };
+		sum += *(uint16_t *)tmp;
 	}
+	return sum;
+}
 
-	if (d_words * 2 != payload_size) {
-		uint8_t * t = (uint8_t *)d;
-		uint8_t tmp[2];
-		tmp[0] = t[d_words * sizeof(uint16_t)];
-		tmp[1] = 0;
-
-		uint16_t * f = (uint16_t *)tmp;
-
-		sum += ntohs(f[0]);
-		if (sum > 0xFFFF) {
-			sum = (sum >> 16) + (sum & 0xFFFF);
-		}
+static uint16_t checksum_fold(uint64_t sum) {
+	while (sum >> 16) {
+		sum = (sum & 0xFFFF) + (sum >> 16);
 	}
+	return ntohs(~sum & 0xFFFF);
+}
 
-	return ~(sum & 0xFFFF) & 0xFFFF;
+/**
+ * Checksum a TCP segment: @p len bytes of header, options and payload.
+ */
+uint16_t calculate_tcp_checksum(struct tcp_check_header * p, struct tcp_header * h, size_t len) {
+	return checksum_fold(checksum_add(checksum_add(0, p, sizeof(struct tcp_check_header)), h, len));
 }
 
 static hashmap_t * udp_sockets = NULL;
-static hashmap_t * tcp_sockets = NULL;
+static hashmap_t * tcp_sockets = NULL;  /* Bound and listening TCP sockets, by port */
 static hashmap_t * icmp_sockets = NULL;
 
 void ipv4_install(void) {
@@ -127,7 +117,11 @@ void ipv4_install(void) {
 	icmp_sockets = hashmap_create_int(10);
 }
 
-int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
+/**
+ * Send the IPv4 packet at the start of @p nb, which this consumes.
+ */
+int net_ipv4_send(netbuf_t * nb, fs_node_t * nic) {
+	struct ipv4_packet * response = (struct ipv4_packet*)nb->data;
 	/* TODO: This should be routing, with a _hint_ about the interface, not the actual nic to send from! */
 	struct EthernetDevice * enic = nic->device;
 
@@ -157,7 +151,7 @@ int net_ipv4_send(struct ipv4_packet * response, fs_node_t * nic) {
 
 
 	/* Pass the packet to the next stage */
-	net_eth_send(enic, ntohs(response->length), response, ETHERNET_TYPE_IPV4, resp ? resp->hwaddr : ETHERNET_BROADCAST_MAC);
+	net_eth_send(enic, nb, ETHERNET_TYPE_IPV4, resp ? resp->hwaddr : ETHERNET_BROADCAST_MAC);
 
 	return 0;
 }
@@ -176,7 +170,8 @@ static void sock_ipv4_control_common(sock_t * sock, struct msghdr * msg, struct
 	}
 }
 
-static void icmp_handle(struct ipv4_packet * packet, const char * src, const char * dest, fs_node_t * nic) {
+static void icmp_handle(netbuf_t * nb, const char * src, const char * dest, fs_node_t * nic) {
+	struct ipv4_packet * packet = (struct ipv4_packet*)nb->data;
 	struct icmp_header * header = (void*)&packet->payload;
 
 	/* Is this a PING request? */
@@ -186,8 +181,8 @@ static void icmp_handle(struct ipv4_packet * packet, const char * src, const cha
 			packet->length = htons(ntohs(packet->length) + 1);
 		}
 
-		struct ipv4_packet * response = malloc(ntohs(packet->length));
-		memcpy(response, packet, ntohs(packet->length));
+		netbuf_t * reply = netbuf_copy(packet, ntohs(packet->length));
+		struct ipv4_packet * response = (struct ipv4_packet*)reply->data;
 		response->length = packet->length;
 		response->destination = packet->source;
 		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
@@ -206,13 +201,12 @@ static void icmp_handle(struct ipv4_packet * packet, const char * src, const cha
 		ping_reply->csum = htons(icmp_checksum(response));
 
 		/* send ipv4... */
-		net_ipv4_send(response,nic);
-		free(response);
+		net_ipv4_send(reply,nic);
 	} else if (header->type == 0 && header->code == 0) {
 		/* Did we have a client waiting for this? */
 		sock_t * handler = hashmap_get(icmp_sockets, (void*)(uintptr_t)ntohs(header->identifier));
 		if (handler) {
-			net_sock_add(handler, packet, ntohs(packet->length));
+			net_sock_add(handler, nb);
 		}
 	} else {
 		printf("net: ipv4: %s: %s -> %s ICMP %d (code = %d)\n", nic->name, src, dest, header->type, header->code);
@@ -231,11 +225,10 @@ static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
 
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	size_t packet_size = *(size_t*)packet - sizeof(struct ipv4_packet);
-
-	struct ipv4_packet * src = (struct ipv4_packet*)(packet + sizeof(size_t));
+	netbuf_t * nb = net_sock_get(sock);
+	if (!nb) return -EINTR;
+	struct ipv4_packet * src = (struct ipv4_packet*)nb->data;
+	size_t packet_size = ntohs(src->length) - sizeof(struct ipv4_packet);
 
 	if (packet_size > msg->msg_iov[0].iov_len) {
 		dprintf("ICMP recv too big for vector\n");
@@ -253,7 +246,7 @@ static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 	sock_ipv4_control_common(sock,msg,src,IPPROTO_ICMP);
 
 	memcpy(msg->msg_iov[0].iov_base, src->payload, packet_size);
-	free(packet);
+	netbuf_put(nb);
 	return packet_size;
 }
 
@@ -272,7 +265,8 @@ static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	if (!nic) return -ENONET;
 	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len;
 
-	struct ipv4_packet * response = malloc(total_length);
+	netbuf_t * nb = netbuf_alloc(total_length);
+	struct ipv4_packet * response = netbuf_append(nb, total_length);
 	response->length = htons(total_length);
 	response->destination = name->sin_addr.s_addr;
 	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
@@ -291,8 +285,7 @@ static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	micmp->csum = 0;
 	micmp->csum = htons(icmp_checksum(response));
 
-	net_ipv4_send(response,nic);
-	free(response);
+	net_ipv4_send(nb,nic);
 
 	return 0;
 }
@@ -308,115 +301,18 @@ static int icmp_socket(void) {
 	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
 }
 
-#define TCP_FLAGS_FIN (1 << 0)
-#define TCP_FLAGS_SYN (1 << 1)
-#define TCP_FLAGS_RST (1 << 2)
-#define TCP_FLAGS_PSH (1 << 3)
-#define TCP_FLAGS_ACK (1 << 4)
-#define TCP_FLAGS_URG (1 << 5)
-#define TCP_FLAGS_ECE (1 << 6)
-#define TCP_FLAGS_CWR (1 << 7)
-#define TCP_FLAGS_NS  (1 << 8)
-#define DATA_OFFSET_5 (0x5 << 12)
-
-static int tcp_ack(fs_node_t * nic, sock_t * sock, struct ipv4_packet * packet, int isSynAck, size_t payload_len) {
-	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-	int retval = 1;
-	int window_size = DEFAULT_TCP_WINDOW_SIZE;
-	int send_thrice = 0;
-
-#if 0
-	/* XXX: This means the header is bigger than we expect... */
-	if ((ntohs(tcp->flags) & 0xF000) != 0x5000) {
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: uh, weird flags? %#4x\n", ntohs(tcp->flags));
-	}
-#endif
-
-	if (sock->priv32[1] != 0 && !isSynAck &&
-		sock->priv32[1] != ntohl(tcp->seq_number)) {
-#if 0
-		int _debug __attribute__((unused)) = 1;
-		printf("tcp: suspicious of their seq number?\n");
-		printf("tcp: their seq = %u our ack = %u\n",
-			ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-		//window_size = 300;
-		
-		retval = 0;
-		send_thrice = 1;
-	} else {
-		sock->priv32[0] = isSynAck ? 1 : sock->priv32[0];
-		sock->priv32[1] = (ntohl(tcp->seq_number) + payload_len) & 0xFFFFFFFF;
-		sock->priv[1] = 2;
-	}
-
-	sock->priv[2]++;
-
-#if 0
-	printf("tcp: their ack = %u our seq = %u\n",
-		ntohl(tcp->ack_number), sock->priv32[0]);
-	printf("tcp: their seq = %u our ack = %u\n",
-		ntohl(tcp->seq_number), sock->priv32[1]);
-#endif
-
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-
-	struct ipv4_packet * response = malloc(total_length);
-	response->length = htons(total_length);
-	response->destination = packet->source;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-	response->ttl = 64;
-	response->protocol = IPV4_PROT_TCP;
-	response->ident = htons(sock->priv[2]);
-	response->flags_fragment = htons(0x0);
-	response->version_ihl = 0x45;
-	response->dscp_ecn = 0;
-	response->checksum = 0;
-	response->checksum = htons(calculate_ipv4_checksum(response));
-
-	int flags = TCP_FLAGS_ACK;
-	if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-		/* Other side is closed now */
-		sock->priv32[1]++;
-		sock->priv[1] = 3;
-	}
-
-	/* Stick TCP header into payload */
-	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[0]);
-	tcp_header->destination_port = tcp->source_port;
-	tcp_header->seq_number = htonl(sock->priv32[0]);
-	tcp_header->ack_number = htonl(sock->priv32[1]);
-	tcp_header->flags = htons(flags | 0x5000);
-	tcp_header->window_size = htons(window_size);
-	tcp_header->checksum = 0;
-	tcp_header->urgent = 0;
-
-	/* Calculate checksum */
-	struct tcp_check_header check_hd = {
-		.source = response->source,
-		.destination = response->destination,
-		.zeros = 0,
-		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
-	};
-
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-	net_ipv4_send(response,nic);
-	if (send_thrice) {
-		net_ipv4_send(response,nic);
-		net_ipv4_send(response,nic);
-	}
-	free(response);
-	return retval;
-}
+static void tcp_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size);
 
-void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
+/**
+ * Handle a received packet. As with net_eth_handle, the caller keeps
+ * its reference to @p nb.
+ */
+void net_ipv4_handle(netbuf_t * nb, fs_node_t * nic) {
+	struct ipv4_packet * packet = (struct ipv4_packet*)nb->data;
 
-	if (size < sizeof(struct ipv4_packet)) {
+	if (nb->len < sizeof(struct ipv4_packet) || ntohs(packet->length) > nb->len) {
 		dprintf("ipv4: Incoming packet is too small.\n");
+		return;
 	}
 
 	char dest[16];
@@ -427,7 +323,7 @@ void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size)
 
 	switch (packet->protocol) {
 		case 1:
-			icmp_handle(packet, src, dest, nic);
+			icmp_handle(nb, src, dest, nic);
 			break;
 		case IPV4_PROT_UDP: {
 			uint16_t dest_port = ntohs(((uint16_t*)&packet->payload)[1]);
@@ -435,44 +331,14 @@ void net_ipv4_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size)
 			if (hashmap_has(udp_sockets, (void*)(uintptr_t)dest_port)) {
 				printf("net: udp: received and have a waiting endpoint!\n");
 				sock_t * sock = hashmap_get(udp_sockets, (void*)(uintptr_t)dest_port);
-				net_sock_add(sock, packet, ntohs(packet->length));
+				net_sock_add(sock, nb);
 			}
 			break;
 		}
 		case IPV4_PROT_TCP: {
 			uint16_t dest_port = ntohs(((uint16_t*)&packet->payload)[1]);
 			printf("net: ipv4: %s: %s -> %s tcp %d to %d\n", nic->name, src, dest, ntohs(((uint16_t*)&packet->payload)[0]), dest_port);
-			sock_t * sock = hashmap_get(tcp_sockets, (void*)(uintptr_t)dest_port);
-			if (sock) {
-				printf("net: tcp: received and have a waiting endpoint!\n");
-				/* What kind of packet is this? Is it something we were expecting? */
-				struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
-
-				if (sock->priv[1] == 1) {
-					/* Awaiting SYN ACK, is this one? */
-					if ((ntohs(tcp->flags) & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) {
-						printf("tcp: synack\n");
-						if (tcp_ack(nic, sock, packet, 1, 1)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					} else if ((ntohs(tcp->flags) & (TCP_FLAGS_RST))) {
-						sock->priv[1] = 0;
-						net_sock_alert(sock);
-					}
-				} else if (sock->priv[1] == 2) {
-					size_t packet_len = ntohs(packet->length) - sizeof(struct ipv4_packet);
-					size_t hlen = ((ntohs(tcp->flags) & 0xF000) >> 12) * 4;
-					size_t payload_len = packet_len - hlen;
-					if (payload_len) {
-						printf("tcp: acking because payload_len = %zu (hlen=%zu, packet_len=%zu)\n", payload_len, hlen, packet_len);
-						if (tcp_ack(nic, sock, packet, 0, payload_len)) {
-							net_sock_add(sock, packet, ntohs(packet->length));
-						}
-					} else if (ntohs(tcp->flags) & TCP_FLAGS_FIN) {
-						tcp_ack(nic, sock, packet, 0, 0);
-					}
-				}
-			}
+			tcp_handle(packet, nic, nb->len);
 			break;
 		}
 	}
@@ -534,7 +400,8 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 
 	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len + sizeof(struct udp_packet);
 
-	struct ipv4_packet * response = malloc(total_length);
+	netbuf_t * nb = netbuf_alloc(total_length);
+	struct ipv4_packet * response = netbuf_append(nb, total_length);
 	response->length = htons(total_length);
 	response->destination = name->sin_addr.s_addr;
 	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
@@ -555,8 +422,7 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	udp_packet->checksum = 0;
 
 	memcpy(response->payload + sizeof(struct udp_packet), msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
-	net_ipv4_send(response,nic);
-	free(response);
+	net_ipv4_send(nb,nic);
 
 	return msg->msg_iov[0].iov_len;
 }
@@ -576,9 +442,9 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
 
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	struct ipv4_packet * data = (struct ipv4_packet*)(packet + sizeof(size_t));
+	netbuf_t * nb = net_sock_get(sock);
+	if (!nb) return -EINTR;
+	struct ipv4_packet * data = (struct ipv4_packet*)nb->data;
 	struct udp_packet * udp_packet = (struct udp_packet*)&data->payload;
 
 	printf("udp: got response, size is %u - sizeof(ipv4) - sizeof(udp) = %lu\n",
@@ -598,7 +464,7 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 	printf("udp: data copied to iov 0, return length?\n");
 
 	long resp = ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet);
-	free(packet);
+	netbuf_put(nb);
 	return resp;
 }
 
@@ -654,188 +520,298 @@ static int udp_socket(void) {
 	return process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
 }
 
-static spin_lock_t tcp_port_lock = {0};
-static void sock_tcp_close(sock_t * sock) {
-	if (sock->priv[0]) {
-		printf("tcp: removing port %d from bound map\n", sock->priv[0]);
-		spin_lock(tcp_port_lock);
-		hashmap_remove(tcp_sockets, (void*)(uintptr_t)sock->priv[0]);
-		spin_unlock(tcp_port_lock);
+#define TCP_FLAGS_FIN (1 << 0)
+#define TCP_FLAGS_SYN (1 << 1)
+#define TCP_FLAGS_RST (1 << 2)
+#define TCP_FLAGS_PSH (1 << 3)
+#define TCP_FLAGS_ACK (1 << 4)
+#define TCP_FLAGS_URG (1 << 5)
+#define TCP_FLAGS_ECE (1 << 6)
+#define TCP_FLAGS_CWR (1 << 7)
+#define TCP_FLAGS_NS  (1 << 8)
+#define DATA_OFFSET_5 (0x5 << 12)
+#define DATA_OFFSET_6 (0x6 << 12)
 
-		size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
-		fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-		if (!nic) return;
+#define TCP_OPT_END 0
+#define TCP_OPT_NOP 1
+#define TCP_OPT_MSS 2
 
-		struct ipv4_packet * response = malloc(total_length);
-		response->length = htons(total_length);
-		response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-		response->ttl = 64;
-		response->protocol = IPV4_PROT_TCP;
-		sock->priv[2]++;
-		response->ident = htons(sock->priv[2]);
-		response->flags_fragment = htons(0x0);
-		response->version_ihl = 0x45;
-		response->dscp_ecn = 0;
-		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
+/*
+ * Connection states. Once our side is closed we stay around in FIN_WAIT
+ * until everything we sent, FIN included, has been acknowledged, and a
+ * little longer if the other side has yet to send its own FIN. There is
+ * no TIME_WAIT.
+ */
+#define TCP_STATE_CLOSED       0
+#define TCP_STATE_SYN_SENT     1
+#define TCP_STATE_ESTABLISHED  2
+#define TCP_STATE_CLOSE_WAIT   3 /* The other side has sent its FIN */
+#define TCP_STATE_LISTEN       4
+#define TCP_STATE_SYN_RECEIVED 5
+#define TCP_STATE_FIN_WAIT     6 /* The socket is gone; sending what's left, then the FIN */
+
+#define TCP_CONN_BUCKETS    1024
+#define TCP_BACKLOG_MAX     128
+#define TCP_SYN_TIMEOUT     3000000 /* Microseconds a half-open connection may hold a backlog slot */
+#define TCP_EPHEMERAL_FIRST 49152
+
+#define TCP_SNDBUF          (256 * 1024) /* Send ring size; must be a power of two */
+#define TCP_RCVBUF          65536        /* Receive ring size; must be a power of two */
+#define TCP_OOO_MAX         8            /* Ranges that arrived out of order we can keep track of */
+#define TCP_MSS_DEFAULT     536
+#define TCP_RTO_INITIAL     1000000  /* Microseconds */
+#define TCP_RTO_MIN         200000
+#define TCP_RTO_MAX         60000000
+#define TCP_MAX_RETRIES     8
+#define TCP_SYN_RETRIES     3        /* Times a SYN-ACK is resent before the half-open connection is dropped */
+#define TCP_LINGER          5000000  /* How long to wait for the other side's FIN after ours is acknowledged */
+#define TCP_TIMER_TICK      20000    /* How often the retransmission timers are looked at */
+
+/* Sequence number comparisons, modulo 2^32 */
+#define SEQ_LT(a,b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a,b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a,b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a,b) ((int32_t)((a) - (b)) >= 0)
+
+/*
+ * TCP control block.
+ *
+ * This is kept apart from the socket because segments for a connection
+ * can still be on their way through the receive path when the socket
+ * is closed and freed. References are held by the connection table, by
+ * the port map for bound sockets, by the socket, and by the receive
+ * path while it works on a segment; counts, table links, queues and
+ * @c sock are all protected by tcp_lock.
+ *
+ * The send and receive rings and their state are protected by the control
+ * block's own @c lock, which is never held together with tcp_lock.
+ */
+struct tcp_pcb {
+	struct tcp_pcb * hash_next;
+	sock_t * sock;              /* NULL once the socket is gone */
+	int refs;
+	int state;
+	int hashed;                 /* In the connection table */
+	int bound;                  /* In tcp_sockets */
+	int connecting;             /* connect() is waiting for the handshake */
+
+	uint32_t local_addr;        /* Network byte order */
+	uint32_t remote_addr;
+	uint16_t local_port;        /* Host byte order */
+	uint16_t remote_port;
+
+	uint32_t snd_nxt;           /* Sequence number of the next byte we send */
+	uint32_t rcv_nxt;           /* Sequence number of the next byte we expect */
+	uint16_t ident;
+
+	/* Passive open */
+	struct tcp_pcb * listener;  /* Where a half-open connection came in */
+	uint64_t syn_time;          /* When its SYN arrived, in microseconds */
+	list_t * syn_queue;         /* Half-open connections, waiting for the last ACK of the handshake */
+	list_t * accept_queue;      /* Connections waiting for accept() */
+	int backlog;
+
+	/* Send side */
+	spin_lock_t lock;
+	uint8_t * snd_buf;          /* Ring of TCP_SNDBUF bytes, indexed by sequence number */
+	uint32_t snd_len;           /* Bytes in the ring, starting at snd_una */
+	uint32_t snd_una;           /* Oldest unacknowledged sequence number */
+	uint32_t snd_max;           /* One past the highest sequence number sent */
+	uint32_t snd_wnd;           /* Window the other side last advertised */
+	uint32_t mss;               /* Largest segment the other side takes */
+	uint32_t cwnd;              /* Congestion window */
+	uint32_t ssthresh;
+	uint32_t recover;           /* snd_max when fast recovery started */
+	int dupacks;
+	int output_busy;            /* Someone is sending in tcp_output */
+	int probe;                  /* Push a byte into a zero window */
+	int fin_queued;             /* A FIN follows the data in the ring */
+	int fin_acked;
+	int retries;
+	uint32_t rtt_seq;           /* Sequence number that ends the segment being timed */
+	uint64_t rtt_time;          /* When it was sent, or 0 when nothing is being timed */
+	uint32_t srtt;              /* Smoothed round trip time, in microseconds */
+	uint32_t rttvar;
+	uint32_t rto;               /* Retransmission timeout, in microseconds */
+	uint64_t rto_deadline;      /* When the retransmission timer goes off, or 0 */
+	list_t * snd_wait;          /* Writers waiting for room in the ring */
+
+	/* Receive side */
+	uint8_t * rcv_buf;          /* Ring of TCP_RCVBUF bytes, indexed by sequence number */
+	uint32_t rcv_read;          /* Sequence number of the next byte for recv() */
+	uint32_t rcv_wnd;           /* Window we last advertised */
+	uint32_t rcv_fin;           /* Where the other side's FIN goes in the sequence, if fin_seen */
+	int fin_seen;
+	int fin_received;           /* ... and everything up to it has arrived */
+	int ooo_count;
+	struct {
+		uint32_t start, end;
+	} ooo[TCP_OOO_MAX];         /* Data past rcv_nxt that is already in the ring, in order */
+};
 
-		/* Stick TCP header into payload */
-		struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-		tcp_header->source_port = htons(sock->priv[0]);
-		tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-		tcp_header->seq_number = htonl(sock->priv32[0]);
-		tcp_header->ack_number = htonl(sock->priv32[1]);
-		tcp_header->flags = htons(TCP_FLAGS_FIN | TCP_FLAGS_ACK | 0x5000);
-		tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-		tcp_header->checksum = 0;
-		tcp_header->urgent = 0;
-
-		/* Calculate checksum */
-		struct tcp_check_header check_hd = {
-			.source = response->source,
-			.destination = response->destination,
-			.zeros = 0,
-			.protocol = IPV4_PROT_TCP,
-			.tcp_len = htons(sizeof(struct tcp_header)),
-		};
-
-		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, 0));
-		net_ipv4_send(response,nic);
-		free(response);
-	}
-}
-
-static int next_tcp_port = 49152;
-static int tcp_get_port(sock_t * sock) {
-	spin_lock(tcp_port_lock);
-	int out = next_tcp_port++;
-	hashmap_set(tcp_sockets, (void*)(uintptr_t)out, sock);
-	sock->priv[0] = out;
-	spin_unlock(tcp_port_lock);
-	return out;
-}
+extern uint32_t rand(void);
 
-static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
-	if (!sock->priv[0]) {
-		printf("tcp: recv() but socket has no port\n");
-		return -EINVAL;
-	}
+static spin_lock_t tcp_lock = {0};
+static struct tcp_pcb * tcp_conns[TCP_CONN_BUCKETS]; /* Connections, by address and port at both ends */
+static uint16_t next_tcp_port = TCP_EPHEMERAL_FIRST;
+static volatile int tcp_timer_started = 0;
 
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
+static uint64_t tcp_now(void) {
+	return arch_perf_timer() / arch_cpu_mhz();
+}
 
-	if (sock->unread) {
-		if (sock->unread > msg->msg_iov[0].iov_len) {
-			unsigned long out = msg->msg_iov[0].iov_len;
-			sock->unread -= out;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			char * x = malloc(sock->unread);
-			memcpy(x, sock->buf + out, sock->unread);
-			free(sock->buf);
-			sock->buf = x;
-			return out;
-		} else {
-			unsigned long out = sock->unread;
-			sock->unread = 0;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
-			free(sock->buf);
-			sock->buf = NULL;
-			return out;
-		}
-	}
+static struct tcp_pcb * tcp_pcb_create(void) {
+	struct tcp_pcb * pcb = calloc(1, sizeof(struct tcp_pcb));
+	pcb->snd_wait = list_create("tcp writers", pcb);
+	pcb->mss = TCP_MSS_DEFAULT;
+	pcb->rto = TCP_RTO_INITIAL;
+	return pcb;
+}
 
-	if (!sock->rx_queue->length && sock->priv[1] == 3) {
-		return 0; /* EOF */
+/**
+ * Drop a reference to a control block. Called with tcp_lock held.
+ */
+static void tcp_pcb_unref(struct tcp_pcb * pcb) {
+	if (--pcb->refs) return;
+	if (pcb->syn_queue) {
+		list_free(pcb->syn_queue);
+		free(pcb->syn_queue);
 	}
-
-	if (!sock->rx_queue->length && sock->nonblocking) return -EAGAIN;
-
-	while (!sock->rx_queue->length) {
-		int r = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		if (r == -EINTR) return -ERESTARTSYS;
-		if (!sock->rx_queue->length) {
-			if (sock->priv[1] == 3) {
-				/* Socket was closed while waiting */
-				return 0;
-			}
-		}
+	if (pcb->accept_queue) {
+		list_free(pcb->accept_queue);
+		free(pcb->accept_queue);
 	}
+	list_free(pcb->snd_wait);
+	free(pcb->snd_wait);
+	if (pcb->snd_buf) free(pcb->snd_buf);
+	if (pcb->rcv_buf) free(pcb->rcv_buf);
+	free(pcb);
+}
 
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	struct ipv4_packet * data = (struct ipv4_packet*)(packet + sizeof(size_t));
-	size_t packet_size = *(size_t*)packet;
-	unsigned long resp = ntohs(data->length);
+static unsigned int tcp_hash(uint32_t local_addr, uint16_t local_port, uint32_t remote_addr, uint16_t remote_port) {
+	uint32_t h = local_addr * 0x9E3779B1 ^ remote_addr * 0x85EBCA6B ^ (((uint32_t)local_port << 16) | remote_port) * 0xC2B2AE35;
+	h ^= h >> 16;
+	return h & (TCP_CONN_BUCKETS - 1);
+}
 
-	if (resp != packet_size) {
-		dprintf("packet size does not match: %zu %zu\n", resp, packet_size);
-		resp = packet_size;
+/**
+ * Find a connection by its addresses and ports. Called with tcp_lock held.
+ */
+static struct tcp_pcb * tcp_conn_find(uint32_t local_addr, uint16_t local_port, uint32_t remote_addr, uint16_t remote_port) {
+	for (struct tcp_pcb * pcb = tcp_conns[tcp_hash(local_addr, local_port, remote_addr, remote_port)]; pcb; pcb = pcb->hash_next) {
+		if (pcb->local_port == local_port && pcb->remote_port == remote_port &&
+			pcb->local_addr == local_addr && pcb->remote_addr == remote_addr) {
+			return pcb;
+		}
 	}
+	return NULL;
+}
 
-	if (resp < sizeof(struct ipv4_packet) + sizeof(struct tcp_header)) {
-		dprintf("Invalid receive data?\n");
-		assert(0);
-	}
+static void tcp_conn_insert(struct tcp_pcb * pcb) {
+	unsigned int bucket = tcp_hash(pcb->local_addr, pcb->local_port, pcb->remote_addr, pcb->remote_port);
+	pcb->hash_next = tcp_conns[bucket];
+	tcp_conns[bucket] = pcb;
+	pcb->hashed = 1;
+	pcb->refs++;
+}
 
-	resp -=  sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
+static void tcp_conn_remove(struct tcp_pcb * pcb) {
+	if (!pcb->hashed) return;
+	struct tcp_pcb ** link = &tcp_conns[tcp_hash(pcb->local_addr, pcb->local_port, pcb->remote_addr, pcb->remote_port)];
+	while (*link != pcb) link = &(*link)->hash_next;
+	*link = pcb->hash_next;
+	pcb->hash_next = NULL;
+	pcb->hashed = 0;
+	tcp_pcb_unref(pcb);
+}
 
-	if (resp > (unsigned long)msg->msg_iov[0].iov_len) {
-		memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header),msg->msg_iov[0].iov_len);
-		resp -= msg->msg_iov[0].iov_len;
-		if (resp == 0xFFFFffffFFFFffff) printf("what\n");
-		sock->unread = resp;
-		sock->buf = malloc(resp);
-		memcpy(sock->buf, data->payload + sizeof(struct tcp_header) + msg->msg_iov[0].iov_len, resp);
-		free(packet);
-		return msg->msg_iov[0].iov_len;
+/**
+ * Pick an ephemeral port. Called with tcp_lock held.
+ *
+ * Bound ports are never picked. A port in use by another connection is
+ * still fine if the other end is different.
+ */
+static int tcp_pick_port(struct tcp_pcb * pcb) {
+	for (int tries = 0; tries < 65536 - TCP_EPHEMERAL_FIRST; ++tries) {
+		uint16_t port = next_tcp_port;
+		next_tcp_port = port == 65535 ? TCP_EPHEMERAL_FIRST : port + 1;
+		if (hashmap_has(tcp_sockets, (void*)(uintptr_t)port)) continue;
+		if (pcb->remote_port && tcp_conn_find(pcb->local_addr, port, pcb->remote_addr, pcb->remote_port)) continue;
+		pcb->local_port = port;
+		return 0;
 	}
+	return -EADDRNOTAVAIL;
+}
 
-	memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header), resp);
-	free(packet);
-	return resp;
+/**
+ * Wake up anyone waiting on a connection's socket. Called with tcp_lock held.
+ */
+static void tcp_wake(struct tcp_pcb * pcb) {
+	if (!pcb->sock) return;
+	wakeup_queue(pcb->sock->rx_wait);
+	net_sock_alert(pcb->sock);
 }
 
-extern uint32_t rand(void);
+/**
+ * The room left in the receive ring, which is the window we advertise.
+ */
+static uint32_t tcp_rcv_window(struct tcp_pcb * pcb) {
+	if (!pcb->rcv_buf) return DEFAULT_TCP_WINDOW_SIZE;
+	uint32_t used = pcb->rcv_nxt - pcb->rcv_read;
+	uint32_t window = used < TCP_RCVBUF ? TCP_RCVBUF - used : 0;
+	return window > DEFAULT_TCP_WINDOW_SIZE ? DEFAULT_TCP_WINDOW_SIZE : window;
+}
 
-static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
-	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
-	char deststr[16];
-	ip_ntoa(ntohl(dest->sin_addr.s_addr), deststr);
-	printf("tcp: connect requested to %s port %d\n", deststr, ntohs(dest->sin_port));
+/**
+ * The largest segment we can take, or send, through an interface.
+ */
+static uint32_t tcp_local_mss(fs_node_t * nic) {
+	size_t mtu = ((struct EthernetDevice*)nic->device)->mtu;
+	if (mtu > 65535) mtu = 65535;
+	return mtu - sizeof(struct ipv4_packet) - sizeof(struct tcp_header);
+}
 
-	if (sock->priv[1] != 0) {
-		printf("tcp: socket is already connected?\n");
-		return -EINVAL;
+/**
+ * Find the MSS option in a SYN.
+ */
+static uint32_t tcp_peer_mss(struct tcp_header * tcp, size_t hlen) {
+	uint8_t * opt = tcp->payload;
+	uint8_t * end = (uint8_t*)tcp + hlen;
+	while (opt < end && *opt != TCP_OPT_END) {
+		if (*opt == TCP_OPT_NOP) {
+			opt++;
+			continue;
+		}
+		if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end) break;
+		if (opt[0] == TCP_OPT_MSS && opt[1] == 4) {
+			uint32_t mss = (opt[2] << 8) | opt[3];
+			return mss < 64 ? 64 : mss;
+		}
+		opt += opt[1];
 	}
+	return TCP_MSS_DEFAULT;
+}
 
-	if (!dest->sin_port) return -EADDRNOTAVAIL; /* 0 is still 0 in both endians */
-
-	/* Get a port */
-	tcp_get_port(sock);
-	printf("tcp: connecting from ephemeral port %d\n", (int)sock->priv[0]);
-
-	/* Mark as awaiting connection, send initial SYN */
-	sock->priv[1] = 1;
-
-	memcpy(&sock->dest, addr, addrlen);
-
-	fs_node_t * nic = net_if_route(dest->sin_addr.s_addr);
-	if (!nic) return -ENONET;
-
-	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
+/**
+ * Start a segment on a connection.
+ *
+ * Fills in the IP and TCP headers, and an MSS option if it's a SYN.
+ * The caller puts @p len bytes of data at @p payload and then passes
+ * the segment to tcp_segment_send.
+ */
+static netbuf_t * tcp_segment_alloc(struct tcp_pcb * pcb, fs_node_t * nic, int flags, uint32_t seq, size_t len, uint8_t ** payload) {
+	size_t options = (flags & TCP_FLAGS_SYN) ? 4 : 0;
+	size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header) + options + len;
 
-	struct ipv4_packet * response = malloc(total_length);
+	netbuf_t * nb = netbuf_alloc(total_length);
+	struct ipv4_packet * response = netbuf_append(nb, total_length);
 	response->length = htons(total_length);
-	response->destination = dest->sin_addr.s_addr;
-	response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
+	response->destination = pcb->remote_addr;
+	response->source = pcb->local_addr ? pcb->local_addr : ((struct EthernetDevice*)nic->device)->ipv4_addr;
 	response->ttl = 64;
 	response->protocol = IPV4_PROT_TCP;
-	sock->priv[2] = rand();
-	response->ident = htons(sock->priv[2]);
+	response->ident = htons(pcb->ident);
+	pcb->ident++;
 	response->flags_fragment = htons(0x0);
 	response->version_ihl = 0x45;
 	response->dscp_ecn = 0;
@@ -844,176 +820,1287 @@ static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen
 
 	/* Stick TCP header into payload */
 	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-	tcp_header->source_port = htons(sock->priv[0]);
-	tcp_header->destination_port = dest->sin_port;
-	tcp_header->seq_number = 0;
-	tcp_header->ack_number = 0;
-	tcp_header->flags = htons((1 << 1) | 0x5000);
-	tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
+	tcp_header->source_port = htons(pcb->local_port);
+	tcp_header->destination_port = htons(pcb->remote_port);
+	tcp_header->seq_number = htonl(seq);
+	tcp_header->ack_number = (flags & TCP_FLAGS_ACK) ? htonl(pcb->rcv_nxt) : 0;
+	tcp_header->flags = htons(flags | (options ? DATA_OFFSET_6 : DATA_OFFSET_5));
+	pcb->rcv_wnd = tcp_rcv_window(pcb);
+	tcp_header->window_size = htons(pcb->rcv_wnd);
 	tcp_header->checksum = 0;
 	tcp_header->urgent = 0;
 
-	/* Calculate checksum */
+	if (options) {
+		uint32_t mss = tcp_local_mss(nic);
+		tcp_header->payload[0] = TCP_OPT_MSS;
+		tcp_header->payload[1] = 4;
+		tcp_header->payload[2] = mss >> 8;
+		tcp_header->payload[3] = mss & 0xFF;
+	}
+
+	*payload = tcp_header->payload + options;
+	return nb;
+}
+
+/**
+ * Checksum and send a segment from tcp_segment_alloc.
+ */
+static void tcp_segment_send(netbuf_t * nb, fs_node_t * nic) {
+	struct ipv4_packet * response = (struct ipv4_packet*)nb->data;
+	struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
+	size_t tcp_len = ntohs(response->length) - sizeof(struct ipv4_packet);
+
 	struct tcp_check_header check_hd = {
 		.source = response->source,
 		.destination = response->destination,
 		.zeros = 0,
 		.protocol = IPV4_PROT_TCP,
-		.tcp_len = htons(sizeof(struct tcp_header)),
+		.tcp_len = htons(tcp_len),
 	};
 
-	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, NULL, 0));
-
-	net_ipv4_send(response,nic);
-
-	//int _debug __attribute__((unused)) = 1;
-	printf("tcp: waiting for connect to finish; queue = %ld\n", sock->rx_queue->length);
-
-	unsigned long s, ss;
-	unsigned long ns, nss;
-	relative_time(1,0,&s,&ss);
-	int attempts = 0;
-
-	while (!sock->rx_queue->length) {
-		int result = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
-		if (result == -EINTR) {
-			free(response);
-			return -EINTR;
-		}
-		relative_time(0,0,&ns,&nss);
-		if (sock->priv[1] == 0) {
-			free(response);
-			return -ECONNREFUSED;
-		}
-		if (result != 0 && (ns > s || (ns == s && nss > ss))) {
-			if (attempts++ == 3) {
-				printf("tcp: connect timed out\n");
-				free(response);
-				return -ETIMEDOUT;
-			}
-			printf("tcp: retrying...\n");
-			net_ipv4_send(response,nic);
-			relative_time(1,0,&s,&ss);
-		}
-	}
-
-	free(response);
-
-	printf("tcp: queue should have data now (len = %lu), trying to read\n", sock->rx_queue->length);
+	tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_len));
+	net_ipv4_send(nb,nic);
+}
 
-	/* wait for signal that we connected or timed out */
-	char * packet = net_sock_get(sock);
-	if (!packet) return -EINTR;
-	//struct ipv4_packet * data = packet + sizeof(size_t);
-	printf("tcp: connect complete\n");
-	free(packet);
+/**
+ * Send a segment with no data on a connection.
+ */
+static int tcp_send_segment(struct tcp_pcb * pcb, int flags, uint32_t seq) {
+	fs_node_t * nic = net_if_route(pcb->remote_addr);
+	if (!nic) return -ENONET;
 
+	uint8_t * payload;
+	tcp_segment_send(tcp_segment_alloc(pcb, nic, flags, seq, 0, &payload), nic);
 	return 0;
 }
 
-ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	printf("tcp: read into buffer of %zu bytes\n", size);
-	struct iovec _iovec = {
-		buffer, size
-	};
-	struct msghdr _header = {
-		.msg_name = NULL,
-		.msg_namelen = 0,
-		.msg_iov = &_iovec,
-		.msg_iovlen = 1,
-		.msg_control = NULL,
-		.msg_controllen = 0,
-		.msg_flags = 0,
+/**
+ * Refuse a connection attempt for which there is no listener.
+ */
+static void tcp_send_reset(struct ipv4_packet * packet) {
+	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
+	struct tcp_pcb pcb = {
+		.local_addr = packet->destination,
+		.remote_addr = packet->source,
+		.local_port = ntohs(tcp->destination_port),
+		.remote_port = ntohs(tcp->source_port),
+		.rcv_nxt = ntohl(tcp->seq_number) + 1,
 	};
-	return sock_tcp_recv((sock_t*)node, &_header, 0);
+	tcp_send_segment(&pcb, TCP_FLAGS_RST | TCP_FLAGS_ACK, 0);
 }
 
-static void delay_yield(size_t subticks) {
-	unsigned long s, ss;
-	relative_time(0, subticks, &s, &ss);
-	sleep_until((process_t *)this_core->current_process, s, ss);
-	switch_task(0);
+static void tcp_ring_read(struct tcp_pcb * pcb, uint32_t seq, uint8_t * out, size_t len) {
+	size_t off = seq & (TCP_SNDBUF - 1);
+	size_t first = len < TCP_SNDBUF - off ? len : TCP_SNDBUF - off;
+	memcpy(out, pcb->snd_buf + off, first);
+	memcpy(out + first, pcb->snd_buf, len - first);
 }
 
-static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
-	printf("tcp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
-	if (msg->msg_iovlen == 0) return 0;
+static void tcp_ring_write(struct tcp_pcb * pcb, uint32_t seq, const uint8_t * in, size_t len) {
+	size_t off = seq & (TCP_SNDBUF - 1);
+	size_t first = len < TCP_SNDBUF - off ? len : TCP_SNDBUF - off;
+	memcpy(pcb->snd_buf + off, in, first);
+	memcpy(pcb->snd_buf, in + first, len - first);
+}
 
-	size_t size_into = 0;
-	size_t size_remaining = msg->msg_iov[0].iov_len;
+static void tcp_rcv_ring_write(struct tcp_pcb * pcb, uint32_t seq, const uint8_t * in, size_t len) {
+	size_t off = seq & (TCP_RCVBUF - 1);
+	size_t first = len < TCP_RCVBUF - off ? len : TCP_RCVBUF - off;
+	memcpy(pcb->rcv_buf + off, in, first);
+	memcpy(pcb->rcv_buf, in + first, len - first);
+}
 
-	size_t last = arch_perf_timer();
-	while (size_remaining) {
-		size_t size_to_send = size_remaining > 1024 ? 1024 : size_remaining;
-		size_t total_length = sizeof(struct ipv4_packet) + sizeof(struct tcp_header) + size_to_send;
+static void tcp_rcv_ring_read(struct tcp_pcb * pcb, uint32_t seq, uint8_t * out, size_t len) {
+	size_t off = seq & (TCP_RCVBUF - 1);
+	size_t first = len < TCP_RCVBUF - off ? len : TCP_RCVBUF - off;
+	memcpy(out, pcb->rcv_buf + off, first);
+	memcpy(out + first, pcb->rcv_buf, len - first);
+}
 
-		fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-		if (!nic) return -ENONET;
+static void tcp_set_rto(struct tcp_pcb * pcb, uint32_t rto) {
+	if (rto < TCP_RTO_MIN) rto = TCP_RTO_MIN;
+	if (rto > TCP_RTO_MAX) rto = TCP_RTO_MAX;
+	pcb->rto = rto;
+}
 
-		struct ipv4_packet * response = malloc(total_length);
-		response->length = htons(total_length);
-		response->destination = ((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr;
-		response->source = ((struct EthernetDevice*)nic->device)->ipv4_addr;
-		response->ttl = 64;
-		response->protocol = IPV4_PROT_TCP;
-		sock->priv[2]++;
-		response->ident = htons(sock->priv[2]);
-		response->flags_fragment = htons(0x0);
-		response->version_ihl = 0x45;
-		response->dscp_ecn = 0;
-		response->checksum = 0;
-		response->checksum = htons(calculate_ipv4_checksum(response));
+/**
+ * Fold a round trip measurement into the smoothed estimate and set the
+ * retransmission timeout from it, as in RFC 6298.
+ */
+static void tcp_rtt_sample(struct tcp_pcb * pcb, uint32_t rtt) {
+	if (!rtt) rtt = 1;
+	if (!pcb->srtt) {
+		pcb->srtt = rtt;
+		pcb->rttvar = rtt / 2;
+	} else {
+		uint32_t err = rtt > pcb->srtt ? rtt - pcb->srtt : pcb->srtt - rtt;
+		pcb->rttvar = (3 * pcb->rttvar + err) / 4;
+		pcb->srtt = (7 * pcb->srtt + rtt) / 8;
+	}
+	tcp_set_rto(pcb, pcb->srtt + 4 * pcb->rttvar);
+}
 
-		/* Stick TCP header into payload */
-		struct tcp_header * tcp_header = (struct tcp_header*)&response->payload;
-		tcp_header->source_port = htons(sock->priv[0]);
-		tcp_header->destination_port = ((struct sockaddr_in*)&sock->dest)->sin_port;
-		tcp_header->seq_number = htonl(sock->priv32[0]);
-		tcp_header->ack_number = htonl(sock->priv32[1]);
-		tcp_header->flags = htons(TCP_FLAGS_PSH | TCP_FLAGS_ACK | 0x5000);
-		tcp_header->window_size = htons(DEFAULT_TCP_WINDOW_SIZE);
-		tcp_header->checksum = 0;
-		tcp_header->urgent = 0;
-
-		sock->priv32[0] += size_to_send;
-
-		/* Calculate checksum */
-		struct tcp_check_header check_hd = {
-			.source = response->source,
-			.destination = response->destination,
-			.zeros = 0,
-			.protocol = IPV4_PROT_TCP,
-			.tcp_len = htons(sizeof(struct tcp_header) + size_to_send),
-		};
-
-		memcpy(tcp_header->payload, (char*)msg->msg_iov[0].iov_base + size_into, size_to_send);
-		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, size_to_send));
-		net_ipv4_send(response,nic);
-		free(response);
-
-		size_remaining -= size_to_send;
-		size_into += size_to_send;
-
-		if (size_remaining) {
-			/* Keep us away from the BSP... */
-			if (processor_count > 1) {
-				if (this_core->cpu_id == 0) {
-					delay_yield(0);
-				}
+/**
+ * Set up both directions when the handshake finishes.
+ *
+ * @p tcp is the segment that finished it, for the other side's window;
+ * its MSS should already be in @c mss from its SYN.
+ */
+static void tcp_init_transfer(struct tcp_pcb * pcb, struct tcp_header * tcp) {
+	fs_node_t * nic = net_if_route(pcb->remote_addr);
+	if (nic && pcb->mss > tcp_local_mss(nic)) pcb->mss = tcp_local_mss(nic);
+
+	pcb->snd_una = pcb->snd_nxt;
+	pcb->snd_max = pcb->snd_nxt;
+	pcb->snd_wnd = ntohs(tcp->window_size);
+	/* Initial window from RFC 6928 */
+	uint32_t initial = 14600 > 2 * pcb->mss ? 14600 : 2 * pcb->mss;
+	pcb->cwnd = initial < 10 * pcb->mss ? initial : 10 * pcb->mss;
+	pcb->ssthresh = 0xFFFFFFFF;
+
+	pcb->rcv_buf = malloc(TCP_RCVBUF);
+	pcb->rcv_read = pcb->rcv_nxt;
+
+	/* A passive open had the timer on its SYN-ACK. */
+	pcb->rto_deadline = 0;
+	pcb->retries = 0;
+}
+
+/**
+ * Build the next segment that may be sent: new data from the ring if
+ * the windows have room for it, or the FIN once all the data is out.
+ * Called with the connection's lock held.
+ */
+static netbuf_t * tcp_next_segment(struct tcp_pcb * pcb, fs_node_t * nic) {
+	if (pcb->state != TCP_STATE_ESTABLISHED && pcb->state != TCP_STATE_CLOSE_WAIT && pcb->state != TCP_STATE_FIN_WAIT) return NULL;
+
+	uint32_t end = pcb->snd_una + pcb->snd_len;
+	uint32_t in_flight = pcb->snd_nxt - pcb->snd_una;
+	uint32_t window = pcb->cwnd < pcb->snd_wnd ? pcb->cwnd : pcb->snd_wnd;
+	uint32_t room = window > in_flight ? window - in_flight : 0;
+	uint8_t * payload;
+
+	if (SEQ_LT(pcb->snd_nxt, end)) {
+		uint32_t len = end - pcb->snd_nxt;
+		if (len > pcb->mss) len = pcb->mss;
+		if (!room && pcb->probe) room = 1;
+		if (len > room) {
+			/* Wait for a window worth filling, unless there's nothing in flight to open it. */
+			if (!room || (in_flight && room < pcb->mss / 2)) {
+				if (!in_flight && !pcb->rto_deadline) pcb->rto_deadline = tcp_now() + pcb->rto;
+				return NULL;
+			}
+			len = room;
+		}
+		pcb->probe = 0;
+
+		netbuf_t * segment = tcp_segment_alloc(pcb, nic, TCP_FLAGS_PSH | TCP_FLAGS_ACK, pcb->snd_nxt, len, &payload);
+		tcp_ring_read(pcb, pcb->snd_nxt, payload, len);
+
+		/* Only time segments on their first trip. */
+		if (!pcb->rtt_time && pcb->snd_nxt == pcb->snd_max) {
+			pcb->rtt_time = tcp_now();
+			pcb->rtt_seq = pcb->snd_nxt + len;
+		}
+		pcb->snd_nxt += len;
+		if (SEQ_GT(pcb->snd_nxt, pcb->snd_max)) pcb->snd_max = pcb->snd_nxt;
+		if (!pcb->rto_deadline) pcb->rto_deadline = tcp_now() + pcb->rto;
+		return segment;
+	}
+
+	if (pcb->fin_queued && pcb->snd_nxt == end) {
+		netbuf_t * segment = tcp_segment_alloc(pcb, nic, TCP_FLAGS_FIN | TCP_FLAGS_ACK, end, 0, &payload);
+		pcb->snd_nxt = end + 1;
+		if (SEQ_GT(pcb->snd_nxt, pcb->snd_max)) pcb->snd_max = pcb->snd_nxt;
+		if (!pcb->rto_deadline) pcb->rto_deadline = tcp_now() + pcb->rto;
+		return segment;
+	}
+
+	return NULL;
+}
+
+/**
+ * Send what the windows allow.
+ *
+ * Segments are built under the connection's lock but sent without it.
+ * Only one caller sends at a time, so segments leave in order; anyone
+ * else who turns up meanwhile leaves their data to that caller, who
+ * looks again before giving up the job.
+ */
+static void tcp_output(struct tcp_pcb * pcb) {
+	fs_node_t * nic = net_if_route(pcb->remote_addr);
+	if (!nic) return;
+
+	spin_lock(pcb->lock);
+	if (pcb->output_busy) {
+		spin_unlock(pcb->lock);
+		return;
+	}
+	pcb->output_busy = 1;
+
+	netbuf_t * segment;
+	while ((segment = tcp_next_segment(pcb, nic))) {
+		spin_unlock(pcb->lock);
+		tcp_segment_send(segment, nic);
+		spin_lock(pcb->lock);
+	}
+
+	pcb->output_busy = 0;
+	spin_unlock(pcb->lock);
+}
+
+/**
+ * Build a segment to resend the oldest unacknowledged data. Called with
+ * the connection's lock held.
+ */
+static netbuf_t * tcp_resend_segment(struct tcp_pcb * pcb, fs_node_t * nic) {
+	uint32_t len = pcb->snd_len < pcb->mss ? pcb->snd_len : pcb->mss;
+	if (!len || !nic) return NULL;
+
+	uint8_t * payload;
+	netbuf_t * segment = tcp_segment_alloc(pcb, nic, TCP_FLAGS_PSH | TCP_FLAGS_ACK, pcb->snd_una, len, &payload);
+	tcp_ring_read(pcb, pcb->snd_una, payload, len);
+	return segment;
+}
+
+/**
+ * Forget a connection that has finished closing.
+ */
+static void tcp_finish(struct tcp_pcb * pcb) {
+	spin_lock(tcp_lock);
+	pcb->state = TCP_STATE_CLOSED;
+	tcp_conn_remove(pcb);
+	spin_unlock(tcp_lock);
+}
+
+/**
+ * The connection is over without a proper close: the other side reset
+ * it, or stopped answering. Anything not yet sent is thrown away.
+ */
+static void tcp_drop(struct tcp_pcb * pcb) {
+	spin_lock(pcb->lock);
+	pcb->state = TCP_STATE_CLOSED;
+	pcb->snd_len = 0;
+	pcb->rto_deadline = 0;
+	wakeup_queue(pcb->snd_wait);
+	spin_unlock(pcb->lock);
+
+	spin_lock(tcp_lock);
+	tcp_wake(pcb);
+	tcp_conn_remove(pcb);
+	spin_unlock(tcp_lock);
+}
+
+/**
+ * Take in the acknowledgement and window of a segment on a synchronized
+ * connection.
+ *
+ * Congestion control is Reno, with the NewReno change to fast recovery
+ * so one partial acknowledgement resends the next hole straight away.
+ */
+static void tcp_input_ack(struct tcp_pcb * pcb, struct tcp_header * tcp, int flags, size_t payload_len) {
+	if (!(flags & TCP_FLAGS_ACK)) return;
+
+	uint32_t ack = ntohl(tcp->ack_number);
+	uint32_t window = ntohs(tcp->window_size);
+	fs_node_t * nic = net_if_route(pcb->remote_addr);
+	netbuf_t * resend = NULL;
+
+	spin_lock(pcb->lock);
+	if (SEQ_LT(ack, pcb->snd_una) || SEQ_GT(ack, pcb->snd_max)) {
+		spin_unlock(pcb->lock);
+		return;
+	}
+
+	/* The other side is still there, whatever it thinks of our data. */
+	pcb->retries = 0;
+
+	if (SEQ_GT(ack, pcb->snd_una)) {
+		uint32_t acked = ack - pcb->snd_una;
+		uint32_t data = acked < pcb->snd_len ? acked : pcb->snd_len;
+		pcb->snd_len -= data;
+		pcb->snd_una = ack;
+		if (SEQ_LT(pcb->snd_nxt, ack)) pcb->snd_nxt = ack;
+		if (acked > data) pcb->fin_acked = 1;
+
+		if (pcb->rtt_time && SEQ_GEQ(ack, pcb->rtt_seq)) {
+			tcp_rtt_sample(pcb, tcp_now() - pcb->rtt_time);
+			pcb->rtt_time = 0;
+		} else if (pcb->srtt) {
+			/* Undo any backoff now that things are moving again. */
+			tcp_set_rto(pcb, pcb->srtt + 4 * pcb->rttvar);
+		}
+
+		if (pcb->dupacks >= 3 && SEQ_LT(ack, pcb->recover)) {
+			resend = tcp_resend_segment(pcb, nic);
+			pcb->cwnd = pcb->cwnd > acked ? pcb->cwnd - acked + pcb->mss : pcb->mss;
+		} else if (pcb->dupacks >= 3) {
+			pcb->cwnd = pcb->ssthresh;
+			pcb->dupacks = 0;
+		} else {
+			pcb->dupacks = 0;
+			if (pcb->cwnd < pcb->ssthresh) {
+				pcb->cwnd += acked < pcb->mss ? acked : pcb->mss;
 			} else {
-				if (arch_perf_timer() - last > 10000UL * arch_cpu_mhz()) {
-					delay_yield(0);
-					last = arch_perf_timer();
+				uint32_t grow = pcb->mss * pcb->mss / pcb->cwnd;
+				pcb->cwnd += grow ? grow : 1;
+			}
+		}
+
+		if (pcb->fin_acked) {
+			pcb->rto_deadline = tcp_now() + TCP_LINGER;
+		} else {
+			pcb->rto_deadline = pcb->snd_una == pcb->snd_max ? 0 : tcp_now() + pcb->rto;
+		}
+		if (data) wakeup_queue(pcb->snd_wait);
+	} else if (!payload_len && !(flags & (TCP_FLAGS_SYN | TCP_FLAGS_FIN)) &&
+		window == pcb->snd_wnd && pcb->snd_una != pcb->snd_max) {
+		/* A duplicate: something after snd_una got there without it. */
+		if (++pcb->dupacks == 3) {
+			uint32_t flight = pcb->snd_max - pcb->snd_una;
+			pcb->ssthresh = flight / 2 > 2 * pcb->mss ? flight / 2 : 2 * pcb->mss;
+			pcb->recover = pcb->snd_max;
+			pcb->cwnd = pcb->ssthresh + 3 * pcb->mss;
+			pcb->rtt_time = 0;
+			resend = tcp_resend_segment(pcb, nic);
+		} else if (pcb->dupacks > 3) {
+			pcb->cwnd += pcb->mss;
+		}
+	}
+
+	pcb->snd_wnd = window;
+	spin_unlock(pcb->lock);
+
+	if (resend) tcp_segment_send(resend, nic);
+	tcp_output(pcb);
+}
+
+static void tcp_drop_half_open(struct tcp_pcb * pcb);
+
+/**
+ * Nothing came back for our SYN-ACK: send it again, or forget the
+ * half-open connection once it has been sent too many times.
+ */
+static void tcp_synack_timeout(struct tcp_pcb * pcb, uint64_t now) {
+	spin_lock(tcp_lock);
+	if (pcb->state != TCP_STATE_SYN_RECEIVED) {
+		spin_unlock(tcp_lock);
+		return;
+	}
+	if (++pcb->retries > TCP_SYN_RETRIES) {
+		tcp_drop_half_open(pcb);
+		spin_unlock(tcp_lock);
+		return;
+	}
+	spin_unlock(tcp_lock);
+
+	spin_lock(pcb->lock);
+	tcp_set_rto(pcb, pcb->rto * 2);
+	pcb->rto_deadline = now + pcb->rto;
+	spin_unlock(pcb->lock);
+
+	tcp_send_segment(pcb, TCP_FLAGS_SYN | TCP_FLAGS_ACK, pcb->snd_nxt - 1);
+}
+
+/**
+ * A connection's retransmission timer went off.
+ *
+ * With data in flight, all of it is sent again from the oldest byte
+ * and the congestion window starts over from one segment. With nothing
+ * in flight the other side must have closed its window, so a byte is
+ * pushed at it to get a fresh window back. In FIN_WAIT, after our FIN
+ * was acknowledged, it means the other side's FIN never came. Before
+ * the handshake is done, it's our SYN-ACK that needs sending again.
+ */
+static void tcp_timeout(struct tcp_pcb * pcb) {
+	uint64_t now = tcp_now();
+	int finish = 0, drop = 0;
+
+	spin_lock(pcb->lock);
+	if (!pcb->rto_deadline || now < pcb->rto_deadline) {
+		spin_unlock(pcb->lock);
+		return;
+	}
+
+	if (pcb->state == TCP_STATE_SYN_RECEIVED) {
+		spin_unlock(pcb->lock);
+		tcp_synack_timeout(pcb, now);
+		return;
+	}
+
+	if (pcb->fin_acked) {
+		pcb->rto_deadline = 0;
+		finish = 1;
+	} else if (++pcb->retries > TCP_MAX_RETRIES) {
+		drop = 1;
+	} else if (pcb->snd_una == pcb->snd_max) {
+		pcb->probe = 1;
+		tcp_set_rto(pcb, pcb->rto * 2);
+		pcb->rto_deadline = now + pcb->rto;
+	} else {
+		uint32_t flight = pcb->snd_max - pcb->snd_una;
+		pcb->ssthresh = flight / 2 > 2 * pcb->mss ? flight / 2 : 2 * pcb->mss;
+		pcb->cwnd = pcb->mss;
+		pcb->dupacks = 0;
+		pcb->snd_nxt = pcb->snd_una;
+		pcb->rtt_time = 0;
+		tcp_set_rto(pcb, pcb->rto * 2);
+		pcb->rto_deadline = now + pcb->rto;
+	}
+	spin_unlock(pcb->lock);
+
+	if (finish) {
+		tcp_finish(pcb);
+	} else if (drop) {
+		printf("tcp: port %d gave up on retransmitting\n", pcb->local_port);
+		tcp_send_segment(pcb, TCP_FLAGS_RST | TCP_FLAGS_ACK, pcb->snd_nxt);
+		tcp_drop(pcb);
+	} else {
+		tcp_output(pcb);
+	}
+}
+
+static void delay_yield(size_t subticks) {
+	unsigned long s, ss;
+	relative_time(0, subticks, &s, &ss);
+	sleep_until((process_t *)this_core->current_process, s, ss);
+	switch_task(0);
+}
+
+/**
+ * Look for expired retransmission timers every TCP_TIMER_TICK.
+ */
+static void tcp_timer_thread(void * arg) {
+	list_t * due = list_create("tcp timers", NULL);
+
+	while (1) {
+		delay_yield(TCP_TIMER_TICK);
+		uint64_t now = tcp_now();
+
+		spin_lock(tcp_lock);
+		for (int i = 0; i < TCP_CONN_BUCKETS; ++i) {
+			for (struct tcp_pcb * pcb = tcp_conns[i]; pcb; pcb = pcb->hash_next) {
+				if (pcb->rto_deadline && pcb->rto_deadline <= now) {
+					pcb->refs++;
+					list_insert(due, pcb);
+				}
+			}
+		}
+		spin_unlock(tcp_lock);
+
+		foreach(node, due) {
+			tcp_timeout(node->value);
+		}
+
+		spin_lock(tcp_lock);
+		while (due->length) {
+			node_t * n = list_dequeue(due);
+			tcp_pcb_unref(n->value);
+			free(n);
+		}
+		spin_unlock(tcp_lock);
+	}
+}
+
+/**
+ * There are no processes yet when the stack is set up, so the timer
+ * thread is started by the first connection.
+ */
+static void tcp_timer_start(void) {
+	if (tcp_timer_started) return;
+	if (__sync_lock_test_and_set(&tcp_timer_started, 1)) return;
+	spawn_worker_thread(tcp_timer_thread, "[tcp]", NULL);
+}
+
+/**
+ * Note a range of data that arrived ahead of rcv_nxt. Called with the
+ * connection's lock held.
+ *
+ * Ranges are kept sorted and merged. If there are already too many to
+ * keep track of, the data stays in the ring unaccounted for and will be
+ * written there again when it is resent.
+ */
+static void tcp_ooo_add(struct tcp_pcb * pcb, uint32_t start, uint32_t end) {
+	int i = 0;
+	while (i < pcb->ooo_count && SEQ_LT(pcb->ooo[i].end, start)) i++;
+
+	if (i < pcb->ooo_count && SEQ_LEQ(pcb->ooo[i].start, end)) {
+		/* Overlaps or touches this one, and maybe the ones after it too */
+		if (SEQ_LT(start, pcb->ooo[i].start)) pcb->ooo[i].start = start;
+		if (SEQ_GT(end, pcb->ooo[i].end)) pcb->ooo[i].end = end;
+		int j = i + 1;
+		while (j < pcb->ooo_count && SEQ_LEQ(pcb->ooo[j].start, pcb->ooo[i].end)) {
+			if (SEQ_GT(pcb->ooo[j].end, pcb->ooo[i].end)) pcb->ooo[i].end = pcb->ooo[j].end;
+			j++;
+		}
+		memmove(&pcb->ooo[i + 1], &pcb->ooo[j], (pcb->ooo_count - j) * sizeof(pcb->ooo[0]));
+		pcb->ooo_count -= j - i - 1;
+		return;
+	}
+
+	if (pcb->ooo_count == TCP_OOO_MAX) return;
+	memmove(&pcb->ooo[i + 1], &pcb->ooo[i], (pcb->ooo_count - i) * sizeof(pcb->ooo[0]));
+	pcb->ooo[i].start = start;
+	pcb->ooo[i].end = end;
+	pcb->ooo_count++;
+}
+
+/**
+ * Take in the data and FIN of a segment on a synchronized connection,
+ * and acknowledge it.
+ *
+ * Data goes straight into the receive ring at its place in the sequence,
+ * so a segment that arrives early only has to wait there for the ones
+ * before it. Anything past the window is dropped. Out of order data is
+ * acknowledged right away, which tells the other side what's missing.
+ *
+ * A segment with nothing in it needs no answer, unless it is outside the
+ * window or is the other side's SYN-ACK again because our ACK of it was
+ * lost; those get an ACK saying where we are.
+ */
+static void tcp_input_data(struct tcp_pcb * pcb, struct tcp_header * tcp, int flags, const uint8_t * payload, size_t len) {
+	uint32_t seq = ntohl(tcp->seq_number);
+	int wake = 0;
+
+	spin_lock(pcb->lock);
+	if (!pcb->rcv_buf) {
+		spin_unlock(pcb->lock);
+		return;
+	}
+
+	uint32_t limit = pcb->rcv_read + TCP_RCVBUF;
+	if (!len && !(flags & TCP_FLAGS_FIN)) {
+		int acceptable = seq == pcb->rcv_nxt || (SEQ_GT(seq, pcb->rcv_nxt) && SEQ_LT(seq, limit));
+		spin_unlock(pcb->lock);
+		if (!acceptable || (flags & TCP_FLAGS_SYN)) tcp_send_segment(pcb, TCP_FLAGS_ACK, pcb->snd_nxt);
+		return;
+	}
+	if ((flags & TCP_FLAGS_FIN) && !pcb->fin_seen && SEQ_LEQ(seq + len, limit)) {
+		pcb->fin_seen = 1;
+		pcb->rcv_fin = seq + len;
+	}
+
+	/* Cut off what we already have, and what doesn't fit. */
+	if (SEQ_LT(seq, pcb->rcv_nxt)) {
+		uint32_t skip = pcb->rcv_nxt - seq;
+		if (skip > len) skip = len;
+		seq += skip;
+		payload += skip;
+		len -= skip;
+	}
+	if (len && SEQ_GT(seq + len, limit)) {
+		len = SEQ_LT(seq, limit) ? limit - seq : 0;
+	}
+
+	if (len) {
+		tcp_rcv_ring_write(pcb, seq, payload, len);
+		if (seq == pcb->rcv_nxt) {
+			pcb->rcv_nxt += len;
+			/* Pull in anything that was waiting for this. */
+			while (pcb->ooo_count && SEQ_LEQ(pcb->ooo[0].start, pcb->rcv_nxt)) {
+				if (SEQ_GT(pcb->ooo[0].end, pcb->rcv_nxt)) pcb->rcv_nxt = pcb->ooo[0].end;
+				pcb->ooo_count--;
+				memmove(&pcb->ooo[0], &pcb->ooo[1], pcb->ooo_count * sizeof(pcb->ooo[0]));
+			}
+			wake = 1;
+		} else {
+			tcp_ooo_add(pcb, seq, seq + len);
+		}
+	}
+
+	if (pcb->fin_seen && !pcb->fin_received && pcb->rcv_nxt == pcb->rcv_fin) {
+		/* Other side is closed now */
+		pcb->rcv_nxt++;
+		pcb->fin_received = 1;
+		if (pcb->state == TCP_STATE_ESTABLISHED) pcb->state = TCP_STATE_CLOSE_WAIT;
+		wake = 1;
+	}
+
+	/* Nobody is left to read it. */
+	if (pcb->state == TCP_STATE_FIN_WAIT) pcb->rcv_read = pcb->rcv_nxt;
+	spin_unlock(pcb->lock);
+
+	tcp_send_segment(pcb, TCP_FLAGS_ACK, pcb->snd_nxt);
+
+	if (wake) {
+		spin_lock(tcp_lock);
+		tcp_wake(pcb);
+		spin_unlock(tcp_lock);
+	}
+}
+
+/**
+ * Forget a half-open connection. Called with tcp_lock held.
+ */
+static void tcp_drop_half_open(struct tcp_pcb * pcb) {
+	struct tcp_pcb * listener = pcb->listener;
+	if (listener) {
+		node_t * node = list_find(listener->syn_queue, pcb);
+		if (node) {
+			list_delete(listener->syn_queue, node);
+			free(node);
+		}
+		pcb->listener = NULL;
+		tcp_pcb_unref(listener);
+	}
+	pcb->state = TCP_STATE_CLOSED;
+	tcp_conn_remove(pcb);
+}
+
+/**
+ * Make room in a full SYN queue by dropping connections whose handshake
+ * never finished. Called with tcp_lock held.
+ */
+static void tcp_expire_half_open(struct tcp_pcb * listener, uint64_t now) {
+	node_t * node = listener->syn_queue->head;
+	while (node) {
+		node_t * next = node->next;
+		struct tcp_pcb * pcb = node->value;
+		if (now - pcb->syn_time > TCP_SYN_TIMEOUT) {
+			tcp_drop_half_open(pcb);
+		}
+		node = next;
+	}
+}
+
+/**
+ * A SYN came in for a listening socket: answer it and keep the
+ * half-open connection until the handshake finishes.
+ *
+ * If the SYN queue or the accept queue is full, the SYN is dropped and
+ * the other side will try again.
+ */
+static void tcp_listen_syn(struct tcp_pcb * listener, struct ipv4_packet * packet, struct tcp_header * tcp, size_t hlen) {
+	uint64_t now = tcp_now();
+
+	spin_lock(tcp_lock);
+	if (listener->state != TCP_STATE_LISTEN) goto _drop;
+	if ((int)listener->syn_queue->length >= listener->backlog) {
+		tcp_expire_half_open(listener, now);
+	}
+	if ((int)listener->syn_queue->length >= listener->backlog ||
+		(int)listener->accept_queue->length >= listener->backlog) {
+		printf("tcp: backlog of port %d is full\n", listener->local_port);
+		goto _drop;
+	}
+
+	struct tcp_pcb * pcb = tcp_pcb_create();
+	pcb->state = TCP_STATE_SYN_RECEIVED;
+	pcb->local_addr = packet->destination;
+	pcb->remote_addr = packet->source;
+	pcb->local_port = ntohs(tcp->destination_port);
+	pcb->remote_port = ntohs(tcp->source_port);
+	pcb->rcv_nxt = ntohl(tcp->seq_number) + 1;
+	pcb->snd_nxt = rand() + 1;
+	pcb->ident = rand();
+	pcb->mss = tcp_peer_mss(tcp, hlen);
+	pcb->syn_time = now;
+	pcb->rto_deadline = now + pcb->rto;
+	pcb->listener = listener;
+	listener->refs++;
+	list_insert(listener->syn_queue, pcb);
+	tcp_conn_insert(pcb);
+	pcb->refs++;
+	spin_unlock(tcp_lock);
+
+	tcp_timer_start();
+	tcp_send_segment(pcb, TCP_FLAGS_SYN | TCP_FLAGS_ACK, pcb->snd_nxt - 1);
+
+	spin_lock(tcp_lock);
+	tcp_pcb_unref(pcb);
+_drop:
+	spin_unlock(tcp_lock);
+}
+
+static sock_t * tcp_sock_create(void);
+static void tcp_sock_discard(sock_t * sock);
+
+/**
+ * The last ACK of a passive open arrived: give the connection a socket
+ * and put it on its listener's accept queue.
+ *
+ * @returns 0 if the listener has gone away, and the connection with it.
+ */
+static int tcp_passive_established(struct tcp_pcb * pcb) {
+	sock_t * sock = tcp_sock_create();
+
+	spin_lock(tcp_lock);
+	struct tcp_pcb * listener = pcb->listener;
+	if (pcb->state != TCP_STATE_SYN_RECEIVED || !listener || listener->state != TCP_STATE_LISTEN) {
+		tcp_drop_half_open(pcb);
+		spin_unlock(tcp_lock);
+		tcp_sock_discard(sock);
+		return 0;
+	}
+
+	node_t * node = list_find(listener->syn_queue, pcb);
+	if (node) {
+		list_delete(listener->syn_queue, node);
+		free(node);
+	}
+	pcb->listener = NULL;
+
+	struct sockaddr_in * dest = (struct sockaddr_in*)&sock->dest;
+	dest->sin_family = AF_INET;
+	dest->sin_port = htons(pcb->remote_port);
+	dest->sin_addr.s_addr = pcb->remote_addr;
+	sock->pcb = pcb;
+	pcb->sock = sock;
+	pcb->refs++;
+	pcb->state = TCP_STATE_ESTABLISHED;
+
+	list_insert(listener->accept_queue, pcb);
+	tcp_wake(listener);
+	tcp_pcb_unref(listener);
+	spin_unlock(tcp_lock);
+
+	tcp_timer_start();
+	return 1;
+}
+
+static void tcp_handle(struct ipv4_packet * packet, fs_node_t * nic, size_t size) {
+	size_t packet_len = ntohs(packet->length);
+	if (packet_len > size || packet_len < sizeof(struct ipv4_packet) + sizeof(struct tcp_header)) return;
+
+	struct tcp_header * tcp = (struct tcp_header*)&packet->payload;
+	int flags = ntohs(tcp->flags);
+	size_t hlen = ((flags & 0xF000) >> 12) * 4;
+	if (hlen < sizeof(struct tcp_header) || hlen > packet_len - sizeof(struct ipv4_packet)) return;
+	size_t payload_len = packet_len - sizeof(struct ipv4_packet) - hlen;
+	const uint8_t * payload = (const uint8_t *)tcp + hlen;
+	uint16_t local_port = ntohs(tcp->destination_port);
+	uint16_t remote_port = ntohs(tcp->source_port);
+
+	spin_lock(tcp_lock);
+	struct tcp_pcb * pcb = tcp_conn_find(packet->destination, local_port, packet->source, remote_port);
+	if (!pcb) {
+		pcb = hashmap_get(tcp_sockets, (void*)(uintptr_t)local_port);
+		if (pcb && pcb->state != TCP_STATE_LISTEN) pcb = NULL;
+	}
+	if (pcb) pcb->refs++;
+	spin_unlock(tcp_lock);
+
+	if (!pcb) {
+		if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK | TCP_FLAGS_RST)) == TCP_FLAGS_SYN) {
+			tcp_send_reset(packet);
+		}
+		return;
+	}
+
+	switch (pcb->state) {
+		case TCP_STATE_LISTEN:
+			if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK | TCP_FLAGS_RST)) == TCP_FLAGS_SYN) {
+				tcp_listen_syn(pcb, packet, tcp, hlen);
+			}
+			break;
+
+		case TCP_STATE_SYN_SENT:
+			if ((flags & (TCP_FLAGS_SYN | TCP_FLAGS_ACK)) == (TCP_FLAGS_SYN | TCP_FLAGS_ACK) && ntohl(tcp->ack_number) == pcb->snd_nxt) {
+				printf("tcp: synack\n");
+				pcb->rcv_nxt = ntohl(tcp->seq_number) + 1;
+				pcb->mss = tcp_peer_mss(tcp, hlen);
+				tcp_init_transfer(pcb, tcp);
+				pcb->state = TCP_STATE_ESTABLISHED;
+				tcp_send_segment(pcb, TCP_FLAGS_ACK, pcb->snd_nxt);
+				spin_lock(tcp_lock);
+				tcp_wake(pcb);
+				spin_unlock(tcp_lock);
+			} else if (flags & TCP_FLAGS_RST) {
+				spin_lock(tcp_lock);
+				pcb->state = TCP_STATE_CLOSED;
+				tcp_wake(pcb);
+				spin_unlock(tcp_lock);
+			}
+			break;
+
+		case TCP_STATE_SYN_RECEIVED:
+			if (flags & TCP_FLAGS_RST) {
+				spin_lock(tcp_lock);
+				tcp_drop_half_open(pcb);
+				spin_unlock(tcp_lock);
+			} else if (flags & TCP_FLAGS_SYN) {
+				/* Our SYN-ACK must have been lost. */
+				tcp_send_segment(pcb, TCP_FLAGS_SYN | TCP_FLAGS_ACK, pcb->snd_nxt - 1);
+			} else if ((flags & TCP_FLAGS_ACK) && ntohl(tcp->ack_number) == pcb->snd_nxt) {
+				tcp_init_transfer(pcb, tcp);
+				if (tcp_passive_established(pcb)) {
+					tcp_input_data(pcb, tcp, flags, payload, payload_len);
+				} else {
+					tcp_send_segment(pcb, TCP_FLAGS_RST, pcb->snd_nxt);
 				}
 			}
+			break;
+
+		case TCP_STATE_ESTABLISHED:
+		case TCP_STATE_CLOSE_WAIT:
+		case TCP_STATE_FIN_WAIT:
+			if (flags & TCP_FLAGS_RST) {
+				tcp_drop(pcb);
+				break;
+			}
+			tcp_input_ack(pcb, tcp, flags, payload_len);
+			tcp_input_data(pcb, tcp, flags, payload, payload_len);
+			if (pcb->state == TCP_STATE_FIN_WAIT && pcb->fin_acked && pcb->fin_received) {
+				tcp_finish(pcb);
+			}
+			break;
+	}
+
+	spin_lock(tcp_lock);
+	tcp_pcb_unref(pcb);
+	spin_unlock(tcp_lock);
+}
+
+/**
+ * Free a socket nobody has a descriptor for.
+ *
+ * This is for connections that never got to accept(). It can't go
+ * through close_fs, as the listener's own close is already in there.
+ */
+static void tcp_sock_discard(sock_t * sock) {
+	while (sock->rx_queue->length) {
+		node_t * n = list_dequeue(sock->rx_queue);
+		netbuf_put(n->value);
+		free(n);
+	}
+	list_free(sock->alert_wait);
+	free(sock->alert_wait);
+	list_free(sock->rx_wait);
+	free(sock->rx_wait);
+	free(sock->rx_queue);
+	free(sock);
+}
+
+static void sock_tcp_close(sock_t * sock) {
+	struct tcp_pcb * pcb = sock->pcb;
+	if (!pcb) return;
+
+	/* Connections that were never accepted are reset. */
+	list_t * orphans = list_create("tcp orphans", NULL);
+
+	spin_lock(tcp_lock);
+	int state = pcb->state;
+	/* Established connections stay in the table until our data and FIN are delivered. */
+	int linger = state == TCP_STATE_ESTABLISHED || state == TCP_STATE_CLOSE_WAIT;
+	pcb->state = linger ? TCP_STATE_FIN_WAIT : TCP_STATE_CLOSED;
+	pcb->sock = NULL;
+	sock->pcb = NULL;
+
+	if (pcb->bound) {
+		printf("tcp: removing port %d from bound map\n", pcb->local_port);
+		hashmap_remove(tcp_sockets, (void*)(uintptr_t)pcb->local_port);
+		pcb->bound = 0;
+		tcp_pcb_unref(pcb);
+	}
+
+	if (state == TCP_STATE_LISTEN) {
+		while (pcb->syn_queue->length) {
+			struct tcp_pcb * child = pcb->syn_queue->head->value;
+			child->refs++;
+			list_insert(orphans, child);
+			tcp_drop_half_open(child);
+		}
+		while (pcb->accept_queue->length) {
+			node_t * n = list_dequeue(pcb->accept_queue);
+			struct tcp_pcb * child = n->value;
+			free(n);
+			tcp_sock_discard(child->sock);
+			child->sock = NULL;
+			child->state = TCP_STATE_CLOSED;
+			tcp_conn_remove(child);
+			/* The socket's reference is now ours. */
+			list_insert(orphans, child);
 		}
 	}
 
-	return size_into;
+	if (!linger) tcp_conn_remove(pcb);
+	spin_unlock(tcp_lock);
+
+	if (linger) {
+		spin_lock(pcb->lock);
+		pcb->fin_queued = 1;
+		spin_unlock(pcb->lock);
+		tcp_output(pcb);
+	}
+
+	foreach(node, orphans) {
+		struct tcp_pcb * child = node->value;
+		tcp_send_segment(child, TCP_FLAGS_RST | TCP_FLAGS_ACK, child->snd_nxt);
+	}
+
+	spin_lock(tcp_lock);
+	foreach(node, orphans) {
+		tcp_pcb_unref(node->value);
+	}
+	tcp_pcb_unref(pcb);
+	spin_unlock(tcp_lock);
+
+	list_free(orphans);
+	free(orphans);
+}
+
+/**
+ * Data the application can have: everything up to rcv_nxt, less the FIN.
+ */
+static uint32_t tcp_rcv_ready(struct tcp_pcb * pcb) {
+	return pcb->rcv_nxt - pcb->rcv_read - (pcb->fin_received ? 1 : 0);
+}
+
+/**
+ * Copy @p len bytes from rcv_read on out to the caller's buffers,
+ * skipping the first @p skip bytes of them.
+ */
+static void tcp_rcv_copy_out(struct tcp_pcb * pcb, struct msghdr * msg, size_t skip, size_t len) {
+	size_t offset = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && len; ++i) {
+		size_t iov_len = msg->msg_iov[i].iov_len;
+		if (skip >= iov_len) {
+			skip -= iov_len;
+			continue;
+		}
+		size_t n = iov_len - skip < len ? iov_len - skip : len;
+		tcp_rcv_ring_read(pcb, pcb->rcv_read + offset, (uint8_t*)msg->msg_iov[i].iov_base + skip, n);
+		skip = 0;
+		offset += n;
+		len -= n;
+	}
+}
+
+static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
+	struct tcp_pcb * pcb = sock->pcb;
+	if (pcb->state == TCP_STATE_LISTEN || !pcb->rcv_buf) return -ENOTCONN;
+
+	size_t want = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+		want += msg->msg_iov[i].iov_len;
+	}
+	if (!want) return 0;
+
+	int nonblocking = sock->nonblocking || (flags & MSG_DONTWAIT);
+	size_t got = 0;
+	long result = 0;
+
+	spin_lock(pcb->lock);
+	while (1) {
+		size_t ready = tcp_rcv_ready(pcb);
+
+		if (flags & MSG_PEEK) {
+			/*
+			 * Nothing is taken, so with MSG_WAITALL wait until it's all there at once,
+			 * or until there's no more room for it to arrive in: the other side only
+			 * has to fill the largest window we advertise.
+			 */
+			size_t most = want < DEFAULT_TCP_WINDOW_SIZE ? want : DEFAULT_TCP_WINDOW_SIZE;
+			if (ready && (ready >= most || !tcp_rcv_window(pcb) || !(flags & MSG_WAITALL))) {
+				got = ready < want ? ready : want;
+				tcp_rcv_copy_out(pcb, msg, 0, got);
+				break;
+			}
+		} else if (ready) {
+			size_t n = ready < want - got ? ready : want - got;
+			tcp_rcv_copy_out(pcb, msg, got, n);
+			pcb->rcv_read += n;
+			got += n;
+			if (got == want || !(flags & MSG_WAITALL)) break;
+			continue;
+		}
+
+		if (pcb->fin_received || pcb->state == TCP_STATE_CLOSED) break; /* EOF */
+		if (nonblocking) {
+			if (!got) result = -EAGAIN;
+			break;
+		}
+		if (sleep_on_unlocking(sock->rx_wait, &pcb->lock)) {
+			if (!got) return -ERESTARTSYS;
+			spin_lock(pcb->lock);
+			break;
+		}
+		spin_lock(pcb->lock);
+	}
+
+	/* Tell the other side once the window has opened up enough to be worth it. */
+	uint32_t window = tcp_rcv_window(pcb);
+	int update = got && !(flags & MSG_PEEK) && window > pcb->rcv_wnd &&
+		window - pcb->rcv_wnd >= (pcb->mss < TCP_RCVBUF / 2 ? pcb->mss : TCP_RCVBUF / 2);
+	spin_unlock(pcb->lock);
+
+	if (update) tcp_send_segment(pcb, TCP_FLAGS_ACK, pcb->snd_nxt);
+	return result ? result : (long)got;
+}
+
+static long sock_tcp_connect(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_pcb * pcb = sock->pcb;
+	const struct sockaddr_in * dest = (const struct sockaddr_in *)addr;
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+
+	char deststr[16];
+	ip_ntoa(ntohl(dest->sin_addr.s_addr), deststr);
+	printf("tcp: connect requested to %s port %d\n", deststr, ntohs(dest->sin_port));
+
+	if (pcb->state != TCP_STATE_CLOSED || pcb->remote_port) {
+		printf("tcp: socket is already connected?\n");
+		return -EINVAL;
+	}
+
+	if (!dest->sin_port) return -EADDRNOTAVAIL; /* 0 is still 0 in both endians */
+
+	fs_node_t * nic = net_if_route(dest->sin_addr.s_addr);
+	if (!nic) return -ENONET;
+
+	memcpy(&sock->dest, addr, sizeof(struct sockaddr_in));
+
+	spin_lock(tcp_lock);
+	pcb->local_addr = ((struct EthernetDevice*)nic->device)->ipv4_addr;
+	pcb->remote_addr = dest->sin_addr.s_addr;
+	pcb->remote_port = ntohs(dest->sin_port);
+	if (!pcb->bound && tcp_pick_port(pcb)) {
+		pcb->remote_port = 0;
+		spin_unlock(tcp_lock);
+		return -EADDRNOTAVAIL;
+	}
+	if (tcp_conn_find(pcb->local_addr, pcb->local_port, pcb->remote_addr, pcb->remote_port)) {
+		pcb->remote_port = 0;
+		spin_unlock(tcp_lock);
+		return -EADDRINUSE;
+	}
+	printf("tcp: connecting from ephemeral port %d\n", (int)pcb->local_port);
+
+	/* Mark as awaiting connection, send initial SYN */
+	pcb->snd_nxt = rand() + 1;
+	pcb->ident = rand();
+	pcb->state = TCP_STATE_SYN_SENT;
+	pcb->connecting = 1;
+	tcp_conn_insert(pcb);
+	spin_unlock(tcp_lock);
+
+	tcp_timer_start();
+	tcp_send_segment(pcb, TCP_FLAGS_SYN, pcb->snd_nxt - 1);
+
+	unsigned long s, ss;
+	unsigned long ns, nss;
+	relative_time(1,0,&s,&ss);
+	int attempts = 0;
+	long result = 0;
+
+	while (pcb->state == TCP_STATE_SYN_SENT) {
+		int r = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
+		if (r == -EINTR) {
+			result = -EINTR;
+			break;
+		}
+		relative_time(0,0,&ns,&nss);
+		if (pcb->state == TCP_STATE_SYN_SENT && r != 0 && (ns > s || (ns == s && nss > ss))) {
+			if (attempts++ == 3) {
+				printf("tcp: connect timed out\n");
+				result = -ETIMEDOUT;
+				break;
+			}
+			printf("tcp: retrying...\n");
+			tcp_send_segment(pcb, TCP_FLAGS_SYN, pcb->snd_nxt - 1);
+			relative_time(1,0,&s,&ss);
+		}
+	}
+
+	pcb->connecting = 0;
+	if (pcb->state == TCP_STATE_ESTABLISHED || pcb->state == TCP_STATE_CLOSE_WAIT) {
+		printf("tcp: connect complete\n");
+		return 0;
+	}
+
+	spin_lock(tcp_lock);
+	if (!result) result = -ECONNREFUSED;
+	pcb->state = TCP_STATE_CLOSED;
+	pcb->remote_port = 0;
+	tcp_conn_remove(pcb);
+	spin_unlock(tcp_lock);
+	return result;
+}
+
+static long sock_tcp_bind(sock_t * sock, const struct sockaddr *addr, socklen_t addrlen) {
+	struct tcp_pcb * pcb = sock->pcb;
+	if (pcb->bound || pcb->state != TCP_STATE_CLOSED || pcb->remote_port) return -EINVAL; /* Already bound */
+	if (addrlen < sizeof(struct sockaddr_in)) return -EINVAL;
+
+	const struct sockaddr_in * addr_in = (const struct sockaddr_in *)addr;
+	int port = ntohs(addr_in->sin_port);
+
+	if (port && port < 1024 && this_core->current_process->user != 0) {
+		/* Only superuser can bind to lower ports */
+		return -EACCES;
+	}
+
+	spin_lock(tcp_lock);
+	if (!port) {
+		if (tcp_pick_port(pcb)) {
+			spin_unlock(tcp_lock);
+			return -EADDRNOTAVAIL;
+		}
+	} else if (hashmap_has(tcp_sockets, (void*)(uintptr_t)port)) {
+		spin_unlock(tcp_lock);
+		return -EADDRINUSE;
+	} else {
+		pcb->local_port = port;
+	}
+	pcb->local_addr = addr_in->sin_addr.s_addr;
+	hashmap_set(tcp_sockets, (void*)(uintptr_t)pcb->local_port, pcb);
+	pcb->bound = 1;
+	pcb->refs++;
+	spin_unlock(tcp_lock);
+
+	return 0;
+}
+
+static long sock_tcp_listen(sock_t * sock, int backlog) {
+	struct tcp_pcb * pcb = sock->pcb;
+
+	if (backlog < 1) backlog = 1;
+	if (backlog > TCP_BACKLOG_MAX) backlog = TCP_BACKLOG_MAX;
+
+	if (pcb->state == TCP_STATE_LISTEN) {
+		pcb->backlog = backlog;
+		return 0;
+	}
+	if (pcb->state != TCP_STATE_CLOSED || pcb->remote_port) return -EINVAL;
+
+	if (!pcb->bound) {
+		struct sockaddr_in any = { AF_INET, 0, { 0 }, {0} };
+		long r = sock_tcp_bind(sock, (struct sockaddr*)&any, sizeof(any));
+		if (r) return r;
+	}
+
+	list_t * syn_queue = list_create("tcp syn queue", pcb);
+	list_t * accept_queue = list_create("tcp accept queue", pcb);
+
+	spin_lock(tcp_lock);
+	pcb->syn_queue = syn_queue;
+	pcb->accept_queue = accept_queue;
+	pcb->backlog = backlog;
+	pcb->state = TCP_STATE_LISTEN;
+	spin_unlock(tcp_lock);
+
+	printf("tcp: listening on port %d, backlog %d\n", pcb->local_port, backlog);
+	return 0;
+}
+
+static long sock_tcp_accept(sock_t * sock, struct sockaddr *addr, socklen_t *addrlen) {
+	struct tcp_pcb * pcb = sock->pcb;
+	if (pcb->state != TCP_STATE_LISTEN) return -EINVAL;
+
+	struct tcp_pcb * child = NULL;
+	while (1) {
+		spin_lock(tcp_lock);
+		if (pcb->accept_queue->length) {
+			node_t * n = list_dequeue(pcb->accept_queue);
+			child = n->value;
+			free(n);
+		}
+		spin_unlock(tcp_lock);
+		if (child) break;
+
+		if (sock->nonblocking) return -EAGAIN;
+		int r = process_wait_nodes((process_t *)this_core->current_process, (fs_node_t*[]){(fs_node_t*)sock,NULL}, 200);
+		if (r == -EINTR) return -ERESTARTSYS;
+	}
+
+	if (addr) {
+		memcpy(addr, &child->sock->dest, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
+		if (*addrlen < sizeof(struct sockaddr_in)) *addrlen = sizeof(struct sockaddr_in);
+	}
+
+	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)child->sock);
+	FD_MODE(fd) = 03;
+	return fd;
+}
+
+/**
+ * Readiness for fswait: a listening socket is ready when there is a
+ * connection to accept, a connecting one when the handshake is over
+ * one way or the other, and a connection when there is data to read
+ * or the other side has closed it.
+ */
+static int sock_tcp_check(fs_node_t * node) {
+	sock_t * sock = (sock_t*)node;
+	struct tcp_pcb * pcb = sock->pcb;
+	if (!pcb) return 1;
+	if (pcb->state == TCP_STATE_LISTEN) return pcb->accept_queue->length ? 0 : 1;
+	if (pcb->connecting && pcb->state != TCP_STATE_SYN_SENT) return 0;
+	if (pcb->rcv_buf && (tcp_rcv_ready(pcb) || pcb->fin_received)) return 0;
+	if (pcb->state == TCP_STATE_CLOSED && pcb->remote_port) return 0;
+	return 1;
+}
+
+ssize_t sock_tcp_read(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	printf("tcp: read into buffer of %zu bytes\n", size);
+	struct iovec _iovec = {
+		buffer, size
+	};
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = &_iovec,
+		.msg_iovlen = 1,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock_tcp_recv((sock_t*)node, &_header, 0);
+}
+
+/**
+ * Queue data on a connection and send what the windows allow right away;
+ * the rest goes out as acknowledgements come in. This only blocks while
+ * the send ring is full.
+ */
+static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
+	struct tcp_pcb * pcb = sock->pcb;
+	printf("tcp: send called\n");
+	if (msg->msg_iovlen > 1) {
+		printf("net: todo: can't send multiple iovs\n");
+		return -ENOTSUP;
+	}
+	if (msg->msg_iovlen == 0) return 0;
+	if (pcb->state != TCP_STATE_ESTABLISHED && pcb->state != TCP_STATE_CLOSE_WAIT) {
+		return (pcb->state == TCP_STATE_CLOSED && pcb->remote_port) ? -EPIPE : -ENOTCONN;
+	}
+
+	const uint8_t * data = msg->msg_iov[0].iov_base;
+	size_t size = msg->msg_iov[0].iov_len;
+	size_t written = 0;
+
+	spin_lock(pcb->lock);
+	if (!pcb->snd_buf) pcb->snd_buf = malloc(TCP_SNDBUF);
+
+	while (written < size) {
+		if (pcb->state != TCP_STATE_ESTABLISHED && pcb->state != TCP_STATE_CLOSE_WAIT) {
+			spin_unlock(pcb->lock);
+			return written ? (long)written : -EPIPE;
+		}
+
+		size_t room = TCP_SNDBUF - pcb->snd_len;
+		if (!room) {
+			if (sock->nonblocking) {
+				spin_unlock(pcb->lock);
+				return written ? (long)written : -EAGAIN;
+			}
+			if (sleep_on_unlocking(pcb->snd_wait, &pcb->lock)) {
+				return written ? (long)written : -ERESTARTSYS;
+			}
+			spin_lock(pcb->lock);
+			continue;
+		}
+
+		size_t n = size - written < room ? size - written : room;
+		tcp_ring_write(pcb, pcb->snd_una + pcb->snd_len, data + written, n);
+		pcb->snd_len += n;
+		written += n;
+		spin_unlock(pcb->lock);
+
+		tcp_output(pcb);
+		spin_lock(pcb->lock);
+	}
+
+	spin_unlock(pcb->lock);
+	return written;
 }
 
 ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -1034,14 +2121,17 @@ ssize_t sock_tcp_write(fs_node_t *node, off_t offset, size_t size, uint8_t *buff
 }
 
 long sock_tcp_getsockname(sock_t * sock, struct sockaddr *addr, socklen_t * addrlen) {
-	in_addr_t ip4_addr = 0;
-	fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
-	if (nic) {
-		ip4_addr = ((struct EthernetDevice*)nic->device)->ipv4_addr;
+	struct tcp_pcb * pcb = sock->pcb;
+	in_addr_t ip4_addr = pcb->local_addr;
+	if (!ip4_addr) {
+		fs_node_t * nic = net_if_route(((struct sockaddr_in*)&sock->dest)->sin_addr.s_addr);
+		if (nic) {
+			ip4_addr = ((struct EthernetDevice*)nic->device)->ipv4_addr;
+		}
 	}
 
 	struct sockaddr_in out = {
-		AF_INET, htons(sock->priv[0]), { ip4_addr }, {0},
+		AF_INET, htons(pcb->local_port), { ip4_addr }, {0},
 	};
 
 	memcpy(addr, &out, *addrlen < sizeof(struct sockaddr_in) ? *addrlen : sizeof(struct sockaddr_in));
@@ -1059,17 +2149,30 @@ long sock_tcp_getpeername(sock_t * sock, struct sockaddr *addr, socklen_t * addr
 	return 0;
 }
 
-static int tcp_socket(void) {
-	printf("tcp socket...\n");
+static sock_t * tcp_sock_create(void) {
 	sock_t * sock = net_sock_create();
 	sock->sock_recv = sock_tcp_recv;
 	sock->sock_send = sock_tcp_send;
 	sock->sock_close = sock_tcp_close;
 	sock->sock_connect = sock_tcp_connect;
+	sock->sock_bind = sock_tcp_bind;
+	sock->sock_listen = sock_tcp_listen;
+	sock->sock_accept = sock_tcp_accept;
 	sock->sock_getsockname = sock_tcp_getsockname;
 	sock->sock_getpeername = sock_tcp_getpeername;
+	sock->_fnode.selectcheck = sock_tcp_check;
 	sock->_fnode.read = sock_tcp_read;
 	sock->_fnode.write = sock_tcp_write;
+	return sock;
+}
+
+static int tcp_socket(void) {
+	printf("tcp socket...\n");
+	sock_t * sock = tcp_sock_create();
+	struct tcp_pcb * pcb = tcp_pcb_create();
+	pcb->sock = sock;
+	pcb->refs = 1;
+	sock->pcb = pcb;
 	int fd = process_append_fd((process_t *)this_core->current_process, (fs_node_t *)sock);
 	FD_MODE(fd) = 03;
 	return fd;
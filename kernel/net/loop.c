@@ -13,6 +13,7 @@
 #include <kernel/vfs.h>
 #include <kernel/spinlock.h>
 #include <kernel/list.h>
+#include <kernel/process.h>
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
 #include <errno.h>
@@ -23,6 +24,11 @@
 struct loop_nic {
 	struct EthernetDevice eth;
 	netif_counters_t counts;
+
+	spin_lock_t rx_lock;
+	list_t * rx_queue;    /* Frames sent, but not yet received */
+	list_t * rx_wait;
+	int rx_started;
 };
 
 static int ioctl_loop(fs_node_t * node, unsigned long request, void * argp) {
@@ -84,14 +90,59 @@ static int ioctl_loop(fs_node_t * node, unsigned long request, void * argp) {
 	}
 }
 
-static ssize_t write_loop(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct loop_nic * nic = node->device;
+/**
+ * Frames sent to the loopback interface are received by a worker
+ * thread, the same as frames from a real NIC, rather than by the
+ * sender. Otherwise the reply to a frame would be handled, and maybe
+ * answered in turn, in the middle of sending it, under whatever locks
+ * the sender holds.
+ */
+static void loop_receiver(void * data) {
+	struct loop_nic * nic = data;
+
+	while (1) {
+		spin_lock(nic->rx_lock);
+		while (!nic->rx_queue->length) {
+			sleep_on_unlocking(nic->rx_wait, &nic->rx_lock);
+			spin_lock(nic->rx_lock);
+		}
+		node_t * n = list_dequeue(nic->rx_queue);
+		spin_unlock(nic->rx_lock);
+
+		net_eth_handle(n->value, nic->eth.device_node);
+		netbuf_put(n->value);
+		free(n);
+	}
+}
+
+/**
+ * Sent frames are queued for the receiver as they are; the buffer
+ * a packet was built in is the one it's received in.
+ */
+static void loop_xmit(struct EthernetDevice * eth, netbuf_t * nb) {
+	struct loop_nic * nic = (struct loop_nic *)eth;
 	nic->counts.rx_count++;
 	nic->counts.tx_count++;
-	nic->counts.rx_bytes += size;
-	nic->counts.tx_bytes += size;
+	nic->counts.rx_bytes += nb->len;
+	nic->counts.tx_bytes += nb->len;
+
+	spin_lock(nic->rx_lock);
+	list_insert(nic->rx_queue, nb);
+	int start = !nic->rx_started;
+	nic->rx_started = 1;
+	spin_unlock(nic->rx_lock);
+
+	/* There are no processes yet when the interface is set up, so start the receiver on first use. */
+	if (start) {
+		spawn_worker_thread(loop_receiver, "[loopback]", nic);
+	} else {
+		wakeup_queue(nic->rx_wait);
+	}
+}
 
-	net_eth_handle((void*)buffer, node, size);
+static ssize_t write_loop(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	struct loop_nic * nic = node->device;
+	loop_xmit(&nic->eth, netbuf_copy(buffer, size));
 	return size;
 }
 
@@ -103,7 +154,10 @@ static void loop_init(struct loop_nic * nic) {
 	nic->eth.device_node->ioctl = ioctl_loop;
 	nic->eth.device_node->write = write_loop;
 	nic->eth.device_node->device = nic;
+	nic->eth.xmit = loop_xmit;
 	nic->eth.mtu = 65536; /* guess */
+	nic->rx_queue = list_create("loopback rx queue", nic);
+	nic->rx_wait  = list_create("loopback rx wait", nic);
 
 	nic->eth.ipv4_addr   = 0x0100007F;
 	nic->eth.ipv4_subnet = 0x000000FF;
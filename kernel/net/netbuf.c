@@ -0,0 +1,155 @@
+/**
+ * @file  kernel/net/netbuf.c
+ * @brief Reference-counted packet buffers.
+ *
+ * Packets are built in, and received into, buffers with room in front
+ * for the headers of each layer they pass through, so headers can be
+ * pushed and pulled in place and the same buffer can go from a socket
+ * to a NIC's descriptor ring, or from the ring to a socket, without
+ * being copied along the way.
+ *
+ * Buffers that fit in a page are kept on a free list once released,
+ * so the steady state of a busy interface doesn't touch the allocator.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/assert.h>
+#include <kernel/spinlock.h>
+#include <kernel/mmu.h>
+#include <kernel/net/netbuf.h>
+
+/* Free pages beyond this many are given back. */
+#define NETBUF_POOL_MAX 1024
+
+static spin_lock_t netbuf_pool_lock = {0};
+static netbuf_t * netbuf_pool = NULL;
+static size_t netbuf_pool_free = 0;
+
+static netbuf_t * netbuf_pool_get(void) {
+	spin_lock(netbuf_pool_lock);
+	netbuf_t * nb = netbuf_pool;
+	if (nb) {
+		netbuf_pool = nb->next;
+		netbuf_pool_free--;
+	}
+	spin_unlock(netbuf_pool_lock);
+
+	if (!nb) {
+		uintptr_t phys = mmu_allocate_a_frame() << 12;
+		nb = mmu_map_from_physical(phys);
+		nb->phys = phys;
+		nb->end  = (uint8_t*)nb + NETBUF_POOL_SIZE;
+	}
+
+	return nb;
+}
+
+/**
+ * @brief Get a buffer with room for @p size bytes of packet.
+ *
+ * The buffer starts out empty, with NETBUF_HEADROOM bytes in front of it.
+ */
+netbuf_t * netbuf_alloc(size_t size) {
+	netbuf_t * nb;
+	if (size <= NETBUF_POOL_DATA) {
+		nb = netbuf_pool_get();
+	} else {
+		nb = malloc(sizeof(netbuf_t) + NETBUF_HEADROOM + size);
+		nb->phys = 0;
+		nb->end  = nb->head + NETBUF_HEADROOM + size;
+	}
+
+	nb->data = nb->head + NETBUF_HEADROOM;
+	nb->len  = 0;
+	nb->refs = 1;
+	nb->next = NULL;
+	return nb;
+}
+
+/**
+ * @brief Get a buffer holding a copy of @p len bytes from @p data.
+ */
+netbuf_t * netbuf_copy(const void * data, size_t len) {
+	netbuf_t * nb = netbuf_alloc(len);
+	memcpy(netbuf_append(nb, len), data, len);
+	return nb;
+}
+
+void netbuf_get(netbuf_t * nb) {
+	__sync_add_and_fetch(&nb->refs, 1);
+}
+
+/**
+ * @brief Release a reference, and the buffer with the last one.
+ */
+void netbuf_put(netbuf_t * nb) {
+	if (__sync_sub_and_fetch(&nb->refs, 1)) return;
+
+	if (!nb->phys) {
+		free(nb);
+		return;
+	}
+
+	spin_lock(netbuf_pool_lock);
+	if (netbuf_pool_free < NETBUF_POOL_MAX) {
+		nb->next = netbuf_pool;
+		netbuf_pool = nb;
+		netbuf_pool_free++;
+		nb = NULL;
+	}
+	spin_unlock(netbuf_pool_lock);
+
+	if (nb) mmu_frame_release(nb->phys);
+}
+
+/**
+ * @brief Add @p len bytes to the front of the packet.
+ *
+ * @returns the new start of the packet, for the header to be written.
+ */
+void * netbuf_push(netbuf_t * nb, size_t len) {
+	assert(nb->data - nb->head >= (ptrdiff_t)len);
+	nb->data -= len;
+	nb->len  += len;
+	return nb->data;
+}
+
+/**
+ * @brief Remove @p len bytes from the front of the packet.
+ *
+ * @returns the new start of the packet.
+ */
+void * netbuf_pull(netbuf_t * nb, size_t len) {
+	assert(nb->len >= len);
+	nb->data += len;
+	nb->len  -= len;
+	return nb->data;
+}
+
+/**
+ * @brief Add @p len bytes to the end of the packet.
+ *
+ * @returns where the new bytes go.
+ */
+void * netbuf_append(netbuf_t * nb, size_t len) {
+	uint8_t * tail = nb->data + nb->len;
+	assert(tail + len <= nb->end);
+	nb->len += len;
+	return tail;
+}
+
+/**
+ * @brief Physical address of the start of the packet, for a NIC.
+ *
+ * @returns 0 if the buffer isn't from the pool and can't be given to one.
+ */
+uintptr_t netbuf_dma(netbuf_t * nb) {
+	if (!nb->phys) return 0;
+	return nb->phys + (nb->data - (uint8_t*)nb);
+}
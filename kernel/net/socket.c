@@ -47,18 +47,20 @@ void net_sock_alert(sock_t * sock) {
 	spin_unlock(sock->alert_lock);
 }
 
-void net_sock_add(sock_t * sock, void * frame, size_t size) {
+/**
+ * Queue a received packet on a socket. The socket takes its own
+ * reference to it, which is released by whoever dequeues it.
+ */
+void net_sock_add(sock_t * sock, netbuf_t * nb) {
 	spin_lock(sock->rx_lock);
-	char * bleh = malloc(size + sizeof(size_t));
-	*(size_t*)bleh = size;
-	memcpy(bleh + sizeof(size_t), frame, size);
-	list_insert(sock->rx_queue, bleh);
+	netbuf_get(nb);
+	list_insert(sock->rx_queue, nb);
 	wakeup_queue(sock->rx_wait);
 	net_sock_alert(sock);
 	spin_unlock(sock->rx_lock);
 }
 
-void * net_sock_get(sock_t * sock) {
+netbuf_t * net_sock_get(sock_t * sock) {
 	while (!sock->rx_queue->length) {
 		if (sleep_on(sock->rx_wait)) {
 			if (!sock->rx_queue->length)
@@ -68,7 +70,7 @@ void * net_sock_get(sock_t * sock) {
 
 	spin_lock(sock->rx_lock);
 	node_t * n = list_dequeue(sock->rx_queue);
-	void* value = n->value;
+	netbuf_t * value = n->value;
 	free(n);
 	spin_unlock(sock->rx_lock);
 
@@ -78,7 +80,6 @@ void * net_sock_get(sock_t * sock) {
 int sock_generic_check(fs_node_t *node) {
 	sock_t * sock = (sock_t*)node;
 	if (sock->rx_queue->length) return 0;
-	if (sock->unread) return 0;
 	return 1;
 }
 
@@ -99,7 +100,7 @@ void sock_generic_close(fs_node_t *node) {
 	sock->sock_close(sock);
 	while (sock->rx_queue->length) {
 		node_t * n = list_dequeue(sock->rx_queue);
-		free(n->value);
+		netbuf_put(n->value);
 		free(n);
 	}
 	printf("net: socket closed\n");
@@ -143,15 +144,14 @@ static long sock_raw_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		return -ENOTSUP;
 	}
 	if (msg->msg_iovlen == 0) return 0;
-	char * data = net_sock_get(sock);
-	if (!data) return -EINTR;
-	size_t packet_size = *(size_t*)data;
-	if (msg->msg_iov[0].iov_len < packet_size) {
-		free(data);
+	netbuf_t * nb = net_sock_get(sock);
+	if (!nb) return -EINTR;
+	if (msg->msg_iov[0].iov_len < nb->len) {
+		netbuf_put(nb);
 		return -EINVAL;
 	}
-	memcpy(msg->msg_iov[0].iov_base, data + sizeof(size_t), packet_size);
-	free(data);
+	memcpy(msg->msg_iov[0].iov_base, nb->data, nb->len);
+	netbuf_put(nb);
 	return 4096;
 }
 
@@ -269,12 +269,17 @@ long net_bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 
 long net_accept(int sockfd, struct sockaddr * addr, socklen_t * addrlen) {
 	CHECK_SOCK(sockfd);
-	return -EINVAL;
+	if (addr) CHECK_ADDR_ADDRLEN(addr,addrlen,ADDR_WR_ADDR|ADDR_WR_LEN);
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_accept) return -EOPNOTSUPP;
+	return node->sock_accept(node, addr, addrlen);
 }
 
 long net_listen(int sockfd, int backlog) {
 	CHECK_SOCK(sockfd);
-	return -EINVAL;
+	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+	if (!node->sock_listen) return -EOPNOTSUPP;
+	return node->sock_listen(node, backlog);
 }
 
 long net_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
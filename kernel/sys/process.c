@@ -36,6 +36,8 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/syscall.h>
+#include <kernel/slab.h>
+#include <kernel/vm.h>
 #include <sys/wait.h>
 #include <sys/signal_defs.h>
 
@@ -50,21 +52,50 @@
 
 tree_t * process_tree;  /* Stores the parent-child process relationships; the root of this graph is 'init'. */
 list_t * process_list;  /* Stores all existing processes. Mostly used for sanity checking or for places where iterating over all processes is useful. */
-list_t * process_queue; /* Scheduler ready queue. This the round-robin source. The head is the next process to run. */
-list_t * sleep_queue;   /* Ordered list of processes waiting to be awoken by timeouts. The head is the earliest thread to awaken. */
 list_t * reap_queue;    /* Processes that could not be cleaned up and need to be deleted. */
 
 struct ProcessorLocal processor_local_data[32] = {0};
 int processor_count = 1;
 
+/**
+ * Per-core ready queues. Each is a round-robin source for its own core;
+ * processes are queued on the core they last ran on to keep their caches
+ * warm, and idle cores steal from the busiest queue.
+ */
+static struct run_queue {
+	spin_lock_t lock;
+	list_t queue;
+	struct runqueue_stats stats;
+} run_queues[32];
+
+static volatile int ready_count = 0; /* Total entries across all run queues */
+static volatile uint32_t idle_cores = 0; /* Cores halted in their idle task; a waker clears a core's bit when it sends it an IPI */
+
 /* The following locks protect access to the process tree, scheduler queue,
  * sleeping, and the very special wait queue... */
 static spin_lock_t tree_lock = { 0 };
-static spin_lock_t process_queue_lock = { 0 };
 static spin_lock_t wait_lock_tmp = { 0 };
 static spin_lock_t sleep_lock = { 0 };
 static spin_lock_t reap_lock = { 0 };
 
+/* Sleep queue entries are created and destroyed on every timed wait. */
+static slab_cache_t * sleeper_cache = NULL;
+
+/**
+ * Processes waiting to be awoken by timeouts, as a binary min-heap
+ * ordered by wakeup time. The root is the earliest thread to awaken.
+ * Sleepers track their own heap index so they can be cancelled
+ * without a search. Protected by sleep_lock.
+ */
+static struct {
+	sleeper_t ** heap;
+	size_t length;
+	size_t capacity;
+} sleep_queue;
+
+/* Owner tag for the sleep_node of processes in a plain timed sleep. */
+static list_t timed_sleepers = { .name = "global timed sleep queue" };
+
 /**
  * Update both the total time and the system time when switching to a new thread
  * or exiting the current thread.
@@ -220,9 +251,13 @@ void switch_task(uint8_t reschedule) {
 void initialize_process_tree(void) {
 	process_tree = tree_create();
 	process_list = list_create("global process list",NULL);
-	process_queue = list_create("global scheduler queue",NULL);
-	sleep_queue = list_create("global timed sleep queue",NULL);
+	for (int i = 0; i < 32; ++i) {
+		run_queues[i].queue.name = "core scheduler queue";
+	}
+	sleep_queue.capacity = 64;
+	sleep_queue.heap = malloc(sizeof(sleeper_t *) * sleep_queue.capacity);
 	reap_queue = list_create("processes awaiting later cleanup",NULL);
+	sleeper_cache = slab_create("sleeper_t", sizeof(sleeper_t), 32, NULL);
 
 	/* TODO: PID bitset? */
 }
@@ -382,8 +417,11 @@ pid_t get_next_pid(void) {
  * whenever scheduled, as we don't both to save its state.
  */
 static void _kidle(void) {
+	uint32_t mask = 1U << this_core->cpu_id;
 	while (1) {
-		arch_pause();
+		__sync_or_and_fetch(&idle_cores, mask);
+		if (!process_ready_pending()) arch_pause();
+		__sync_and_and_fetch(&idle_cores, ~mask);
 		switch_next();
 	}
 }
@@ -402,11 +440,14 @@ static void _kidle(void) {
 void process_release_directory(page_directory_t * dir) {
 	spin_lock(dir->lock);
 	dir->refcount--;
-	if (dir->refcount < 1) {
+	int last = dir->refcount < 1;
+	spin_unlock(dir->lock);
+
+	/* Nobody else can reach the directory now, so tear it down without the lock. */
+	if (last) {
 		mmu_free(dir->directory);
+		vm_areas_free(dir->areas);
 		free(dir);
-	} else {
-		spin_unlock(dir->lock);
 	}
 }
 
@@ -433,6 +474,7 @@ process_t * spawn_kidle(int bsp) {
 	idle->thread.page_directory = malloc(sizeof(page_directory_t));
 	idle->thread.page_directory->refcount = 1;
 	idle->thread.page_directory->directory = mmu_clone(this_core->current_pml);
+	idle->thread.page_directory->areas = NULL;
 	spin_init(idle->thread.page_directory->lock);
 	return idle;
 }
@@ -492,6 +534,7 @@ process_t * spawn_init(void) {
 	init->thread.page_directory = malloc(sizeof(page_directory_t));
 	init->thread.page_directory->refcount = 1;
 	init->thread.page_directory->directory = this_core->current_pml;
+	init->thread.page_directory->areas = NULL;
 	spin_init(init->thread.page_directory->lock);
 	init->description = strdup("[init]");
 	list_insert(process_list, (void*)init);
@@ -688,6 +731,85 @@ void process_delete(process_t * proc) {
 	process_reap(proc);
 }
 
+static inline int sleeper_before(sleeper_t * a, sleeper_t * b) {
+	return a->end_tick < b->end_tick || (a->end_tick == b->end_tick && a->end_subtick < b->end_subtick);
+}
+
+static void sleep_heap_set(size_t index, sleeper_t * proc) {
+	sleep_queue.heap[index] = proc;
+	proc->index = index;
+}
+
+static void sleep_heap_up(size_t index) {
+	sleeper_t * proc = sleep_queue.heap[index];
+	while (index) {
+		size_t parent = (index - 1) / 2;
+		if (!sleeper_before(proc, sleep_queue.heap[parent])) break;
+		sleep_heap_set(index, sleep_queue.heap[parent]);
+		index = parent;
+	}
+	sleep_heap_set(index, proc);
+}
+
+static void sleep_heap_down(size_t index) {
+	sleeper_t * proc = sleep_queue.heap[index];
+	while (1) {
+		size_t child = index * 2 + 1;
+		if (child >= sleep_queue.length) break;
+		if (child + 1 < sleep_queue.length && sleeper_before(sleep_queue.heap[child+1], sleep_queue.heap[child])) child++;
+		if (!sleeper_before(sleep_queue.heap[child], proc)) break;
+		sleep_heap_set(index, sleep_queue.heap[child]);
+		index = child;
+	}
+	sleep_heap_set(index, proc);
+}
+
+/**
+ * @brief Remove a sleeper from the sleep queue, if it is still in it.
+ *
+ * The sleeper itself is not freed.
+ */
+static void sleep_queue_remove(sleeper_t * proc) {
+	if (proc->index < 0) return;
+	size_t index = proc->index;
+	proc->index = -1;
+	sleeper_t * last = sleep_queue.heap[--sleep_queue.length];
+	if (last == proc) return;
+	sleep_heap_set(index, last);
+	if (index && sleeper_before(last, sleep_queue.heap[(index - 1) / 2])) {
+		sleep_heap_up(index);
+	} else {
+		sleep_heap_down(index);
+	}
+}
+
+/**
+ * @brief Claim an idle core to pick up newly ready work.
+ *
+ * Prefers @p target, the core the process was queued on, then any other
+ * idle core that can steal it. Only one IPI is sent; a core whose bit was
+ * already claimed by another waker is on its way and doesn't need another.
+ * If every other core is busy, nothing is sent and the process is picked
+ * up at the next reschedule of its target core.
+ */
+static void wakeup_idle_core(int target) {
+	struct runqueue_stats * stats = &run_queues[this_core->cpu_id].stats;
+	uint32_t others = idle_cores & ~(1U << this_core->cpu_id);
+
+	while (others) {
+		int cpu = (others & (1U << target)) ? target : __builtin_ctz(others);
+		uint32_t mask = 1U << cpu;
+		if (__sync_fetch_and_and(&idle_cores, ~mask) & mask) {
+			arch_wakeup_core(cpu);
+			stats->ipi_sent++;
+			return;
+		}
+		others &= ~mask;
+	}
+
+	stats->ipi_avoided++;
+}
+
 /**
  * @brief Place an available process in the ready queue.
  *
@@ -703,12 +825,13 @@ void make_process_ready(volatile process_t * proc) {
 	int sleep_lock_is_mine = sleep_lock.owner == (this_core->cpu_id + 1);
 	if (!sleep_lock_is_mine) spin_lock(sleep_lock);
 	if (proc->sleep_node.owner != NULL) {
-		if (proc->sleep_node.owner == sleep_queue) {
+		if (proc->sleep_node.owner == &timed_sleepers) {
 			/* The sleep queue is slightly special... */
 			if (proc->timed_sleep_node) {
-				list_delete(sleep_queue, proc->timed_sleep_node);
+				sleep_queue_remove(proc->timed_sleep_node);
 				proc->sleep_node.owner = NULL;
-				free(proc->timed_sleep_node->value);
+				slab_free(sleeper_cache, proc->timed_sleep_node);
+				proc->timed_sleep_node = NULL;
 			}
 		} else {
 			/* This was blocked on a semaphore we can interrupt. */
@@ -718,72 +841,145 @@ void make_process_ready(volatile process_t * proc) {
 	}
 	if (!sleep_lock_is_mine) spin_unlock(sleep_lock);
 
-	spin_lock(process_queue_lock);
+	/* Wake processes on the core they last ran on; new processes start here. */
+	int target = this_core->cpu_id;
+	if ((proc->flags & PROC_FLAG_STARTED) && proc->owner >= 0 && proc->owner < processor_count) {
+		target = proc->owner;
+	}
+	struct run_queue * rq = &run_queues[target];
+
+	spin_lock(rq->lock);
 	if (proc->sched_node.owner) {
-		/* There's only one ready queue, so this means the process was already ready, which
-		 * is indicative of a bug somewhere as we shouldn't be added processes to the ready
-		 * queue multiple times. */
-		spin_unlock(process_queue_lock);
+		/* The process is already in a ready queue, which is indicative of a bug
+		 * somewhere as we shouldn't be added processes to the ready queue multiple times. */
+		spin_unlock(rq->lock);
 		return;
 	}
 
-	list_append(process_queue, (node_t*)&proc->sched_node);
-	spin_unlock(process_queue_lock);
+	list_append(&rq->queue, (node_t*)&proc->sched_node);
+	rq->stats.enqueued++;
+	__sync_add_and_fetch(&ready_count, 1);
+	spin_unlock(rq->lock);
 
-	arch_wakeup_others();
+	wakeup_idle_core(target);
 }
 
+
 /**
- * @brief Pop the next available process from the queue.
+ * @brief Take a runnable process from a ready queue.
  *
- * Gets the next available process from the round-robin scheduling
- * queue. If there is no process to run, the idle task is returned.
+ * A process can be queued on its own core while that core is still switching
+ * away from it; such a process can only be picked up by that core itself.
+ */
+static volatile process_t * run_queue_take(struct run_queue * rq, int stealing) {
+	spin_lock(rq->lock);
+
+	if (!rq->queue.head && rq->queue.length) {
+		arch_fatal_prepare();
+		printf("Queue has a length but head is NULL\n");
+		arch_dump_traceback();
+		arch_fatal();
+	}
+
+	foreach(np, &rq->queue) {
+		volatile process_t * next = np->value;
+		if ((next->flags & PROC_FLAG_RUNNING) && (stealing || next->owner != this_core->cpu_id)) continue;
+		list_delete(&rq->queue, np);
+		__sync_sub_and_fetch(&ready_count, 1);
+		spin_unlock(rq->lock);
+		return next;
+	}
+
+	spin_unlock(rq->lock);
+	return NULL;
+}
+
+/**
+ * @brief Steal a process from another core's queue.
  *
- * TODO This needs more locking for SMP...
+ * Tries the longest queue first, then any other queue with work.
  */
-volatile process_t * next_ready_process(void) {
-	spin_lock(process_queue_lock);
-
-	if (!process_queue->head) {
-		if (process_queue->length) {
-			arch_fatal_prepare();
-			printf("Queue has a length but head is NULL\n");
-			arch_dump_traceback();
-			arch_fatal();
+static volatile process_t * run_queue_steal(void) {
+	int me = this_core->cpu_id;
+	int victim = -1;
+	size_t longest = 0;
+
+	for (int i = 1; i < processor_count; ++i) {
+		int cpu = (me + i) % processor_count;
+		if (run_queues[cpu].queue.length > longest) {
+			longest = run_queues[cpu].queue.length;
+			victim = cpu;
 		}
-		spin_unlock(process_queue_lock);
-		return this_core->kernel_idle_task;
 	}
 
-	node_t * np = list_dequeue(process_queue);
+	if (victim < 0) return NULL;
 
-	if ((uintptr_t)np < 0xFFFFff0000000000UL || (uintptr_t)np > 0xFFFFfff000000000UL) {
-		arch_fatal_prepare();
-		printf("Suspicious pointer in queue: %#zx\n", (uintptr_t)np);
-		arch_dump_traceback();
-		arch_fatal();
+	for (int i = 0; i < processor_count; ++i) {
+		int cpu = (victim + i) % processor_count;
+		if (cpu == me || !run_queues[cpu].queue.length) continue;
+		volatile process_t * next = run_queue_take(&run_queues[cpu], 1);
+		if (next) {
+			__sync_add_and_fetch(&run_queues[cpu].stats.stolen, 1);
+			run_queues[me].stats.steals++;
+			return next;
+		}
 	}
-	volatile process_t * next = np->value;
 
-	if ((next->flags & PROC_FLAG_RUNNING) && (next->owner != this_core->cpu_id)) {
-		/* We pulled a process too soon, switch to idle for a bit so the
-		 * core that marked this process as ready can finish switching away from it. */
-		list_append(process_queue, (node_t*)&next->sched_node);
-		spin_unlock(process_queue_lock);
+	return NULL;
+}
+
+/**
+ * @brief Pop the next available process from the queue.
+ *
+ * Gets the next available process from this core's round-robin scheduling
+ * queue, or steals one from another core. If there is no process to run,
+ * the idle task is returned.
+ */
+volatile process_t * next_ready_process(void) {
+	volatile process_t * next = run_queue_take(&run_queues[this_core->cpu_id], 0);
+
+	if (!next && ready_count) {
+		next = run_queue_steal();
+	}
+
+	if (!next) {
 		return this_core->kernel_idle_task;
 	}
 
-	spin_unlock(process_queue_lock);
+	/* We may have been pulled out of the idle task by an interrupt. */
+	uint32_t mask = 1U << this_core->cpu_id;
+	if (idle_cores & mask) __sync_and_and_fetch(&idle_cores, ~mask);
 
 	if (!(next->flags & PROC_FLAG_FINISHED)) {
 		__sync_or_and_fetch(&next->flags, PROC_FLAG_RUNNING);
 	}
 
+	if ((next->flags & PROC_FLAG_STARTED) && next->owner != this_core->cpu_id) {
+		run_queues[this_core->cpu_id].stats.migrations++;
+	}
+
 	next->owner = this_core->cpu_id;
 
 	return next;
 }
 
+/**
+ * @brief Is there anything in the ready queues for this core to pick up?
+ */
+int process_ready_pending(void) {
+	return ready_count != 0;
+}
+
+/**
+ * @brief Snapshot of a core's ready queue, for /proc/sched
+ */
+int process_runqueue_stats(int cpu, struct runqueue_stats * out) {
+	if (cpu < 0 || cpu >= processor_count) return -1;
+	memcpy(out, &run_queues[cpu].stats, sizeof(struct runqueue_stats));
+	out->length = run_queues[cpu].queue.length;
+	return 0;
+}
+
 /**
  * @brief Signal a semaphore.
  *
@@ -913,33 +1109,49 @@ int process_alert_node_locked(process_t * process, void * value);
  */
 void wakeup_sleepers(unsigned long seconds, unsigned long subseconds) {
 	spin_lock(sleep_lock);
-	if (sleep_queue->length) {
-		sleeper_t * proc = ((sleeper_t *)sleep_queue->head->value);
-		while (proc && (proc->end_tick < seconds || (proc->end_tick == seconds && proc->end_subtick <= subseconds))) {
-
-			if (proc->is_fswait) {
-				proc->is_fswait = -1;
-				process_alert_node_locked(proc->process,proc);
-			} else {
-				process_t * process = proc->process;
-				process->sleep_node.owner = NULL;
-				process->timed_sleep_node = NULL;
-				if (!process_is_ready(process)) {
-					make_process_ready(process);
-				}
-			}
-			free(proc);
-			free(list_dequeue(sleep_queue));
-			if (sleep_queue->length) {
-				proc = ((sleeper_t *)sleep_queue->head->value);
-			} else {
-				break;
+	while (sleep_queue.length) {
+		sleeper_t * proc = sleep_queue.heap[0];
+		if (proc->end_tick > seconds || (proc->end_tick == seconds && proc->end_subtick > subseconds)) break;
+
+		sleep_queue_remove(proc);
+
+		if (proc->is_fswait) {
+			proc->is_fswait = -1;
+			process_alert_node_locked(proc->process,proc);
+		} else {
+			process_t * process = proc->process;
+			process->sleep_node.owner = NULL;
+			process->timed_sleep_node = NULL;
+			if (!process_is_ready(process)) {
+				make_process_ready(process);
 			}
 		}
+		slab_free(sleeper_cache, proc);
 	}
 	spin_unlock(sleep_lock);
 }
 
+/**
+ * @brief Add a new sleeper to the sleep queue.
+ */
+static sleeper_t * sleep_queue_insert(process_t * process, unsigned long seconds, unsigned long subseconds, int is_fswait) {
+	sleeper_t * proc = slab_alloc(sleeper_cache);
+	proc->process     = process;
+	proc->end_tick    = seconds;
+	proc->end_subtick = subseconds;
+	proc->is_fswait   = is_fswait;
+
+	if (sleep_queue.length == sleep_queue.capacity) {
+		sleep_queue.capacity *= 2;
+		sleep_queue.heap = realloc(sleep_queue.heap, sizeof(sleeper_t *) * sleep_queue.capacity);
+	}
+
+	proc->index = sleep_queue.length++;
+	sleep_queue.heap[proc->index] = proc;
+	sleep_heap_up(proc->index);
+	return proc;
+}
+
 /**
  * @brief Wait until a given time.
  *
@@ -954,26 +1166,8 @@ void sleep_until(process_t * process, unsigned long seconds, unsigned long subse
 		/* Can't sleep, sleeping already */
 		return;
 	}
-	process->sleep_node.owner = sleep_queue;
-
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (!candidate) {
-			printf("null candidate?\n");
-			continue;
-		}
-		if (candidate->end_tick > seconds || (candidate->end_tick == seconds && candidate->end_subtick > subseconds)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = seconds;
-	proc->end_subtick = subseconds;
-	proc->is_fswait = 0;
-	process->timed_sleep_node = list_insert_after(sleep_queue, before, proc);
+	process->sleep_node.owner = &timed_sleepers;
+	process->timed_sleep_node = sleep_queue_insert(process, seconds, subseconds, 0);
 	spin_unlock(sleep_lock);
 }
 
@@ -1127,21 +1321,9 @@ int process_timeout_sleep(process_t * process, int timeout) {
 	unsigned long s, ss;
 	relative_time(0, timeout * 1000, &s, &ss);
 
-	node_t * before = NULL;
-	foreach(node, sleep_queue) {
-		sleeper_t * candidate = ((sleeper_t *)node->value);
-		if (candidate->end_tick > s || (candidate->end_tick == s && candidate->end_subtick > ss)) {
-			break;
-		}
-		before = node;
-	}
-	sleeper_t * proc = malloc(sizeof(sleeper_t));
-	proc->process     = process;
-	proc->end_tick    = s;
-	proc->end_subtick = ss;
-	proc->is_fswait = 1;
+	sleeper_t * proc = sleep_queue_insert(process, s, ss, 1);
 	list_insert(((process_t *)process)->node_waits, proc);
-	process->timeout_node = list_insert_after(sleep_queue, before, proc);
+	process->timeout_node = proc;
 
 	return 0;
 }
@@ -1205,13 +1387,9 @@ int process_awaken_from_fswait(process_t * process, int index) {
 	free(process->node_waits);
 	process->node_waits = NULL;
 
-	if (process->timeout_node && process->timeout_node->owner == sleep_queue) {
-		sleeper_t * proc = process->timeout_node->value;
-		if (proc->is_fswait != -1) {
-			list_delete(sleep_queue, process->timeout_node);
-			free(process->timeout_node->value);
-			free(process->timeout_node);
-		}
+	if (process->timeout_node && process->timeout_node->is_fswait != -1) {
+		sleep_queue_remove(process->timeout_node);
+		slab_free(sleeper_cache, process->timeout_node);
 	}
 	process->timeout_node = NULL;
 
@@ -1294,6 +1472,9 @@ void task_exit(int retval) {
 		this_core->current_process->node_waits = NULL;
 	}
 
+	/* Shared file mappings are written back while we can still do I/O as ourselves. */
+	vm_areas_sync(this_core->current_process->thread.page_directory, 0, 0x800000000000UL);
+
 	if (this_core->current_process->fds) {
 		spin_lock(this_core->current_process->fds->lock);
 		this_core->current_process->fds->refs--;
@@ -1368,6 +1549,9 @@ pid_t fork(void) {
 	new_proc->thread.page_directory = malloc(sizeof(page_directory_t));
 	new_proc->thread.page_directory->refcount = 1;
 	new_proc->thread.page_directory->directory = directory;
+	spin_lock(parent->thread.page_directory->lock);
+	new_proc->thread.page_directory->areas = vm_areas_clone(parent->thread.page_directory->areas);
+	spin_unlock(parent->thread.page_directory->lock);
 	spin_init(new_proc->thread.page_directory->lock);
 
 	memcpy(new_proc->signals, parent->signals, sizeof(struct signal_config) * (NUMSIGNALS+1));
@@ -306,11 +306,14 @@ int shm_release (char * path) {
 	shm_mapping_t * mapping = (shm_mapping_t *)node->value;
 
 	/* Clear the mappings from the process's address space */
+	uintptr_t low = (uintptr_t)-1, high = 0;
 	for (uint32_t i = 0; i < mapping->num_vaddrs; i++) {
 		union PML * page = mmu_get_page(mapping->vaddrs[i], 0);
 		page->bits.present = 0;
-		mmu_invalidate(mapping->vaddrs[i]);
+		if (mapping->vaddrs[i] < low) low = mapping->vaddrs[i];
+		if (mapping->vaddrs[i] + 0x1000 > high) high = mapping->vaddrs[i] + 0x1000;
 	}
+	if (high) mmu_invalidate_range(low, high - low);
 
 	/* Clean up */
 	release_chunk(chunk);
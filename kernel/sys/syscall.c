@@ -16,6 +16,7 @@
 #include <sys/times.h>
 #include <sys/ptrace.h>
 #include <sys/signal.h>
+#include <sys/mman.h>
 #include <syscall_nums.h>
 #include <kernel/printf.h>
 #include <kernel/process.h>
@@ -32,6 +33,7 @@
 #include <kernel/misc.h>
 #include <kernel/ptrace.h>
 #include <kernel/net/netif.h>
+#include <kernel/vm.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -108,7 +110,6 @@ long sys_sysfunc(long fn, char ** args) {
 			return 0;
 
 		case TOARU_SYS_FUNC_MUNMAP: {
-			extern void mmu_unmap_user(uintptr_t addr, size_t size);
 			PTR_VALIDATE(&args[0]);
 			PTR_VALIDATE(&args[1]);
 			volatile process_t * volatile proc = this_core->current_process;
@@ -657,7 +658,7 @@ long sys_truncate(char * file, off_t size) {
 		return -ENOTSUP;
 	}
 
-	long out = fn->truncate(fn, size);
+	long out = truncate_fs(fn, size);
 	close_fs(fn);
 	return out;
 }
@@ -667,7 +668,7 @@ long sys_ftruncate(int fd, off_t size) {
 	if (!(FD_MODE(fd) & 2)) return -EACCES;
 	if (size < 0) return -EINVAL;
 	if (!FD_ENTRY(fd)->truncate) return -ENOTSUP;
-	return FD_ENTRY(fd)->truncate(FD_ENTRY(fd), size);
+	return truncate_fs(FD_ENTRY(fd), size);
 }
 
 long sys_gettimeofday(struct timeval * tv, void * tz) {
@@ -839,6 +840,189 @@ long sys_getppid(void) {
 	return parent->id;
 }
 
+/**
+ * @brief Is [start, end) somewhere userspace may map things?
+ *
+ * Device and SHM mappings are managed elsewhere and can't be replaced.
+ */
+static int mmap_range_ok(uintptr_t start, uintptr_t end) {
+	if (end <= start || end > 0x800000000000UL) return 0;
+	if (!PTR_INRANGE(start)) return 0;
+	if (start <= USER_SHM_HIGH && end > USER_DEVICE_MAP) return 0;
+	return 1;
+}
+
+/**
+ * @brief Find a free stretch of the mmap region for a new mapping.
+ *
+ * @returns the start of the stretch, or 0 if there isn't one.
+ */
+static uintptr_t mmap_find_space(list_t * areas, uintptr_t hint, size_t size) {
+	if (hint >= USER_MMAP_LOW && hint + size <= USER_MMAP_HIGH && hint + size > hint &&
+		!vm_areas_overlap(areas, hint, hint + size)) return hint;
+
+	uintptr_t candidate = USER_MMAP_LOW;
+	while (candidate + size <= USER_MMAP_HIGH) {
+		uintptr_t next = candidate;
+		if (areas) {
+			foreach(node, areas) {
+				vm_area_t * area = node->value;
+				if (area->start < candidate + size && area->end > candidate && area->end > next) {
+					next = area->end;
+				}
+			}
+		}
+		if (next == candidate) return candidate;
+		candidate = next;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Remove [start, end) from the current address space.
+ *
+ * Shared file pages in the range should already have been written back.
+ * Called with the image lock held.
+ */
+static void unmap_range(uintptr_t start, uintptr_t end) {
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	spin_lock(dir->lock);
+	list_t * removed = vm_areas_remove(dir->areas, start, end);
+	spin_unlock(dir->lock);
+	vm_areas_free(removed);
+	mmu_unmap_user(start, end - start);
+}
+
+long sys_mmap(struct mmap_args * args) {
+	PTR_VALIDATE(args);
+	if (!args) return -EFAULT;
+
+	struct mmap_args a = *args;
+	int sharing = a.flags & (MAP_SHARED | MAP_PRIVATE);
+	if (sharing != MAP_SHARED && sharing != MAP_PRIVATE) return -EINVAL;
+	if (!a.length || (a.offset & 0xFFF) || a.offset < 0) return -EINVAL;
+
+	size_t size = (a.length + 0xFFF) & ~0xFFFUL;
+	if (size < a.length) return -ENOMEM;
+
+	int flags = 0;
+	if (!(a.prot & (PROT_READ | PROT_WRITE | PROT_EXEC))) flags |= VM_AREA_NONE;
+	if (a.prot & PROT_WRITE) flags |= VM_AREA_WRITE;
+	if (a.prot & PROT_EXEC)  flags |= VM_AREA_EXEC;
+	if (a.flags & MAP_SHARED) flags |= VM_AREA_SHARED | VM_AREA_MAYWRITE;
+
+	fs_node_t * file = NULL;
+	if (!(a.flags & MAP_ANONYMOUS)) {
+		if (!FD_CHECK(a.fd)) return -EBADF;
+		file = FD_ENTRY(a.fd);
+		if (!(file->flags & FS_FILE)) return -ENODEV;
+		if (!(FD_MODE(a.fd) & 01)) return -EACCES;
+		if ((a.flags & MAP_SHARED) && !(FD_MODE(a.fd) & 02)) {
+			if (a.prot & PROT_WRITE) return -EACCES;
+			flags &= ~VM_AREA_MAYWRITE;
+		}
+#ifndef __x86_64__
+		/* Frames can't be shared between mappings here yet. */
+		if (a.flags & MAP_SHARED) return -ENODEV;
+#endif
+	}
+
+	volatile process_t * volatile proc = this_core->current_process;
+	if (proc->group != 0) proc = process_from_pid(proc->group);
+	if (!proc) return -EFAULT;
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+
+	uintptr_t start;
+	if (a.flags & MAP_FIXED) {
+		start = (uintptr_t)a.addr;
+		if (start & 0xFFF) return -EINVAL;
+		if (!mmap_range_ok(start, start + size)) return -ENOMEM;
+		vm_areas_sync(dir, start, start + size);
+		spin_lock(proc->image.lock);
+		unmap_range(start, start + size);
+	} else {
+		spin_lock(proc->image.lock);
+		start = mmap_find_space(dir->areas, (uintptr_t)a.addr & ~0xFFFUL, size);
+		if (!start) {
+			spin_unlock(proc->image.lock);
+			return -ENOMEM;
+		}
+	}
+
+	/* Only whole pages that exist in the file are read from it; the rest is zero. */
+	uintptr_t file_end = start;
+	if (file && (uint64_t)a.offset < file->length) {
+		file_end = file->length - a.offset < size ? start + (file->length - a.offset) : start + size;
+	}
+
+	spin_lock(dir->lock);
+	if (!dir->areas) dir->areas = list_create("vm areas", NULL);
+	vm_area_create(dir->areas, start, start + size, flags, file, a.offset, start, file_end);
+	spin_unlock(dir->lock);
+
+#ifndef __x86_64__
+	/* Faults don't fill in regions here, so populate it now. */
+	for (uintptr_t page = start; page < start + size; page += 0x1000) {
+		vm_area_fault(page);
+	}
+#endif
+
+	spin_unlock(proc->image.lock);
+	return (long)start;
+}
+
+long sys_munmap(void * addr, size_t length) {
+	uintptr_t start = (uintptr_t)addr;
+	uintptr_t end = (start + length + 0xFFF) & ~0xFFFUL;
+	if ((start & 0xFFF) || !length) return -EINVAL;
+	if (!mmap_range_ok(start, end)) return -EINVAL;
+
+	volatile process_t * volatile proc = this_core->current_process;
+	if (proc->group != 0) proc = process_from_pid(proc->group);
+	if (!proc) return -EFAULT;
+
+	vm_areas_sync(this_core->current_process->thread.page_directory, start, end);
+	spin_lock(proc->image.lock);
+	unmap_range(start, end);
+	spin_unlock(proc->image.lock);
+	return 0;
+}
+
+long sys_mprotect(void * addr, size_t length, int prot) {
+	uintptr_t start = (uintptr_t)addr;
+	uintptr_t end = (start + length + 0xFFF) & ~0xFFFUL;
+	if (start & 0xFFF) return -EINVAL;
+	if (!length) return 0;
+	if (!mmap_range_ok(start, end)) return -ENOMEM;
+
+	int flags = 0;
+	unsigned int mmu_flags = 0;
+	if (!(prot & (PROT_READ | PROT_WRITE | PROT_EXEC))) {
+		flags |= VM_AREA_NONE;
+		mmu_flags |= MMU_FLAG_NOACCESS;
+	}
+	if (prot & PROT_WRITE) {
+		flags |= VM_AREA_WRITE;
+		mmu_flags |= MMU_FLAG_WRITABLE;
+	}
+	if (prot & PROT_EXEC) flags |= VM_AREA_EXEC;
+
+	volatile process_t * volatile proc = this_core->current_process;
+	if (proc->group != 0) proc = process_from_pid(proc->group);
+	if (!proc) return -EFAULT;
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+
+	spin_lock(proc->image.lock);
+	spin_lock(dir->lock);
+	int denied = vm_areas_protect(dir->areas, start, end, flags);
+	spin_unlock(dir->lock);
+	if (!denied) mmu_protect_user(start, end - start, mmu_flags);
+	spin_unlock(proc->image.lock);
+
+	return denied ? -EACCES : 0;
+}
+
 long sys_uname(struct utsname * name) {
 	PTR_VALIDATE(name);
 	if (!name) return -EFAULT;
@@ -1401,6 +1585,9 @@ static scall_func syscalls[] = {
 	[SYS_TRUNCATE]     = (scall_func)(uintptr_t)sys_truncate,
 	[SYS_FTRUNCATE]    = (scall_func)(uintptr_t)sys_ftruncate,
 	[SYS_GETPPID]      = (scall_func)(uintptr_t)sys_getppid,
+	[SYS_MMAP]         = (scall_func)(uintptr_t)sys_mmap,
+	[SYS_MUNMAP]       = (scall_func)(uintptr_t)sys_munmap,
+	[SYS_MPROTECT]     = (scall_func)(uintptr_t)sys_mprotect,
 
 	[SYS_SOCKET]       = (scall_func)(uintptr_t)net_socket,
 	[SYS_SETSOCKOPT]   = (scall_func)(uintptr_t)net_setsockopt,
@@ -0,0 +1,525 @@
+/**
+ * @file  kernel/sys/vm.c
+ * @brief Demand-paged user memory regions.
+ *
+ * Regions of a user address space that are populated when they are
+ * first touched, rather than up front. This is used by the ELF loader
+ * so that exec only pays for the pages a program actually uses.
+ *
+ * Read-only pages that are entirely backed by a file go through a
+ * small cache of frames, so processes running the same binary share
+ * one copy of its text. Cached frames hold a reference of their own
+ * and are released when they are evicted. Private writable pages can
+ * come from the same cache, mapped copy-on-write.
+ *
+ * Regions are also what mmap creates. Shared regions find their pages
+ * in a @c vm_shared_t for their file, so every process mapping the same
+ * file sees the same frames; those are written back to the file by
+ * @ref vm_areas_sync when regions are unmapped or their process exits.
+ * For files in the page cache, both kinds of region map the cache's own
+ * frames, so shared mappings see the same data as read and write.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/vm.h>
+#include <kernel/pagecache.h>
+
+#define PAGE_SIZE 0x1000UL
+#define TEXT_CACHE_SIZE 512
+
+static struct text_page {
+	void * device;
+	uint64_t inode;
+	time_t mtime;
+	uint64_t offset;
+	uintptr_t frame; /* 0 when unused */
+} text_cache[TEXT_CACHE_SIZE];
+
+static spin_lock_t text_cache_lock = { 0 };
+
+static list_t * shared_objects = NULL;
+static spin_lock_t shared_objects_lock = { 0 };
+
+/**
+ * @brief Find or create the shared page object for a file.
+ *
+ * @param file File to map, or NULL for a new anonymous object.
+ */
+static vm_shared_t * vm_shared_get(fs_node_t * file) {
+	spin_lock(shared_objects_lock);
+	if (!shared_objects) shared_objects = list_create("vm shared objects", NULL);
+
+	if (file) {
+		foreach(node, shared_objects) {
+			vm_shared_t * obj = node->value;
+			if (obj->file && obj->device == file->device && obj->inode == file->inode) {
+				spin_lock(obj->lock);
+				obj->refs++;
+				spin_unlock(obj->lock);
+				spin_unlock(shared_objects_lock);
+				return obj;
+			}
+		}
+	}
+
+	vm_shared_t * obj = calloc(1, sizeof(vm_shared_t));
+	obj->refs = 1;
+	obj->file = file;
+	if (file) {
+		obj->device = file->device;
+		obj->inode = file->inode;
+		open_fs(file, 0);
+	}
+	obj->pages = hashmap_create_int(64);
+	list_insert(shared_objects, obj);
+	spin_unlock(shared_objects_lock);
+	return obj;
+}
+
+static void vm_shared_ref(vm_shared_t * obj) {
+	spin_lock(obj->lock);
+	obj->refs++;
+	spin_unlock(obj->lock);
+}
+
+/**
+ * @brief Drop a reference to a shared page object, releasing its frames with the last one.
+ *
+ * Does not write anything back; that is up to @ref vm_areas_sync.
+ */
+static void vm_shared_release(vm_shared_t * obj) {
+	spin_lock(shared_objects_lock);
+	spin_lock(obj->lock);
+	int refs = --obj->refs;
+	spin_unlock(obj->lock);
+	if (refs) {
+		spin_unlock(shared_objects_lock);
+		return;
+	}
+	node_t * node = list_find(shared_objects, obj);
+	list_delete(shared_objects, node);
+	free(node);
+	spin_unlock(shared_objects_lock);
+
+	list_t * frames = hashmap_values(obj->pages);
+	foreach(node, frames) {
+		mmu_frame_unref((uintptr_t)node->value);
+	}
+	list_free(frames);
+	free(frames);
+	hashmap_free(obj->pages);
+	free(obj->pages);
+	if (obj->file) close_fs(obj->file);
+	free(obj);
+}
+
+/**
+ * @brief Write cached pages [from, to) of a shared object back to its file.
+ */
+static void vm_shared_sync(vm_shared_t * obj, uint64_t from, uint64_t to) {
+	if (!obj->file) return;
+	for (uint64_t index = from; index < to; ++index) {
+		uint64_t offset = index << 12;
+		if (offset >= obj->file->length) break;
+
+		spin_lock(obj->lock);
+		uintptr_t frame = (uintptr_t)hashmap_get(obj->pages, (void*)(uintptr_t)index);
+		spin_unlock(obj->lock);
+		if (!frame) continue;
+
+		/* Never grow the file; bytes past the end of it are just zero padding. */
+		size_t size = obj->file->length - offset < PAGE_SIZE ? obj->file->length - offset : PAGE_SIZE;
+		write_fs(obj->file, offset, size, mmu_map_from_physical(frame << 12));
+	}
+}
+
+/**
+ * @brief Add a new region to a list of regions.
+ *
+ * Takes a reference on @p file, which is released when the region is freed.
+ */
+vm_area_t * vm_area_create(list_t * areas, uintptr_t start, uintptr_t end, int flags,
+	fs_node_t * file, uint64_t offset, uintptr_t file_start, uintptr_t file_end) {
+	vm_area_t * area = malloc(sizeof(vm_area_t));
+	area->start = start;
+	area->end = end;
+	area->flags = flags;
+	area->file = file;
+	area->offset = offset;
+	area->file_start = file_start;
+	area->file_end = file_end;
+	area->shared = (flags & VM_AREA_SHARED) ? vm_shared_get(file) : NULL;
+	if (file) open_fs(file, 0);
+	list_insert(areas, area);
+	return area;
+}
+
+/**
+ * @brief Duplicate a region, taking new references on its file and shared pages.
+ */
+static vm_area_t * vm_area_copy(list_t * areas, vm_area_t * area) {
+	vm_area_t * out = malloc(sizeof(vm_area_t));
+	memcpy(out, area, sizeof(vm_area_t));
+	if (out->file) open_fs(out->file, 0);
+	if (out->shared) vm_shared_ref(out->shared);
+	list_insert(areas, out);
+	return out;
+}
+
+static void vm_area_release(vm_area_t * area) {
+	if (area->shared) vm_shared_release(area->shared);
+	if (area->file) close_fs(area->file);
+	free(area);
+}
+
+/**
+ * @brief Copy a list of regions for a new address space.
+ */
+list_t * vm_areas_clone(list_t * areas) {
+	if (!areas) return NULL;
+	list_t * out = list_create("vm areas", NULL);
+	foreach(node, areas) {
+		vm_area_copy(out, node->value);
+	}
+	return out;
+}
+
+/**
+ * @brief Release a list of regions and their files.
+ */
+void vm_areas_free(list_t * areas) {
+	if (!areas) return;
+	while (areas->length) {
+		vm_area_release(list_pop(areas)->value);
+	}
+	free(areas);
+}
+
+/**
+ * @brief Split the region in @p node so that none of it straddles @p address.
+ *
+ * The new region is inserted after the original, which keeps [start, address).
+ */
+static void vm_area_split(list_t * areas, node_t * node, uintptr_t address) {
+	vm_area_t * area = node->value;
+	if (address <= area->start || address >= area->end) return;
+
+	/* File offsets are relative to file_start, so both halves keep them as-is. */
+	vm_area_t * tail = malloc(sizeof(vm_area_t));
+	memcpy(tail, area, sizeof(vm_area_t));
+	tail->start = address;
+	area->end = address;
+	if (tail->file) open_fs(tail->file, 0);
+	if (tail->shared) vm_shared_ref(tail->shared);
+	list_insert_after(areas, node, tail);
+}
+
+/**
+ * @brief Does any region overlap [start, end)?
+ */
+int vm_areas_overlap(list_t * areas, uintptr_t start, uintptr_t end) {
+	if (!areas) return 0;
+	foreach(node, areas) {
+		vm_area_t * area = node->value;
+		if (area->start < end && area->end > start) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Take [start, end) out of a list of regions.
+ *
+ * Regions that are partially covered are trimmed or split. The caller
+ * should hold the directory lock, and should release the regions that
+ * were removed with @ref vm_areas_free once it has dropped it.
+ *
+ * @returns a list of the regions that were removed.
+ */
+list_t * vm_areas_remove(list_t * areas, uintptr_t start, uintptr_t end) {
+	list_t * removed = list_create("vm areas", NULL);
+	if (!areas) return removed;
+
+	node_t * node = areas->head;
+	while (node) {
+		node_t * next = node->next;
+		vm_area_t * area = node->value;
+		if (area->start < end && area->end > start) {
+			vm_area_split(areas, node, end);
+			vm_area_split(areas, node, start);
+			/* Whatever is in [start, end) is now either this node or the one after it. */
+			if (area->start < start) node = node->next;
+			next = node->next;
+			list_delete(areas, node);
+			list_append(removed, node);
+		}
+		node = next;
+	}
+
+	return removed;
+}
+
+/**
+ * @brief Change the permissions of the regions in [start, end).
+ *
+ * Only the VM_AREA_WRITE, VM_AREA_EXEC and VM_AREA_NONE bits are changed.
+ * The caller should hold the directory lock.
+ *
+ * @returns 0 on success, 1 if a shared region can not be made writable.
+ */
+int vm_areas_protect(list_t * areas, uintptr_t start, uintptr_t end, int flags) {
+	if (!areas) return 0;
+
+	if (flags & VM_AREA_WRITE) {
+		foreach(node, areas) {
+			vm_area_t * area = node->value;
+			if (area->start < end && area->end > start &&
+				(area->flags & VM_AREA_SHARED) && area->file && !(area->flags & VM_AREA_MAYWRITE)) return 1;
+		}
+	}
+
+	foreach(node, areas) {
+		vm_area_t * area = node->value;
+		if (area->start < end && area->end > start) {
+			vm_area_split(areas, node, end);
+			vm_area_split(areas, node, start);
+			if (area->start < start) continue; /* Its other half comes up next. */
+			area->flags = (area->flags & ~(VM_AREA_WRITE | VM_AREA_EXEC | VM_AREA_NONE)) | flags;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Write back shared file pages mapped in [start, end) of a directory.
+ *
+ * File I/O can sleep, so this is done without holding the directory lock;
+ * the shared objects involved are kept alive with extra references instead.
+ */
+void vm_areas_sync(page_directory_t * dir, uintptr_t start, uintptr_t end) {
+	if (!dir->areas) return;
+
+	list_t * pending = list_create("vm sync", NULL);
+	spin_lock(dir->lock);
+	foreach(node, dir->areas) {
+		vm_area_t * area = node->value;
+		if (!area->shared || !area->shared->file) continue;
+		if (area->start >= end || area->end <= start) continue;
+		vm_area_t * range = malloc(sizeof(vm_area_t));
+		memcpy(range, area, sizeof(vm_area_t));
+		if (range->start < start) range->start = start;
+		if (range->end > end) range->end = end;
+		vm_shared_ref(range->shared);
+		list_insert(pending, range);
+	}
+	spin_unlock(dir->lock);
+
+	while (pending->length) {
+		node_t * node = list_pop(pending);
+		vm_area_t * range = node->value;
+		vm_shared_sync(range->shared,
+			(range->offset + (range->start - range->file_start)) >> 12,
+			(range->offset + (range->end - range->file_start)) >> 12);
+		vm_shared_release(range->shared);
+		free(range);
+		free(node);
+	}
+	free(pending);
+}
+
+/**
+ * @brief Fill a fresh frame with the contents of @p page in @p area.
+ */
+static uintptr_t vm_area_fill(vm_area_t * area, uintptr_t page) {
+	uintptr_t frame = mmu_allocate_a_frame();
+	char * out = mmu_map_from_physical(frame << 12);
+
+	uintptr_t from = page < area->file_start ? area->file_start : page;
+	uintptr_t to = page + PAGE_SIZE > area->file_end ? area->file_end : page + PAGE_SIZE;
+
+	if (!area->file || from >= to) {
+		memset(out, 0, PAGE_SIZE);
+		return frame;
+	}
+
+	if (from > page) memset(out, 0, from - page);
+	if (to < page + PAGE_SIZE) memset(out + (to - page), 0, page + PAGE_SIZE - to);
+	read_fs(area->file, area->offset + (from - area->file_start), to - from, (uint8_t*)out + (from - page));
+
+	return frame;
+}
+
+/**
+ * @brief Map a file page through the text cache, read-only or copy-on-write.
+ *
+ * @returns 0 if the page was mapped, 1 if it should be mapped privately instead.
+ */
+static int vm_area_map_shared(vm_area_t * area, uintptr_t page) {
+	fs_node_t * file = area->file;
+	unsigned int flags = (area->flags & VM_AREA_WRITE) ? MMU_FLAG_COW : 0;
+	uint64_t offset = area->offset + (page - area->file_start);
+	size_t slot = ((uintptr_t)file->device ^ (file->inode * 31) ^ (offset >> 12)) % TEXT_CACHE_SIZE;
+	struct text_page * entry = &text_cache[slot];
+
+	/* Files in the page cache already have their pages in frames of their own. */
+	if (!(offset & (PAGE_SIZE - 1))) {
+		uintptr_t frame = pagecache_share(file, offset >> 12);
+		if (frame) {
+			int status = mmu_map_user_frame(page, frame, flags);
+			mmu_frame_unref(frame);
+			return status < 0;
+		}
+	}
+
+	spin_lock(text_cache_lock);
+	if (entry->frame && entry->device == file->device && entry->inode == file->inode &&
+		entry->mtime == file->mtime && entry->offset == offset) {
+		int status = mmu_map_user_frame(page, entry->frame, flags);
+		spin_unlock(text_cache_lock);
+		return status < 0;
+	}
+	spin_unlock(text_cache_lock);
+
+	/* Read without holding the lock; someone else may beat us to this slot. */
+	uintptr_t frame = vm_area_fill(area, page);
+	if (mmu_frame_ref(frame)) {
+		mmu_frame_release(frame << 12);
+		return 1;
+	}
+
+	spin_lock(text_cache_lock);
+	if (entry->frame) mmu_frame_unref(entry->frame);
+	entry->device = file->device;
+	entry->inode = file->inode;
+	entry->mtime = file->mtime;
+	entry->offset = offset;
+	entry->frame = frame;
+	int status = mmu_map_user_frame(page, frame, flags);
+	spin_unlock(text_cache_lock);
+
+	return status < 0;
+}
+
+/**
+ * @brief Map a page of a shared region, reading it in if nobody has it yet.
+ *
+ * @returns 0 if the page was mapped, 1 if it could not be.
+ */
+static int vm_shared_fault(vm_area_t * area, uintptr_t page) {
+	vm_shared_t * obj = area->shared;
+	uint64_t index = (area->offset + (page - area->file_start)) >> 12;
+	unsigned int flags = MMU_FLAG_SHARED | ((area->flags & VM_AREA_WRITE) ? MMU_FLAG_WRITABLE : 0);
+
+	spin_lock(obj->lock);
+	uintptr_t frame = (uintptr_t)hashmap_get(obj->pages, (void*)(uintptr_t)index);
+	spin_unlock(obj->lock);
+
+	if (!frame && obj->file) {
+		/* Share the page cache's frame, if the file is cached; that reference becomes ours. */
+		frame = pagecache_share(obj->file, index);
+	}
+
+	if (!frame) {
+		frame = mmu_allocate_a_frame();
+		char * out = mmu_map_from_physical(frame << 12);
+		memset(out, 0, PAGE_SIZE);
+		if (obj->file && (index << 12) < obj->file->length) {
+			size_t size = obj->file->length - (index << 12);
+			read_fs(obj->file, index << 12, size < PAGE_SIZE ? size : PAGE_SIZE, (uint8_t*)out);
+		}
+		if (mmu_frame_ref(frame)) {
+			mmu_frame_release(frame << 12);
+			return 1;
+		}
+	}
+
+	spin_lock(obj->lock);
+	uintptr_t existing = (uintptr_t)hashmap_get(obj->pages, (void*)(uintptr_t)index);
+	if (!existing) {
+		hashmap_set(obj->pages, (void*)(uintptr_t)index, (void*)frame);
+	} else if (existing != frame) {
+		/* Someone else read it in while we were; use theirs. */
+		mmu_frame_unref(frame);
+		frame = existing;
+	}
+	int status = mmu_map_user_frame(page, frame, flags);
+	spin_unlock(obj->lock);
+
+	return status < 0;
+}
+
+/**
+ * @brief Populate a page of the current address space on demand.
+ *
+ * Called for faults on non-present pages and when validating user
+ * pointers passed to system calls.
+ *
+ * @param address Faulting virtual address.
+ * @returns 0 if the page is now mapped, 1 if it is not part of any region
+ *          or can not be accessed.
+ */
+int vm_area_fault(uintptr_t address) {
+	page_directory_t * dir = this_core->current_process->thread.page_directory;
+	if (!dir || !dir->areas) return 1;
+
+	uintptr_t page = address & ~(PAGE_SIZE - 1);
+	vm_area_t area;
+	int found = 0;
+
+	spin_lock(dir->lock);
+	foreach(node, dir->areas) {
+		vm_area_t * candidate = node->value;
+		if (page >= candidate->start && page < candidate->end) {
+			memcpy(&area, candidate, sizeof(vm_area_t));
+			/* Keep the shared pages, or the file, around even if the region is unmapped under us. */
+			if (area.shared) vm_shared_ref(area.shared);
+			if (area.file) open_fs(area.file, 0);
+			found = 1;
+			break;
+		}
+	}
+	spin_unlock(dir->lock);
+
+	if (!found) return 1;
+	if (area.flags & VM_AREA_NONE) {
+		if (area.shared) vm_shared_release(area.shared);
+		if (area.file) close_fs(area.file);
+		return 1;
+	}
+
+	if (area.shared) {
+		int status = vm_shared_fault(&area, page);
+		vm_shared_release(area.shared);
+		if (area.file) close_fs(area.file);
+		return status;
+	}
+
+	/* Pages entirely backed by the file can be shared, copy-on-write if the region is writable. */
+	if (area.file && page >= area.file_start && page + PAGE_SIZE <= area.file_end) {
+		if (!vm_area_map_shared(&area, page)) {
+			close_fs(area.file);
+			return 0;
+		}
+	}
+
+	uintptr_t frame = vm_area_fill(&area, page);
+	if (mmu_map_user_frame(page, frame, (area.flags & VM_AREA_WRITE) ? MMU_FLAG_WRITABLE : 0)) {
+		/* Another thread got here first. */
+		mmu_frame_release(frame << 12);
+	}
+
+	if (area.file) close_fs(area.file);
+	return 0;
+}
@@ -0,0 +1,673 @@
+/**
+ * @file  kernel/vfs/pagecache.c
+ * @brief Page cache for file data.
+ *
+ * Caches the contents of files on filesystems that register with it,
+ * a page at a time. Each file gets a radix tree of its cached pages,
+ * found by the filesystem's device pointer and the file's inode number,
+ * so every node for the same file sees the same pages.
+ *
+ * Writes only dirty cached pages. They reach the filesystem when it is
+ * synced, when they have been dirty for long enough that the flusher
+ * thread picks them up, or when too many pages are dirty, in which case
+ * the writer that pushed the count over the limit does the writing.
+ * Filesystems that can reserve space do so as a page is first dirtied,
+ * so running out of it is reported to the write that needed it; errors
+ * writing back are reported to the next write to the same file. Clean pages
+ * are evicted with a CLOCK sweep once the cache grows past its share
+ * of memory; pages that were used since the hand last passed them get
+ * a second chance.
+ *
+ * Cached frames can also be mapped into user address spaces for mmap.
+ * Once that happens the cache holds a reference on the frame like any
+ * mapping does, and the page is not evicted until the last mapping is
+ * gone.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2026 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/spinlock.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/slab.h>
+#include <kernel/time.h>
+#include <kernel/process.h>
+#include <kernel/args.h>
+#include <kernel/pagecache.h>
+
+#define PAGE_SIZE       0x1000UL
+#define RADIX_SHIFT     6
+#define RADIX_SLOTS     (1 << RADIX_SHIFT)
+#define RADIX_MASK      (RADIX_SLOTS - 1)
+#define RADIX_MAX_DEPTH 11 /* Enough levels for any 64-bit index */
+#define MAPPING_BUCKETS 256
+#define DIRTY_LIMIT     1024
+#define DIRTY_BATCH     256
+
+#define PAGE_DIRTY      0x01
+#define PAGE_REFERENCED 0x02
+#define PAGE_SHARED     0x04 /* The cache holds a frame reference; see pagecache_share */
+#define PAGE_TRUNCATED  0x08 /* Cut off by a truncate while pinned; released with the last pin */
+
+struct radix_node {
+	void * slots[RADIX_SLOTS];
+	int count;
+};
+
+struct page_mapping;
+
+typedef struct cached_page {
+	struct page_mapping * mapping;
+	uint64_t index;
+	uintptr_t frame;
+	int flags;
+	int pins;                  /* Users copying in or out without the lock */
+	uint64_t dirtied;          /* When it was last made dirty, in milliseconds */
+	struct cached_page * next; /* CLOCK ring */
+	struct cached_page * prev;
+} cached_page_t;
+
+typedef struct page_mapping {
+	void * device;
+	uint64_t inode;
+	const pagecache_ops_t * ops;
+	struct radix_node * root;
+	int height;                /* Levels below and including the root */
+	size_t pages;
+	int error;                 /* A failed writeback, for the next write to report */
+	struct page_mapping * next;
+} page_mapping_t;
+
+struct registered_device {
+	void * device;
+	const pagecache_ops_t * ops;
+};
+
+static page_mapping_t * mappings[MAPPING_BUCKETS];
+static list_t * devices = NULL;
+static cached_page_t * clock_hand = NULL;
+static struct pagecache_stats stats = {0};
+static size_t page_limit = 0;
+static slab_cache_t * page_cache = NULL;
+static slab_cache_t * radix_cache = NULL;
+static spin_lock_t pagecache_lock = { 0 };
+static unsigned long flush_age = 5000; /* Milliseconds; pagecache_flush_age= on the kernel command line */
+
+static void pagecache_flusher(void * arg);
+
+/**
+ * @brief Start caching files of a filesystem.
+ *
+ * @param device The @c device pointer of the filesystem's nodes.
+ * @param ops    How to read and write back its pages.
+ */
+void pagecache_register(void * device, const pagecache_ops_t * ops) {
+	struct registered_device * entry = malloc(sizeof(struct registered_device));
+	entry->device = device;
+	entry->ops = ops;
+
+	spin_lock(pagecache_lock);
+	if (!devices) {
+		devices = list_create("page cache devices", NULL);
+		page_cache = slab_create("cached pages", sizeof(cached_page_t), 0, NULL);
+		radix_cache = slab_create("page cache radix nodes", sizeof(struct radix_node), 0, NULL);
+		/* A quarter of memory, in pages; mmu_total_memory is in kB. */
+		page_limit = mmu_total_memory() / 16;
+		if (args_present("pagecache_flush_age")) {
+			flush_age = atoi(args_value("pagecache_flush_age"));
+		}
+		if (flush_age) {
+			spawn_worker_thread(pagecache_flusher, "[pagecache flush]", NULL);
+		}
+	}
+	list_insert(devices, entry);
+	spin_unlock(pagecache_lock);
+}
+
+static uint64_t pagecache_now_ms(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return s * 1000 + ss / 1000;
+}
+
+static const pagecache_ops_t * device_ops(void * device) {
+	if (!devices) return NULL;
+	foreach(node, devices) {
+		struct registered_device * entry = node->value;
+		if (entry->device == device) return entry->ops;
+	}
+	return NULL;
+}
+
+static unsigned int mapping_hash(void * device, uint64_t inode) {
+	return (((uintptr_t)device >> 4) ^ (inode * 2654435761UL)) % MAPPING_BUCKETS;
+}
+
+static page_mapping_t * mapping_find(void * device, uint64_t inode) {
+	for (page_mapping_t * m = mappings[mapping_hash(device, inode)]; m; m = m->next) {
+		if (m->device == device && m->inode == inode) return m;
+	}
+	return NULL;
+}
+
+static page_mapping_t * mapping_get(void * device, uint64_t inode, const pagecache_ops_t * ops) {
+	page_mapping_t * m = mapping_find(device, inode);
+	if (m) return m;
+
+	unsigned int bucket = mapping_hash(device, inode);
+	m = calloc(1, sizeof(page_mapping_t));
+	m->device = device;
+	m->inode = inode;
+	m->ops = ops;
+	m->next = mappings[bucket];
+	mappings[bucket] = m;
+	return m;
+}
+
+/**
+ * @brief Forget about a file once it has no cached pages left.
+ */
+static void mapping_put(page_mapping_t * m) {
+	if (m->pages) return;
+	page_mapping_t ** link = &mappings[mapping_hash(m->device, m->inode)];
+	while (*link != m) link = &(*link)->next;
+	*link = m->next;
+	free(m);
+}
+
+static int radix_fits(int height, uint64_t index) {
+	return height * RADIX_SHIFT >= 64 || !(index >> (height * RADIX_SHIFT));
+}
+
+static struct radix_node * radix_node_new(void) {
+	struct radix_node * node = slab_alloc(radix_cache);
+	memset(node, 0, sizeof(struct radix_node));
+	return node;
+}
+
+static cached_page_t * radix_lookup(page_mapping_t * m, uint64_t index) {
+	if (!m->root || !radix_fits(m->height, index)) return NULL;
+	struct radix_node * node = m->root;
+	for (int level = m->height - 1; level > 0; --level) {
+		node = node->slots[(index >> (level * RADIX_SHIFT)) & RADIX_MASK];
+		if (!node) return NULL;
+	}
+	return node->slots[index & RADIX_MASK];
+}
+
+static void radix_insert(page_mapping_t * m, uint64_t index, cached_page_t * page) {
+	if (!m->root) {
+		m->root = radix_node_new();
+		m->height = 1;
+	}
+
+	/* Grow the tree upwards until the index fits; the old tree covers the low indices. */
+	while (!radix_fits(m->height, index)) {
+		struct radix_node * top = radix_node_new();
+		top->slots[0] = m->root;
+		top->count = 1;
+		m->root = top;
+		m->height++;
+	}
+
+	struct radix_node * node = m->root;
+	for (int level = m->height - 1; level > 0; --level) {
+		void ** slot = &node->slots[(index >> (level * RADIX_SHIFT)) & RADIX_MASK];
+		if (!*slot) {
+			*slot = radix_node_new();
+			node->count++;
+		}
+		node = *slot;
+	}
+
+	node->slots[index & RADIX_MASK] = page;
+	node->count++;
+}
+
+/**
+ * @brief Remove an index that is known to be present, freeing nodes that become empty.
+ */
+static void radix_remove(page_mapping_t * m, uint64_t index) {
+	struct radix_node * path[RADIX_MAX_DEPTH];
+	struct radix_node * node = m->root;
+	for (int level = m->height - 1; level >= 0; --level) {
+		path[level] = node;
+		if (level) node = node->slots[(index >> (level * RADIX_SHIFT)) & RADIX_MASK];
+	}
+
+	for (int level = 0; level < m->height; ++level) {
+		path[level]->slots[(index >> (level * RADIX_SHIFT)) & RADIX_MASK] = NULL;
+		if (--path[level]->count) return;
+		slab_free(radix_cache, path[level]);
+	}
+
+	m->root = NULL;
+	m->height = 0;
+}
+
+static cached_page_t * radix_next_in(struct radix_node * node, int level, uint64_t index) {
+	for (unsigned int slot = (index >> (level * RADIX_SHIFT)) & RADIX_MASK; slot < RADIX_SLOTS; ++slot) {
+		if (node->slots[slot]) {
+			if (!level) return node->slots[slot];
+			cached_page_t * page = radix_next_in(node->slots[slot], level - 1, index);
+			if (page) return page;
+		}
+		/* Past the slot the index is in, anything in the subtree is further along. */
+		index = 0;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Find the cached page with the lowest index at or after @p index.
+ */
+static cached_page_t * radix_next(page_mapping_t * m, uint64_t index) {
+	if (!m->root || !radix_fits(m->height, index)) return NULL;
+	return radix_next_in(m->root, m->height - 1, index);
+}
+
+/* New pages go just behind the hand, so they are the last ones it reaches. */
+static void clock_insert(cached_page_t * page) {
+	if (!clock_hand) {
+		page->next = page;
+		page->prev = page;
+		clock_hand = page;
+		return;
+	}
+	page->next = clock_hand;
+	page->prev = clock_hand->prev;
+	clock_hand->prev->next = page;
+	clock_hand->prev = page;
+}
+
+static void clock_remove(cached_page_t * page) {
+	if (page->next == page) {
+		clock_hand = NULL;
+		return;
+	}
+	page->prev->next = page->next;
+	page->next->prev = page->prev;
+	if (clock_hand == page) clock_hand = page->next;
+}
+
+/**
+ * @brief Take a page out of the cache.
+ *
+ * @param force Drop it even if it is still mapped somewhere; the mappings
+ *              keep the frame alive, but it no longer belongs to the file.
+ * @returns 0 if the page was removed, 1 if it is still mapped.
+ */
+static int page_release(cached_page_t * page, int force) {
+	if (page->flags & PAGE_SHARED) {
+		if (force) {
+			mmu_frame_unref(page->frame);
+		} else if (mmu_frame_unref_unshared(page->frame)) {
+			return 1;
+		}
+	} else {
+		mmu_frame_release(page->frame << 12);
+	}
+
+	page_mapping_t * m = page->mapping;
+	if (page->flags & PAGE_DIRTY) stats.dirty--;
+	if (!(page->flags & PAGE_TRUNCATED)) radix_remove(m, page->index);
+	clock_remove(page);
+	m->pages--;
+	stats.pages--;
+	slab_free(page_cache, page);
+	mapping_put(m);
+	return 0;
+}
+
+/**
+ * @brief Sweep the CLOCK hand until the cache is back under its limit.
+ *
+ * Dirty and pinned pages are passed over; dirty pages become clean
+ * when writers flush them.
+ */
+static void pagecache_reclaim(void) {
+	size_t scan = stats.pages * 2;
+	while (stats.pages >= page_limit && clock_hand && scan--) {
+		cached_page_t * page = clock_hand;
+		clock_hand = page->next;
+		if (page->flags & PAGE_REFERENCED) {
+			page->flags &= ~PAGE_REFERENCED;
+			continue;
+		}
+		if ((page->flags & PAGE_DIRTY) || page->pins) continue;
+		if (!page_release(page, 0)) stats.evictions++;
+	}
+}
+
+/**
+ * @brief Find a cached page, reading it in if it isn't there yet.
+ *
+ * Called and returns with the page cache lock held, but drops it while
+ * reading. The page is returned pinned, so it stays put once the lock
+ * is released again; unpin it when done.
+ *
+ * @param fill Read the page from the file; otherwise it starts out zeroed,
+ *             for callers about to overwrite all of it.
+ * @param out  Set to the page.
+ * @returns 0, -EINVAL if the file's filesystem isn't cached, or the
+ *          error from reading the page.
+ */
+static int page_get(void * device, uint64_t inode, uint64_t index, int fill, cached_page_t ** out) {
+	const pagecache_ops_t * ops = device_ops(device);
+	if (!ops) return -EINVAL;
+
+	page_mapping_t * m = mapping_find(device, inode);
+	cached_page_t * page = m ? radix_lookup(m, index) : NULL;
+	if (page) {
+		page->flags |= PAGE_REFERENCED;
+		page->pins++;
+		stats.hits++;
+		*out = page;
+		return 0;
+	}
+	stats.misses++;
+
+	spin_unlock(pagecache_lock);
+	uintptr_t frame = mmu_allocate_a_frame();
+	uint8_t * data = mmu_map_from_physical(frame << 12);
+	int status = 0;
+	if (fill) status = ops->readpage(device, inode, index, data);
+	else memset(data, 0, PAGE_SIZE);
+	spin_lock(pagecache_lock);
+
+	if (status) {
+		mmu_frame_release(frame << 12);
+		return status;
+	}
+
+	/* The mapping may have come and gone while we were reading. */
+	m = mapping_get(device, inode, ops);
+	page = radix_lookup(m, index);
+	if (page) {
+		mmu_frame_release(frame << 12);
+		page->pins++;
+		*out = page;
+		return 0;
+	}
+
+	pagecache_reclaim();
+	m = mapping_get(device, inode, ops);
+
+	page = slab_alloc(page_cache);
+	page->mapping = m;
+	page->index = index;
+	page->frame = frame;
+	page->flags = PAGE_REFERENCED;
+	page->pins = 1;
+	radix_insert(m, index, page);
+	clock_insert(page);
+	m->pages++;
+	stats.pages++;
+	*out = page;
+	return 0;
+}
+
+/**
+ * @brief Drop a pin, with the page cache lock held.
+ *
+ * Pages a truncate cut off while they were pinned go with the last pin.
+ */
+static void page_put(cached_page_t * page) {
+	if (!--page->pins && (page->flags & PAGE_TRUNCATED)) page_release(page, 1);
+}
+
+static void page_unpin(cached_page_t * page) {
+	spin_lock(pagecache_lock);
+	page_put(page);
+	spin_unlock(pagecache_lock);
+}
+
+static void page_mark_dirty(cached_page_t * page) {
+	if (page->flags & PAGE_DIRTY) return;
+	page->flags |= PAGE_DIRTY;
+	page->dirtied = pagecache_now_ms();
+	stats.dirty++;
+}
+
+/**
+ * @brief Write back dirty pages.
+ *
+ * Pages that fail to write stay dirty, and the error is kept for the
+ * next write to their file.
+ *
+ * @param device Only write pages of this filesystem, or NULL for any.
+ * @param limit  Stop after this many pages.
+ * @param age    Only write pages dirty for at least this many milliseconds.
+ * @returns 0, or the first error from writing a page.
+ */
+static int pagecache_writeback(void * device, size_t limit, unsigned long age) {
+	size_t written = 0;
+	int error = 0;
+	uint64_t now = pagecache_now_ms();
+
+	spin_lock(pagecache_lock);
+	cached_page_t * page = clock_hand;
+	size_t remaining = stats.pages;
+	while (page && remaining-- && written < limit) {
+		if ((page->flags & PAGE_DIRTY) && (!device || page->mapping->device == device) && page->dirtied + age <= now) {
+			page_mapping_t * m = page->mapping;
+			uint64_t dirtied = page->dirtied;
+			page->flags &= ~PAGE_DIRTY;
+			page->pins++;
+			stats.dirty--;
+			spin_unlock(pagecache_lock);
+
+			/* Anything written from here on dirties the page again. */
+			int status = m->ops->writepage(m->device, m->inode, page->index, mmu_map_from_physical(page->frame << 12));
+
+			spin_lock(pagecache_lock);
+			if (status && !(page->flags & PAGE_TRUNCATED)) {
+				if (!(page->flags & PAGE_DIRTY)) {
+					page_mark_dirty(page);
+					page->dirtied = dirtied;
+				}
+				m->error = status;
+				if (!error) error = status;
+			} else if (!status) {
+				stats.writebacks++;
+			}
+			written++;
+			/* Pinned pages stay in the ring, so this is still valid. */
+			cached_page_t * next = page->next;
+			page_put(page);
+			page = next;
+			continue;
+		}
+		page = page->next;
+	}
+	spin_unlock(pagecache_lock);
+	return error;
+}
+
+/**
+ * @brief Write back pages that have been dirty for longer than @c flush_age.
+ */
+static void pagecache_flusher(void * arg) {
+	while (1) {
+		unsigned long s, ss;
+		relative_time(0, flush_age * 1000 / 2, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+
+		if (stats.dirty) pagecache_writeback(NULL, (size_t)-1, flush_age);
+	}
+}
+
+/**
+ * @brief Read file data through the cache.
+ *
+ * The caller is responsible for not reading past the end of the file.
+ */
+ssize_t pagecache_read(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	size_t done = 0;
+	while (done < size) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t in_page = (offset + done) % PAGE_SIZE;
+		size_t chunk = PAGE_SIZE - in_page < size - done ? PAGE_SIZE - in_page : size - done;
+
+		cached_page_t * page;
+		spin_lock(pagecache_lock);
+		int status = page_get(node->device, node->inode, index, 1, &page);
+		spin_unlock(pagecache_lock);
+		if (status) return done ? (ssize_t)done : status;
+
+		memcpy(buffer + done, (uint8_t *)mmu_map_from_physical(page->frame << 12) + in_page, chunk);
+		page_unpin(page);
+		done += chunk;
+	}
+	return done;
+}
+
+/**
+ * @brief Write file data into the cache.
+ *
+ * The caller is responsible for updating the size of the file once this
+ * returns. Until then, the filesystem's reserve and writepage must allow
+ * for the write extending it. If there are too many dirty pages
+ * afterwards, some are written back before returning.
+ *
+ * @returns the number of bytes written, or an error if none were: one
+ *          from reserving space or reading in a page, or one left by an
+ *          earlier write back of the file.
+ */
+ssize_t pagecache_write(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	spin_lock(pagecache_lock);
+	page_mapping_t * m = mapping_find(node->device, node->inode);
+	if (m && m->error) {
+		int error = m->error;
+		m->error = 0;
+		spin_unlock(pagecache_lock);
+		return error;
+	}
+	spin_unlock(pagecache_lock);
+
+	size_t done = 0;
+	while (done < size) {
+		uint64_t index = (offset + done) / PAGE_SIZE;
+		size_t in_page = (offset + done) % PAGE_SIZE;
+		size_t chunk = PAGE_SIZE - in_page < size - done ? PAGE_SIZE - in_page : size - done;
+
+		cached_page_t * page;
+		spin_lock(pagecache_lock);
+		int status = page_get(node->device, node->inode, index, chunk != PAGE_SIZE, &page);
+		spin_unlock(pagecache_lock);
+		if (status) return done ? (ssize_t)done : status;
+
+		/* Make sure there will be somewhere to write the page back to before taking the data. */
+		page_mapping_t * m = page->mapping;
+		if (m->ops->reserve) status = m->ops->reserve(m->device, m->inode, index);
+		if (status) {
+			page_unpin(page);
+			return done ? (ssize_t)done : status;
+		}
+
+		/* Shared mappings write their pages back to us with the frame itself as the buffer. */
+		uint8_t * data = (uint8_t *)mmu_map_from_physical(page->frame << 12) + in_page;
+		if (data != buffer + done) memcpy(data, buffer + done, chunk);
+
+		spin_lock(pagecache_lock);
+		if (!(page->flags & PAGE_TRUNCATED)) page_mark_dirty(page);
+		page_put(page);
+		spin_unlock(pagecache_lock);
+		done += chunk;
+	}
+
+	if (stats.dirty > DIRTY_LIMIT) pagecache_writeback(NULL, DIRTY_BATCH, 0);
+	return done;
+}
+
+/**
+ * @brief Get a cached frame to map into an address space.
+ *
+ * Reads the page in if necessary.
+ *
+ * @returns the frame with a reference taken for the caller, or 0 if
+ *          the file isn't cached or the frame can not be shared.
+ */
+uintptr_t pagecache_share(fs_node_t * node, uint64_t index) {
+	uintptr_t frame = 0;
+
+	cached_page_t * page;
+	spin_lock(pagecache_lock);
+	if (!page_get(node->device, node->inode, index, 1, &page)) {
+		if (!(page->flags & PAGE_SHARED) && !mmu_frame_ref(page->frame)) {
+			page->flags |= PAGE_SHARED;
+		}
+		if ((page->flags & PAGE_SHARED) && !mmu_frame_ref(page->frame)) {
+			frame = page->frame;
+		}
+		page_put(page);
+	}
+	spin_unlock(pagecache_lock);
+
+	return frame;
+}
+
+/**
+ * @brief Drop cached pages past the new end of a file.
+ *
+ * The part of the last page past @p size is cleared, so it reads back
+ * as zero if the file grows again. Pages someone is still copying in or
+ * out of are taken out of the file now, so they are neither found nor
+ * written back again, and freed once the last pin is dropped.
+ */
+void pagecache_truncate(void * device, uint64_t inode, uint64_t size) {
+	spin_lock(pagecache_lock);
+	page_mapping_t * m = mapping_find(device, inode);
+	if (!m) {
+		spin_unlock(pagecache_lock);
+		return;
+	}
+
+	uint64_t first = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (size % PAGE_SIZE) {
+		cached_page_t * last = radix_lookup(m, size / PAGE_SIZE);
+		if (last) memset((uint8_t *)mmu_map_from_physical(last->frame << 12) + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+	}
+
+	cached_page_t * page;
+	uint64_t index = first;
+	while ((page = radix_next(m, index))) {
+		index = page->index + 1;
+		if (page->pins) {
+			if (page->flags & PAGE_DIRTY) stats.dirty--;
+			page->flags = (page->flags & ~PAGE_DIRTY) | PAGE_TRUNCATED;
+			radix_remove(m, page->index);
+			continue;
+		}
+		int last = m->pages == 1;
+		page_release(page, 1);
+		if (last) break; /* The mapping is gone now. */
+	}
+
+	spin_unlock(pagecache_lock);
+}
+
+/**
+ * @brief Write back every dirty page of a filesystem.
+ *
+ * @param device Filesystem to sync, or NULL for all of them.
+ * @returns 0, or the first error from writing a page.
+ */
+int pagecache_sync(void * device) {
+	return pagecache_writeback(device, (size_t)-1, 0);
+}
+
+void pagecache_get_stats(struct pagecache_stats * out) {
+	spin_lock(pagecache_lock);
+	memcpy(out, &stats, sizeof(struct pagecache_stats));
+	spin_unlock(pagecache_lock);
+}
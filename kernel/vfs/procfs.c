@@ -35,6 +35,8 @@
 #include <kernel/misc.h>
 #include <kernel/module.h>
 #include <kernel/ksym.h>
+#include <kernel/slab.h>
+#include <kernel/pagecache.h>
 
 #define PROCFS_STANDARD_ENTRIES (sizeof(std_entries) / sizeof(struct procfs_entry))
 #define PROCFS_PROCDIR_ENTRIES  (sizeof(procdir_entries) / sizeof(struct procfs_entry))
@@ -353,11 +355,24 @@ static void meminfo_func(fs_node_t *node) {
 	size_t free  = total - mmu_used_memory();
 	size_t kheap = ((uintptr_t)sbrk(0) - 0xffffff0000000000UL) / 1024;
 
+	struct pagecache_stats cache;
+	pagecache_get_stats(&cache);
+	uint64_t lookups = cache.hits + cache.misses;
+
 	procfs_printf(node,
 		"MemTotal: %zu kB\n"
 		"MemFree: %zu kB\n"
 		"KHeapUse: %zu kB\n"
-		, total, free, kheap);
+		"PageCache: %zu kB\n"
+		"PageCacheDirty: %zu kB\n"
+		"PageCacheHits: %lu\n"
+		"PageCacheMisses: %lu\n"
+		"PageCacheHitRatio: %lu%%\n"
+		"PageCacheEvictions: %lu\n"
+		"PageCacheWritebacks: %lu\n"
+		, total, free, kheap, cache.pages * 4, cache.dirty * 4,
+		cache.hits, cache.misses, lookups ? cache.hits * 100 / lookups : 0,
+		cache.evictions, cache.writebacks);
 }
 
 #ifdef __x86_64__
@@ -568,6 +583,75 @@ static void idle_func(fs_node_t *node) {
 	}
 }
 
+static void kmalloc_func(fs_node_t *node) {
+	procfs_printf(node, "cpu hits misses flushes locks contended cached\n");
+	for (int i = 0; i < processor_count; ++i) {
+		struct klmalloc_cpu_stats stats;
+		if (malloc_cpu_stats(i, &stats)) break;
+		procfs_printf(node, "%d: %lu %lu %lu %lu %lu %lu\n",
+			i,
+			stats.hits,
+			stats.misses,
+			stats.flushes,
+			stats.lock_acquires,
+			stats.lock_contended,
+			stats.cached
+		);
+	}
+}
+
+static void slabinfo_func(fs_node_t *node) {
+	if (!slab_caches) return;
+	procfs_printf(node, "name objsize stride perslab active total slabs allocs frees\n");
+	foreach(lnode, slab_caches) {
+		slab_cache_t * cache = lnode->value;
+		procfs_printf(node, "%s: %zu %zu %zu %zu %zu %zu %lu %lu\n",
+			cache->name,
+			cache->size,
+			cache->stride,
+			cache->per_slab,
+			cache->active,
+			cache->slabs * cache->per_slab,
+			cache->slabs,
+			cache->allocs,
+			cache->frees
+		);
+	}
+}
+
+static void dcache_func(fs_node_t *node) {
+	procfs_printf(node, "entries: %zu\n", dcache_entries());
+	procfs_printf(node, "fs hits negative misses ratio\n");
+	for (struct dcache_class * class = dcache_classes(); class; class = class->next) {
+		uint64_t lookups = class->hits + class->negative_hits + class->misses;
+		procfs_printf(node, "%s: %lu %lu %lu %lu%%\n",
+			class->name,
+			class->hits,
+			class->negative_hits,
+			class->misses,
+			lookups ? (class->hits + class->negative_hits) * 100 / lookups : 0
+		);
+	}
+}
+
+static void sched_func(fs_node_t *node) {
+	procfs_printf(node, "cpu queued enqueued migrations steals stolen ipis ipis_avoided\n");
+	for (int i = 0; i < processor_count; ++i) {
+		struct runqueue_stats stats;
+		if (process_runqueue_stats(i, &stats)) break;
+		procfs_printf(node, "%d: %zu %lu %lu %lu %lu %lu %lu\n",
+			i,
+			stats.length,
+			stats.enqueued,
+			stats.migrations,
+			stats.steals,
+			stats.stolen,
+			stats.ipi_sent,
+			stats.ipi_avoided
+		);
+	}
+}
+
 static void kallsyms_func(fs_node_t *fnode) {
 	/* This doesn't include module symbols at the moment... */
 	list_t * syms = ksym_list();
@@ -594,9 +678,13 @@ static struct procfs_entry std_entries[] = {
 	{-11,"idle",     idle_func},
 	{-12,"kallsyms", kallsyms_func},
 	{-13,"pci",      pci_func},
+	{-14,"kmalloc",  kmalloc_func},
+	{-15,"slabinfo", slabinfo_func},
+	{-16,"sched",    sched_func},
+	{-17,"dcache",   dcache_func},
 #ifdef __x86_64__
-	{-14,"irq",      irq_func},
-	{-15,"pat",      pat_func},
+	{-18,"irq",      irq_func},
+	{-19,"pat",      pat_func},
 #endif
 };
 
@@ -12,6 +12,10 @@
  * by the ramdisk driver which may mark those pages as available
  * (via an ioctl request).
  *
+ * A ramdisk can also be mounted before its contents are ready, while
+ * something else fills it in from the start; reads that reach past
+ * what has been filled in so far wait for it.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -25,12 +29,42 @@
 #include <kernel/string.h>
 #include <kernel/process.h>
 #include <kernel/mmu.h>
+#include <kernel/spinlock.h>
+#include <kernel/ramdisk.h>
+
+struct ramdisk_stream {
+	spin_lock_t lock;
+	volatile size_t available;
+	volatile int failed;
+	list_t * waiters;
+};
 
 static ssize_t read_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 static ssize_t write_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
 static void     open_ramdisk(fs_node_t *node, unsigned int flags);
 static void     close_ramdisk(fs_node_t *node);
 
+/**
+ * @brief Wait until the first @p end bytes of a streaming ramdisk are filled in.
+ *
+ * @returns 0 when they are, or -EIO if they never will be.
+ */
+static int ramdisk_wait(fs_node_t * node, size_t end) {
+	/* Nodes opened from the mounted one all point back to it */
+	fs_node_t * disk = node->device;
+	struct ramdisk_stream * stream = (struct ramdisk_stream *)(uintptr_t)disk->impl;
+	if (!stream || stream->available >= end) return 0;
+
+	spin_lock(stream->lock);
+	while (stream->available < end && !stream->failed) {
+		sleep_on_unlocking(stream->waiters, &stream->lock);
+		spin_lock(stream->lock);
+	}
+	int status = stream->available < end ? -EIO : 0;
+	spin_unlock(stream->lock);
+	return status;
+}
+
 static ssize_t read_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 
 	if ((size_t)offset > node->length) {
@@ -42,6 +76,9 @@ static ssize_t read_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t
 		size = i;
 	}
 
+	int status = ramdisk_wait(node, offset + size);
+	if (status) return status;
+
 	memcpy(buffer, (void *)((uintptr_t)mmu_map_from_physical(node->inode) + (uintptr_t)offset), size);
 
 	return size;
@@ -57,6 +94,9 @@ static ssize_t write_ramdisk(fs_node_t *node, off_t offset, size_t size, uint8_t
 		size = i;
 	}
 
+	int status = ramdisk_wait(node, offset + size);
+	if (status) return status;
+
 	memcpy((void *)((uintptr_t)mmu_map_from_physical(node->inode) + (uintptr_t)offset), buffer, size);
 	return size;
 }
@@ -75,6 +115,8 @@ static int ioctl_ramdisk(fs_node_t * node, unsigned long request, void * argp) {
 			if (this_core->current_process->user != 0) {
 				return -EPERM;
 			} else {
+				/* Let whoever is filling it in finish first */
+				ramdisk_wait(node, node->length);
 				/* Clear all of the memory used by this ramdisk */
 				if (node->length >= 0x1000) {
 					if (node->length % 0x1000) {
@@ -131,3 +173,44 @@ fs_node_t * ramdisk_mount(uintptr_t location, size_t size) {
 	return NULL;
 }
 
+/**
+ * @brief Mount a ramdisk whose contents are still being written.
+ *
+ * The caller fills in the pages at @p location from the start and
+ * reports how far it has got with @ref ramdisk_stream_advance.
+ */
+fs_node_t * ramdisk_mount_streaming(uintptr_t location, size_t size) {
+	struct ramdisk_stream * stream = malloc(sizeof(struct ramdisk_stream));
+	spin_init(stream->lock);
+	stream->available = 0;
+	stream->failed = 0;
+	stream->waiters = list_create("ramdisk stream waiters", stream);
+
+	fs_node_t * ramdisk = ramdisk_device_create(last_device_number, location, size);
+	ramdisk->impl = (uintptr_t)stream;
+
+	char tmp[64];
+	snprintf(tmp, 63, "/dev/%s", ramdisk->name);
+	char addr[64];
+	snprintf(addr, 63, "%p,%zu", (void*)location, size);
+	vfs_mount(tmp, ramdisk, "ramdisk", addr);
+	last_device_number += 1;
+	return ramdisk;
+}
+
+void ramdisk_stream_advance(fs_node_t * ramdisk, size_t available) {
+	struct ramdisk_stream * stream = (struct ramdisk_stream *)(uintptr_t)ramdisk->impl;
+	spin_lock(stream->lock);
+	stream->available = available;
+	spin_unlock(stream->lock);
+	wakeup_queue(stream->waiters);
+}
+
+void ramdisk_stream_fail(fs_node_t * ramdisk) {
+	struct ramdisk_stream * stream = (struct ramdisk_stream *)(uintptr_t)ramdisk->impl;
+	spin_lock(stream->lock);
+	stream->failed = 1;
+	spin_unlock(stream->lock);
+	wakeup_queue(stream->waiters);
+}
+
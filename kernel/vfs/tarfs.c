@@ -12,15 +12,64 @@
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <kernel/time.h>
+#include <kernel/misc.h>
 
 #include <kernel/list.h>
 #include <kernel/hashmap.h>
+#include <kernel/mutex.h>
 
 #define TARFS_LOG_LEVEL WARNING
 
+/* Offset of directories that only exist because of their contents */
+#define TARFS_NO_HEADER ((unsigned int)-1)
+
+/**
+ * One file in the archive.
+ *
+ * Directories hold their children in archive order, which is
+ * what readdir walks; lookups by name go through the mount's
+ * path index instead.
+ */
+struct tarfs_entry {
+	char * path;          /* Full path, without leading or trailing slashes */
+	char * name;          /* Last component of path */
+	char * link;          /* Link target, for symlinks and hardlinks */
+	unsigned int offset;  /* Offset of the header, or TARFS_NO_HEADER */
+	unsigned int data;    /* Offset of the contents */
+	unsigned int size;
+	unsigned int mode;
+	unsigned int uid;
+	unsigned int gid;
+	char type;
+
+	struct tarfs_entry ** children;
+	size_t child_count;
+	size_t child_space;
+};
+
+/**
+ * The index is built as it is needed, in a single pass over the
+ * archive: a lookup only reads as far as the header it wants, and
+ * readdir finishes the pass. Nothing is read twice, and mounting
+ * reads nothing at all, so a ramdisk that is still being filled in
+ * is usable as soon as its first files are.
+ */
 struct tarfs {
 	fs_node_t * device;
 	unsigned int length;
+	struct tarfs_entry * root;
+	hashmap_t * index;    /* Full path to entry */
+	size_t entries;
+
+	/* Guards everything below, and the index until it is complete */
+	sched_mutex_t * index_lock;
+	volatile int complete;
+	unsigned int scan_offset;
+	char * long_name;     /* GNU long name or link waiting for its header */
+	char * long_link;
+	size_t headers;
+	uint64_t scan_time;
 };
 
 struct ustar {
@@ -103,39 +152,14 @@ static unsigned int round_to_512(unsigned int i) {
 	return i + (512 - t);
 }
 
-static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset);
+static struct dcache_class tarfs_dcache = { .name = "tarfs" };
 
-#ifndef strncat
-static char * strncat(char *dest, const char *src, size_t n) {
-	char * end = dest;
-	while (*end != '\0') {
-		++end;
-	}
-	size_t i = 0;
-	while (*src && i < n) {
-		*end = *src;
-		end++;
-		src++;
-		i++;
-	}
-	*end = '\0';
-	return dest;
-}
-#endif
-
-static int count_slashes(char * string) {
-	int i = 0;
-	char * s = strstr(string, "/");
-	while (s) {
-		if (*(s+1) == '\0') return i;
-		i++;
-		s = strstr(s+1,"/");
-	}
-	return i;
-}
+static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
+static fs_node_t * file_from_entry(struct tarfs * self, struct tarfs_entry * entry);
+static struct tarfs_entry * tarfs_lookup(struct tarfs * self, const char * path);
+static void tarfs_index_all(struct tarfs * self);
 
-static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
+static struct dirent * readdir_tarfs(fs_node_t *node, unsigned long index) {
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
 		memset(out, 0x00, sizeof(struct dirent));
@@ -155,245 +179,110 @@ static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
 	index -= 2;
 
 	struct tarfs * self = node->device;
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
+	tarfs_index_all(self);
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	struct tarfs_entry * dir = (struct tarfs_entry *)node->inode;
+	if (index >= dir->child_count) return NULL;
 
-		char filename_workspace[256];
-
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (!count_slashes(filename_workspace)) {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0'; /* remove trailing slash */
-			if (strlen(filename_workspace)) {
-				if (index == 0) {
-					struct dirent * out = malloc(sizeof(struct dirent));
-					memset(out, 0x00, sizeof(struct dirent));
-					out->d_ino = offset;
-					strcpy(out->d_name, filename_workspace);
-					free(file);
-					return out;
-				} else {
-					index--;
-				}
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-
-	}
-
-	free(file);
-	return NULL;
+	struct tarfs_entry * entry = dir->children[index];
+	struct dirent * out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
+	out->d_ino = entry->offset;
+	strcpy(out->d_name, entry->name);
+	return out;
 }
 
 static ssize_t read_tarfs(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
 	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-	size_t file_size = interpret_size(file);
+	struct tarfs_entry * entry = (struct tarfs_entry *)node->inode;
 
-	if ((size_t)offset > file_size) return 0;
-	if (offset + size > file_size) {
-		size = file_size - offset;
+	if ((size_t)offset > entry->size) return 0;
+	if (offset + size > entry->size) {
+		size = entry->size - offset;
 	}
 
-	free(file);
-
-	return read_fs(self->device, offset + node->inode + 512, size, buffer);
+	return read_fs(self->device, offset + entry->data, size, buffer);
 }
 
-static struct dirent * readdir_tarfs(fs_node_t *node, unsigned long index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, ".");
-		return out;
-	}
-
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, "..");
-		return out;
-	}
-
-	index -= 2;
-
-	struct tarfs * self = node->device;
-
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = node->inode;
-
-	/* Read myself */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	int status = ustar_from_offset(self, node->inode, file);
-	char my_filename[256];
-
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	while (offset < self->length) {
-		ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (startswith(filename_workspace, my_filename)) {
-			if (!count_slashes(filename_workspace + strlen(my_filename))) {
-				if (strlen(filename_workspace + strlen(my_filename))) {
-					if (index == 0) {
-						char * slash = strstr(filename_workspace+strlen(my_filename),"/");
-						if (slash) *slash = '\0'; /* remove trailing slash */
-						struct dirent * out = malloc(sizeof(struct dirent));
-						memset(out, 0x00, sizeof(struct dirent));
-						out->d_ino = offset;
-						strcpy(out->d_name, filename_workspace+strlen(my_filename));
-						free(file);
-						return out;
-					} else {
-						index--;
-					}
-				}
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+/**
+ * @brief Build "dir/name" from a directory's path and @p len bytes of @p name.
+ */
+static char * tarfs_join(const char * dir, const char * name, size_t len) {
+	size_t dir_len = strlen(dir);
+	char * out = malloc(dir_len + len + 2);
+	char * o = out;
+	if (dir_len) {
+		memcpy(o, dir, dir_len);
+		o += dir_len;
+		*o++ = '/';
 	}
-
-	free(file);
-	return NULL;
+	memcpy(o, name, len);
+	o[len] = '\0';
+	return out;
 }
 
 static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
+	struct tarfs_entry * dir = (struct tarfs_entry *)node->inode;
 
-	/* find my own filename */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-
-	char my_filename[256];
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	/* Append name */
-	strncat(my_filename, name, strlen(name));
-	if (strlen(my_filename) > 255) {
-		printf("tarfs: critical: what?");
-	}
-
-	unsigned int offset = node->inode;
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (filename_workspace[strlen(filename_workspace)-1] == '/') {
-			filename_workspace[strlen(filename_workspace)-1] = '\0';
-		}
-		if (!strcmp(filename_workspace, my_filename)) {
-			return file_from_ustar(self, file, offset);
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
+	char * path = tarfs_join(dir->path, name, strlen(name));
+	struct tarfs_entry * entry = tarfs_lookup(self, path);
+	free(path);
 
-	free(file);
-	return NULL;
+	if (!entry) return NULL;
+	return file_from_entry(self, entry);
 }
 
 static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
-	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
+	struct tarfs_entry * entry = (struct tarfs_entry *)node->inode;
+	size_t len = strlen(entry->link);
 
-	if (size < strlen(file->link) + 1) {
-		//debug_print(INFO, "Requested read size was only %d, need %d.", size, strlen(file->link)+1);
-		memcpy(buf, file->link, size-1);
+	if (size < len + 1) {
+		memcpy(buf, entry->link, size-1);
 		buf[size-1] = '\0';
-		free(file);
 		return size-1;
 	} else {
-		//debug_print(INFO, "Reading link target is [%s]", file->link);
-		memcpy(buf, file->link, strlen(file->link) + 1);
-		free(file);
-		return strlen(file->link);
+		memcpy(buf, entry->link, len + 1);
+		return len;
 	}
-
 }
 
 static int create_ret_rofs(fs_node_t *parent, char *name, mode_t permission) {
 	return -EROFS;
 }
 
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
-	fs_node_t * fs = malloc(sizeof(fs_node_t));
+static fs_node_t * file_from_entry(struct tarfs * self, struct tarfs_entry * entry) {
+	fs_node_t * fs = vfs_alloc_node();
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
-	fs->inode  = offset;
+	fs->inode  = (uintptr_t)entry;
 	fs->impl   = 0;
-	char filename_workspace[256];
-	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
-
-	fs->uid = interpret_uid(file);
-	fs->gid = interpret_gid(file);
-	fs->length = interpret_size(file);
-	fs->mask = interpret_mode(file);
+	size_t len = strlen(entry->name);
+	if (len > 255) len = 255;
+	memcpy(fs->name, entry->name, len);
+	fs->name[len] = '\0';
+
+	fs->uid = entry->uid;
+	fs->gid = entry->gid;
+	fs->length = entry->size;
+	fs->mask = entry->mode;
 	fs->nlink = 0; /* Unsupported */
 	fs->flags = FS_FILE;
-	if (file->type[0] == '5') {
+	if (entry->type == '5') {
 		fs->flags = FS_DIRECTORY;
 		fs->readdir = readdir_tarfs;
 		fs->finddir = finddir_tarfs;
+		fs->dcache  = &tarfs_dcache;
 		fs->create  = create_ret_rofs;
-	} else if (file->type[0] == '1') {
-		//debug_print(ERROR, "Hardlink detected");
-		/* go through file and find target, reassign inode to point to that */
-	} else if (file->type[0] == '2') {
+	} else if (entry->type == '1') {
+		/* Hardlink whose target was not in the archive */
+	} else if (entry->type == '2') {
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
 		fs->flags = FS_FILE;
 		fs->read = read_tarfs;
 	}
-	free(file);
 #if 0
 	/* TODO times are also available from the file */
 	fs->atime = now();
@@ -403,52 +292,227 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 	return fs;
 }
 
-static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
-	struct tarfs * self = node->device;
+static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
+	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
+	if (out->ustar[0] != 'u' ||
+		out->ustar[1] != 's' ||
+		out->ustar[2] != 't' ||
+		out->ustar[3] != 'a' ||
+		out->ustar[4] != 'r') {
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @brief Tidy up an archive path in place.
+ *
+ * Drops empty and "." components, so "./usr//bin/" becomes "usr/bin".
+ *
+ * @returns the length of the result.
+ */
+static size_t tarfs_normalize(char * path) {
+	char * out = path;
+	char * in = path;
+	while (*in) {
+		char * end = strchrnul(in, '/');
+		size_t len = end - in;
+		if (len && !(len == 1 && *in == '.')) {
+			if (out != path) *out++ = '/';
+			memmove(out, in, len);
+			out += len;
+		}
+		in = *end ? end + 1 : end;
+	}
+	*out = '\0';
+	return out - path;
+}
+
+/**
+ * @brief Find the entry for a path, creating it and any missing parents.
+ *
+ * New entries start out as header-less directories; the caller
+ * fills them in if it has a header for them.
+ */
+static struct tarfs_entry * tarfs_get_entry(struct tarfs * self, const char * path, size_t len) {
+	char * full = tarfs_join("", path, len);
+	struct tarfs_entry * entry = hashmap_get(self->index, full);
+	if (entry) {
+		free(full);
+		return entry;
+	}
+
+	size_t parent_len = len;
+	while (parent_len && path[parent_len-1] != '/') parent_len--;
+	struct tarfs_entry * parent = parent_len ? tarfs_get_entry(self, path, parent_len - 1) : self->root;
+
+	entry = calloc(1, sizeof(struct tarfs_entry));
+	entry->path   = full;
+	entry->name   = full + parent_len;
+	entry->offset = TARFS_NO_HEADER;
+	entry->type   = '5';
+	entry->mode   = 0555;
+	hashmap_set(self->index, full, entry);
+
+	if (parent->child_count == parent->child_space) {
+		parent->child_space = parent->child_space ? parent->child_space * 2 : 8;
+		parent->children = realloc(parent->children, sizeof(struct tarfs_entry *) * parent->child_space);
+	}
+	parent->children[parent->child_count++] = entry;
+	self->entries++;
+
+	return entry;
+}
+
+static char * tarfs_read_string(struct tarfs * self, unsigned int offset, unsigned int size) {
+	char * out = malloc(size + 1);
+	read_fs(self->device, offset, size, (uint8_t *)out);
+	out[size] = '\0';
+	return out;
+}
+
+static char * tarfs_field(const char * field, size_t len) {
+	char * out = malloc(len + 1);
+	size_t i = 0;
+	while (i < len && field[i]) {
+		out[i] = field[i];
+		i++;
+	}
+	out[i] = '\0';
+	return out;
+}
+
+/**
+ * @brief Index the next header in the archive.
+ *
+ * GNU long name and long link records are applied to the header
+ * that follows them; pax headers are skipped. Hardlinks always
+ * name a file earlier in the archive, so they can be pointed at
+ * its contents straight away.
+ *
+ * Called with the index lock held.
+ *
+ * @returns 0 once the end of the archive has been reached.
+ */
+static int tarfs_index_next(struct tarfs * self) {
+	if (self->complete) return 0;
 
-	unsigned int offset = 0;
 	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
+	unsigned int offset = self->scan_offset;
 
-		if (!status) {
+	if (offset >= self->length || !ustar_from_offset(self, offset, file)) {
+		free(file);
+		free(self->long_name);
+		free(self->long_link);
+		self->long_name = NULL;
+		self->long_link = NULL;
+		self->complete = 1;
+		dprintf("tarfs: indexed %zu entries from %zu headers in %lu us\n",
+			self->entries, self->headers, self->scan_time / arch_cpu_mhz());
+		return 0;
+	}
+
+	unsigned int size = interpret_size(file);
+	self->headers++;
+	self->scan_offset = offset + 512 + round_to_512(size);
+
+	switch (file->type[0]) {
+		case 'L':
+			free(self->long_name);
+			self->long_name = tarfs_read_string(self, offset + 512, size);
 			free(file);
-			return NULL;
-		}
+			return 1;
+		case 'K':
+			free(self->long_link);
+			self->long_link = tarfs_read_string(self, offset + 512, size);
+			free(file);
+			return 1;
+		case 'x':
+		case 'g':
+			free(file);
+			return 1;
+	}
+
+	char * path;
+	if (self->long_name) {
+		path = self->long_name;
+		self->long_name = NULL;
+	} else {
+		char workspace[257];
+		size_t len = 0;
+		for (size_t i = 0; i < 155 && file->prefix[i]; ++i) workspace[len++] = file->prefix[i];
+		if (len) workspace[len++] = '/';
+		for (size_t i = 0; i < 100 && file->filename[i]; ++i) workspace[len++] = file->filename[i];
+		workspace[len] = '\0';
+		path = strdup(workspace);
+	}
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (count_slashes(filename_workspace)) {
-			/* skip */
-		} else {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0';
-			if (!strcmp(filename_workspace, name)) {
-				return file_from_ustar(self, file, offset);
+	size_t len = tarfs_normalize(path);
+	if (len) {
+		struct tarfs_entry * entry = tarfs_get_entry(self, path, len);
+		/* If a path appears twice, the first one wins */
+		if (entry->offset == TARFS_NO_HEADER) {
+			entry->data   = offset + 512;
+			entry->size   = size;
+			entry->mode   = interpret_mode(file);
+			entry->uid    = interpret_uid(file);
+			entry->gid    = interpret_gid(file);
+			entry->type   = file->type[0];
+			if (entry->type == '1' || entry->type == '2') {
+				entry->link = self->long_link ? self->long_link : tarfs_field(file->link, 100);
+				self->long_link = NULL;
 			}
+			if (entry->type == '1') {
+				size_t target_len = tarfs_normalize(entry->link);
+				char * target_path = tarfs_join("", entry->link, target_len);
+				struct tarfs_entry * target = hashmap_get(self->index, target_path);
+				free(target_path);
+				if (target && target->type != '1' && target->type != '5') {
+					entry->type = target->type;
+					entry->data = target->data;
+					entry->size = target->size;
+				}
+			}
+			/* Last, as this is what marks the entry as filled in */
+			entry->offset = offset;
 		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
 	}
 
+	free(path);
+	free(self->long_link);
+	self->long_link = NULL;
 	free(file);
-	return NULL;
+	return 1;
 }
 
-static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
-	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
-	if (out->ustar[0] != 'u' ||
-		out->ustar[1] != 's' ||
-		out->ustar[2] != 't' ||
-		out->ustar[3] != 'a' ||
-		out->ustar[4] != 'r') {
-		return 0;
+/**
+ * @brief Find an entry by its full path, indexing as far as needed.
+ */
+static struct tarfs_entry * tarfs_lookup(struct tarfs * self, const char * path) {
+	if (self->complete) return hashmap_get(self->index, path);
+
+	mutex_acquire(self->index_lock);
+	uint64_t before = arch_perf_timer();
+
+	/* Parent directories can be seen before their own headers, if they have any */
+	struct tarfs_entry * entry = hashmap_get(self->index, path);
+	while ((!entry || entry->offset == TARFS_NO_HEADER) && tarfs_index_next(self)) {
+		entry = hashmap_get(self->index, path);
 	}
-	return 1;
+
+	self->scan_time += arch_perf_timer() - before;
+	mutex_release(self->index_lock);
+	return entry;
+}
+
+static void tarfs_index_all(struct tarfs * self) {
+	if (self->complete) return;
+
+	mutex_acquire(self->index_lock);
+	uint64_t before = arch_perf_timer();
+	while (tarfs_index_next(self));
+	self->scan_time += arch_perf_timer() - before;
+	mutex_release(self->index_lock);
 }
 
 static fs_node_t * tar_mount(const char * device, const char * mount_path) {
@@ -475,6 +539,26 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 
 	self->device = dev;
 	self->length = dev->length;
+	self->entries = 0;
+	self->index_lock = mutex_init("tarfs index");
+	self->complete = 0;
+	self->scan_offset = 0;
+	self->long_name = NULL;
+	self->long_link = NULL;
+	self->headers = 0;
+	self->scan_time = 0;
+
+	self->root = calloc(1, sizeof(struct tarfs_entry));
+	self->root->path = strdup("");
+	self->root->name = self->root->path;
+	self->root->type = '5';
+	self->root->mode = 0555;
+
+	/* Headers are at least 512 bytes apart, but most files are a good deal bigger */
+	unsigned int buckets = self->length / 4096;
+	if (buckets < 64) buckets = 64;
+	if (buckets > 65536) buckets = 65536;
+	self->index = hashmap_create(buckets);
 
 	fs_node_t * root = malloc(sizeof(fs_node_t));
 	memset(root, 0, sizeof(fs_node_t));
@@ -483,8 +567,10 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->gid     = 0;
 	root->length  = 0;
 	root->mask    = 0555;
-	root->readdir = readdir_tar_root;
-	root->finddir = finddir_tar_root;
+	root->inode   = (uintptr_t)self->root;
+	root->readdir = readdir_tarfs;
+	root->finddir = finddir_tarfs;
+	root->dcache  = &tarfs_dcache;
 	root->create  = create_ret_rofs;
 	root->flags   = FS_DIRECTORY;
 	root->device  = self;
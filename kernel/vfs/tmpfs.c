@@ -23,15 +23,22 @@
 #include <kernel/mmu.h>
 #include <kernel/time.h>
 #include <kernel/procfs.h>
+#include <kernel/hashmap.h>
 
 /* 4KB */
 #define BLOCKSIZE 0x1000
 
+/* Largest run of pages allocated for a file at once (256KB) */
+#define TMPFS_EXTENT_MAX 64
+
+#define TMPFS_MIN_BUCKETS 16
+
 #define TMPFS_TYPE_FILE 1
 #define TMPFS_TYPE_DIR  2
 #define TMPFS_TYPE_LINK 3
 
 static volatile intptr_t tmpfs_total_blocks = 0;
+static struct dcache_class tmpfs_dcache = { .name = "tmpfs" };
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d);
 
@@ -40,33 +47,131 @@ static struct tmpfs_file * tmpfs_file_new(char * name) {
 	spin_init(t->lock);
 	t->name = strdup(name);
 	t->type = TMPFS_TYPE_FILE;
+	t->hash_next = NULL;
+	t->slot = 0;
 	t->length = 0;
-	t->pointers = 2;
 	t->block_count = 0;
+	t->extent_count = 0;
+	t->extent_space = 0;
+	t->extents = NULL;
 	t->mask = 0;
 	t->uid = 0;
 	t->gid = 0;
 	t->atime = now();
 	t->mtime = t->atime;
 	t->ctime = t->atime;
-	t->blocks = malloc(t->pointers * sizeof(char *));
-	for (size_t i = 0; i < t->pointers; ++i) {
-		t->blocks[i] = 0;
-	}
 
 	return t;
 }
 
+static inline size_t tmpfs_bucket(struct tmpfs_dir * d, const char * name) {
+	return hashmap_string_hash(name) & (d->bucket_count - 1);
+}
+
+/**
+ * @brief Find an entry in a directory by name.
+ *
+ * Called with the directory locked.
+ */
+static struct tmpfs_file * tmpfs_dir_lookup(struct tmpfs_dir * d, const char * name) {
+	if (!d->entries) return NULL;
+	for (struct tmpfs_file * t = d->buckets[tmpfs_bucket(d, name)]; t; t = t->hash_next) {
+		if (!strcmp(name, t->name)) return t;
+	}
+	return NULL;
+}
+
+static void tmpfs_dir_rehash(struct tmpfs_dir * d, size_t count) {
+	free(d->buckets);
+	d->buckets = calloc(count, sizeof(struct tmpfs_file *));
+	d->bucket_count = count;
+	for (size_t i = 0; i < d->slot_count; ++i) {
+		struct tmpfs_file * t = d->slots[i];
+		if (!t) continue;
+		size_t b = tmpfs_bucket(d, t->name);
+		t->hash_next = d->buckets[b];
+		d->buckets[b] = t;
+	}
+}
+
+/**
+ * @brief Squeeze out the holes left by removed entries.
+ *
+ * Entries keep their relative order, so readdir indices are unchanged;
+ * only the saved cursor has to be forgotten.
+ */
+static void tmpfs_dir_compact(struct tmpfs_dir * d) {
+	size_t out = 0;
+	for (size_t i = 0; i < d->slot_count; ++i) {
+		if (!d->slots[i]) continue;
+		d->slots[out] = d->slots[i];
+		d->slots[out]->slot = out;
+		out++;
+	}
+	d->slot_count = out;
+	d->cursor_index = 0;
+	d->cursor_slot = 0;
+}
+
+/**
+ * @brief Add an entry to the end of a directory.
+ *
+ * Called with the directory locked.
+ */
+static void tmpfs_dir_insert(struct tmpfs_dir * d, struct tmpfs_file * t) {
+	if (d->slot_count == d->slot_space) {
+		if (d->entries < d->slot_count / 2) {
+			tmpfs_dir_compact(d);
+		} else {
+			d->slot_space = d->slot_space ? d->slot_space * 2 : 8;
+			d->slots = realloc(d->slots, sizeof(struct tmpfs_file *) * d->slot_space);
+		}
+	}
+
+	t->slot = d->slot_count;
+	d->slots[d->slot_count++] = t;
+	d->entries++;
+
+	if (d->entries > d->bucket_count) {
+		tmpfs_dir_rehash(d, d->bucket_count ? d->bucket_count * 2 : TMPFS_MIN_BUCKETS);
+	} else {
+		size_t b = tmpfs_bucket(d, t->name);
+		t->hash_next = d->buckets[b];
+		d->buckets[b] = t;
+	}
+}
+
+/**
+ * @brief Take an entry out of a directory.
+ *
+ * Called with the directory locked.
+ */
+static void tmpfs_dir_remove(struct tmpfs_dir * d, struct tmpfs_file * t) {
+	struct tmpfs_file ** link = &d->buckets[tmpfs_bucket(d, t->name)];
+	while (*link != t) link = &(*link)->hash_next;
+	*link = t->hash_next;
+	t->hash_next = NULL;
+
+	d->slots[t->slot] = NULL;
+	d->entries--;
+
+	/* Everything after this entry moves up one place in the listing */
+	if (t->slot < d->cursor_slot) d->cursor_index--;
+
+	if (!d->entries) {
+		d->slot_count = 0;
+		d->cursor_index = 0;
+		d->cursor_slot = 0;
+	}
+}
+
 static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->inode;
 
 	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
-		}
+	if (tmpfs_dir_lookup(d, name)) {
+		spin_unlock(d->lock);
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(d->lock);
 
@@ -81,7 +186,7 @@ static int symlink_tmpfs(fs_node_t * parent, char * target, char * name) {
 	t->gid = this_core->current_process->user;
 
 	spin_lock(d->lock);
-	list_insert(d->files, t);
+	tmpfs_dir_insert(d, t);
 	spin_unlock(d->lock);
 
 	return 0;
@@ -124,52 +229,154 @@ static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent)
 	d->atime = now();
 	d->mtime = d->atime;
 	d->ctime = d->atime;
-	d->files = list_create("tmpfs directory entries",d);
 	return d;
 }
 
+/**
+ * @brief Release every page of a file from block @p keep onwards.
+ */
+static void tmpfs_file_release(struct tmpfs_file * t, size_t keep) {
+	while (t->extent_count) {
+		struct tmpfs_extent * e = &t->extents[t->extent_count - 1];
+		if (e->block + e->count <= keep) break;
+		size_t first = e->block < keep ? keep - e->block : 0;
+		for (size_t i = first; i < e->count; ++i) {
+			mmu_frame_release((e->frame + i) << 12);
+			tmpfs_total_blocks--;
+		}
+		if (first) {
+			e->count = first;
+			break;
+		}
+		t->extent_count--;
+	}
+	if (keep < t->block_count) t->block_count = keep;
+}
+
 static void tmpfs_file_free(struct tmpfs_file * t) {
 	spin_lock(t->lock);
 	if (t->type == TMPFS_TYPE_LINK) {
 		/* free target string */
 		free(t->target);
 	}
-	for (size_t i = 0; i < t->block_count; ++i) {
-		mmu_frame_release((uintptr_t)t->blocks[i] * 0x1000);
-		tmpfs_total_blocks--;
-	}
+	tmpfs_file_release(t, 0);
+	free(t->extents);
+	t->extents = NULL;
+	t->extent_space = 0;
 	spin_unlock(t->lock);
 }
 
-static void tmpfs_file_blocks_embiggen(struct tmpfs_file * t) {
-	t->pointers *= 2;
-	t->blocks = realloc(t->blocks, sizeof(char *) * t->pointers);
+/**
+ * @brief Append a run of @p count pages starting at @p frame to a file.
+ *
+ * Runs that happen to follow on from the last extent extend it.
+ */
+static void tmpfs_file_add_run(struct tmpfs_file * t, uintptr_t frame, size_t count) {
+	struct tmpfs_extent * last = t->extent_count ? &t->extents[t->extent_count - 1] : NULL;
+	if (last && last->frame + last->count == frame) {
+		last->count += count;
+	} else {
+		if (t->extent_count == t->extent_space) {
+			t->extent_space = t->extent_space ? t->extent_space * 2 : 4;
+			t->extents = realloc(t->extents, sizeof(struct tmpfs_extent) * t->extent_space);
+		}
+		t->extents[t->extent_count].block = t->block_count;
+		t->extents[t->extent_count].frame = frame;
+		t->extents[t->extent_count].count = count;
+		t->extent_count++;
+	}
+	t->block_count += count;
+	tmpfs_total_blocks += count;
 }
 
-static char * tmpfs_file_getset_block(struct tmpfs_file * t, size_t blockid, int create) {
-	if (create) {
-		while (blockid >= t->pointers) {
-			tmpfs_file_blocks_embiggen(t);
-		}
-		while (blockid >= t->block_count) {
-			uintptr_t index = mmu_allocate_a_frame();
-			tmpfs_total_blocks++;
-			if (create == 2) {
-				memset((char*)mmu_map_from_physical(index << 12), 0, BLOCKSIZE);
+/**
+ * @brief Make sure blocks up to and including @p blockid have pages.
+ *
+ * Pages are taken in physically contiguous runs of up to
+ * TMPFS_EXTENT_MAX, halving the run size when memory is too
+ * fragmented for it. Growing files also allocate a quarter of
+ * their current size ahead, so streams of small appends still
+ * end up in large extents. Pages past the end of the file are
+ * not cleared here; see tmpfs_file_copy.
+ */
+static void tmpfs_file_grow(struct tmpfs_file * t, size_t blockid) {
+	if (blockid < t->block_count) return;
+
+	size_t want = blockid + 1 - t->block_count;
+	size_t ahead = t->block_count / 4;
+	if (ahead > TMPFS_EXTENT_MAX) ahead = TMPFS_EXTENT_MAX;
+	if (want < ahead) want = ahead;
+
+	while (want) {
+		size_t n = want < TMPFS_EXTENT_MAX ? want : TMPFS_EXTENT_MAX;
+		uintptr_t frame;
+		for (;;) {
+			if (n == 1) {
+				frame = mmu_allocate_a_frame();
+				break;
 			}
-			t->blocks[t->block_count] = index;
-			t->block_count += 1;
-		}
-	} else {
-		if (blockid >= t->block_count) {
-			printf("tmpfs: not enough blocks?\n");
-			return NULL;
+			frame = mmu_try_allocate_n_frames(n);
+			if (frame != (uintptr_t)-1) break;
+			n /= 2;
 		}
+		tmpfs_file_add_run(t, frame, n);
+		want -= n;
 	}
+}
 
-	return (char *)mmu_map_from_physical(t->blocks[blockid] << 12);
+static struct tmpfs_extent * tmpfs_file_find_extent(struct tmpfs_file * t, size_t blockid) {
+	size_t lo = 0, hi = t->extent_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		struct tmpfs_extent * e = &t->extents[mid];
+		if (blockid < e->block) {
+			hi = mid;
+		} else if (blockid >= e->block + e->count) {
+			lo = mid + 1;
+		} else {
+			return e;
+		}
+	}
+	return NULL;
 }
 
+/**
+ * @brief Copy between @p buffer and an already-allocated range of a file.
+ *
+ * Each extent is one contiguous piece of the physical map, so this
+ * is a single memcpy per extent. A NULL @p buffer when writing
+ * clears the range instead, which is how bytes between the old end
+ * of a file and its new one are zeroed when it grows.
+ */
+static void tmpfs_file_copy(struct tmpfs_file * t, uint64_t offset, size_t size, uint8_t * buffer, int write) {
+	if (!size) return;
+
+	struct tmpfs_extent * e = tmpfs_file_find_extent(t, offset / BLOCKSIZE);
+	if (!e) {
+		printf("tmpfs: not enough blocks?\n");
+		return;
+	}
+
+	while (size) {
+		uint64_t within = offset - e->block * BLOCKSIZE;
+		size_t count = e->count * BLOCKSIZE - within;
+		if (count > size) count = size;
+
+		uint8_t * data = (uint8_t *)mmu_map_from_physical(e->frame << 12) + within;
+		if (!write) {
+			memcpy(buffer, data, count);
+		} else if (buffer) {
+			memcpy(data, buffer, count);
+		} else {
+			memset(data, 0, count);
+		}
+
+		if (buffer) buffer += count;
+		offset += count;
+		size -= count;
+		e++;
+	}
+}
 
 static ssize_t read_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct tmpfs_file * t = (struct tmpfs_file *)(node->inode);
@@ -178,44 +385,19 @@ static ssize_t read_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 
 	t->atime = now();
 
-	uint64_t end;
-	if ((size_t)offset + size > t->length) {
-		end = t->length;
-	} else {
-		end = offset + size;
-	}
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block && (size_t)offset == end) {
+	if ((size_t)offset >= t->length) {
 		spin_unlock(t->lock);
 		return 0;
 	}
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 0);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), size_to_read);
-		spin_unlock(t->lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer, (uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), BLOCKSIZE - (offset % BLOCKSIZE));
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 0);
-				memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, BLOCKSIZE);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 0);
-			memcpy(buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), buf, end_size);
-		}
+
+	if ((size_t)offset + size > t->length) {
+		size = t->length - offset;
 	}
+
+	tmpfs_file_copy(t, offset, size, buffer, 0);
+
 	spin_unlock(t->lock);
-	return size_to_read;
+	return size;
 }
 
 static ssize_t write_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -225,39 +407,27 @@ static ssize_t write_tmpfs(fs_node_t *node, off_t offset, size_t size, uint8_t *
 	t->atime = now();
 	t->mtime = t->atime;
 
-	uint64_t end;
-	if ((size_t)offset + size > t->length) {
-		t->length = offset + size;
-	}
-	end = offset + size;
-	uint64_t start_block  = offset / BLOCKSIZE;
-	uint64_t end_block    = end / BLOCKSIZE;
-	uint64_t end_size     = end - end_block * BLOCKSIZE;
-	uint64_t size_to_read = end - offset;
-	if (start_block == end_block) {
-		void *buf = tmpfs_file_getset_block(t, start_block, 1);
-		memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, size_to_read);
+	if (!size) {
 		spin_unlock(t->lock);
-		return size_to_read;
-	} else {
-		uint64_t block_offset;
-		uint64_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy((uint8_t *)(((uint64_t)buf) + ((uintptr_t)offset % BLOCKSIZE)), buffer, BLOCKSIZE - (offset % BLOCKSIZE));
-			} else {
-				void *buf = tmpfs_file_getset_block(t, block_offset, 1);
-				memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), BLOCKSIZE);
-			}
-		}
-		if (end_size) {
-			void *buf = tmpfs_file_getset_block(t, end_block, 1);
-			memcpy(buf, buffer + BLOCKSIZE * blocks_read - (offset % BLOCKSIZE), end_size);
-		}
+		return 0;
 	}
+
+	uint64_t end = offset + size;
+	tmpfs_file_grow(t, (end - 1) / BLOCKSIZE);
+
+	/* Writing past the end leaves a gap that should read back as zeroes */
+	if ((size_t)offset > t->length) {
+		tmpfs_file_copy(t, t->length, offset - t->length, NULL, 1);
+	}
+
+	tmpfs_file_copy(t, offset, size, buffer, 1);
+
+	if (end > t->length) {
+		t->length = end;
+	}
+
 	spin_unlock(t->lock);
-	return size_to_read;
+	return size;
 }
 
 static int chmod_tmpfs(fs_node_t * node, int mode) {
@@ -286,49 +456,15 @@ static int truncate_tmpfs(fs_node_t * node, size_t size) {
 
 	if (size == t->length) goto _exit_truncate;
 
-	uint64_t old_end_block = (t->length / BLOCKSIZE);
-	uint64_t old_end_size  = t->length - old_end_block * BLOCKSIZE;
-	uint64_t old_blocks = old_end_block + !!old_end_size;
-	uint64_t new_end_block = (size / BLOCKSIZE);
-	uint64_t new_end_size  = size - new_end_block * BLOCKSIZE;
-	uint64_t new_blocks = new_end_block + !!new_end_size;
-
-
 	/* Is the target size bigger or smaller? */
 	if (size > t->length) {
-		if (old_end_block == new_end_block) {
-			char *buf = tmpfs_file_getset_block(t, old_end_block, 0);
-			memset(buf + old_end_size, 0, new_end_size - old_end_size);
-		} else {
-			tmpfs_file_getset_block(t, new_end_block, 2);
-			char *buf = tmpfs_file_getset_block(t, old_end_block, 0);
-			memset(buf + old_end_size, 0, BLOCKSIZE - old_end_size);
-		}
+		tmpfs_file_grow(t, (size - 1) / BLOCKSIZE);
+		tmpfs_file_copy(t, t->length, size - t->length, NULL, 1);
 		t->length = size;
 		goto _exit_truncate;
 	}
 
-	if (size == 0) {
-		for (size_t i = 0; i < t->block_count; ++i) {
-			mmu_frame_release((uintptr_t)t->blocks[i] * 0x1000);
-			tmpfs_total_blocks--;
-			t->blocks[i] = 0;
-		}
-		t->block_count = 0;
-		t->length = 0;
-		goto _exit_truncate;
-	}
-
-	/* Size is less than current but > 0 */
-	if (new_blocks < old_blocks) {
-		for (uint64_t i = new_blocks; i < old_blocks; ++i) {
-			mmu_frame_release((uintptr_t)t->blocks[i] * 0x1000);
-			tmpfs_total_blocks--;
-			t->blocks[i] = 0;
-		}
-		t->block_count = new_blocks;
-	}
-
+	tmpfs_file_release(t, (size + BLOCKSIZE - 1) / BLOCKSIZE);
 	t->length = size;
 
 _exit_truncate:
@@ -344,7 +480,7 @@ static void open_tmpfs(fs_node_t * node, unsigned int flags) {
 }
 
 static fs_node_t * tmpfs_from_file(struct tmpfs_file * t) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_alloc_node();
 	spin_lock(t->lock);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	strcpy(fnode->name, t->name);
@@ -388,7 +524,6 @@ static fs_node_t * tmpfs_from_link(struct tmpfs_file * t) {
 
 static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->inode;
-	uint64_t i = 0;
 
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
@@ -408,20 +543,40 @@ static struct dirent * readdir_tmpfs(fs_node_t *node, uint64_t index) {
 
 	index -= 2;
 
-	if (index >= d->files->length) return NULL;
+	spin_lock(d->lock);
+
+	if (index >= d->entries) {
+		spin_unlock(d->lock);
+		return NULL;
+	}
+
+	/*
+	 * Listings ask for each index in turn, so pick up from where the
+	 * last call stopped; only a step backwards starts from the top.
+	 */
+	if (index < d->cursor_index) {
+		d->cursor_index = 0;
+		d->cursor_slot = 0;
+	}
 
-	foreach(f, d->files) {
+	uint64_t i = d->cursor_index;
+	for (size_t slot = d->cursor_slot; slot < d->slot_count; ++slot) {
+		struct tmpfs_file * t = d->slots[slot];
+		if (!t) continue;
 		if (i == index) {
-			struct tmpfs_file * t = (struct tmpfs_file *)f->value;
+			d->cursor_index = i + 1;
+			d->cursor_slot = slot + 1;
 			struct dirent * out = malloc(sizeof(struct dirent));
 			memset(out, 0x00, sizeof(struct dirent));
 			out->d_ino = (uint64_t)t;
 			strcpy(out->d_name, t->name);
+			spin_unlock(d->lock);
 			return out;
-		} else {
-			++i;
 		}
+		++i;
 	}
+
+	spin_unlock(d->lock);
 	return NULL;
 }
 
@@ -432,72 +587,63 @@ static fs_node_t * finddir_tmpfs(fs_node_t * node, char * name) {
 
 	spin_lock(d->lock);
 
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			fs_node_t * out = NULL;
-			switch (t->type) {
-				case TMPFS_TYPE_FILE:
-					out = tmpfs_from_file(t);
-					break;
-				case TMPFS_TYPE_LINK:
-					out = tmpfs_from_link(t);
-					break;
-				case TMPFS_TYPE_DIR:
-					out = tmpfs_from_dir((struct tmpfs_dir *)t);
-					break;
-			}
-			spin_unlock(d->lock);
-			return out;
+	struct tmpfs_file * t = tmpfs_dir_lookup(d, name);
+	fs_node_t * out = NULL;
+	if (t) {
+		switch (t->type) {
+			case TMPFS_TYPE_FILE:
+				out = tmpfs_from_file(t);
+				break;
+			case TMPFS_TYPE_LINK:
+				out = tmpfs_from_link(t);
+				break;
+			case TMPFS_TYPE_DIR:
+				out = tmpfs_from_dir((struct tmpfs_dir *)t);
+				break;
 		}
 	}
 
 	spin_unlock(d->lock);
-	return NULL;
+	return out;
 }
 
 
 static int try_free_dir(struct tmpfs_dir * d) {
 	spin_lock(d->lock);
-	if (d->files && d->files->length != 0) {
+	if (d->entries != 0) {
 		spin_unlock(d->lock);
 		return 1;
 	}
-	free(d->files);
+	free(d->slots);
+	free(d->buckets);
+	d->slots = NULL;
+	d->buckets = NULL;
 	spin_unlock(d->lock);
 	return 0;
 }
 
 static int unlink_tmpfs(fs_node_t * node, char * name) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)node->inode;
-	int i = -1, j = 0;
 
 	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			if (t->type == TMPFS_TYPE_DIR) {
-				if (try_free_dir((void*)t)) {
-					spin_unlock(d->lock);
-					return -ENOTEMPTY;
-				}
-			} else {
-				tmpfs_file_free(t);
-			}
-			free(t);
-			i = j;
-			break;
-		}
-		j++;
+	struct tmpfs_file * t = tmpfs_dir_lookup(d, name);
+	if (!t) {
+		spin_unlock(d->lock);
+		return -ENOENT;
 	}
 
-	if (i >= 0) {
-		list_remove(d->files, i);
+	if (t->type == TMPFS_TYPE_DIR) {
+		if (try_free_dir((void*)t)) {
+			spin_unlock(d->lock);
+			return -ENOTEMPTY;
+		}
 	} else {
-		spin_unlock(d->lock);
-		return -ENOENT;
+		tmpfs_file_free(t);
 	}
 
+	tmpfs_dir_remove(d, t);
+	free(t);
+
 	spin_unlock(d->lock);
 	return 0;
 }
@@ -508,12 +654,9 @@ static int create_tmpfs(fs_node_t *parent, char *name, mode_t permission) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->inode;
 
 	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
-		}
+	if (tmpfs_dir_lookup(d, name)) {
+		spin_unlock(d->lock);
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(d->lock);
 
@@ -524,7 +667,7 @@ static int create_tmpfs(fs_node_t *parent, char *name, mode_t permission) {
 	t->gid = this_core->current_process->user_group;
 
 	spin_lock(d->lock);
-	list_insert(d->files, t);
+	tmpfs_dir_insert(d, t);
 	spin_unlock(d->lock);
 
 	return 0;
@@ -537,12 +680,9 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, mode_t permission) {
 	struct tmpfs_dir * d = (struct tmpfs_dir *)parent->inode;
 
 	spin_lock(d->lock);
-	foreach(f, d->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!strcmp(name, t->name)) {
-			spin_unlock(d->lock);
-			return -EEXIST; /* Already exists */
-		}
+	if (tmpfs_dir_lookup(d, name)) {
+		spin_unlock(d->lock);
+		return -EEXIST; /* Already exists */
 	}
 	spin_unlock(d->lock);
 
@@ -557,23 +697,12 @@ static int mkdir_tmpfs(fs_node_t * parent, char * name, mode_t permission) {
 	out->gid  = this_core->current_process->user;
 
 	spin_lock(d->lock);
-	list_insert(d->files, out);
+	tmpfs_dir_insert(d, (struct tmpfs_file *)out);
 	spin_unlock(d->lock);
 
 	return 0;
 }
 
-static int path_comp(const char * a, const char * b) {
-	while (*a && *b && *a != '/' && *b != '/') {
-		if (*a != *b) return 1;
-		a++;
-		b++;
-	}
-
-	if ((*a == '/' || !*a) && (*b == '/' || !*b)) return 0;
-	return 1;
-}
-
 static int endswith(const char * str, char ch) {
 	size_t len = strlen(str);
 	if (len > 1 && str[len-1] == ch) return 1;
@@ -594,6 +723,10 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 	/* src_dir and dest_dir are definitely from us, no worries there */
 	int ret = 0;
 
+	/* Names may carry trailing slashes; entries are looked up without them */
+	char * src_part  = path_dup(src_name);
+	char * dest_part = path_dup(dest_name);
+
 	struct tmpfs_dir * root = (struct tmpfs_dir*)mount_root->inode;
 	spin_lock(root->nest_lock);
 
@@ -601,16 +734,7 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 	spin_lock(ds->lock);
 
 	/* First, get the source file */
-	struct tmpfs_file * src_file = NULL;
-	node_t * src_node = NULL;
-	foreach(f, ds->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!path_comp(src_name, t->name)) {
-			src_file = t;
-			src_node = f;
-			break;
-		}
-	}
+	struct tmpfs_file * src_file = tmpfs_dir_lookup(ds, src_part);
 
 	if (!src_file) {
 		ret = -ENOENT;
@@ -626,16 +750,7 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 	struct tmpfs_dir * dd = (struct tmpfs_dir *)dest_dir->inode;
 	if (dd != ds) spin_lock(dd->lock);
 
-	struct tmpfs_file * dest_file = NULL;
-	node_t * dest_node = NULL;
-	foreach(f, dd->files) {
-		struct tmpfs_file * t = (struct tmpfs_file *)f->value;
-		if (!path_comp(dest_name, t->name)) {
-			dest_file = t;
-			dest_node = f;
-			break;
-		}
-	}
+	struct tmpfs_file * dest_file = tmpfs_dir_lookup(dd, dest_part);
 
 	if (dest_file && dest_file->type != TMPFS_TYPE_DIR && endswith(dest_name, '/')) {
 		/* Destination ended with trailing slashes, but was not a directory. */
@@ -661,18 +776,13 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 			ret = -ENOTDIR;
 			goto _cleanup;
 		}
-		char * old_name = src_file->name;
-		src_file->name = path_dup(dest_name);
-		free(old_name);
-
-		list_insert(dd->files, src_file);
-		list_delete(ds->files, src_node);
 	} else if (src_file == dest_file) {
 		/* Do nothing */
+		goto _cleanup;
 	} else {
 		if (dest_file->type == TMPFS_TYPE_DIR) {
 			struct tmpfs_dir * dest = (struct tmpfs_dir*)dest_file;
-			if (dest->files && dest->files->length) {
+			if (dest->entries) {
 				/* Destination is not empty */
 				ret = -ENOTEMPTY;
 				goto _cleanup;
@@ -688,15 +798,8 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 			goto _cleanup;
 		}
 
-		/* Rename src */
-		char * old_name = src_file->name;
-		src_file->name = path_dup(dest_name);
-		free(old_name);
-
-		list_delete(ds->files, src_node);
-		dest_node->value = src_file;
-
 		/* Unlink the original destination file */
+		tmpfs_dir_remove(dd, dest_file);
 		if (dest_file->type == TMPFS_TYPE_DIR) {
 			try_free_dir((void*)dest_file);
 		} else {
@@ -704,16 +807,29 @@ static int rename_tmpfs(fs_node_t * mount_root, fs_node_t * src_dir, const char
 		}
 	}
 
+	/* Rename src; its hash changes with its name, so it comes out first */
+	tmpfs_dir_remove(ds, src_file);
+	free(src_file->name);
+	src_file->name = dest_part;
+	dest_part = NULL;
+	tmpfs_dir_insert(dd, src_file);
+
+	if (src_file->type == TMPFS_TYPE_DIR) {
+		((struct tmpfs_dir *)src_file)->parent = dd;
+	}
+
 _cleanup:
 	if (dd != ds) spin_unlock(dd->lock);
 _cleanup_src:
 	spin_unlock(ds->lock);
 	spin_unlock(root->nest_lock);
+	free(src_part);
+	free(dest_part);
 	return ret;
 }
 
 static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	fs_node_t * fnode = vfs_alloc_node();
 	spin_lock(d->lock);
 	memset(fnode, 0x00, sizeof(fs_node_t));
 	fnode->inode = 0;
@@ -734,6 +850,7 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	fnode->close   = NULL;
 	fnode->readdir = readdir_tmpfs;
 	fnode->finddir = finddir_tmpfs;
+	fnode->dcache  = &tmpfs_dcache;
 	fnode->create  = create_tmpfs;
 	fnode->unlink  = unlink_tmpfs;
 	fnode->mkdir   = mkdir_tmpfs;
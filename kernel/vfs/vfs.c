@@ -29,6 +29,7 @@
 #include <kernel/hashmap.h>
 #include <kernel/tree.h>
 #include <kernel/spinlock.h>
+#include <kernel/slab.h>
 
 #define MAX_SYMLINK_DEPTH 8
 #define MAX_SYMLINK_SIZE 4096
@@ -38,6 +39,296 @@ fs_node_t * fs_root = NULL; /* Pointer to the root mount fs_node (must be some f
 
 hashmap_t * fs_types = NULL;
 
+static slab_cache_t * fs_node_cache = NULL;
+
+/**
+ * @brief Allocate a file system node.
+ *
+ * File nodes are created and released for every path lookup, so they
+ * come from a dedicated object cache. The result is uninitialized and
+ * can be released with @c free or @c close_fs like any other node.
+ */
+fs_node_t * vfs_alloc_node(void) {
+	if (!fs_node_cache) return malloc(sizeof(fs_node_t));
+	return slab_alloc(fs_node_cache);
+}
+
+/*
+ * Directory entry cache.
+ *
+ * Remembers what finddir returned for a name in a directory, including
+ * names that were not there, for directories that ask for it by setting
+ * their dcache class. Entries are found by parent and name, and positive
+ * entries also by the node they hold, so that changes to a file can drop
+ * its cached copy. Nodes handed out are always fresh copies.
+ */
+#define DCACHE_BUCKETS 1024
+#define DCACHE_LIMIT   4096
+
+struct dcache_entry {
+	struct dcache_entry * next;        /* Same parent and name bucket */
+	struct dcache_entry * node_next;   /* Same node bucket */
+	struct dcache_entry * lru_prev;
+	struct dcache_entry * lru_next;
+	struct dcache_class * class;
+	void * device;
+	uint64_t parent;
+	finddir_type_t finddir;            /* Tells apart roots that share an inode number with a directory */
+	fs_node_t * node;                  /* NULL if the name does not exist */
+	char name[];
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dcache_entry * dcache_hash[DCACHE_BUCKETS];
+static struct dcache_entry * dcache_by_node[DCACHE_BUCKETS];
+static struct dcache_entry * dcache_head = NULL; /* Most recently used */
+static struct dcache_entry * dcache_tail = NULL;
+static struct dcache_class * dcache_class_list = NULL;
+static size_t dcache_count = 0;
+static uint64_t dcache_generation = 0;
+
+static unsigned int dcache_bucket(struct dcache_class * class, void * device, uint64_t parent, const char * name) {
+	uint64_t hash = 14695981039346656037UL ^ (uintptr_t)class ^ ((uintptr_t)device << 7) ^ (parent << 17);
+	while (*name) {
+		hash = (hash ^ (unsigned char)*name++) * 1099511628211UL;
+	}
+	return (hash ^ (hash >> 32)) % DCACHE_BUCKETS;
+}
+
+static unsigned int dcache_node_bucket(void * device, uint64_t inode) {
+	uint64_t hash = ((uintptr_t)device >> 4) ^ inode ^ (inode >> 29);
+	return hash % DCACHE_BUCKETS;
+}
+
+static int dcache_key_matches(struct dcache_entry * e, fs_node_t * parent, const char * name) {
+	return e->class == parent->dcache && e->device == parent->device && e->parent == parent->inode &&
+		e->finddir == parent->finddir && !strcmp(e->name, name);
+}
+
+static void dcache_lru_unlink(struct dcache_entry * e) {
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else dcache_head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else dcache_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
+
+static void dcache_lru_push(struct dcache_entry * e) {
+	e->lru_next = dcache_head;
+	if (dcache_head) dcache_head->lru_prev = e;
+	dcache_head = e;
+	if (!dcache_tail) dcache_tail = e;
+}
+
+/**
+ * @brief Take an entry out of the cache.
+ *
+ * Called with the lock held; returns the entry for the caller to free
+ * once the lock is released.
+ */
+static struct dcache_entry * dcache_unlink(struct dcache_entry * e) {
+	struct dcache_entry ** link = &dcache_hash[dcache_bucket(e->class, e->device, e->parent, e->name)];
+	while (*link != e) link = &(*link)->next;
+	*link = e->next;
+
+	if (e->node) {
+		link = &dcache_by_node[dcache_node_bucket(e->node->device, e->node->inode)];
+		while (*link != e) link = &(*link)->node_next;
+		*link = e->node_next;
+	}
+
+	dcache_lru_unlink(e);
+	dcache_count--;
+	dcache_generation++;
+	e->next = NULL;
+	return e;
+}
+
+static void dcache_free(struct dcache_entry * list) {
+	while (list) {
+		struct dcache_entry * next = list->next;
+		if (list->node) free(list->node);
+		free(list);
+		list = next;
+	}
+}
+
+/**
+ * @brief Look a name up in the cache.
+ *
+ * @param found Set if the name was in the cache
+ * @returns A copy of the cached node, or NULL if the cache says the name doesn't exist.
+ */
+static fs_node_t * dcache_lookup(fs_node_t * parent, const char * name, int * found) {
+	*found = 0;
+	spin_lock(dcache_lock);
+	struct dcache_entry * e = dcache_hash[dcache_bucket(parent->dcache, parent->device, parent->inode, name)];
+	for (; e; e = e->next) {
+		if (dcache_key_matches(e, parent, name)) break;
+	}
+	if (!e) {
+		parent->dcache->misses++;
+		spin_unlock(dcache_lock);
+		return NULL;
+	}
+
+	*found = 1;
+	dcache_lru_unlink(e);
+	dcache_lru_push(e);
+	if (!e->node) {
+		parent->dcache->negative_hits++;
+		spin_unlock(dcache_lock);
+		return NULL;
+	}
+	parent->dcache->hits++;
+
+	fs_node_t * out = vfs_alloc_node();
+	memcpy(out, e->node, sizeof(fs_node_t));
+	spin_unlock(dcache_lock);
+	out->refcount = 0;
+	return out;
+}
+
+/**
+ * @brief Remember the result of a finddir.
+ *
+ * @param generation dcache_generation from before the finddir; if anything
+ *                   was invalidated since, the result may already be stale.
+ */
+static void dcache_insert(fs_node_t * parent, const char * name, fs_node_t * node, uint64_t generation) {
+	struct dcache_entry * e = malloc(sizeof(struct dcache_entry) + strlen(name) + 1);
+	memset(e, 0, sizeof(struct dcache_entry));
+	e->class = parent->dcache;
+	e->device = parent->device;
+	e->parent = parent->inode;
+	e->finddir = parent->finddir;
+	strcpy(e->name, name);
+	if (node) {
+		e->node = vfs_alloc_node();
+		memcpy(e->node, node, sizeof(fs_node_t));
+		e->node->refcount = 0;
+	}
+
+	struct dcache_entry * evicted = NULL;
+	spin_lock(dcache_lock);
+	if (generation != dcache_generation) {
+		spin_unlock(dcache_lock);
+		dcache_free(e);
+		return;
+	}
+
+	for (struct dcache_entry * other = dcache_hash[dcache_bucket(e->class, e->device, e->parent, name)]; other; other = other->next) {
+		if (dcache_key_matches(other, parent, name)) {
+			spin_unlock(dcache_lock);
+			dcache_free(e);
+			return;
+		}
+	}
+
+	if (!e->class->next && dcache_class_list != e->class) {
+		e->class->next = dcache_class_list;
+		dcache_class_list = e->class;
+	}
+
+	unsigned int bucket = dcache_bucket(e->class, e->device, e->parent, name);
+	e->next = dcache_hash[bucket];
+	dcache_hash[bucket] = e;
+	if (e->node) {
+		bucket = dcache_node_bucket(e->node->device, e->node->inode);
+		e->node_next = dcache_by_node[bucket];
+		dcache_by_node[bucket] = e;
+	}
+	dcache_lru_push(e);
+	dcache_count++;
+
+	while (dcache_count > DCACHE_LIMIT) {
+		struct dcache_entry * victim = dcache_unlink(dcache_tail);
+		victim->next = evicted;
+		evicted = victim;
+	}
+	spin_unlock(dcache_lock);
+
+	dcache_free(evicted);
+}
+
+/**
+ * @brief Forget what the cache knows about a name in a directory.
+ */
+static void dcache_forget(fs_node_t * parent, const char * name) {
+	if (!parent->dcache) return;
+	struct dcache_entry * e;
+	spin_lock(dcache_lock);
+	for (e = dcache_hash[dcache_bucket(parent->dcache, parent->device, parent->inode, name)]; e; e = e->next) {
+		if (dcache_key_matches(e, parent, name)) {
+			dcache_unlink(e);
+			break;
+		}
+	}
+	dcache_generation++;
+	spin_unlock(dcache_lock);
+	dcache_free(e);
+}
+
+/**
+ * @brief Forget cached copies of a node whose attributes changed.
+ */
+static void dcache_forget_node(fs_node_t * node) {
+	struct dcache_entry * list = NULL;
+	spin_lock(dcache_lock);
+	if (!dcache_count) {
+		spin_unlock(dcache_lock);
+		return;
+	}
+	struct dcache_entry * e = dcache_by_node[dcache_node_bucket(node->device, node->inode)];
+	while (e) {
+		struct dcache_entry * next = e->node_next;
+		if (e->node->device == node->device && e->node->inode == node->inode) {
+			dcache_unlink(e);
+			e->next = list;
+			list = e;
+		}
+		e = next;
+	}
+	dcache_generation++;
+	spin_unlock(dcache_lock);
+	dcache_free(list);
+}
+
+/**
+ * @brief Forget everything cached for the filesystem @p dir is on, or for all of them if it is NULL.
+ *
+ * For changes that can take whole directories away with them.
+ */
+static void dcache_flush(fs_node_t * dir) {
+	struct dcache_entry * list = NULL;
+	spin_lock(dcache_lock);
+	struct dcache_entry * e = dcache_head;
+	while (e) {
+		struct dcache_entry * next = e->lru_next;
+		if (!dir || (e->class == dir->dcache && e->device == dir->device)) {
+			dcache_unlink(e);
+			e->next = list;
+			list = e;
+		}
+		e = next;
+	}
+	dcache_generation++;
+	spin_unlock(dcache_lock);
+	dcache_free(list);
+}
+
+/**
+ * @brief Filesystems that have used the directory entry cache, for procfs.
+ */
+struct dcache_class * dcache_classes(void) {
+	return dcache_class_list;
+}
+
+size_t dcache_entries(void) {
+	return dcache_count;
+}
+
 #define MIN(l,r) ((l) < (r) ? (l) : (r))
 #define MAX(l,r) ((l) > (r) ? (l) : (r))
 
@@ -196,7 +487,13 @@ ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->write) {
-		return node->write(node, offset, size, buffer);
+		ssize_t out = node->write(node, offset, size, buffer);
+		/* Any write changes the mtime, if not the length, of cached copies of the node. */
+		if (out > 0 && (node->flags & FS_FILE)) {
+			if ((uint64_t)offset + out > node->length) node->length = offset + out;
+			dcache_forget_node(node);
+		}
+		return out;
 	} else {
 		if (node->flags & FS_DIRECTORY) return -EISDIR;
 		return -EROFS;
@@ -212,7 +509,12 @@ int truncate_fs(fs_node_t * node, size_t size) {
 	if (!node) return -ENOENT;
 
 	if (node->truncate) {
-		return node->truncate(node, size);
+		int out = node->truncate(node, size);
+		if (!out) {
+			node->length = size;
+			dcache_forget_node(node);
+		}
+		return out;
 	}
 
 	return -EINVAL;
@@ -285,7 +587,9 @@ void close_fs(fs_node_t *node) {
  */
 int chmod_fs(fs_node_t *node, mode_t mode) {
 	if (node->chmod) {
-		return node->chmod(node, mode);
+		int out = node->chmod(node, mode);
+		dcache_forget_node(node);
+		return out;
 	}
 	return 0;
 }
@@ -295,7 +599,9 @@ int chmod_fs(fs_node_t *node, mode_t mode) {
  */
 int chown_fs(fs_node_t *node, uid_t uid, gid_t gid) {
 	if (node->chown) {
-		return node->chown(node, uid, gid);
+		int out = node->chown(node, uid, gid);
+		dcache_forget_node(node);
+		return out;
 	}
 	return 0;
 }
@@ -328,7 +634,19 @@ fs_node_t *finddir_fs(fs_node_t *node, char *name) {
 	if (!node) return NULL;
 
 	if ((node->flags & FS_DIRECTORY) && node->finddir) {
-		return node->finddir(node, name);
+		if (!node->dcache) return node->finddir(node, name);
+
+		int found;
+		fs_node_t * out = dcache_lookup(node, name, &found);
+		if (found) return out;
+
+		spin_lock(dcache_lock);
+		uint64_t generation = dcache_generation;
+		spin_unlock(dcache_lock);
+
+		out = node->finddir(node, name);
+		dcache_insert(node, name, out, generation);
+		return out;
 	} else {
 		debug_print(WARNING, "Node passed to finddir_fs isn't a directory!");
 		debug_print(WARNING, "node = %p, name = %s", (void*)node, name);
@@ -406,6 +724,8 @@ int rename_file_fs(const char * src, const char * dest) {
 	if (*src_name == '/' || *dest_name == '/') return -EINVAL;
 
 	out = src_parent->mount->rename(src_parent->mount, src_parent, src_name, dest_parent, dest_name);
+	/* Whole directories may have moved. */
+	dcache_flush(src_parent);
 
 _nope:
 	close_fs(dest_parent);
@@ -463,6 +783,8 @@ int create_file_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->create) {
 		ret = parent->create(parent, f_path, permission);
+		dcache_forget(parent, f_path);
+		dcache_forget_node(parent);
 	} else {
 		ret = -EINVAL;
 	}
@@ -512,7 +834,19 @@ int unlink_fs(char * name) {
 
 	int ret = 0;
 	if (parent->unlink) {
+		/* If it's a directory, everything cached under it goes with it, so look before it's gone. */
+		int was_dir = 0;
+		if (parent->dcache) {
+			fs_node_t * victim = finddir_fs(parent, f_path);
+			if (victim) {
+				was_dir = !!(victim->flags & FS_DIRECTORY);
+				free(victim);
+			}
+		}
 		ret = parent->unlink(parent, f_path);
+		dcache_forget(parent, f_path);
+		if (was_dir && !ret) dcache_flush(parent);
+		dcache_forget_node(parent);
 	} else {
 		ret = -EINVAL;
 	}
@@ -567,6 +901,8 @@ int mkdir_fs(char *name, mode_t permission) {
 	int ret = 0;
 	if (parent->mkdir) {
 		ret = parent->mkdir(parent, f_path, permission);
+		dcache_forget(parent, f_path);
+		dcache_forget_node(parent);
 	} else {
 		ret = -EROFS;
 	}
@@ -626,6 +962,8 @@ int symlink_fs(char * target, char * name) {
 	int ret = 0;
 	if (parent->symlink) {
 		ret = parent->symlink(parent, target, f_path);
+		dcache_forget(parent, f_path);
+		dcache_forget_node(parent);
 	} else {
 		ret = -EINVAL;
 	}
@@ -765,6 +1103,8 @@ char *canonicalize_path(const char *cwd, const char *input) {
 }
 
 void vfs_install(void) {
+	fs_node_cache = slab_create("fs_node_t", sizeof(fs_node_t), SLAB_ALIGN_CACHE, NULL);
+
 	/* Initialize the mountpoint tree */
 	fs_tree = tree_create();
 
@@ -836,6 +1176,7 @@ void * vfs_mount(const char * path, fs_node_t * local_root, const char * type, c
 	spin_lock(tmp_vfs_lock);
 
 	local_root->refcount = -1;
+	dcache_flush(NULL);
 
 	tree_node_t * ret_val = NULL;
 
@@ -1006,7 +1347,7 @@ fs_node_t *get_mount_point(char * path, unsigned int path_depth, char **outpath,
 	*outdepth = _tree_depth;
 
 	if (last) {
-		fs_node_t * last_clone = malloc(sizeof(fs_node_t));
+		fs_node_t * last_clone = vfs_alloc_node();
 		memcpy(last_clone, last, sizeof(fs_node_t));
 		last_clone->refcount = 0;
 		return last_clone;
@@ -1030,7 +1371,7 @@ fs_node_t *kopen_recur(const char *filename, uint64_t flags, uint64_t symlink_de
 	/* If strlen(path) == 1, then path = "/"; return root */
 	if (path_len == 1) {
 		/* Clone the root file system node */
-		fs_node_t *root_clone = malloc(sizeof(fs_node_t));
+		fs_node_t *root_clone = vfs_alloc_node();
 		memcpy(root_clone, fs_root, sizeof(fs_node_t));
 		root_clone->refcount = 0;
 
@@ -0,0 +1,26 @@
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+DEFN_SYSCALL1(mmap, SYS_MMAP, struct mmap_args *);
+DEFN_SYSCALL2(munmap, SYS_MUNMAP, void *, size_t);
+DEFN_SYSCALL3(mprotect, SYS_MPROTECT, void *, size_t, int);
+
+void * mmap(void * addr, size_t length, int prot, int flags, int fd, off_t offset) {
+	struct mmap_args args = { addr, length, prot, flags, fd, offset };
+	long ret = syscall_mmap(&args);
+	if (ret < 0 && ret > -4096) {
+		errno = -ret;
+		return MAP_FAILED;
+	}
+	return (void *)ret;
+}
+
+int munmap(void * addr, size_t length) {
+	__sets_errno(syscall_munmap(addr, length));
+}
+
+int mprotect(void * addr, size_t length, int prot) {
+	__sets_errno(syscall_mprotect(addr, length, prot));
+}
@@ -3,19 +3,40 @@
  * @file modules/ahci.c
  * @package x86_64
  *
- * @warning This is a stub driver.
+ * Drives SATA hard disks attached to an AHCI controller. Each port
+ * gets a command list, a FIS receive area and a command table per
+ * slot. When the drive and the controller support Native Command
+ * Queuing, reads and writes are issued as FPDMA QUEUED commands with
+ * as many in flight as the drive allows; otherwise they still use
+ * every slot the controller has, and the drive takes them in turn.
+ *
+ * Disks show up as /dev/sda, /dev/sdb, ... and can be mounted like
+ * any other block device. ATAPI devices are detected, but not yet
+ * supported.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
- * Copyright (C) 2021 K. Lange
+ * Copyright (C) 2021-2026 K. Lange
  */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
 #include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
 #include <kernel/pci.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/mutex.h>
+#include <kernel/time.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
 
 static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
 	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
@@ -36,6 +57,33 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 	return buf;
 }
 
+/* HBA registers */
+#define AHCI_CAP   0x00
+#define AHCI_GHC   0x04
+#define AHCI_IS    0x08
+#define AHCI_PI    0x0C
+#define AHCI_VS    0x10
+
+#define AHCI_CAP_SNCQ (1UL << 30)
+#define AHCI_CAP_S64A (1UL << 31)
+#define AHCI_GHC_IE   (1UL << 1)
+#define AHCI_GHC_AE   (1UL << 31)
+
+/* Port registers, relative to 0x100 + port * 0x80 */
+#define AHCI_PXCLB  0x00
+#define AHCI_PXCLBU 0x04
+#define AHCI_PXFB   0x08
+#define AHCI_PXFBU  0x0C
+#define AHCI_PXIS   0x10
+#define AHCI_PXIE   0x14
+#define AHCI_PXCMD  0x18
+#define AHCI_PXTFD  0x20
+#define AHCI_PXSIG  0x24
+#define AHCI_PXSSTS 0x28
+#define AHCI_PXSERR 0x30
+#define AHCI_PXSACT 0x34
+#define AHCI_PXCI   0x38
+
 #define AHCI_PXCMD_ST    (1 << 0UL)
 #define AHCI_PXCMD_SUD   (1 << 1UL)
 #define AHCI_PXCMD_POD   (1 << 2UL)
@@ -45,6 +93,484 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 #define AHCI_PXCMD_FR    (1 << 14UL)
 #define AHCI_PXCMD_CR    (1 << 15UL)
 
+#define AHCI_PXIS_TFES   (1UL << 30)
+#define AHCI_PXIS_ERRORS 0x78000000 /* TFES, HBFS, HBDS, IFS */
+#define AHCI_PXIE_ALL    (AHCI_PXIS_ERRORS | 0x0F) /* Errors, D2H, PIO setup, DMA setup, set device bits */
+
+#define AHCI_TFD_BSY 0x80
+#define AHCI_TFD_DRQ 0x08
+#define AHCI_TFD_ERR 0x01
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA        0x60
+#define ATA_CMD_WRITE_FPDMA       0x61
+#define ATA_CMD_CACHE_FLUSH_EXT   0xEA
+#define ATA_CMD_IDENTIFY          0xEC
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define AHCI_SECTOR_SIZE  512
+#define AHCI_MAX_SECTORS  256 /* Per command; 128 KiB */
+#define AHCI_PRDT_ENTRIES (AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE / 0x1000 + 1)
+#define AHCI_TABLE_SIZE   0x400 /* Command FIS and friends, then the PRDT, rounded up */
+#define AHCI_BOUNCE_SIZE  (AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE)
+#define AHCI_POLL_TIMEOUT 5000 /* ms */
+
+struct ahci_cmd_header {
+	uint16_t flags;   /* FIS length in dwords, write, prefetch, ... */
+	uint16_t prdtl;   /* PRDT entries */
+	volatile uint32_t prdbc; /* Bytes transferred */
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc;     /* Byte count - 1, bit 31 = interrupt on completion */
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[AHCI_PRDT_ENTRIES];
+} __attribute__((packed));
+
+struct ahci_request {
+	struct ahci_port * port;
+	uint8_t command;
+	uint64_t lba;
+	size_t sectors;
+	int write;
+	uint8_t * buffer;
+	volatile int done;
+	int error;
+};
+
+struct ahci_port {
+	uintptr_t regs;
+	uint32_t pcidev;
+	int index;
+	int ncq;
+	int s64a;            /* The controller can reach memory above 4 GiB */
+	int slots;           /* Commands we let the port have in flight */
+	uint64_t sectors;
+	uint16_t identity[256];
+
+	struct ahci_cmd_header * cmd_list;
+	uintptr_t cmd_list_phys;
+	uintptr_t fis_phys;
+	uint8_t * tables;
+	uintptr_t tables_phys;
+
+	/* Without s64a, a bounce buffer below 4 GiB for when the heap's is out of reach */
+	uint8_t * bounce;
+	uintptr_t bounce_phys;
+	sched_mutex_t * bounce_lock;
+
+	spin_lock_t lock;
+	uint32_t busy;       /* Slots with a command issued */
+	int exclusive;       /* A non-queued command must run alone */
+	int draining;        /* Commands waiting for the port to go idle */
+	struct ahci_request * active[32];
+	list_t * waiters;
+};
+
+struct ahci_hba {
+	uint32_t pcidev;
+	uintptr_t mmio;
+	int irq;
+	struct ahci_port * ports[32];
+};
+
+static list_t * ahci_controllers = NULL;
+static char ahci_drive_char = 'a';
+
+static void * ahci_alloc_dma(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames((size + 0xFFF) / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static uintptr_t ahci_phys(void * addr) {
+	return mmu_map_to_physical(mmu_get_kernel_directory(), (uintptr_t)addr);
+}
+
+static uint64_t ahci_now_ms(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return s * 1000 + ss / 1000;
+}
+
+/**
+ * @brief Fill in the command table of a slot for a request.
+ */
+static void ahci_build_command(struct ahci_port * port, int slot, struct ahci_request * req) {
+	struct ahci_cmd_header * header = &port->cmd_list[slot];
+	struct ahci_cmd_table * table = (struct ahci_cmd_table *)(port->tables + slot * AHCI_TABLE_SIZE);
+	memset(table, 0, sizeof(struct ahci_cmd_table));
+
+	/* One PRD per page of the buffer; it need not be physically contiguous. */
+	size_t n = 0;
+	if (req->buffer) {
+		uintptr_t addr = (uintptr_t)req->buffer;
+		size_t left = req->command == ATA_CMD_IDENTIFY ? 512 : req->sectors * AHCI_SECTOR_SIZE;
+		while (left) {
+			size_t chunk = 0x1000 - (addr & 0xFFF);
+			if (chunk > left) chunk = left;
+			uintptr_t phys = ahci_phys((void *)addr);
+			table->prdt[n].dba = phys & 0xFFFFFFFF;
+			table->prdt[n].dbau = phys >> 32;
+			table->prdt[n].dbc = chunk - 1;
+			n++;
+			addr += chunk;
+			left -= chunk;
+		}
+	}
+
+	uint8_t * fis = table->cfis;
+	fis[0] = FIS_TYPE_REG_H2D;
+	fis[1] = 0x80; /* Command */
+	fis[2] = req->command;
+	fis[7] = 0x40; /* LBA mode */
+
+	if (req->command == ATA_CMD_READ_FPDMA || req->command == ATA_CMD_WRITE_FPDMA) {
+		/* Queued commands carry the count in the features registers and the tag in the count. */
+		fis[3]  = req->sectors & 0xFF;
+		fis[11] = (req->sectors >> 8) & 0xFF;
+		fis[12] = slot << 3;
+	} else {
+		fis[12] = req->sectors & 0xFF;
+		fis[13] = (req->sectors >> 8) & 0xFF;
+	}
+
+	if (req->command != ATA_CMD_IDENTIFY && req->command != ATA_CMD_CACHE_FLUSH_EXT) {
+		fis[4]  = (req->lba >>  0) & 0xFF;
+		fis[5]  = (req->lba >>  8) & 0xFF;
+		fis[6]  = (req->lba >> 16) & 0xFF;
+		fis[8]  = (req->lba >> 24) & 0xFF;
+		fis[9]  = (req->lba >> 32) & 0xFF;
+		fis[10] = (req->lba >> 40) & 0xFF;
+	}
+
+	header->flags = 5 | (req->write ? (1 << 6) : 0); /* 5 dword FIS */
+	header->prdtl = n;
+	header->prdbc = 0;
+}
+
+static int ahci_is_queued(struct ahci_request * req) {
+	return req->command == ATA_CMD_READ_FPDMA || req->command == ATA_CMD_WRITE_FPDMA;
+}
+
+/**
+ * @brief Does a request need the port to itself?
+ *
+ * Non-queued commands can't be mixed with queued ones. A cache flush
+ * only covers writes the drive has finished, and the controller is
+ * free to pick slots in any order, so it also waits for the writes
+ * already issued, whether or not they were queued.
+ */
+static int ahci_must_be_alone(struct ahci_port * port, struct ahci_request * req) {
+	if (ahci_is_queued(req)) return 0;
+	return port->ncq || req->command == ATA_CMD_CACHE_FLUSH_EXT;
+}
+
+/**
+ * @brief Issue a request in a free command slot, waiting for one if needed.
+ *
+ * Returns as soon as the command is issued; use @ref ahci_request_wait
+ * to wait for it to complete. Commands that must run alone wait for the
+ * port to go idle, hold back new commands while they do, and keep the
+ * port to themselves until they are done.
+ */
+static void ahci_request_submit(struct ahci_request * req) {
+	struct ahci_port * port = req->port;
+	int must_be_alone = ahci_must_be_alone(port, req);
+	int draining = 0;
+	req->done = 0;
+	req->error = 0;
+
+	spin_lock(port->lock);
+	while (1) {
+		uint32_t all = port->slots == 32 ? 0xFFFFFFFF : ((1U << port->slots) - 1);
+		if (!port->exclusive && (port->busy & all) != all &&
+			(must_be_alone ? !port->busy : !port->draining)) break;
+		if (must_be_alone && !draining) {
+			port->draining++;
+			draining = 1;
+		}
+		sleep_on_unlocking(port->waiters, &port->lock);
+		spin_lock(port->lock);
+	}
+	if (draining) port->draining--;
+
+	int slot = __builtin_ctz(~port->busy);
+	if (must_be_alone) port->exclusive = 1;
+	port->busy |= (1U << slot);
+	port->active[slot] = req;
+
+	ahci_build_command(port, slot, req);
+	asm volatile ("" ::: "memory");
+	if (ahci_is_queued(req)) mmio_write4(port->regs, AHCI_PXSACT, 1U << slot);
+	mmio_write4(port->regs, AHCI_PXCI, 1U << slot);
+	spin_unlock(port->lock);
+}
+
+static int ahci_request_wait(struct ahci_request * req) {
+	struct ahci_port * port = req->port;
+	spin_lock(port->lock);
+	while (!req->done) {
+		sleep_on_unlocking(port->waiters, &port->lock);
+		spin_lock(port->lock);
+	}
+	spin_unlock(port->lock);
+	return req->error;
+}
+
+static void ahci_port_stop(struct ahci_port * port) {
+	uint32_t cmd = mmio_read4(port->regs, AHCI_PXCMD);
+	mmio_write4(port->regs, AHCI_PXCMD, cmd & ~AHCI_PXCMD_ST);
+	while (mmio_read4(port->regs, AHCI_PXCMD) & AHCI_PXCMD_CR);
+	cmd = mmio_read4(port->regs, AHCI_PXCMD);
+	mmio_write4(port->regs, AHCI_PXCMD, cmd & ~AHCI_PXCMD_FRE);
+	while (mmio_read4(port->regs, AHCI_PXCMD) & AHCI_PXCMD_FR);
+}
+
+static void ahci_port_start(struct ahci_port * port) {
+	while (mmio_read4(port->regs, AHCI_PXTFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ));
+	mmio_write4(port->regs, AHCI_PXCMD, mmio_read4(port->regs, AHCI_PXCMD) | AHCI_PXCMD_FRE);
+	mmio_write4(port->regs, AHCI_PXCMD, mmio_read4(port->regs, AHCI_PXCMD) | AHCI_PXCMD_ST);
+}
+
+/**
+ * @brief Complete finished commands on a port. Called with the port lock held.
+ */
+static void ahci_port_complete(struct ahci_port * port) {
+	uint32_t status = mmio_read4(port->regs, AHCI_PXIS);
+	mmio_write4(port->regs, AHCI_PXIS, status);
+
+	uint32_t failed = 0;
+	if (status & AHCI_PXIS_ERRORS) {
+		/*
+		 * The port stops processing commands on errors, and which one
+		 * failed is hard to tell with several queued; fail them all and
+		 * restart the port.
+		 */
+		failed = port->busy;
+		ahci_port_stop(port);
+		mmio_write4(port->regs, AHCI_PXSERR, 0xFFFFFFFF);
+		mmio_write4(port->regs, AHCI_PXIS, 0xFFFFFFFF);
+		ahci_port_start(port);
+	}
+
+	uint32_t running = mmio_read4(port->regs, AHCI_PXSACT) | mmio_read4(port->regs, AHCI_PXCI);
+	uint32_t finished = (port->busy & ~running) | failed;
+
+	for (int slot = 0; slot < 32; ++slot) {
+		if (!(finished & (1U << slot))) continue;
+		struct ahci_request * req = port->active[slot];
+		port->active[slot] = NULL;
+		port->busy &= ~(1U << slot);
+		if (ahci_must_be_alone(port, req)) port->exclusive = 0;
+		req->error = !!(failed & (1U << slot));
+		req->done = 1;
+	}
+
+	if (finished) wakeup_queue(port->waiters);
+}
+
+static int ahci_irq_handler(struct regs *r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	foreach(node, ahci_controllers) {
+		struct ahci_hba * hba = node->value;
+		if (hba->irq != irq) continue;
+
+		uint32_t pending = mmio_read4(hba->mmio, AHCI_IS);
+		if (!pending) continue;
+
+		for (int i = 0; i < 32; ++i) {
+			if (!(pending & (1U << i))) continue;
+			struct ahci_port * port = hba->ports[i];
+			if (port) {
+				spin_lock(port->lock);
+				ahci_port_complete(port);
+				spin_unlock(port->lock);
+			} else {
+				mmio_write4(hba->mmio, 0x100 + i * 0x80 + AHCI_PXIS, 0xFFFFFFFF);
+			}
+		}
+
+		mmio_write4(hba->mmio, AHCI_IS, pending);
+		handled = 1;
+	}
+
+	if (handled) irq_ack(irq);
+	return handled;
+}
+
+/**
+ * @brief Can the controller transfer straight to or from this buffer?
+ *
+ * PRDs need an even address, and it must be kernel memory that stays mapped.
+ * Controllers without 64-bit addressing can only reach the low 4 GiB.
+ */
+static int ahci_dma_capable(struct ahci_port * port, uint8_t * buf, size_t size) {
+	uintptr_t addr = (uintptr_t)buf;
+	if (addr < KERNEL_HEAP_START || (addr & 1)) return 0;
+	if (port->s64a) return 1;
+	for (uintptr_t page = addr & ~0xFFFUL; page < addr + size; page += 0x1000) {
+		if (ahci_phys((void *)page) > 0xFFFFFFFFUL) return 0;
+	}
+	return 1;
+}
+
+static int ahci_sectors(struct ahci_port * port, uint64_t lba, size_t sectors, uint8_t * buf, int write) {
+	struct ahci_request req = {
+		.port = port,
+		.command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA) : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT),
+		.lba = lba, .sectors = sectors, .write = write, .buffer = buf,
+	};
+	ahci_request_submit(&req);
+	return ahci_request_wait(&req);
+}
+
+/**
+ * @brief Read or write a byte range of a disk.
+ *
+ * Sector-aligned transfers to kernel buffers are split into commands
+ * of at most @c AHCI_MAX_SECTORS that are all issued before waiting,
+ * so the drive can work on them together. Anything else goes through
+ * a bounce buffer a chunk at a time.
+ */
+static ssize_t ahci_transfer(struct ahci_port * port, off_t offset, size_t size, uint8_t * buffer, int write) {
+	uint64_t max = port->sectors * AHCI_SECTOR_SIZE;
+	if ((uint64_t)offset >= max) return 0;
+	if (offset + size > max) size = max - offset;
+	if (!size) return 0;
+
+	if (!(offset % AHCI_SECTOR_SIZE) && !(size % AHCI_SECTOR_SIZE) && ahci_dma_capable(port, buffer, size)) {
+		size_t chunk = AHCI_MAX_SECTORS * AHCI_SECTOR_SIZE;
+		size_t count = (size + chunk - 1) / chunk;
+		struct ahci_request * requests = calloc(count, sizeof(struct ahci_request));
+		for (size_t i = 0; i < count; ++i) {
+			size_t bytes = size - i * chunk < chunk ? size - i * chunk : chunk;
+			requests[i].port = port;
+			requests[i].command = port->ncq ? (write ? ATA_CMD_WRITE_FPDMA : ATA_CMD_READ_FPDMA) : (write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+			requests[i].lba = (offset + i * chunk) / AHCI_SECTOR_SIZE;
+			requests[i].sectors = bytes / AHCI_SECTOR_SIZE;
+			requests[i].write = write;
+			requests[i].buffer = buffer + i * chunk;
+			ahci_request_submit(&requests[i]);
+		}
+		int error = 0;
+		for (size_t i = 0; i < count; ++i) {
+			error |= ahci_request_wait(&requests[i]);
+		}
+		free(requests);
+		return error ? -EIO : (ssize_t)size;
+	}
+
+	size_t bounce_size = AHCI_BOUNCE_SIZE;
+	uint8_t * bounce = malloc(bounce_size);
+	int shared = !ahci_dma_capable(port, bounce, bounce_size);
+	if (shared) {
+		/* The heap gave us memory the controller can't reach; use the port's own. */
+		free(bounce);
+		mutex_acquire(port->bounce_lock);
+		bounce = port->bounce;
+	}
+	size_t done = 0;
+	while (done < size) {
+		uint64_t pos = offset + done;
+		uint64_t lba = pos / AHCI_SECTOR_SIZE;
+		size_t in_sector = pos % AHCI_SECTOR_SIZE;
+		size_t chunk = bounce_size - in_sector < size - done ? bounce_size - in_sector : size - done;
+		size_t sectors = (in_sector + chunk + AHCI_SECTOR_SIZE - 1) / AHCI_SECTOR_SIZE;
+
+		/* Partial sectors being written need the rest of their contents first. */
+		if (!write || in_sector || (in_sector + chunk) % AHCI_SECTOR_SIZE) {
+			if (ahci_sectors(port, lba, sectors, bounce, 0)) goto _error;
+		}
+
+		if (write) {
+			memcpy(bounce + in_sector, buffer + done, chunk);
+			if (ahci_sectors(port, lba, sectors, bounce, 1)) goto _error;
+		} else {
+			memcpy(buffer + done, bounce + in_sector, chunk);
+		}
+
+		done += chunk;
+	}
+	if (shared) mutex_release(port->bounce_lock);
+	else free(bounce);
+	return size;
+
+_error:
+	if (shared) mutex_release(port->bounce_lock);
+	else free(bounce);
+	return -EIO;
+}
+
+static ssize_t read_ahci(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	return ahci_transfer(node->device, offset, size, buffer, 0);
+}
+
+static ssize_t write_ahci(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	return ahci_transfer(node->device, offset, size, buffer, 1);
+}
+
+static void open_ahci(fs_node_t * node, unsigned int flags) {
+	return;
+}
+
+static void close_ahci(fs_node_t * node) {
+	return;
+}
+
+static int ioctl_ahci(fs_node_t * node, unsigned long request, void * argp) {
+	struct ahci_port * port = node->device;
+
+	switch (request) {
+		case IOCTLSYNC: {
+			struct ahci_request req = { .port = port, .command = ATA_CMD_CACHE_FLUSH_EXT };
+			ahci_request_submit(&req);
+			return ahci_request_wait(&req) ? -EIO : 0;
+		}
+
+		default:
+			return -EINVAL;
+	}
+}
+
+static fs_node_t * ahci_device_create(struct ahci_port * port) {
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, 10, "sd%c", ahci_drive_char);
+	fnode->device  = port;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = port->sectors * AHCI_SECTOR_SIZE;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_ahci;
+	fnode->write   = write_ahci;
+	fnode->open    = open_ahci;
+	fnode->close   = close_ahci;
+	fnode->readdir = NULL;
+	fnode->finddir = NULL;
+	fnode->ioctl   = ioctl_ahci;
+	return fnode;
+}
+
 #define DPRINT(fmt,...) fprintf(stderr, "%s: " fmt, ahci_device_name(pcidev,port), ##__VA_ARGS__)
 static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio_addr, int port) {
 	intptr_t offset = 0x100 + port * 0x80;
@@ -66,6 +592,95 @@ static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio
 	}
 }
 
+/**
+ * @brief Run a command by polling, before interrupts are enabled.
+ *
+ * Gives up on a drive that hasn't finished after @c AHCI_POLL_TIMEOUT;
+ * the caller stops the port, which takes the command back.
+ */
+static int ahci_poll_command(struct ahci_port * port, struct ahci_request * req) {
+	ahci_build_command(port, 0, req);
+	asm volatile ("" ::: "memory");
+	uint64_t deadline = ahci_now_ms() + AHCI_POLL_TIMEOUT;
+	mmio_write4(port->regs, AHCI_PXCI, 1);
+	while (mmio_read4(port->regs, AHCI_PXCI) & 1) {
+		if (mmio_read4(port->regs, AHCI_PXIS) & AHCI_PXIS_TFES) return 1;
+		if (ahci_now_ms() > deadline) return 1;
+	}
+	mmio_write4(port->regs, AHCI_PXIS, 0xFFFFFFFF);
+	return 0;
+}
+
+static struct ahci_port * ahci_setup_disk(fs_node_t * stderr, uint32_t pcidev, struct ahci_hba * hba, int port) {
+	uint32_t cap = mmio_read4(hba->mmio, AHCI_CAP);
+
+	struct ahci_port * p = calloc(1, sizeof(struct ahci_port));
+	p->regs = hba->mmio + 0x100 + port * 0x80;
+	p->pcidev = pcidev;
+	p->index = port;
+	p->s64a = !!(cap & AHCI_CAP_S64A);
+	p->waiters = list_create("ahci port waiters", NULL);
+
+	ahci_port_stop(p);
+
+	/* Command list, FIS receive area and one command table per slot */
+	p->cmd_list = ahci_alloc_dma(0x1000, &p->cmd_list_phys);
+	p->fis_phys = p->cmd_list_phys + 0x400;
+	p->tables = ahci_alloc_dma(32 * AHCI_TABLE_SIZE, &p->tables_phys);
+	for (int slot = 0; slot < 32; ++slot) {
+		uintptr_t table = p->tables_phys + slot * AHCI_TABLE_SIZE;
+		p->cmd_list[slot].ctba = table & 0xFFFFFFFF;
+		p->cmd_list[slot].ctbau = table >> 32;
+	}
+	if (!p->s64a) {
+		p->bounce = ahci_alloc_dma(AHCI_BOUNCE_SIZE, &p->bounce_phys);
+		p->bounce_lock = mutex_init("ahci bounce");
+		if (p->cmd_list_phys + 0x1000 > 0x100000000UL || p->tables_phys + 32 * AHCI_TABLE_SIZE > 0x100000000UL ||
+			p->bounce_phys + AHCI_BOUNCE_SIZE > 0x100000000UL) {
+			DPRINT("no memory below 4 GiB for a 32-bit controller\n");
+			return NULL;
+		}
+	}
+
+	mmio_write4(p->regs, AHCI_PXCLB, p->cmd_list_phys & 0xFFFFFFFF);
+	mmio_write4(p->regs, AHCI_PXCLBU, p->cmd_list_phys >> 32);
+	mmio_write4(p->regs, AHCI_PXFB, p->fis_phys & 0xFFFFFFFF);
+	mmio_write4(p->regs, AHCI_PXFBU, p->fis_phys >> 32);
+	mmio_write4(p->regs, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(p->regs, AHCI_PXIS, 0xFFFFFFFF);
+
+	ahci_port_start(p);
+
+	uint16_t * identity = p->s64a ? malloc(512) : (uint16_t *)p->bounce;
+	struct ahci_request req = { .port = p, .command = ATA_CMD_IDENTIFY, .buffer = (uint8_t *)identity };
+	if (ahci_poll_command(p, &req)) {
+		DPRINT("IDENTIFY failed\n");
+		if (p->s64a) free(identity);
+		ahci_port_stop(p);
+		return NULL;
+	}
+	memcpy(p->identity, identity, 512);
+	if (p->s64a) free(identity);
+
+	/* Words 100-103 hold the LBA48 sector count, 60-61 the LBA28 one */
+	p->sectors = (uint64_t)p->identity[100] | ((uint64_t)p->identity[101] << 16) |
+		((uint64_t)p->identity[102] << 32) | ((uint64_t)p->identity[103] << 48);
+	if (!p->sectors) p->sectors = (uint32_t)p->identity[60] | ((uint32_t)p->identity[61] << 16);
+
+	int controller_slots = ((cap >> 8) & 0x1F) + 1;
+	p->slots = controller_slots;
+	if ((cap & AHCI_CAP_SNCQ) && (p->identity[76] & (1 << 8))) {
+		int depth = (p->identity[75] & 0x1F) + 1;
+		p->ncq = 1;
+		if (depth < p->slots) p->slots = depth;
+	}
+
+	DPRINT("%zu MiB, %d slots%s\n", (size_t)(p->sectors / 2048), p->slots, p->ncq ? ", NCQ" : "");
+
+	mmio_write4(p->regs, AHCI_PXIE, AHCI_PXIE_ALL);
+	return p;
+}
+
 static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) != 0x0106) return; /* Mass Storage, SATA controller */
 	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x01) return; /* AHCI */
@@ -73,37 +688,41 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 
 	fprintf(stderr, "ahci: located device at %#x\n", device);
 
+	/* Enable bus mastering and MMIO, and make sure legacy interrupts are not disabled */
 	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
 	command_reg |= (1 << 2);
 	command_reg |= (1 << 1);
-	command_reg ^= (1 << 10);
+	command_reg &= ~(1 << 10);
 	pci_write_field(device, PCI_COMMAND, 2, command_reg);
 
-	fprintf(stderr, "ahci: examining PCI config space...\n");
 	fprintf(stderr, "ahci: interrupt line = %d\n", pci_get_interrupt(device));
 	fprintf(stderr, "ahci: BAR5 = %#x\n", pci_read_field(device, PCI_BAR5, 4));
 
-	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* I have no idea how much space this needs */
-	fprintf(stderr, "ahci: mapping mmio to %#zx\n", mmio_addr);
+	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* 0x100 + 32 ports * 0x80 */
 
-	uint32_t enabledPorts = mmio_read4(mmio_addr, 0x0C);
+	uint32_t enabledPorts = mmio_read4(mmio_addr, AHCI_PI);
 	fprintf(stderr, "ahci: implemented ports = %#x\n", enabledPorts);
 
-	uint32_t ahciVersion = mmio_read4(mmio_addr, 0x10);
+	uint32_t ahciVersion = mmio_read4(mmio_addr, AHCI_VS);
 	fprintf(stderr, "ahci: version %d.%d%d\n",
 		(ahciVersion >> 16) & 0xFFF,
 		(ahciVersion >> 8) & 0xFF,
 		(ahciVersion) & 0xFF);
 
 	fprintf(stderr, "ahci: Telling host controller we are aware of it.\n");
-	mmio_write4(mmio_addr, 0x04, mmio_read4(mmio_addr, 0x04) | (1 << 31UL));
+	mmio_write4(mmio_addr, AHCI_GHC, mmio_read4(mmio_addr, AHCI_GHC) | AHCI_GHC_AE);
+
+	struct ahci_hba * hba = calloc(1, sizeof(struct ahci_hba));
+	hba->pcidev = device;
+	hba->mmio = mmio_addr;
+	hba->irq = pci_get_interrupt(device);
 
 	int offset = 0x100;
 	for (int port = 0; port < 32; ++port) {
 		if (enabledPorts & (1UL << port)) {
 			/* Check status */
-			uint32_t portSig    = mmio_read4(mmio_addr, offset + 0x24);
-			uint32_t portStatus = mmio_read4(mmio_addr, offset + 0x28);
+			uint32_t portSig    = mmio_read4(mmio_addr, offset + AHCI_PXSIG);
+			uint32_t portStatus = mmio_read4(mmio_addr, offset + AHCI_PXSSTS);
 			fprintf(stderr, "ahci: port %d: status = %#x\n", port, portStatus);
 			fprintf(stderr, "ahci: port %d: sig    = %#x\n", port, portSig);
 
@@ -114,6 +733,7 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 					break;
 				case 0x00000101:
 					fprintf(stderr, "ahci:           hard disk\n");
+					hba->ports[port] = ahci_setup_disk(stderr, device, hba, port);
 					break;
 				case 0xffff0101:
 					fprintf(stderr, "ahci:           no device\n");
@@ -127,8 +747,25 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 		offset += 0x80;
 	}
 
+	if (!ahci_controllers) ahci_controllers = list_create("ahci controllers", NULL);
+	list_insert(ahci_controllers, hba);
 
-	
+	/* Controllers share their interrupt line; the handler checks each one. */
+	irq_install_handler(hba->irq, ahci_irq_handler, "ahci");
+	mmio_write4(mmio_addr, AHCI_IS, 0xFFFFFFFF);
+	mmio_write4(mmio_addr, AHCI_GHC, mmio_read4(mmio_addr, AHCI_GHC) | AHCI_GHC_IE);
+
+	for (int port = 0; port < 32; ++port) {
+		if (!hba->ports[port]) continue;
+		char devname[64];
+		snprintf(devname, 20, "/dev/sd%c", ahci_drive_char);
+		fs_node_t * node = ahci_device_create(hba->ports[port]);
+		char options[21];
+		snprintf(options, 20, "%c", ahci_drive_char);
+		vfs_mount(devname, node, "ahci-sd", options);
+		fprintf(stderr, "ahci: port %d is %s\n", port, devname);
+		ahci_drive_char++;
+	}
 }
 
 static int init(int argc, char * argv[]) {
@@ -146,4 +783,3 @@ struct Module metadata = {
 	.init = init,
 	.fini = fini,
 };
-
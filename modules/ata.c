@@ -27,6 +27,8 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/mutex.h>
+#include <kernel/args.h>
+#include <kernel/procfs.h>
 
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
@@ -170,10 +172,45 @@ static void find_ata_pci(uint32_t device, uint16_t vendorid, uint16_t deviceid,
 }
 
 typedef struct {
-	uintptr_t offset;
+	uint32_t offset;
 	uint16_t bytes;
 	uint16_t last;
-} prdt_t;
+} __attribute__((packed)) prdt_t;
+
+#define ATA_PRDT_ENTRIES (4096 / sizeof(prdt_t))
+#define ATA_MAX_SECTORS  256 /* Per command; 128 KiB */
+
+/**
+ * A DMA transfer of whole sectors to or from a kernel buffer.
+ *
+ * Requests are queued on their channel and may be issued together with
+ * others that continue where they end, as one command with a PRDT entry
+ * for each run of physical memory. The buffer does not need to be
+ * physically contiguous, but must stay put until @c done is set.
+ */
+struct ata_request {
+	struct ata_device * dev;
+	uint64_t lba;
+	size_t sectors;
+	int write;
+	uint8_t * buffer;
+	volatile int done;
+	int error;
+	struct ata_request * next;  /* Channel queue */
+	struct ata_request * batch; /* Issued in the same command, in LBA order */
+};
+
+struct ata_channel {
+	spin_lock_t lock;
+	struct ata_request * head;
+	struct ata_request * tail;
+	struct ata_request * active; /* First request of the command in flight */
+	int plugged;                 /* Hold off issuing while a batch is queued */
+	int pio;                     /* An ATAPI command owns the channel */
+	list_t * waiters;
+};
+
+struct CacheEntry;
 
 struct ata_device {
 	int io_base;
@@ -183,17 +220,24 @@ struct ata_device {
 	ata_identify_t identity;
 	prdt_t * dma_prdt;
 	uintptr_t dma_prdt_phys;
-	uint8_t * dma_start;
-	uintptr_t dma_start_phys;
 	uint32_t bar4;
 	uint32_t atapi_lba;
 	uint32_t atapi_sector_size;
+	struct ata_channel * channel;
+	struct CacheEntry * dirty_head;
+	struct CacheEntry * dirty_tail;
+	uint64_t ra_next;   /* Block a sequential reader would read next */
+	uint64_t ra_end;    /* First block past the last read-ahead */
+	size_t ra_window;
 };
 
-static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0};
-static struct ata_device ata_primary_slave    = {.io_base = 0x1F0, .control = 0x3F6, .slave = 1};
-static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x376, .slave = 0};
-static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1};
+static struct ata_channel ata_primary = {0};
+static struct ata_channel ata_secondary = {0};
+
+static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0, .channel = &ata_primary};
+static struct ata_device ata_primary_slave    = {.io_base = 0x1F0, .control = 0x3F6, .slave = 1, .channel = &ata_primary};
+static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x376, .slave = 0, .channel = &ata_secondary};
+static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1, .channel = &ata_secondary};
 
 static spin_lock_t atapi_cmd_lock = { 0 };
 
@@ -202,29 +246,64 @@ static spin_lock_t atapi_cmd_lock = { 0 };
 #define ATA_CACHE_SIZE  4096
 #define SECTORS_PER_CACHE_BLOCK 8
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static int ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba);
+static int ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static int ata_cache_contains(struct ata_device * dev, uint64_t lba);
+static int ata_cache_flush(struct ata_device * dev, unsigned long age);
+static int ata_device_read_direct(struct ata_device * dev, uint64_t lba, size_t blocks, uint8_t * buf);
+static void ata_request_submit(struct ata_request * req);
+static int ata_request_wait(struct ata_request * req);
+static void ata_channel_plug(struct ata_channel * ch);
+static void ata_channel_unplug(struct ata_channel * ch);
 
+/**
+ * A cached 4 KiB block.
+ *
+ * Entries are found through a hash of device and LBA, and kept on an
+ * LRU list, most recently used first. Dirty entries are also on their
+ * device's dirty list, oldest first, for the flusher.
+ *
+ * Each entry's block is a frame below 4 GiB, where the controller's
+ * 32-bit PRDT can reach it.
+ */
 struct CacheEntry {
-	struct ata_device * dev;
+	struct ata_device * dev;   /* NULL when unused */
 	uint64_t lba;
-	uint64_t last_use;
+	uint8_t * block;
 	uint64_t flags;
+	uint64_t dirtied;          /* When it became dirty, in milliseconds */
+	struct ata_request io;     /* Read-ahead or write-back in flight */
+	struct CacheEntry * hash_next;
+	struct CacheEntry * lru_prev;
+	struct CacheEntry * lru_next;
+	struct CacheEntry * dirty_prev;
+	struct CacheEntry * dirty_next;
 };
 
-#define CACHE_COUNT 4096
+#define CACHE_DIRTY   0x01
+#define CACHE_PENDING 0x02 /* io has been submitted and not waited for */
+
+#define CACHE_COUNT       4096
+#define CACHE_BUCKETS     4096
+#define CACHE_EVICT_SCAN  64   /* How far up the LRU list to look for a clean entry */
+#define READAHEAD_MIN     4    /* Blocks */
+#define READAHEAD_MAX     32
+#define DIRECT_READ_MIN   8    /* Shorter runs of uncached blocks go through the cache */
 
 static uint64_t hit_count = 0;
 static uint64_t miss_count = 0;
 static uint64_t eviction_count = 0;
 static uint64_t write_count = 0;
+static uint64_t flush_count = 0;
+static uint64_t readahead_count = 0;
 static sched_mutex_t * ata_mutex = NULL;
 
 static struct CacheEntry * cache_entries = NULL;
-static char * cache_blocks = NULL;
-static uint64_t counter = 1;
+static struct CacheEntry * cache_hash[CACHE_BUCKETS];
+static struct CacheEntry * lru_head = NULL;
+static struct CacheEntry * lru_tail = NULL;
+static unsigned long flush_age = 5000; /* Milliseconds; ata_flush_age= on the kernel command line */
 
 static off_t ata_max_offset(struct ata_device * dev) {
 	uint64_t sectors = dev->identity.sectors_48;
@@ -265,11 +344,12 @@ static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
 		if (prefix_size > size) prefix_size = size;
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		int error = ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
 
 		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), prefix_size);
 
 		free(tmp);
+		if (error) return error;
 
 		x_offset += prefix_size;
 		start_block++;
@@ -278,19 +358,39 @@ static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buf
 	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
 		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		int error = ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
 
 		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
 
 		free(tmp);
+		if (error) return error;
 
 		end_block--;
 	}
 
 	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
+		int error;
+		if (ata_cache_contains(dev, start_block)) {
+			error = ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
+			if (error) return error;
+			x_offset += ATA_CACHE_SIZE;
+			start_block++;
+			continue;
+		}
+
+		/* Read long runs of uncached blocks in as few commands as possible. */
+		unsigned int run = 1;
+		while (start_block + run <= end_block && !ata_cache_contains(dev, start_block + run)) run++;
+		if (run < DIRECT_READ_MIN) {
+			/* Short reads are better off in the cache, where read-ahead can see them. */
+			error = ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
+			run = 1;
+		} else {
+			error = ata_device_read_direct(dev, start_block, run, (uint8_t *)((uintptr_t)buffer + x_offset));
+		}
+		if (error) return error;
+		x_offset += run * ATA_CACHE_SIZE;
+		start_block += run;
 	}
 
 	return size;
@@ -371,12 +471,13 @@ static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *bu
 		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
 
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
+		int error = ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
 
 		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), buffer, prefix_size);
-		ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
+		if (!error) error = ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
 
 		free(tmp);
+		if (error) return error;
 		x_offset += prefix_size;
 		start_block++;
 	}
@@ -385,18 +486,20 @@ static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *bu
 		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
 
 		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
+		int error = ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
 
 		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
 
-		ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
+		if (!error) error = ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
 
 		free(tmp);
+		if (error) return error;
 		end_block--;
 	}
 
 	while (start_block <= end_block) {
-		ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
+		int error = ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
+		if (error) return error;
 		x_offset += ATA_CACHE_SIZE;
 		start_block++;
 	}
@@ -418,16 +521,9 @@ static int ioctl_ata(fs_node_t * node, unsigned long request, void * argp) {
 	switch (request) {
 		case IOCTLSYNC: {
 			mutex_acquire(ata_mutex);
-			for (int i = 0; i < CACHE_COUNT; ++i) {
-				if (cache_entries[i].dev == dev && cache_entries[i].flags & 1) {
-					eviction_count++;
-					memcpy(cache_entries[i].dev->dma_start, cache_blocks + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-					ata_device_write_sector_actual(cache_entries[i].dev, cache_entries[i].lba);
-					cache_entries[i].flags = 0;
-				}
-			}
+			int error = ata_cache_flush(dev, 0);
 			mutex_release(ata_mutex);
-			return 0;
+			return error;
 		}
 
 		case 0x2A01234UL: {
@@ -527,15 +623,252 @@ static void ata_soft_reset(struct ata_device * dev) {
 	outportb(dev->control, 0x00);
 }
 
+/**
+ * @brief Point the PRDT of a device at the buffers of a batch of requests.
+ *
+ * Consecutive pages that happen to be physically contiguous share an
+ * entry, as long as it stays within one 64 KiB region.
+ */
+static void ata_build_prdt(struct ata_device * dev, struct ata_request * batch) {
+	prdt_t * prdt = dev->dma_prdt;
+	union PML * kernel = mmu_get_kernel_directory();
+	size_t n = 0;
+
+	for (struct ata_request * req = batch; req; req = req->batch) {
+		uintptr_t addr = (uintptr_t)req->buffer;
+		size_t left = req->sectors * ATA_SECTOR_SIZE;
+		while (left) {
+			size_t chunk = 0x1000 - (addr & 0xFFF);
+			if (chunk > left) chunk = left;
+			uintptr_t phys = mmu_map_to_physical(kernel, addr);
+
+			if (n && prdt[n-1].offset + prdt[n-1].bytes == phys &&
+			    prdt[n-1].bytes + chunk < 0x10000 &&
+			    (prdt[n-1].offset >> 16) == ((phys + chunk - 1) >> 16)) {
+				prdt[n-1].bytes += chunk;
+			} else {
+				prdt[n].offset = phys;
+				prdt[n].bytes = chunk;
+				prdt[n].last = 0;
+				n++;
+			}
+
+			addr += chunk;
+			left -= chunk;
+		}
+	}
+
+	prdt[n-1].last = 0x8000;
+}
+
+/**
+ * @brief Start a DMA command; completion is signalled by the channel's IRQ.
+ */
+static void ata_issue(struct ata_device * dev, uint64_t lba, size_t sectors, int write) {
+	uint16_t bus = dev->io_base;
+
+	/* Stop, set the PRDT, clear error and irq status, set direction */
+	outportb(dev->bar4, 0x00);
+	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
+	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+	outportb(dev->bar4, write ? 0x00 : 0x08);
+
+	while (1) {
+		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
+		if (!(status & ATA_SR_BSY)) break;
+	}
+
+	outportb(bus + ATA_REG_CONTROL, 0x00);
+	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | dev->slave << 4);
+	ata_io_wait(dev);
+	outportb(bus + ATA_REG_FEATURES, 0x00);
+
+	outportb(bus + ATA_REG_SECCOUNT0, (sectors >> 8) & 0xFF);
+	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
+	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
+	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
+
+	outportb(bus + ATA_REG_SECCOUNT0, sectors & 0xFF);
+	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
+	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
+	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
+
+	while (1) {
+		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
+		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
+	}
+
+	outportb(bus + ATA_REG_COMMAND, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
+	ata_io_wait(dev);
+	outportb(dev->bar4, (write ? 0x00 : 0x08) | 0x01);
+}
+
+static struct ata_request * ata_queue_take(struct ata_channel * ch, struct ata_request ** link) {
+	struct ata_request * req = *link;
+	*link = req->next;
+	if (ch->tail == req) {
+		ch->tail = (link == &ch->head) ? NULL :
+			(struct ata_request *)((uintptr_t)link - offsetof(struct ata_request, next));
+	}
+	req->next = NULL;
+	return req;
+}
+
+/**
+ * @brief Issue the next queued command if the channel is idle.
+ *
+ * The request at the head of the queue is merged with any queued
+ * requests that extend it at either end, up to @c ATA_MAX_SECTORS.
+ * Called with the channel lock held, from threads and from the IRQ handler.
+ */
+static void ata_channel_start(struct ata_channel * ch) {
+	if (ch->active || ch->plugged || ch->pio || !ch->head) return;
+
+	struct ata_request * first = ata_queue_take(ch, &ch->head);
+	struct ata_request * last = first;
+	size_t sectors = first->sectors;
+
+	struct ata_request ** link = &ch->head;
+	while (*link) {
+		struct ata_request * other = *link;
+		if (other->dev != first->dev || other->write != first->write || sectors + other->sectors > ATA_MAX_SECTORS) {
+			link = &other->next;
+			continue;
+		}
+		if (other->lba == last->lba + last->sectors) {
+			ata_queue_take(ch, link);
+			last->batch = other;
+			last = other;
+		} else if (other->lba + other->sectors == first->lba) {
+			ata_queue_take(ch, link);
+			other->batch = first;
+			first = other;
+		} else {
+			link = &other->next;
+			continue;
+		}
+		sectors += other->sectors;
+		/* Something we already passed over may fit now. */
+		link = &ch->head;
+	}
+
+	ch->active = first;
+	ata_build_prdt(first->dev, first);
+	ata_issue(first->dev, first->lba, sectors, first->write);
+}
+
+/**
+ * @brief Queue a request and return without waiting for it.
+ */
+static void ata_request_submit(struct ata_request * req) {
+	struct ata_channel * ch = req->dev->channel;
+	req->done = 0;
+	req->error = 0;
+	req->next = NULL;
+	req->batch = NULL;
+
+	spin_lock(ch->lock);
+	if (ch->tail) ch->tail->next = req;
+	else ch->head = req;
+	ch->tail = req;
+	ata_channel_start(ch);
+	spin_unlock(ch->lock);
+}
+
+/**
+ * @brief Sleep until a submitted request has completed.
+ *
+ * @returns 0 on success, 1 if the drive or controller reported an error.
+ */
+static int ata_request_wait(struct ata_request * req) {
+	struct ata_channel * ch = req->dev->channel;
+	spin_lock(ch->lock);
+	while (!req->done) {
+		sleep_on_unlocking(ch->waiters, &ch->lock);
+		spin_lock(ch->lock);
+	}
+	spin_unlock(ch->lock);
+	return req->error;
+}
+
+/**
+ * @brief Hold queued requests back until @ref ata_channel_unplug, so they can be merged.
+ */
+static void ata_channel_plug(struct ata_channel * ch) {
+	spin_lock(ch->lock);
+	ch->plugged++;
+	spin_unlock(ch->lock);
+}
+
+static void ata_channel_unplug(struct ata_channel * ch) {
+	spin_lock(ch->lock);
+	ch->plugged--;
+	ata_channel_start(ch);
+	spin_unlock(ch->lock);
+}
+
+/**
+ * @brief Take a channel for a PIO command, once queued DMA has drained.
+ */
+static void ata_channel_claim(struct ata_channel * ch) {
+	spin_lock(ch->lock);
+	while (ch->active || ch->head || ch->pio) {
+		sleep_on_unlocking(ch->waiters, &ch->lock);
+		spin_lock(ch->lock);
+	}
+	ch->pio = 1;
+	spin_unlock(ch->lock);
+}
+
+static void ata_channel_release(struct ata_channel * ch) {
+	spin_lock(ch->lock);
+	ch->pio = 0;
+	ata_channel_start(ch);
+	wakeup_queue(ch->waiters);
+	spin_unlock(ch->lock);
+}
+
 static int ata_irq_handler(struct regs *r) {
-	struct ata_device * dev = r->int_no == 14 ? &ata_primary_master : &ata_secondary_master;
-	inportb(dev->io_base + ATA_REG_STATUS);
+	int irq = r->int_no - 32;
+	struct ata_channel * ch = irq == 14 ? &ata_primary : &ata_secondary;
+	struct ata_device * dev = irq == 14 ? &ata_primary_master : &ata_secondary_master;
+
+	spin_lock(ch->lock);
+	if (ch->active) {
+		dev = ch->active->dev;
+		uint8_t dstatus = inportb(dev->io_base + ATA_REG_STATUS);
+		uint8_t status = inportb(dev->bar4 + 0x02);
+		if (status & 0x04) {
+			/* Stop the transfer and inform the controller we are done. */
+			outportb(dev->bar4, 0x00);
+			outportb(dev->bar4 + 0x2, status | 0x04 | 0x02);
+
+			int error = (status & 0x02) || (dstatus & (ATA_SR_ERR | ATA_SR_DF));
+			struct ata_request * req = ch->active;
+			ch->active = NULL;
+			while (req) {
+				/* The submitter may free the request as soon as it is done. */
+				struct ata_request * next = req->batch;
+				req->batch = NULL;
+				req->error = error;
+				req->done = 1;
+				req = next;
+			}
 
-	spin_lock(atapi_cmd_lock);
-	wakeup_queue(atapi_waiter);
-	spin_unlock(atapi_cmd_lock);
-	irq_ack(r->int_no);
+			ata_channel_start(ch);
+			wakeup_queue(ch->waiters);
+		}
+		spin_unlock(ch->lock);
+	} else {
+		spin_unlock(ch->lock);
+		inportb(dev->io_base + ATA_REG_STATUS);
+
+		spin_lock(atapi_cmd_lock);
+		wakeup_queue(atapi_waiter);
+		spin_unlock(atapi_cmd_lock);
+	}
 
+	irq_ack(irq);
 	return 1;
 }
 
@@ -574,10 +907,6 @@ static void ata_device_init(struct ata_device * dev) {
 
 	dev->is_atapi = 0;
 	dev->dma_prdt  = (void *)kvmalloc_p(4096, &dev->dma_prdt_phys);
-	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = ATA_CACHE_SIZE;
-	dev->dma_prdt[0].last = 0x8000;
 
 	uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
 	if (!(command_reg & (1 << 2))) {
@@ -589,7 +918,8 @@ static void ata_device_init(struct ata_device * dev) {
 	dev->bar4 = pci_read_field(ata_pci, PCI_BAR4, 4);
 
 	if (dev->bar4 & 0x00000001) {
-		dev->bar4 = dev->bar4 & 0xFFFFFFFC;
+		/* The secondary channel's bus master registers follow the primary's. */
+		dev->bar4 = (dev->bar4 & 0xFFFFFFFC) + (dev->channel == &ata_secondary ? 8 : 0);
 	} else {
 		return; /* No DMA because we're not sure what to do here */
 	}
@@ -758,73 +1088,6 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba) {
-	uint16_t bus = dev->io_base;
-	uint8_t slave = dev->slave;
-
-	if (dev->is_atapi) return;
-
-	ata_wait(dev, 0);
-
-	/* Stop */
-	outportb(dev->bar4, 0x00);
-
-	/* Set the PRDT */
-	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
-
-	/* Enable error, irq status */
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
-
-	/* set read */
-	outportb(dev->bar4, 0x08);
-
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
-
-	outportb(bus + ATA_REG_CONTROL, 0x00);
-	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
-	ata_io_wait(dev);
-	outportb(bus + ATA_REG_FEATURES, 0x00);
-
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
-	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
-	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
-	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
-
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
-	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
-	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
-	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-	spin_lock(atapi_cmd_lock);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
-
-	ata_io_wait(dev);
-
-	outportb(dev->bar4, 0x08 | 0x01);
-	sleep_on_unlocking(atapi_waiter, &atapi_cmd_lock);
-
-	while (1) {
-		int status = inportb(dev->bar4 + 0x02);
-		int dstatus = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
-		}
-	}
-
-	/* Inform device we are done. */
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
-}
-
 static void ata_device_read_sector_atapi_actual(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
 
 	if (!dev->is_atapi) return;
@@ -895,144 +1158,419 @@ atapi_timeout:
 	return;
 }
 
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba) {
-	uint16_t bus = dev->io_base;
-	uint8_t slave = dev->slave;
+/**
+ * @brief Transfer sectors and wait for them.
+ */
+static int ata_device_transfer(struct ata_device * dev, uint64_t lba, size_t sectors, uint8_t * buf, int write) {
+	struct ata_request req = { .dev = dev, .lba = lba, .sectors = sectors, .write = write, .buffer = buf };
+	ata_request_submit(&req);
+	return ata_request_wait(&req);
+}
 
-	ata_wait(dev, 0);
-	outportb(dev->bar4, 0x00);
-	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+/**
+ * @brief Can the controller transfer straight to or from this buffer?
+ *
+ * It needs an even kernel address that stays mapped, in the low 4 GiB.
+ */
+static int ata_dma_capable(uint8_t * buf, size_t size) {
+	uintptr_t addr = (uintptr_t)buf;
+	if (addr < KERNEL_HEAP_START || (addr & 1)) return 0;
+	union PML * kernel = mmu_get_kernel_directory();
+	for (uintptr_t page = addr & ~0xFFFUL; page < addr + size; page += 0x1000) {
+		if (mmu_map_to_physical(kernel, page) > 0xFFFFFFFFUL) return 0;
+	}
+	return 1;
+}
 
-	/* set write */
-	outportb(dev->bar4, 0x00);
+/**
+ * @brief Read whole cache blocks without going through the cache.
+ *
+ * The blocks are split into commands of at most @c ATA_MAX_SECTORS,
+ * which are all queued before waiting for any of them.
+ *
+ * @returns 0, or -EIO if any of them failed.
+ */
+static int ata_device_read_direct(struct ata_device * dev, uint64_t lba, size_t blocks, uint8_t * buf) {
+	if (!ata_dma_capable(buf, blocks * ATA_CACHE_SIZE)) {
+		/* Probably a user buffer; go through the cache one block at a time. */
+		for (size_t i = 0; i < blocks; ++i) {
+			int error = ata_device_read_sector(dev, lba + i, buf + i * ATA_CACHE_SIZE);
+			if (error) return error;
+		}
+		return 0;
+	}
 
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
+	size_t per_request = ATA_MAX_SECTORS / SECTORS_PER_CACHE_BLOCK;
+	size_t count = (blocks + per_request - 1) / per_request;
+	struct ata_request * requests = calloc(count, sizeof(struct ata_request));
+
+	for (size_t i = 0; i < count; ++i) {
+		size_t first = i * per_request;
+		size_t n = blocks - first < per_request ? blocks - first : per_request;
+		requests[i].dev = dev;
+		requests[i].lba = (lba + first) * SECTORS_PER_CACHE_BLOCK;
+		requests[i].sectors = n * SECTORS_PER_CACHE_BLOCK;
+		requests[i].buffer = buf + first * ATA_CACHE_SIZE;
+		ata_request_submit(&requests[i]);
 	}
 
-	outportb(bus + ATA_REG_CONTROL, 0x02);
-	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
-	ata_wait(dev, 0);
-	outportb(bus + ATA_REG_FEATURES, 0x00);
+	int error = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (ata_request_wait(&requests[i])) error = -EIO;
+	}
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
-	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
-	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
-	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
+	free(requests);
+	return error;
+}
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
-	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
-	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
-	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
+static uint64_t ata_now_ms(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return s * 1000 + ss / 1000;
+}
 
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
+static unsigned int cache_bucket(struct ata_device * dev, uint64_t lba) {
+	return (((uintptr_t)dev >> 4) ^ (lba / SECTORS_PER_CACHE_BLOCK)) % CACHE_BUCKETS;
+}
+
+static uint8_t * cache_block(struct CacheEntry * e) {
+	return e->block;
+}
+
+static struct CacheEntry * cache_lookup(struct ata_device * dev, uint64_t lba) {
+	for (struct CacheEntry * e = cache_hash[cache_bucket(dev, lba)]; e; e = e->hash_next) {
+		if (e->dev == dev && e->lba == lba) return e;
 	}
-	spin_lock(atapi_cmd_lock);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA_EXT);
+	return NULL;
+}
 
-	ata_io_wait(dev);
+static void cache_lru_unlink(struct CacheEntry * e) {
+	if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+	else lru_head = e->lru_next;
+	if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+	else lru_tail = e->lru_prev;
+	e->lru_prev = NULL;
+	e->lru_next = NULL;
+}
 
-	outportb(dev->bar4, 0x00 | 0x01);
-	sleep_on_unlocking(atapi_waiter, &atapi_cmd_lock);
+static void cache_touch(struct CacheEntry * e) {
+	cache_lru_unlink(e);
+	e->lru_next = lru_head;
+	if (lru_head) lru_head->lru_prev = e;
+	lru_head = e;
+	if (!lru_tail) lru_tail = e;
+}
 
-	#if 0
-	ata_wait(dev, 0);
-	int size = ATA_SECTOR_SIZE / 2;
-	outportsm(bus,buf,size);
-	#endif
+static void cache_mark_dirty(struct CacheEntry * e) {
+	if (e->flags & CACHE_DIRTY) return;
+	struct ata_device * dev = e->dev;
+	e->flags |= CACHE_DIRTY;
+	e->dirtied = ata_now_ms();
+	e->dirty_next = NULL;
+	e->dirty_prev = dev->dirty_tail;
+	if (dev->dirty_tail) dev->dirty_tail->dirty_next = e;
+	else dev->dirty_head = e;
+	dev->dirty_tail = e;
+}
 
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+static void cache_mark_clean(struct CacheEntry * e) {
+	if (!(e->flags & CACHE_DIRTY)) return;
+	struct ata_device * dev = e->dev;
+	e->flags &= ~CACHE_DIRTY;
+	if (e->dirty_prev) e->dirty_prev->dirty_next = e->dirty_next;
+	else dev->dirty_head = e->dirty_next;
+	if (e->dirty_next) e->dirty_next->dirty_prev = e->dirty_prev;
+	else dev->dirty_tail = e->dirty_prev;
+	e->dirty_prev = NULL;
+	e->dirty_next = NULL;
+}
 
-#if 0
-	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
-	ata_wait(dev, 0);
-#endif
+/**
+ * @brief Wait for I/O submitted for an entry to finish.
+ *
+ * A write back that failed leaves the entry dirty again, to be retried.
+ *
+ * @returns 0, or -EIO if the I/O failed.
+ */
+static int cache_wait(struct CacheEntry * e) {
+	if (!(e->flags & CACHE_PENDING)) return 0;
+	int error = ata_request_wait(&e->io);
+	e->flags &= ~CACHE_PENDING;
+	if (!error) return 0;
+	if (e->io.write) cache_mark_dirty(e);
+	return -EIO;
 }
 
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	/* Is it in the cache? */
-	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
+static void cache_submit(struct CacheEntry * e, int write) {
+	e->io.dev = e->dev;
+	e->io.lba = e->lba;
+	e->io.sectors = SECTORS_PER_CACHE_BLOCK;
+	e->io.write = write;
+	e->io.buffer = cache_block(e);
+	e->flags |= CACHE_PENDING;
+	ata_request_submit(&e->io);
+}
+
+/**
+ * @brief Forget what an entry holds, leaving it unused.
+ */
+static void cache_remove(struct CacheEntry * e) {
+	struct CacheEntry ** link = &cache_hash[cache_bucket(e->dev, e->lba)];
+	while (*link != e) link = &(*link)->hash_next;
+	*link = e->hash_next;
+	e->hash_next = NULL;
+	e->dev = NULL;
+	e->flags = 0;
+}
+
+/**
+ * @brief Take the least recently used entry out of the cache so it can be reused.
+ *
+ * Clean entries near the end of the LRU list are preferred, so that
+ * only a cache full of dirty blocks makes us wait for a write. A dirty
+ * block that can't be written back stays in the cache, and the next
+ * candidate is tried instead.
+ *
+ * @param clean_only Give up rather than write anything back.
+ * @returns an unused entry, or NULL if @p clean_only and there was none,
+ *          or if nothing could be written back.
+ */
+static struct CacheEntry * cache_evict(int clean_only) {
+	for (int attempt = 0; attempt < CACHE_EVICT_SCAN; ++attempt) {
+		struct CacheEntry * e = lru_tail;
+		for (int i = 0; i < CACHE_EVICT_SCAN && e; ++i, e = e->lru_prev) {
+			if (!e->dev || !(e->flags & (CACHE_DIRTY | CACHE_PENDING))) break;
 		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
+		if (!e || (e->dev && (e->flags & (CACHE_DIRTY | CACHE_PENDING)))) {
+			if (clean_only) return NULL;
+			e = lru_tail;
+		}
+
+		if (!e->dev) return e;
+
+		cache_wait(e);
+		if (e->flags & CACHE_DIRTY) {
+			if (ata_device_transfer(e->dev, e->lba, SECTORS_PER_CACHE_BLOCK, cache_block(e), 1)) {
+				/* Moving it to the front means the next look finds something else. */
+				cache_touch(e);
+				continue;
+			}
+			cache_mark_clean(e);
 		}
-		ata_device_read_sector_actual(dev, lba);
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-		cache_entries[oldest].flags = 0;
-		memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
+		eviction_count++;
+		cache_remove(e);
+		return e;
 	}
-	cache_entries[oldest].last_use = counter++;
-	memcpy(buf, cache_blocks + ATA_CACHE_SIZE * oldest, ATA_CACHE_SIZE);
+	return NULL;
+}
+
+static void cache_insert(struct CacheEntry * e, struct ata_device * dev, uint64_t lba) {
+	unsigned int bucket = cache_bucket(dev, lba);
+	e->dev = dev;
+	e->lba = lba;
+	e->flags = 0;
+	e->hash_next = cache_hash[bucket];
+	cache_hash[bucket] = e;
+	cache_touch(e);
+}
+
+static int ata_cache_contains(struct ata_device * dev, uint64_t lba) {
+	mutex_acquire(ata_mutex);
+	int found = cache_lookup(dev, lba * SECTORS_PER_CACHE_BLOCK) != NULL;
 	mutex_release(ata_mutex);
+	return found;
+}
+
+/**
+ * @brief Queue reads of the blocks following a sequential reader.
+ *
+ * Only reuses clean entries, so it never has to wait for anything.
+ * Called with the cache lock held, and the requests are left pending;
+ * whoever looks the blocks up first waits for them.
+ */
+static void ata_readahead(struct ata_device * dev, uint64_t block, size_t count) {
+	uint64_t max_block = ata_max_offset(dev) / ATA_CACHE_SIZE;
+	for (size_t i = 0; i < count && block + i < max_block; ++i) {
+		uint64_t lba = (block + i) * SECTORS_PER_CACHE_BLOCK;
+		if (cache_lookup(dev, lba)) continue;
+		struct CacheEntry * e = cache_evict(1);
+		if (!e) break;
+		cache_insert(e, dev, lba);
+		cache_submit(e, 0);
+		readahead_count++;
+	}
+	dev->ra_end = block + count;
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
+static int ata_device_read_sector(struct ata_device * dev, uint64_t block, uint8_t * buf) {
+	uint64_t lba = block * SECTORS_PER_CACHE_BLOCK;
 	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
+
+	/* Grow the read-ahead window while reads stay sequential. */
+	int sequential = block == dev->ra_next;
+	if (sequential) {
+		if (dev->ra_window < READAHEAD_MAX) dev->ra_window = dev->ra_window ? dev->ra_window * 2 : READAHEAD_MIN;
+	} else {
+		dev->ra_window = 0;
+	}
+	dev->ra_next = block + 1;
+
+	struct CacheEntry * e = cache_lookup(dev, lba);
+	int miss = !e;
+	if (!miss) {
+		hit_count++;
+		cache_touch(e);
+	} else {
+		miss_count++;
+		e = cache_evict(0);
+		if (!e) {
+			mutex_release(ata_mutex);
+			return -EIO;
 		}
+		cache_insert(e, dev, lba);
 	}
-	if (!found) {
+
+	/*
+	 * Queue the miss and whatever comes next before waiting, so they can
+	 * go out as one command. On hits, keep the window ahead of the reader
+	 * once it is halfway through what we read ahead last time.
+	 */
+	if (miss || (sequential && block + dev->ra_window / 2 >= dev->ra_end)) {
+		ata_channel_plug(dev->channel);
+		if (miss) cache_submit(e, 0);
+		if (sequential) ata_readahead(dev, miss ? block + 1 : dev->ra_end > block ? dev->ra_end : block + 1, dev->ra_window);
+		ata_channel_unplug(dev->channel);
+	}
+
+	if (cache_wait(e) && !(e->flags & CACHE_DIRTY)) {
+		/* The block never arrived; don't keep what's in its place. */
+		cache_remove(e);
+		mutex_release(ata_mutex);
+		return -EIO;
+	}
+	memcpy(buf, cache_block(e), ATA_CACHE_SIZE);
+	mutex_release(ata_mutex);
+	return 0;
+}
+
+static int ata_device_write_sector(struct ata_device * dev, uint64_t block, uint8_t * buf) {
+	uint64_t lba = block * SECTORS_PER_CACHE_BLOCK;
+	mutex_acquire(ata_mutex);
+	struct CacheEntry * e = cache_lookup(dev, lba);
+	if (e) {
+		hit_count++;
+		cache_touch(e);
+		/* Don't change the block under a read or write that is still going. */
+		cache_wait(e);
+	} else {
 		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
+		e = cache_evict(0);
+		if (!e) {
+			mutex_release(ata_mutex);
+			return -EIO;
 		}
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
+		cache_insert(e, dev, lba);
 	}
 	write_count++;
-	cache_entries[oldest].last_use = counter++;
-	memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, buf, ATA_CACHE_SIZE);
-	cache_entries[oldest].flags = 1;
+	memcpy(cache_block(e), buf, ATA_CACHE_SIZE);
+	cache_mark_dirty(e);
+	mutex_release(ata_mutex);
+	return 0;
+}
+
+/**
+ * @brief Write back dirty blocks of a device that have been dirty for at least @p age milliseconds.
+ *
+ * All of them are queued at once, with the channel plugged, so that
+ * neighbouring blocks are written in the same command. Called with
+ * the cache lock held. Blocks that fail to write stay dirty.
+ *
+ * @returns 0, or -EIO if any of them failed.
+ */
+static int ata_cache_flush(struct ata_device * dev, unsigned long age) {
+	uint64_t now = ata_now_ms();
+	struct CacheEntry * flushing = NULL;
+	int error = 0;
+
+	ata_channel_plug(dev->channel);
+	while (dev->dirty_head && dev->dirty_head->dirtied + age <= now) {
+		struct CacheEntry * e = dev->dirty_head;
+		cache_wait(e);
+		cache_mark_clean(e);
+		cache_submit(e, 1);
+		flush_count++;
+		/* Reuse the dirty list links to remember what we are waiting for. */
+		e->dirty_next = flushing;
+		flushing = e;
+	}
+	ata_channel_unplug(dev->channel);
+
+	while (flushing) {
+		struct CacheEntry * e = flushing;
+		flushing = e->dirty_next;
+		e->dirty_next = NULL;
+		if (cache_wait(e)) error = -EIO;
+	}
+	return error;
+}
+
+static struct ata_device * ata_devices[] = {
+	&ata_primary_master, &ata_primary_slave, &ata_secondary_master, &ata_secondary_slave,
+};
+
+/**
+ * @brief Write back blocks that have been dirty for longer than @c flush_age.
+ */
+static void ata_flusher(void * arg) {
+	while (1) {
+		unsigned long s, ss;
+		relative_time(0, flush_age * 1000 / 2, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+
+		mutex_acquire(ata_mutex);
+		for (size_t i = 0; i < sizeof(ata_devices) / sizeof(*ata_devices); ++i) {
+			if (ata_devices[i]->dirty_head) ata_cache_flush(ata_devices[i], flush_age);
+		}
+		mutex_release(ata_mutex);
+	}
+}
+
+static void ata_cache_func(fs_node_t * node) {
+	size_t dirty = 0, used = 0;
+	mutex_acquire(ata_mutex);
+	for (int i = 0; i < CACHE_COUNT; ++i) {
+		if (cache_entries[i].dev) used++;
+		if (cache_entries[i].flags & CACHE_DIRTY) dirty++;
+	}
 	mutex_release(ata_mutex);
+
+	procfs_printf(node,
+		"Blocks:\t%zu\n"
+		"Used:\t%zu\n"
+		"Dirty:\t%zu\n"
+		"Hits:\t%lu\n"
+		"Misses:\t%lu\n"
+		"Evictions:\t%lu\n"
+		"Writes:\t%lu\n"
+		"Flushed:\t%lu\n"
+		"ReadAhead:\t%lu\n"
+		"FlushAge:\t%lu ms\n",
+		(size_t)CACHE_COUNT, used, dirty, hit_count, miss_count,
+		eviction_count, write_count, flush_count, readahead_count, flush_age);
 }
+
+static struct procfs_entry ata_cache_entry = {
+	0,
+	"ata",
+	ata_cache_func,
+};
+
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
 	mutex_acquire(ata_mutex);
+	ata_channel_claim(dev->channel);
 	ata_device_read_sector_atapi_actual(dev, lba, buf);
+	ata_channel_release(dev->channel);
 	mutex_release(ata_mutex);
 }
 
@@ -1046,12 +1584,37 @@ static int ata_initialize(int argc, char * argv[]) {
 	irq_install_handler(15, ata_irq_handler, "ide slave");
 
 	atapi_waiter = list_create("atapi waiter", NULL);
+	ata_primary.waiters = list_create("ata primary channel waiters", NULL);
+	ata_secondary.waiters = list_create("ata secondary channel waiters", NULL);
 
 	cache_entries = malloc(sizeof(struct CacheEntry) * CACHE_COUNT);
 	memset(cache_entries, 0, sizeof(struct CacheEntry) * CACHE_COUNT);
-	cache_blocks  = mmu_map_module(CACHE_COUNT * ATA_CACHE_SIZE);
 	ata_mutex = mutex_init("ata lock");
 
+	/*
+	 * Every entry starts out unused, on the LRU list. Frames come lowest first,
+	 * so if one is out of the controller's reach, there are no more that aren't;
+	 * entries without a block are left off the list and never used.
+	 */
+	for (int i = 0; i < CACHE_COUNT; ++i) {
+		uintptr_t frame = mmu_allocate_a_frame() << 12;
+		if (frame > 0xFFFFFFFFUL) {
+			mmu_frame_release(frame);
+			printf("ata: only %d cache blocks below 4 GiB\n", i);
+			break;
+		}
+		cache_entries[i].block = mmu_map_from_physical(frame);
+		cache_touch(&cache_entries[i]);
+	}
+
+	if (args_present("ata_flush_age")) {
+		flush_age = atoi(args_value("ata_flush_age"));
+	}
+	if (flush_age) {
+		spawn_worker_thread(ata_flusher, "[ata flush]", NULL);
+	}
+	procfs_install(&ata_cache_entry);
+
 	ata_device_detect(&ata_primary_master);
 	ata_device_detect(&ata_primary_slave);
 	ata_device_detect(&ata_secondary_master);
@@ -24,7 +24,10 @@
 #include <kernel/vfs.h>
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
+#include <kernel/net/netbuf.h>
 #include <kernel/module.h>
+#include <kernel/args.h>
+#include <kernel/procfs.h>
 #include <errno.h>
 
 #if defined(__x86_64__)
@@ -37,6 +40,15 @@
 #include <sys/socket.h>
 #include <net/if.h>
 
+/* Receive buffers are pool netbufs, which have this much room past their headroom */
+#define E1000_RX_BUFFER_SIZE 2048
+
+/* Most frames taken off the receive ring before giving other threads a turn */
+#define E1000_POLL_BUDGET 64
+
+/* Interrupts per second, unless e1000_itr= says otherwise; 0 is unthrottled */
+#define E1000_ITR_DEFAULT 8000
+
 #define INTS (ICR_LSC | ICR_RXO | ICR_RXT0 | ICR_TXQE | ICR_TXDW | ICR_ACK | ICR_RXDMT0 | ICR_SRPD)
 
 struct e1000_nic {
@@ -49,26 +61,35 @@ struct e1000_nic {
 	int has_eeprom;
 	int rx_index;
 	int tx_index;
+	int tx_clean;  /* Oldest descriptor the card may still be sending */
 	int link_status;
+	uint32_t itr;  /* Interrupt throttling interval, in 256ns units */
 
 	spin_lock_t tx_lock;
 
-	uint8_t * rx_virt[E1000_NUM_RX_DESC];
-	uint8_t * tx_virt[E1000_NUM_TX_DESC];
+	netbuf_t * rx_bufs[E1000_NUM_RX_DESC];
+	netbuf_t * tx_bufs[E1000_NUM_TX_DESC];
 	volatile struct e1000_rx_desc * rx;
 	volatile struct e1000_tx_desc * tx;
 	uintptr_t rx_phys;
 	uintptr_t tx_phys;
 
 	int configured;
-	process_t * queuer;
+	process_t * poller;
 	process_t * processor;
 
 	netif_counters_t counts;
+
+	/* For /proc/e1000 */
+	uint64_t interrupts;
+	uint64_t polls;       /* Passes through the poller */
+	uint64_t busy_polls;  /* ...that used their whole budget */
+	uint64_t tx_waits;    /* Sends that found the transmit ring full */
 };
 
 static int device_count = 0;
 static struct e1000_nic * devices[32] = {NULL};
+static unsigned long itr_rate = E1000_ITR_DEFAULT;
 
 #ifdef __aarch64__
 static uint32_t mmio_read32(uintptr_t addr) {
@@ -181,6 +202,25 @@ static void read_mac(struct e1000_nic * device) {
 	}
 }
 
+/**
+ * Give a receive descriptor a fresh buffer to fill.
+ */
+static void rx_refill(struct e1000_nic * nic, int i) {
+	netbuf_t * nb = netbuf_alloc(E1000_RX_BUFFER_SIZE);
+#ifdef __aarch64__
+	/* Nothing of ours may be written back over what the card puts here. */
+	cache_clean(nb);
+#endif
+	nic->rx_bufs[i] = nb;
+	nic->rx[i].addr = netbuf_dma(nb);
+	nic->rx[i].status = 0;
+}
+
+/**
+ * Interrupts only say there is work; the poller does it. Further
+ * interrupts stay masked until the poller has emptied the rings,
+ * so a busy interface costs one interrupt per burst, not per frame.
+ */
 static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 	write_command(nic, E1000_REG_ICR, status);
 
@@ -188,64 +228,93 @@ static void e1000_handle(struct e1000_nic * nic, uint32_t status) {
 		return;
 	}
 
+	write_command(nic, E1000_REG_IMC, INTS);
+	nic->interrupts++;
+
 	if (status & ICR_LSC) {
 		nic->link_status= (read_command(nic, E1000_REG_STATUS) & (1 << 1));
 	}
 
-	make_process_ready(nic->queuer);
+	make_process_ready(nic->poller);
 }
 
-static void e1000_queuer(void * data) {
-	struct e1000_nic * nic = data;
-
-	int head = read_command(nic, E1000_REG_RXDESCHEAD);
-	int budget = 8;
+/**
+ * Take up to @p budget received frames off the ring and pass them up.
+ *
+ * @returns how many were taken.
+ */
+static int rx_poll(struct e1000_nic * nic, int budget) {
+	int processed = 0;
 
-	while (1) {
-		int processed = 0;
-		if (head == nic->rx_index) {
-			head = read_command(nic, E1000_REG_RXDESCHEAD);
-		}
-		if (head != nic->rx_index) {
 #ifdef __aarch64__
-			__sync_synchronize();
+	__sync_synchronize();
 #endif
-			while ((nic->rx[nic->rx_index].status & 0x01) && (processed < budget)) {
-				int i = nic->rx_index;
-				if (!(nic->rx[i].errors & (0x97))) {
-					nic->counts.rx_count++;
-					nic->counts.rx_bytes += nic->rx[i].length;
+	while (processed < budget && (nic->rx[nic->rx_index].status & RSTA_DD)) {
+		int i = nic->rx_index;
+		netbuf_t * nb = nic->rx_bufs[i];
+		if (!(nic->rx[i].errors & (0x97))) {
+			nic->counts.rx_count++;
+			nic->counts.rx_bytes += nic->rx[i].length;
 #ifdef __aarch64__
-					cache_invalidate(nic->rx_virt[i]);
+			cache_invalidate(nb);
 #endif
-					net_eth_handle((void*)nic->rx_virt[i], nic->eth.device_node, nic->rx[i].length);
-				} else {
-					printf("error bits set in packet: %x\n", nic->rx[i].errors);
-				}
-				processed++;
-#ifdef __aarch64__
-				__sync_synchronize();
-#endif
-				nic->rx[i].status = 0;
-				if (++nic->rx_index == E1000_NUM_RX_DESC) {
-					nic->rx_index = 0;
-				}
-				if (nic->rx_index == head) {
-					head = read_command(nic, E1000_REG_RXDESCHEAD);
-					if (nic->rx_index == head) break;
-				}
-				write_command(nic, E1000_REG_RXDESCTAIL, nic->rx_index);
-				read_command(nic, E1000_REG_STATUS);
+			/* The buffer goes up the stack as it is; whoever wants to keep it takes a reference. */
+			netbuf_append(nb, nic->rx[i].length);
+			net_eth_handle(nb, nic->eth.device_node);
+		} else {
+			printf("error bits set in packet: %x\n", nic->rx[i].errors);
+		}
+		processed++;
+		netbuf_put(nb);
+		rx_refill(nic, i);
+		if (++nic->rx_index == E1000_NUM_RX_DESC) {
+			nic->rx_index = 0;
+		}
+	}
+
+	if (processed) {
 #ifdef __aarch64__
-				__sync_synchronize();
+		__sync_synchronize();
 #endif
-			}
-		}
-		if (processed == 0) {
-			delay_yield(100000);
-		} else {
-			if (this_core->cpu_id == 0) switch_task(1);
+		/*
+		 * Give back everything refilled but the last one, which
+		 * keeps the tail from catching up to the card's head: the
+		 * card takes that to mean it has no descriptors at all.
+		 */
+		write_command(nic, E1000_REG_RXDESCTAIL, (nic->rx_index + E1000_NUM_RX_DESC - 1) % E1000_NUM_RX_DESC);
+	}
+
+	return processed;
+}
+
+static void tx_reclaim(struct e1000_nic * device);
+
+/**
+ * Receive and reclaim sent buffers until there's nothing left to do,
+ * then unmask interrupts and sleep until one arrives. Anything that
+ * turns up between the last look and the unmasking is still flagged
+ * in ICR, so unmasking raises the interrupt right away and we're
+ * woken again rather than missing it.
+ */
+static void e1000_poller(void * data) {
+	struct e1000_nic * nic = data;
+
+	while (1) {
+		int processed = rx_poll(nic, E1000_POLL_BUDGET);
+		nic->polls++;
+
+		spin_lock(nic->tx_lock);
+		tx_reclaim(nic);
+		spin_unlock(nic->tx_lock);
+
+		if (processed == E1000_POLL_BUDGET) {
+			nic->busy_polls++;
+			switch_task(1);
+			continue;
 		}
+
+		write_command(nic, E1000_REG_IMS, INTS);
+		switch_task(0);
 	}
 }
 
@@ -275,19 +344,38 @@ static int e1000_irq_handler(process_t * this, int irq, void * data) {
 	return handled;
 }
 
-static int tx_full(struct e1000_nic * device, int tx_tail, int tx_head) {
-	if (tx_tail == tx_head) return 0;
-	if (device->tx_index == tx_head) return 1;
-	if (((device->tx_index + 1) & E1000_NUM_TX_DESC) == tx_head) return 1;
-	return 0;
+/**
+ * Release the buffers of frames the card has finished sending.
+ * Called with the transmit lock held, when sending and from the poller.
+ */
+static void tx_reclaim(struct e1000_nic * device) {
+	while (device->tx_clean != device->tx_index) {
+#if defined(__aarch64__)
+		asm volatile ("dc ivac, %0\ndsb sy\n" :: "r"(&device->tx[device->tx_clean]) : "memory");
+#endif
+		if (!(device->tx[device->tx_clean].status & TSTA_DD)) break;
+		netbuf_put(device->tx_bufs[device->tx_clean]);
+		device->tx_bufs[device->tx_clean] = NULL;
+		if (++device->tx_clean == E1000_NUM_TX_DESC) {
+			device->tx_clean = 0;
+		}
+	}
 }
 
-static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payload_size) {
+static int tx_full(struct e1000_nic * device) {
+	tx_reclaim(device);
+	return (device->tx_index + 1) % E1000_NUM_TX_DESC == device->tx_clean;
+}
+
+/**
+ * Put a frame on the transmit ring. The card reads it straight out of
+ * @p nb, which is held until tx_reclaim sees it has been sent.
+ */
+static void send_packet(struct e1000_nic * device, netbuf_t * nb) {
 	spin_lock(device->tx_lock);
-	int tx_tail = read_command(device, E1000_REG_TXDESCTAIL);
-	int tx_head = read_command(device, E1000_REG_TXDESCHEAD);
 
-	if (tx_full(device, tx_tail, tx_head)) {
+	if (tx_full(device)) {
+		device->tx_waits++;
 		int timeout = 1000;
 		do {
 			spin_unlock(device->tx_lock);
@@ -295,31 +383,31 @@ static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payl
 			timeout--;
 			if (timeout == 0) {
 				printf("e1000: wait for tx timed out, giving up\n");
+				netbuf_put(nb);
 				return;
 			}
 			spin_lock(device->tx_lock);
-			tx_tail = read_command(device, E1000_REG_TXDESCTAIL);
-			tx_head = read_command(device, E1000_REG_TXDESCHEAD);
-		} while (tx_full(device, tx_tail, tx_head));
+		} while (tx_full(device));
 	}
 
 	int sent = device->tx_index;
 
-	memcpy(device->tx_virt[device->tx_index], payload, payload_size);
 #if defined(__aarch64__)
 	asm volatile ("dmb ish\nisb" ::: "memory");
-	cache_clean(device->tx_virt[device->tx_index]);
+	cache_clean(nb);
 #endif
 
-	device->tx[device->tx_index].length = payload_size;
-	device->tx[device->tx_index].cmd = CMD_EOP | CMD_IFCS | CMD_RS | CMD_RPS;
-	device->tx[device->tx_index].status = 0;
+	device->tx_bufs[sent] = nb;
+	device->tx[sent].addr = netbuf_dma(nb);
+	device->tx[sent].length = nb->len;
+	device->tx[sent].cmd = CMD_EOP | CMD_IFCS | CMD_RS | CMD_RPS;
+	device->tx[sent].status = 0;
 #if defined(__aarch64__)
 	asm volatile ("dmb ish\nisb" ::: "memory");
 #endif
 
 	device->counts.tx_count++;
-	device->counts.tx_bytes += payload_size;
+	device->counts.tx_bytes += nb->len;
 
 	if (++device->tx_index == E1000_NUM_TX_DESC) {
 		device->tx_index = 0;
@@ -331,13 +419,29 @@ static void send_packet(struct e1000_nic * device, uint8_t* payload, size_t payl
 
 #if defined(__aarch64__)
 	asm volatile ("dc ivac, %0\ndsb sy\n" :: "r"(&device->tx[sent]) : "memory");
-#else
-	(void)sent;
 #endif
 
 	spin_unlock(device->tx_lock);
 }
 
+static void e1000_xmit(struct EthernetDevice * eth, netbuf_t * nb) {
+	struct e1000_nic * nic = (struct e1000_nic *)eth;
+
+	/* Buffers from the heap aren't somewhere the card can reach. */
+	if (!netbuf_dma(nb)) {
+		if (nb->len > NETBUF_POOL_DATA) {
+			printf("e1000: frame of %zu bytes is too big to send\n", nb->len);
+			netbuf_put(nb);
+			return;
+		}
+		netbuf_t * copy = netbuf_copy(nb->data, nb->len);
+		netbuf_put(nb);
+		nb = copy;
+	}
+
+	send_packet(nic, nb);
+}
+
 static void init_rx(struct e1000_nic * device) {
 	write_command(device, E1000_REG_RXDESCLO, device->rx_phys);
 	write_command(device, E1000_REG_RXDESCHI, 0);
@@ -352,8 +456,7 @@ static void init_rx(struct e1000_nic * device) {
 		(1 << 2) | /* store bad packets */
 		(1 << 4) | /* multicast promiscuous */
 		(1 << 15) | /* broadcast accept */
-		(1 << 25) | /* Extended size... */
-		(3 << 16) | /*   4096 */
+		RCTL_BSIZE_2048 |
 		(1 << 26) /* strip CRC */
 	);
 }
@@ -366,6 +469,7 @@ static void init_tx(struct e1000_nic * device) {
 	write_command(device, E1000_REG_TXDESCTAIL, 0);
 
 	device->tx_index = 0;
+	device->tx_clean = 0;
 
 	uint32_t tctl = read_command(device, E1000_REG_TCTRL);
 
@@ -454,7 +558,7 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 static ssize_t write_e1000(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	struct e1000_nic * nic = node->device;
 	/* write packet */
-	send_packet(nic, buffer, size);
+	e1000_xmit(&nic->eth, netbuf_copy(buffer, size));
 	return size;
 }
 
@@ -467,30 +571,20 @@ static void ints_off(struct e1000_nic * nic) {
 static void e1000_init(struct e1000_nic * nic) {
 	uint32_t e1000_device_pci = nic->pci_device;
 
-	nic->rx_phys = mmu_allocate_n_frames(2) << 12;
-	nic->rx = mmu_map_mmio_region(nic->rx_phys, 8192);
+	size_t rx_ring = E1000_NUM_RX_DESC * sizeof(struct e1000_rx_desc);
+	nic->rx_phys = mmu_allocate_n_frames((rx_ring + 0xFFF) >> 12) << 12;
+	nic->rx = mmu_map_mmio_region(nic->rx_phys, (rx_ring + 0xFFF) & ~0xFFF);
 
-	nic->tx_phys = mmu_allocate_n_frames(2) << 12;
-	nic->tx = mmu_map_mmio_region(nic->tx_phys, 8192);
+	size_t tx_ring = E1000_NUM_TX_DESC * sizeof(struct e1000_tx_desc);
+	nic->tx_phys = mmu_allocate_n_frames((tx_ring + 0xFFF) >> 12) << 12;
+	nic->tx = mmu_map_mmio_region(nic->tx_phys, (tx_ring + 0xFFF) & ~0xFFF);
 
 	memset((void*)nic->rx, 0, sizeof(struct e1000_rx_desc) * E1000_NUM_RX_DESC);
 	memset((void*)nic->tx, 0, sizeof(struct e1000_tx_desc) * E1000_NUM_TX_DESC);
 
-	/* Allocate buffers */
+	/* Receive buffers; transmit descriptors get theirs as frames are sent */
 	for (int i = 0; i < E1000_NUM_RX_DESC; ++i) {
-		nic->rx[i].addr = mmu_allocate_a_frame() << 12;
-		nic->rx_virt[i] = mmu_map_mmio_region(nic->rx[i].addr, 4096);
-		mmu_frame_map_address(mmu_get_page((uintptr_t)nic->rx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE,nic->rx[i].addr);
-		nic->rx[i].status = 0;
-	}
-
-	for (int i = 0; i < E1000_NUM_TX_DESC; ++i) {
-		nic->tx[i].addr = mmu_allocate_a_frame() << 12;
-		nic->tx_virt[i] = mmu_map_mmio_region(nic->tx[i].addr, 4096);
-		mmu_frame_allocate(mmu_get_page((uintptr_t)nic->tx_virt[i],0),MMU_FLAG_KERNEL|MMU_FLAG_WRITABLE);
-		memset(nic->tx_virt[i], 0, 4096);
-		nic->tx[i].status = 0;
-		nic->tx[i].cmd = (1 << 0);
+		rx_refill(nic, i);
 	}
 
 	uint16_t command_reg = pci_read_field(e1000_device_pci, PCI_COMMAND, 2);
@@ -515,7 +609,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	read_mac(nic);
 	write_mac(nic);
 
-	nic->queuer = (process_t*)this_core->current_process;
+	nic->poller = (process_t*)this_core->current_process;
 
 	#define CTRL_PHY_RST (1UL << 31UL)
 	#define CTRL_RST     (1UL << 26UL)
@@ -578,7 +672,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	init_tx(nic);
 
 	write_command(nic, E1000_REG_RDTR, 0);
-	write_command(nic, E1000_REG_ITR, 500);
+	write_command(nic, E1000_REG_ITR, nic->itr);
 	read_command(nic, E1000_REG_STATUS);
 
 	nic->link_status = (read_command(nic, E1000_REG_STATUS) & (1 << 1));
@@ -590,6 +684,7 @@ static void e1000_init(struct e1000_nic * nic) {
 	nic->eth.device_node->ioctl = ioctl_e1000;
 	nic->eth.device_node->write = write_e1000;
 	nic->eth.device_node->device = nic;
+	nic->eth.xmit = e1000_xmit;
 
 	nic->eth.mtu = 1500; /* guess */
 
@@ -597,7 +692,7 @@ static void e1000_init(struct e1000_nic * nic) {
 
 	char worker_name[34];
 	snprintf(worker_name, 33, "[%s]", nic->eth.if_name);
-	nic->queuer = spawn_worker_thread(e1000_queuer, worker_name, nic);
+	nic->poller = spawn_worker_thread(e1000_poller, worker_name, nic);
 
 	nic->configured = 1;
 
@@ -619,12 +714,45 @@ static void find_e1000(uint32_t device, uint16_t vendorid, uint16_t deviceid, vo
 			(int)pci_extract_bus(device),
 			(int)pci_extract_slot(device));
 
+		/* The register counts in 256ns intervals between interrupts */
+		nic->itr = itr_rate ? 1000000000UL / (itr_rate * 256) : 0;
+
 		e1000_init(nic);
 		*(int*)found = 1;
 	}
 }
 
+static void e1000_proc_func(fs_node_t * node) {
+	for (int i = 0; i < device_count; ++i) {
+		struct e1000_nic * nic = devices[i];
+		procfs_printf(node,
+			"%s:\n"
+			"Interrupts:\t%lu\n"
+			"Polls:\t%lu\n"
+			"BusyPolls:\t%lu\n"
+			"TxWaits:\t%lu\n"
+			"RxPackets:\t%zu\n"
+			"TxPackets:\t%zu\n"
+			"RxRing:\t%d\n"
+			"TxRing:\t%d\n"
+			"ItrRate:\t%lu/s\n",
+			nic->eth.if_name, nic->interrupts, nic->polls, nic->busy_polls, nic->tx_waits,
+			nic->counts.rx_count, nic->counts.tx_count,
+			E1000_NUM_RX_DESC, E1000_NUM_TX_DESC, itr_rate);
+	}
+}
+
+static struct procfs_entry e1000_proc_entry = {
+	0,
+	"e1000",
+	e1000_proc_func,
+};
+
 static int e1000_install(int argc, char * argv[]) {
+	if (args_present("e1000_itr")) {
+		itr_rate = atoi(args_value("e1000_itr"));
+	}
+
 	uint32_t found = 0;
 	pci_scan(&find_e1000, -1, &found);
 
@@ -633,6 +761,7 @@ static int e1000_install(int argc, char * argv[]) {
 		return -ENODEV;
 	}
 
+	procfs_install(&e1000_proc_entry);
 	return 0;
 }
 
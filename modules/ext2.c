@@ -21,6 +21,9 @@
 #include <kernel/tokenize.h>
 #include <kernel/module.h>
 #include <kernel/mutex.h>
+#include <kernel/pagecache.h>
+#include <kernel/process.h>
+#include <kernel/args.h>
 
 #include <sys/ioctl.h>
 
@@ -28,6 +31,7 @@
 
 #define EXT2_SUPER_MAGIC 0xEF53
 #define EXT2_DIRECT_BLOCKS 12
+#define PAGE_SIZE 0x1000
 
 /* Super block struct. */
 struct ext2_superblock {
@@ -95,10 +99,15 @@ struct ext2_superblock {
 	/* Other Options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _unused[760];
+	uint8_t _unused_a[88];
+	uint32_t flags;
+	uint8_t _unused[668];
 
 } __attribute__ ((packed));
 
+_Static_assert(__builtin_offsetof(struct ext2_superblock, flags) == 0x160, "ext2 superblock flags misplaced");
+_Static_assert(sizeof(struct ext2_superblock) == 1024, "ext2 superblock is not 1024 bytes");
+
 typedef struct ext2_superblock ext2_superblock_t;
 
 /* Block group descriptor. */
@@ -186,6 +195,72 @@ typedef struct ext2_dir ext2_dir_t;
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+#define ICACHE_BUCKETS 256
+#define ICACHE_LIMIT   1024  /* Inodes kept in memory per filesystem */
+#define BMAP_EXTENTS   32    /* Block map runs remembered per inode */
+#define RESV_SLOTS     16    /* Inodes that can hold a block reservation at once */
+#define RESV_MIN       8     /* First reservation for an inode, in blocks */
+#define RESV_MAX       256   /* Reservations double up to this while a file keeps growing */
+
+/*
+ * A run of logical blocks of a file that are also contiguous on disk.
+ */
+struct ext2_extent {
+	uint32_t logical;
+	uint32_t physical;
+	uint32_t count;
+};
+
+/*
+ * In-memory copy of an inode.
+ *
+ * Inodes are written back every ext2_flush_age milliseconds, when the
+ * filesystem is synced, or when they are evicted, always after the bitmaps and descriptors, so an inode on
+ * disk never points at blocks that are free there. Entries with
+ * references are in use and are not evicted.
+ * Each also remembers where on disk recently used parts of the file
+ * are, so reads don't have to walk the indirect blocks again.
+ */
+struct ext2_cached_inode {
+	struct ext2_cached_inode * hash_next;
+	struct ext2_cached_inode * lru_prev;
+	struct ext2_cached_inode * lru_next;
+	uint32_t number;
+	int refs;
+	int dirty;
+	int writers;                              /* Writes in progress that may extend the file */
+	uint64_t write_end;                       /* Furthest end of those writes */
+	size_t extent_count;
+	struct ext2_extent extents[BMAP_EXTENTS]; /* Sorted by logical block */
+	uint8_t raw[];                            /* inode_size bytes */
+};
+
+/*
+ * In-memory copy of a block group's bitmaps, read in when first needed.
+ */
+struct ext2_group_cache {
+	uint8_t * block_bitmap;
+	uint8_t * inode_bitmap;
+	int dirty;
+};
+
+#define GROUP_BLOCKS_DIRTY 0x1
+#define GROUP_INODES_DIRTY 0x2
+
+/*
+ * Blocks set aside for an inode that is being written sequentially.
+ *
+ * They are marked as used in the bitmap, so nobody else takes them; the
+ * ones that are still left over go back to the free pool on sync or
+ * when the slot is needed for another inode.
+ */
+struct ext2_reservation {
+	uint32_t inode;
+	uint32_t next;  /* Next reserved block */
+	uint32_t left;  /* How many are left from there */
+	uint32_t size;  /* How many we took last time */
+};
+
 /*
  * EXT2 filesystem object
  */
@@ -210,11 +285,27 @@ typedef struct {
 	int flags;
 
 	sched_mutex_t *           mutex;
+
+	spin_lock_t               icache_lock;
+	struct ext2_cached_inode * icache[ICACHE_BUCKETS];
+	struct ext2_cached_inode * icache_head;        /* Most recently used */
+	struct ext2_cached_inode * icache_tail;
+	size_t                    icache_count;
+
+	/* The rest is protected by the fs mutex. */
+	struct ext2_group_cache * groups;
+	int                       meta_dirty;          /* Descriptors or superblock need writing */
+	struct ext2_reservation   resv[RESV_SLOTS];
+	unsigned int              resv_clock;
 } ext2_fs_t;
 
 #define EXT2_FLAG_READWRITE 0x0002
 #define EXT2_FLAG_LOUD      0x0004
 
+static struct dcache_class ext2_dcache = { .name = "ext2" };
+
+static unsigned long ext2_flush_age = 5000; /* Milliseconds; ext2_flush_age= on the kernel command line */
+
 /*
  * These macros were used in the original toaru ext2 driver.
  * They make referring to some of the core parts of the drive a bit easier.
@@ -237,7 +328,8 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode);
 static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode);
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index);
 static fs_node_t * finddir_ext2(fs_node_t *node, char *name);
-static size_t allocate_block(ext2_fs_t * this);
+static size_t allocate_block(ext2_fs_t * this, unsigned int inode_no, size_t goal, int zero);
+static void ext2_sync_metadata(ext2_fs_t * this, int drop_reservations);
 
 /**
  * ext2->rewrite_superblock Rewrite the superblock.
@@ -267,7 +359,10 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 	}
 
 	/* In such cases, we read directly from the block device */
-	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf);
+	if (read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf) < 0) {
+		debug_print(ERROR, "Failed to read block #%u.", block_no);
+		return E_BADBLOCK;
+	}
 
 	/* And return SUCCESS */
 	return E_SUCCESS;
@@ -288,7 +383,10 @@ static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
 	}
 
 	/* This operation requires the filesystem lock */
-	write_fs(this->block_device, block_no * this->block_size, this->block_size, buf);
+	if (write_fs(this->block_device, block_no * this->block_size, this->block_size, buf) < 0) {
+		debug_print(ERROR, "Failed to write block #%u.", block_no);
+		return E_BADBLOCK;
+	}
 
 	/* We're done. */
 	return E_SUCCESS;
@@ -317,7 +415,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
 		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
 		if (!inode->block[EXT2_DIRECT_BLOCKS]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS] = block_no;
 			write_inode(this, inode, inode_no);
@@ -337,7 +435,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		d = b - c * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+1]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+1] = block_no;
 			write_inode(this, inode, inode_no);
@@ -347,7 +445,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
@@ -371,7 +469,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		g = e - f * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+2]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+2] = block_no;
 			write_inode(this, inode, inode_no);
@@ -381,7 +479,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[d]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[d] = block_no;
 			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
@@ -391,7 +489,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[f]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_block(this, inode_no, rblock, 1);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[f] = block_no;
 			write_block(this, nblock, (uint8_t *)tmp);
@@ -400,7 +498,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		nblock = ((uint32_t *)tmp)[f];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		((uint32_t *)tmp)[g] = nblock;
+		((uint32_t *)tmp)[g] = rblock;
 		write_block(this, nblock, (uint8_t *)tmp);
 
 		free(tmp);
@@ -414,76 +512,121 @@ no_space_free:
 	return E_NOSPACE;
 }
 
+/**
+ * ext2->read_block_map Find the table of block pointers that covers an inode block.
+ *
+ * For direct blocks this is the inode's own block list; otherwise it is
+ * the last level of indirect blocks. Unallocated indirect blocks read
+ * as a table of zeroes.
+ *
+ * @param inode  Inode to operate on
+ * @param iblock Block offset within the inode
+ * @param table  Filled with the block pointers; must hold a whole block
+ * @param first  Set to the inode block number of the first entry in @p table
+ * @param count  Set to the number of entries in @p table
+ * @returns Error code or E_SUCCESS
+ */
+static int read_block_map(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int iblock, uint32_t * table, unsigned int * first, unsigned int * count) {
+	unsigned int p = this->pointers_per_block;
+
+	if (iblock < EXT2_DIRECT_BLOCKS) {
+		memcpy(table, inode->block, sizeof(uint32_t) * EXT2_DIRECT_BLOCKS);
+		*first = 0;
+		*count = EXT2_DIRECT_BLOCKS;
+		return E_SUCCESS;
+	}
+
+	uint32_t nblock;
+	iblock -= EXT2_DIRECT_BLOCKS;
+	*count = p;
+
+	if (iblock < p) {
+		nblock = inode->block[EXT2_DIRECT_BLOCKS];
+		*first = EXT2_DIRECT_BLOCKS;
+	} else if (iblock - p < p * p) {
+		unsigned int b = iblock - p;
+		if (!inode->block[EXT2_DIRECT_BLOCKS + 1]) goto _hole;
+		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)table);
+		nblock = table[b / p];
+		*first = EXT2_DIRECT_BLOCKS + p + (b / p) * p;
+	} else if (iblock - p - p * p < p * p * p) {
+		unsigned int c = iblock - p - p * p;
+		if (!inode->block[EXT2_DIRECT_BLOCKS + 2]) goto _hole;
+		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)table);
+		nblock = table[c / (p * p)];
+		if (!nblock) goto _hole;
+		read_block(this, nblock, (uint8_t *)table);
+		nblock = table[(c % (p * p)) / p];
+		*first = EXT2_DIRECT_BLOCKS + p + p * p + (c / p) * p;
+	} else {
+		debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock + EXT2_DIRECT_BLOCKS);
+		return E_BADBLOCK;
+	}
+
+	if (!nblock) goto _hole;
+	read_block(this, nblock, (uint8_t *)table);
+	return E_SUCCESS;
+
+_hole:
+	*first = EXT2_DIRECT_BLOCKS + (iblock / p) * p;
+	memset(table, 0, this->block_size);
+	return E_SUCCESS;
+}
+
 /**
  * ext2->get_block_number Given an inode block number, get the real block number.
  *
+ * This always walks the indirect blocks; map_block() is the cached version.
+ *
  * @param inode   Inode to operate on
  * @param iblock  Block offset within the inode
  * @returns Real block number
  */
 static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int iblock) {
-
-	unsigned int p = this->pointers_per_block;
-
-	/* We're going to do some crazy math in a bit... */
-	unsigned int a, b, c, d, e, f, g;
-
-	uint8_t * tmp;
-
 	if (iblock < EXT2_DIRECT_BLOCKS) {
 		return inode->block[iblock];
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
-		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
-
-		unsigned int out = ((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS];
-		free(tmp);
-		return out;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
-		a = iblock - EXT2_DIRECT_BLOCKS;
-		b = a - p;
-		c = b / p;
-		d = b - c * p;
-
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
+	}
 
-		uint32_t nblock = ((uint32_t *)tmp)[c];
-		read_block(this, nblock, (uint8_t *)tmp);
+	uint32_t * table = malloc(this->block_size);
+	unsigned int first, count;
+	unsigned int out = 0;
+	if (read_block_map(this, inode, iblock, table, &first, &count) == E_SUCCESS) {
+		out = table[iblock - first];
+	}
+	free(table);
+	return out;
+}
 
-		unsigned int out = ((uint32_t  *)tmp)[d];
-		free(tmp);
-		return out;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
-		a = iblock - EXT2_DIRECT_BLOCKS;
-		b = a - p;
-		c = b - p * p;
-		d = c / (p * p);
-		e = c - d * p * p;
-		f = e / p;
-		g = e - f * p;
+static int read_inode_disk(ext2_fs_t * this, void * inodet, size_t inode) {
+	if (!inode) {
+		dprintf("ext2: Attempt to read inode 0\n");
+		return E_BADBLOCK;
+	}
+	inode--;
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
+	uint32_t group = inode / this->inodes_per_group;
+	if (group > BGDS) {
+		return E_BADBLOCK;
+	}
+	uint32_t inode_table_block = BGD[group].inode_table;
+	inode -= group * this->inodes_per_group;	// adjust index within group
+	uint32_t block_offset		= (inode * this->inode_size) / this->block_size;
+	uint32_t offset_in_block    = inode - block_offset * (this->block_size / this->inode_size);
 
-		uint32_t nblock = ((uint32_t *)tmp)[d];
-		read_block(this, nblock, (uint8_t *)tmp);
+	uint8_t * buf = malloc(this->block_size);
 
-		nblock = ((uint32_t *)tmp)[f];
-		read_block(this, nblock, (uint8_t *)tmp);
+	read_block(this, inode_table_block + block_offset, buf);
 
-		unsigned int out = ((uint32_t  *)tmp)[g];
-		free(tmp);
-		return out;
-	}
+	ext2_inodetable_t *inodes = (ext2_inodetable_t *)buf;
 
-	debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
 
-	return 0;
+	free(buf);
+	return E_SUCCESS;
 }
 
-static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
+
+static int write_inode_disk(ext2_fs_t * this, void * inode, size_t index) {
 	if (!index) {
 		dprintf("ext2: Attempt to write inode 0\n");
 		return E_BADBLOCK;
@@ -510,131 +653,1315 @@ static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index)
 	return E_SUCCESS;
 }
 
-static size_t allocate_block(ext2_fs_t * this) {
-	size_t block_no     = 0;
-	size_t block_offset = 0;
-	size_t group        = 0;
-	uint8_t * bg_buffer = malloc(this->block_size);
+/**
+ * ext2->icache Inode cache.
+ *
+ * The lock only protects the cache itself; reading and writing inodes
+ * on disk is done without it.
+ */
+static unsigned int icache_bucket(size_t inode) {
+	return inode % ICACHE_BUCKETS;
+}
+
+static void icache_lru_unlink(ext2_fs_t * this, struct ext2_cached_inode * ci) {
+	if (ci->lru_prev) ci->lru_prev->lru_next = ci->lru_next;
+	else this->icache_head = ci->lru_next;
+	if (ci->lru_next) ci->lru_next->lru_prev = ci->lru_prev;
+	else this->icache_tail = ci->lru_prev;
+	ci->lru_prev = NULL;
+	ci->lru_next = NULL;
+}
+
+static void icache_touch(ext2_fs_t * this, struct ext2_cached_inode * ci) {
+	icache_lru_unlink(this, ci);
+	ci->lru_next = this->icache_head;
+	if (this->icache_head) this->icache_head->lru_prev = ci;
+	this->icache_head = ci;
+	if (!this->icache_tail) this->icache_tail = ci;
+}
+
+static struct ext2_cached_inode * icache_lookup(ext2_fs_t * this, size_t inode) {
+	for (struct ext2_cached_inode * ci = this->icache[icache_bucket(inode)]; ci; ci = ci->hash_next) {
+		if (ci->number == inode) return ci;
+	}
+	return NULL;
+}
+
+/**
+ * ext2->icache_shrink Drop unreferenced inodes until the cache is back under its limit.
+ *
+ * Dirty inodes are written back first and left for a later pass, so
+ * that nobody can read the old copy from disk while we write the new one.
+ * The allocation metadata goes out before them.
+ */
+static void icache_shrink(ext2_fs_t * this) {
+	uint8_t * tmp = malloc(this->inode_size);
+
+	spin_lock(this->icache_lock);
+	struct ext2_cached_inode * ci = this->icache_tail;
+	while (this->icache_count > ICACHE_LIMIT && ci) {
+		if (ci->refs) {
+			ci = ci->lru_prev;
+			continue;
+		}
+
+		if (ci->dirty) {
+			memcpy(tmp, ci->raw, this->inode_size);
+			ci->dirty = 0;
+			ci->refs++;
+			spin_unlock(this->icache_lock);
+			ext2_sync_metadata(this, 0);
+			write_inode_disk(this, tmp, ci->number);
+			spin_lock(this->icache_lock);
+			ci->refs--;
+			ci = ci->lru_prev;
+			continue;
+		}
+
+		struct ext2_cached_inode ** link = &this->icache[icache_bucket(ci->number)];
+		while (*link != ci) link = &(*link)->hash_next;
+		*link = ci->hash_next;
+		icache_lru_unlink(this, ci);
+		this->icache_count--;
+		spin_unlock(this->icache_lock);
+		free(ci);
+		spin_lock(this->icache_lock);
+		ci = this->icache_tail;
+	}
+	spin_unlock(this->icache_lock);
+
+	free(tmp);
+}
+
+/**
+ * ext2->iget Get a referenced in-memory copy of an inode, reading it in if needed.
+ *
+ * @returns The cached inode, or NULL if @p inode is not a valid inode number.
+ */
+static struct ext2_cached_inode * iget(ext2_fs_t * this, size_t inode) {
+	spin_lock(this->icache_lock);
+	struct ext2_cached_inode * ci = icache_lookup(this, inode);
+	if (ci) {
+		ci->refs++;
+		icache_touch(this, ci);
+		spin_unlock(this->icache_lock);
+		return ci;
+	}
+	spin_unlock(this->icache_lock);
+
+	struct ext2_cached_inode * fresh = malloc(sizeof(struct ext2_cached_inode) + this->inode_size);
+	memset(fresh, 0, sizeof(struct ext2_cached_inode));
+	fresh->number = inode;
+	if (read_inode_disk(this, fresh->raw, inode) != E_SUCCESS) {
+		free(fresh);
+		return NULL;
+	}
+
+	spin_lock(this->icache_lock);
+	ci = icache_lookup(this, inode);
+	if (ci) {
+		/* Someone else read it in while we were. */
+		ci->refs++;
+		icache_touch(this, ci);
+		spin_unlock(this->icache_lock);
+		free(fresh);
+		return ci;
+	}
+	fresh->refs = 1;
+	fresh->hash_next = this->icache[icache_bucket(inode)];
+	this->icache[icache_bucket(inode)] = fresh;
+	icache_touch(this, fresh);
+	this->icache_count++;
+	int shrink = this->icache_count > ICACHE_LIMIT;
+	spin_unlock(this->icache_lock);
+
+	if (shrink) icache_shrink(this);
+	return fresh;
+}
+
+static void iput(ext2_fs_t * this, struct ext2_cached_inode * ci) {
+	spin_lock(this->icache_lock);
+	ci->refs--;
+	spin_unlock(this->icache_lock);
+}
+
+/**
+ * ext2->icache_sync Write back all dirty inodes, and the metadata they depend on.
+ *
+ * The dirty inodes are copied out first, then the bitmaps, descriptors
+ * and superblock are written, then the copies. Blocks are allocated
+ * before the inodes that point at them are updated, so whatever the
+ * copies point at is in the metadata that goes out ahead of them.
+ *
+ * @param drop_reservations Give back reserved blocks before writing the bitmaps.
+ */
+static void icache_sync(ext2_fs_t * this, int drop_reservations) {
+	size_t count = 0;
+	spin_lock(this->icache_lock);
+	for (struct ext2_cached_inode * ci = this->icache_head; ci; ci = ci->lru_next) {
+		if (ci->dirty) count++;
+	}
+	spin_unlock(this->icache_lock);
+
+	/* Anything dirtied after we counted waits for the next sync. */
+	uint32_t * numbers = count ? malloc(sizeof(uint32_t) * count) : NULL;
+	uint8_t * copies = count ? malloc(this->inode_size * count) : NULL;
+	size_t copied = 0;
+	spin_lock(this->icache_lock);
+	for (struct ext2_cached_inode * ci = this->icache_head; ci && copied < count; ci = ci->lru_next) {
+		if (!ci->dirty) continue;
+		memcpy(copies + copied * this->inode_size, ci->raw, this->inode_size);
+		numbers[copied++] = ci->number;
+		ci->dirty = 0;
+	}
+	spin_unlock(this->icache_lock);
+
+	ext2_sync_metadata(this, drop_reservations);
+
+	for (size_t i = 0; i < copied; ++i) {
+		write_inode_disk(this, copies + i * this->inode_size, numbers[i]);
+	}
+
+	free(numbers);
+	free(copies);
+}
+
+/**
+ * ext2->ext2_flusher Write back dirty inodes, and the metadata ahead of them, every ext2_flush_age.
+ *
+ * Reservations are kept, as files may still be growing into them.
+ */
+static void ext2_flusher(void * arg) {
+	ext2_fs_t * this = arg;
+	while (1) {
+		unsigned long s, ss;
+		relative_time(0, ext2_flush_age * 1000, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+
+		icache_sync(this, 0);
+	}
+}
+
+/**
+ * ext2->refresh_inode Copy the current contents of an inode into @p inodet.
+ */
+static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode) {
+	struct ext2_cached_inode * ci = iget(this, inode);
+	if (!ci) {
+		memset(inodet, 0, this->inode_size);
+		return;
+	}
+	spin_lock(this->icache_lock);
+	memcpy(inodet, ci->raw, this->inode_size);
+	spin_unlock(this->icache_lock);
+	iput(this, ci);
+}
+
+/**
+ * ext2->write_inode Update an inode.
+ *
+ * This only changes the cached copy; it reaches the disk on sync or eviction.
+ */
+static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
+	struct ext2_cached_inode * ci = iget(this, index);
+	if (!ci) return E_BADBLOCK;
+
+	spin_lock(this->icache_lock);
+	if (memcmp(((ext2_inodetable_t *)ci->raw)->block, inode->block, sizeof(inode->block))) {
+		/* Block pointers changed; what we remember about the block map may be wrong. */
+		ci->extent_count = 0;
+	}
+	memcpy(ci->raw, inode, this->inode_size);
+	ci->dirty = 1;
+	spin_unlock(this->icache_lock);
+
+	iput(this, ci);
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->bmap_find Look up an inode block in the cached block map.
+ *
+ * Called with the cache lock held.
+ *
+ * @param run If not NULL, on input the most blocks wanted; set to how many
+ *            blocks from @p iblock on are contiguous on disk.
+ * @returns The real block number, or 0 if it isn't cached.
+ */
+static unsigned int bmap_find(struct ext2_cached_inode * ci, unsigned int iblock, unsigned int * run) {
+	size_t lo = 0, hi = ci->extent_count;
+	while (lo < hi) {
+		size_t mid = (lo + hi) / 2;
+		struct ext2_extent * e = &ci->extents[mid];
+		if (iblock < e->logical) {
+			hi = mid;
+		} else if (iblock >= e->logical + e->count) {
+			lo = mid + 1;
+		} else {
+			unsigned int left = e->logical + e->count - iblock;
+			if (run && *run > left) *run = left;
+			return e->physical + (iblock - e->logical);
+		}
+	}
+	return 0;
+}
+
+/**
+ * ext2->bmap_add Remember that @p count inode blocks from @p logical are at @p physical on disk.
+ *
+ * Called with the cache lock held. Joins the run with its neighbours
+ * when they are contiguous too; when the map is full, it starts over.
+ */
+static void bmap_add(struct ext2_cached_inode * ci, uint32_t logical, uint32_t physical, uint32_t count) {
+	size_t i = 0;
+	while (i < ci->extent_count && ci->extents[i].logical < logical) i++;
+
+	/* Drop anything this overlaps; it was a stale view of the same blocks. */
+	while (i > 0 && ci->extents[i-1].logical + ci->extents[i-1].count > logical) {
+		memmove(&ci->extents[i-1], &ci->extents[i], sizeof(struct ext2_extent) * (ci->extent_count - i));
+		ci->extent_count--;
+		i--;
+	}
+	while (i < ci->extent_count && ci->extents[i].logical < logical + count) {
+		memmove(&ci->extents[i], &ci->extents[i+1], sizeof(struct ext2_extent) * (ci->extent_count - i - 1));
+		ci->extent_count--;
+	}
+
+	if (i > 0) {
+		struct ext2_extent * prev = &ci->extents[i-1];
+		if (prev->logical + prev->count == logical && prev->physical + prev->count == physical) {
+			prev->count += count;
+			if (i < ci->extent_count) {
+				struct ext2_extent * next = &ci->extents[i];
+				if (next->logical == logical + count && next->physical == physical + count) {
+					prev->count += next->count;
+					memmove(next, next + 1, sizeof(struct ext2_extent) * (ci->extent_count - i - 1));
+					ci->extent_count--;
+				}
+			}
+			return;
+		}
+	}
+	if (i < ci->extent_count) {
+		struct ext2_extent * next = &ci->extents[i];
+		if (next->logical == logical + count && next->physical == physical + count) {
+			next->logical = logical;
+			next->physical = physical;
+			next->count += count;
+			return;
+		}
+	}
+
+	if (ci->extent_count == BMAP_EXTENTS) {
+		ci->extent_count = 0;
+		i = 0;
+	}
+	memmove(&ci->extents[i+1], &ci->extents[i], sizeof(struct ext2_extent) * (ci->extent_count - i));
+	ci->extents[i].logical = logical;
+	ci->extents[i].physical = physical;
+	ci->extents[i].count = count;
+	ci->extent_count++;
+}
+
+/**
+ * ext2->map_block Given an inode block number, get the real block number, using the cached block map.
+ *
+ * On a miss, the whole table of pointers around @p iblock is read and
+ * the contiguous run containing it is remembered, so the next blocks of
+ * a sequential read are hits.
+ *
+ * @param run If not NULL, on input the most blocks wanted; set to how many
+ *            blocks from @p iblock on are contiguous on disk.
+ * @returns Real block number, or 0 for a hole.
+ */
+static unsigned int map_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock, unsigned int * run) {
+	struct ext2_cached_inode * ci = iget(this, inode_no);
+	if (!ci) {
+		if (run) *run = 1;
+		return get_block_number(this, inode, iblock);
+	}
+
+	spin_lock(this->icache_lock);
+	unsigned int real = bmap_find(ci, iblock, run);
+	spin_unlock(this->icache_lock);
+	if (real) {
+		iput(this, ci);
+		return real;
+	}
+
+	uint32_t * table = malloc(this->block_size);
+	unsigned int first, count;
+	if (read_block_map(this, inode, iblock, table, &first, &count) != E_SUCCESS || !table[iblock - first]) {
+		free(table);
+		iput(this, ci);
+		if (run) *run = 1;
+		return 0;
+	}
+
+	unsigned int lo = iblock - first, hi = iblock - first;
+	while (lo > 0 && table[lo-1] && table[lo-1] + 1 == table[lo]) lo--;
+	while (hi + 1 < count && table[hi+1] && table[hi] + 1 == table[hi+1]) hi++;
+	real = table[iblock - first];
+	if (run && *run > hi - (iblock - first) + 1) *run = hi - (iblock - first) + 1;
+
+	spin_lock(this->icache_lock);
+	bmap_add(ci, first + lo, table[lo], hi - lo + 1);
+	spin_unlock(this->icache_lock);
+
+	free(table);
+	iput(this, ci);
+	return real;
+}
+
+/**
+ * ext2->bmap_set Note a block that set_block_number just mapped.
+ */
+static void bmap_set(ext2_fs_t * this, unsigned int inode_no, unsigned int iblock, unsigned int rblock) {
+	struct ext2_cached_inode * ci = iget(this, inode_no);
+	if (!ci) return;
+	spin_lock(this->icache_lock);
+	bmap_add(ci, iblock, rblock, 1);
+	spin_unlock(this->icache_lock);
+	iput(this, ci);
+}
+
+/**
+ * ext2->group_* Block group helpers.
+ *
+ * Bit n of a group's block bitmap is block first_data_block + group * blocks_per_group + n.
+ * The last group may be shorter than the others.
+ */
+static uint32_t group_first_block(ext2_fs_t * this, uint32_t group) {
+	return SB->first_data_block + group * SB->blocks_per_group;
+}
+
+static uint32_t group_block_count(ext2_fs_t * this, uint32_t group) {
+	uint32_t left = SB->blocks_count - group_first_block(this, group);
+	return left < SB->blocks_per_group ? left : SB->blocks_per_group;
+}
+
+/**
+ * ext2->group_bitmap Get the cached block or inode bitmap of a group, reading it in if needed.
+ *
+ * Called with the fs mutex held.
+ */
+static uint8_t * group_bitmap(ext2_fs_t * this, uint32_t group, int inodes) {
+	struct ext2_group_cache * g = &this->groups[group];
+	uint8_t ** map = inodes ? &g->inode_bitmap : &g->block_bitmap;
+	if (!*map) {
+		*map = malloc(this->block_size);
+		read_block(this, inodes ? BGD[group].inode_bitmap : BGD[group].block_bitmap, *map);
+	}
+	return *map;
+}
+
+/**
+ * ext2->bitmap_find_zero Find the first clear bit in [start, end) of a bitmap.
+ *
+ * Looks at a whole word at a time, so full stretches are skipped quickly.
+ * Bitmaps are block-sized and bits are numbered from the low end of each
+ * byte, which is also the order within a little-endian word.
+ *
+ * @returns The bit number, or @p end if they are all set.
+ */
+static uint32_t bitmap_find_zero(const uint8_t * map, uint32_t start, uint32_t end) {
+	const uint64_t * words = (const uint64_t *)map;
+	uint32_t i = start / 64;
+	uint64_t w = words[i] | ((1ULL << (start % 64)) - 1);
+	while (1) {
+		if (~w) {
+			uint32_t bit = i * 64 + __builtin_ctzll(~w);
+			return bit < end ? bit : end;
+		}
+		if (++i * 64 >= end) return end;
+		w = words[i];
+	}
+}
+
+#define BITMAP_TEST(map,n)  ((map)[(n) >> 3] & (1 << ((n) % 8)))
+#define BITMAP_SET(map,n)   ((map)[(n) >> 3] |= (1 << ((n) % 8)))
+#define BITMAP_CLEAR(map,n) ((map)[(n) >> 3] &= ~(1 << ((n) % 8)))
+
+/**
+ * ext2->take_blocks Mark up to @p count free blocks from @p block on as used.
+ *
+ * Stops at the first block that is already used or at the end of the group.
+ * Called with the fs mutex held; @p block itself must be free.
+ *
+ * @returns How many were taken.
+ */
+static uint32_t take_blocks(ext2_fs_t * this, uint32_t block, uint32_t count) {
+	uint32_t group = (block - SB->first_data_block) / SB->blocks_per_group;
+	uint32_t bit = block - group_first_block(this, group);
+	uint32_t end = group_block_count(this, group);
+	uint8_t * map = group_bitmap(this, group, 0);
+
+	uint32_t taken = 0;
+	while (taken < count && bit + taken < end && taken < BGD[group].free_blocks_count && !BITMAP_TEST(map, bit + taken)) {
+		BITMAP_SET(map, bit + taken);
+		taken++;
+	}
+
+	BGD[group].free_blocks_count -= taken;
+	SB->free_blocks_count -= taken;
+	this->groups[group].dirty |= GROUP_BLOCKS_DIRTY;
+	this->meta_dirty = 1;
+	return taken;
+}
+
+/**
+ * ext2->free_blocks Return @p count blocks from @p block on to the free pool.
+ *
+ * Called with the fs mutex held; the blocks must all be in one group.
+ */
+static void free_blocks(ext2_fs_t * this, uint32_t block, uint32_t count) {
+	if (!count) return;
+	uint32_t group = (block - SB->first_data_block) / SB->blocks_per_group;
+	uint32_t bit = block - group_first_block(this, group);
+	uint8_t * map = group_bitmap(this, group, 0);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		BITMAP_CLEAR(map, bit + i);
+	}
+
+	BGD[group].free_blocks_count += count;
+	SB->free_blocks_count += count;
+	this->groups[group].dirty |= GROUP_BLOCKS_DIRTY;
+	this->meta_dirty = 1;
+}
+
+/**
+ * ext2->find_free_block Find a free block, as close after @p goal as we can.
+ *
+ * Looks through the rest of the goal's group, then the groups after it,
+ * then wraps around to the start of the goal's group. Groups with no
+ * free blocks are skipped without looking at their bitmaps.
+ * Called with the fs mutex held.
+ *
+ * @returns Block number, or 0 if the disk is full.
+ */
+static uint32_t find_free_block(ext2_fs_t * this, uint32_t goal) {
+	if (goal < SB->first_data_block || goal >= SB->blocks_count) goal = SB->first_data_block;
+	uint32_t first = (goal - SB->first_data_block) / SB->blocks_per_group;
+	uint32_t offset = goal - group_first_block(this, first);
+
+	for (uint32_t i = 0; i <= BGDS; ++i) {
+		uint32_t group = (first + i) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
+		uint32_t start = (i == 0) ? offset : 0;
+		uint32_t end = (i == BGDS) ? offset : group_block_count(this, group);
+		if (start >= end) continue;
+		uint32_t bit = bitmap_find_zero(group_bitmap(this, group, 0), start, end);
+		if (bit < end) return group_first_block(this, group) + bit;
+	}
+
+	return 0;
+}
+
+/**
+ * ext2->resv_release Give back whatever is left of a reservation.
+ */
+static void resv_release(ext2_fs_t * this, struct ext2_reservation * r) {
+	free_blocks(this, r->next, r->left);
+	r->left = 0;
+}
+
+/**
+ * ext2->resv_get Find the reservation slot for an inode, taking one over if it has none.
+ */
+static struct ext2_reservation * resv_get(ext2_fs_t * this, uint32_t inode_no) {
+	struct ext2_reservation * empty = NULL;
+	for (int i = 0; i < RESV_SLOTS; ++i) {
+		if (this->resv[i].inode == inode_no) return &this->resv[i];
+		if (!this->resv[i].inode && !empty) empty = &this->resv[i];
+	}
+
+	if (!empty) {
+		empty = &this->resv[this->resv_clock++ % RESV_SLOTS];
+		resv_release(this, empty);
+	}
+	empty->inode = inode_no;
+	empty->left = 0;
+	empty->size = 0;
+	return empty;
+}
+
+/**
+ * ext2->resv_drop_all Give back all reservations, so the bitmaps on disk only show blocks in use.
+ */
+static void resv_drop_all(ext2_fs_t * this) {
+	for (int i = 0; i < RESV_SLOTS; ++i) {
+		resv_release(this, &this->resv[i]);
+		this->resv[i].inode = 0;
+	}
+}
+
+/**
+ * ext2->allocate_block Allocate a block.
+ *
+ * Blocks for an inode come out of its reservation while it lasts. When
+ * it runs out, a new one is made starting at the first free block after
+ * @p goal, twice as big as the last one, so a file that keeps growing
+ * ends up in long contiguous runs.
+ *
+ * The bitmaps, descriptors and superblock are only changed in memory
+ * here; they are written before any inode that could point at the
+ * block, see icache_sync.
+ *
+ * @param inode_no Inode the block is for, or 0
+ * @param goal     Where we would like the block to be, or 0 for anywhere
+ * @param zero     Whether to clear the block on disk; callers that are
+ *                 about to write all of it don't need that
+ * @returns Block number, or 0 if the disk is full.
+ */
+static size_t allocate_block(ext2_fs_t * this, unsigned int inode_no, size_t goal, int zero) {
+	uint32_t block_no = 0;
 
 	mutex_acquire(this->mutex);
 
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
+	struct ext2_reservation * r = inode_no ? resv_get(this, inode_no) : NULL;
+	if (r && r->left) {
+		block_no = r->next++;
+		r->left--;
+	} else {
+		block_no = find_free_block(this, goal);
+		if (block_no) {
+			uint32_t want = 1;
+			if (r) {
+				/* Only grow the reservation if the last one was used up. */
+				want = r->size ? r->size * 2 : RESV_MIN;
+				if (want > RESV_MAX) want = RESV_MAX;
+			}
+			uint32_t got = take_blocks(this, block_no, want);
+			if (r) {
+				r->size = got;
+				r->next = block_no + 1;
+				r->left = got - 1;
 			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
 		}
 	}
 
+	mutex_release(this->mutex);
+
 	if (!block_no) {
-		mutex_release(this->mutex);
 		debug_print(CRITICAL, "No available blocks, disk is out of space!");
-		free(bg_buffer);
 		return 0;
 	}
 
-	debug_print(WARNING, "allocating block #%zu (group %zu)", block_no, group);
-
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+	debug_print(WARNING, "allocating block #%u for inode %u", block_no, inode_no);
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+	if (zero) {
+		uint8_t * empty = malloc(this->block_size);
+		memset(empty, 0x00, this->block_size);
+		write_block(this, block_no, empty);
+		free(empty);
 	}
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
+	return block_no;
+}
+
+/**
+ * ext2->ext2_sync_metadata Write back the bitmaps, block group descriptors and superblock.
+ *
+ * On sync, reservations are given back first; anything written since the
+ * last sync has already been assigned its blocks by then, as the page
+ * cache is flushed before we get here. Otherwise reserved blocks are
+ * written out as used, which at worst leaves them allocated to nothing
+ * on disk until the next sync.
+ *
+ * @param drop_reservations Give back reserved blocks first.
+ */
+static void ext2_sync_metadata(ext2_fs_t * this, int drop_reservations) {
+	mutex_acquire(this->mutex);
+
+	if (drop_reservations) resv_drop_all(this);
+
+	for (unsigned int i = 0; i < BGDS; ++i) {
+		struct ext2_group_cache * g = &this->groups[i];
+		if (g->dirty & GROUP_BLOCKS_DIRTY) write_block(this, BGD[i].block_bitmap, g->block_bitmap);
+		if (g->dirty & GROUP_INODES_DIRTY) write_block(this, BGD[i].inode_bitmap, g->inode_bitmap);
+		g->dirty = 0;
+	}
 
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+	if (this->meta_dirty) {
+		for (int i = 0; i < this->bgd_block_span; ++i) {
+			write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		}
+		rewrite_superblock(this);
+		this->meta_dirty = 0;
+	}
 
 	mutex_release(this->mutex);
+}
 
-	free(bg_buffer);
 
-	return block_no;
+/**
+ * ext2->allocate_inode_block Allocate a block in an inode.
+ *
+ * The new block is not cleared; the caller is expected to write all of it.
+ *
+ * @param inode Inode to operate on
+ * @param inode_no Number of the inode (this is not part of the struct)
+ * @param block Block within inode to allocate
+ * @returns Error code or E_SUCCESS
+ */
+static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
+	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
+
+	/* Right after the block before it, or else near the inode. */
+	size_t goal = 0;
+	if (block > 0) goal = map_block(this, inode, inode_no, block - 1, NULL);
+	if (goal) goal++;
+	else goal = group_first_block(this, (inode_no - 1) / this->inodes_per_group);
+
+	unsigned int block_no = allocate_block(this, inode_no, goal, 0);
+
+	if (!block_no) return E_NOSPACE;
+
+	if (set_block_number(this, inode, inode_no, block, block_no) == E_SUCCESS) {
+		bmap_set(this, inode_no, block, block_no);
+	}
+
+	unsigned int t = (block + 1) * (this->block_size / 512);
+	if (inode->blocks < t) {
+		debug_print(NOTICE, "Setting inode->blocks to %d = (%d fs blocks)", t, t / (this->block_size / 512));
+		inode->blocks = t;
+	}
+	write_inode(this, inode, inode_no);
+
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->inode_read_block
+ *
+ * @param inode
+ * @param inode_no
+ * @param block
+ * @parma buf
+ * @returns Real block number for reference.
+ */
+static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+
+	if (block >= inode->blocks / (this->block_size / 512)) {
+		memset(buf, 0x00, this->block_size);
+		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
+		return 0;
+	}
+
+	unsigned int real_block = map_block(this, inode, inode_no, block, NULL);
+	if (read_block(this, real_block, buf) != E_SUCCESS) return 0;
+
+	return real_block;
+}
+
+/**
+ * ext2->inode_write_block
+ */
+static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+	if (block >= inode->blocks / (this->block_size / 512)) {
+		debug_print(WARNING, "Attempting to write beyond the existing allocated blocks for this inode.");
+		debug_print(WARNING, "Inode %d, Block %d", inode_no, block);
+	}
+
+	debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
+	char * empty = NULL;
+
+	while (block >= inode->blocks / (this->block_size / 512)) {
+		unsigned int next = inode->blocks / (this->block_size / 512);
+		if (allocate_inode_block(this, inode, inode_no, next) != E_SUCCESS) {
+			if (empty) free(empty);
+			return 0;
+		}
+		refresh_inode(this, inode, inode_no);
+		if (next < block) {
+			/* Blocks we skip over are not written by anyone else, so clear them. */
+			if (!empty) {
+				empty = malloc(this->block_size);
+				memset(empty, 0x00, this->block_size);
+			}
+			write_block(this, map_block(this, inode, inode_no, next, NULL), (uint8_t *)empty);
+		}
+	}
+	if (empty) free(empty);
+	debug_print(WARNING, "... done");
+
+	unsigned int real_block = map_block(this, inode, inode_no, block, NULL);
+	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+
+	if (write_block(this, real_block, buf) != E_SUCCESS) return 0;
+	return real_block;
+}
+
+/*
+ * Hashed directories (dir_index / htree).
+ *
+ * Block 0 of an indexed directory holds "." and "..", whose record
+ * covers the rest of the block, and after them a table of (hash, block)
+ * pairs sorted by hash. There may be one more level of such tables,
+ * each in a block that looks like a single empty directory entry. The
+ * leaves are ordinary directory blocks, so everything still works as a
+ * plain linear directory for anything that doesn't know about the index.
+ */
+#define EXT2_INDEX_FL                 0x00001000
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002
+
+#define DX_HASH_LEGACY   0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA      2
+#define DX_HASH_UNSIGNED 3  /* Added to the above for the unsigned variants */
+
+#define DX_ROOT_INFO     24 /* After the "." and ".." entries */
+#define DX_NODE_ENTRIES  8  /* After the empty directory entry */
+#define DX_MAX_LEVELS    2
+#define DX_BLOCK_MASK    0x0FFFFFFF
+
+#define DIRENT_LEN(name_len) ((sizeof(ext2_dir_t) + (name_len) + 3) & ~3)
+
+/**
+ * ext2->dirent_valid Can the entry at @p offset be followed, and its name read, without leaving the block?
+ *
+ * @param limit How much of the block is part of the directory
+ */
+static int dirent_valid(ext2_dir_t * d_ent, uint32_t offset, uint32_t limit) {
+	return d_ent->rec_len >= sizeof(ext2_dir_t) && !(d_ent->rec_len & 3) &&
+		offset + d_ent->rec_len <= limit && sizeof(ext2_dir_t) + d_ent->name_len <= d_ent->rec_len;
+}
+
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __attribute__ ((packed));
+
+/* The first entry of each table has no hash; its place holds the limit and count. */
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__ ((packed));
+
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__ ((packed));
+
+/* Where we went through one level of the index. */
+struct dx_frame {
+	uint32_t block;                 /* Directory block holding this table */
+	uint8_t * buf;
+	struct ext2_dx_entry * entries;
+	struct ext2_dx_entry * at;      /* The entry we followed */
+};
+
+static void str2hashbuf(const char * msg, int len, uint32_t * buf, int num, int is_unsigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4) len = num * 4;
+	for (int i = 0; i < len; i++) {
+		int c = is_unsigned ? (int)(unsigned char)msg[i] : (int)(signed char)msg[i];
+		val = c + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+#define ROL32(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+#define MD4_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD4_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define MD4_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD4_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = ROL32(a, s))
+#define MD4_K2 013240474631UL
+#define MD4_K3 015666365641UL
+
+static void half_md4_transform(uint32_t buf[4], const uint32_t in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	MD4_ROUND(MD4_F, a, b, c, d, in[0], 3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[1], 7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[2], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[3], 19);
+	MD4_ROUND(MD4_F, a, b, c, d, in[4], 3);
+	MD4_ROUND(MD4_F, d, a, b, c, in[5], 7);
+	MD4_ROUND(MD4_F, c, d, a, b, in[6], 11);
+	MD4_ROUND(MD4_F, b, c, d, a, in[7], 19);
+
+	MD4_ROUND(MD4_G, a, b, c, d, in[1] + MD4_K2, 3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[3] + MD4_K2, 5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[5] + MD4_K2, 9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[7] + MD4_K2, 13);
+	MD4_ROUND(MD4_G, a, b, c, d, in[0] + MD4_K2, 3);
+	MD4_ROUND(MD4_G, d, a, b, c, in[2] + MD4_K2, 5);
+	MD4_ROUND(MD4_G, c, d, a, b, in[4] + MD4_K2, 9);
+	MD4_ROUND(MD4_G, b, c, d, a, in[6] + MD4_K2, 13);
+
+	MD4_ROUND(MD4_H, a, b, c, d, in[3] + MD4_K3, 3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[7] + MD4_K3, 9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[2] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[6] + MD4_K3, 15);
+	MD4_ROUND(MD4_H, a, b, c, d, in[1] + MD4_K3, 3);
+	MD4_ROUND(MD4_H, d, a, b, c, in[5] + MD4_K3, 9);
+	MD4_ROUND(MD4_H, c, d, a, b, in[0] + MD4_K3, 11);
+	MD4_ROUND(MD4_H, b, c, d, a, in[4] + MD4_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void tea_transform(uint32_t buf[4], const uint32_t in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+	for (int n = 0; n < 16; ++n) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+	buf[0] += b0;
+	buf[1] += b1;
+}
 
+/**
+ * ext2->dx_hash Hash a file name the way the directory index does.
+ *
+ * @param version One of the DX_HASH_ values, including DX_HASH_UNSIGNED if it applies
+ * @returns The major hash, with the low bit clear.
+ */
+static uint32_t dx_hash(ext2_fs_t * this, int version, const char * name, int len) {
+	uint32_t buf[4] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476};
+	uint32_t in[8];
+	uint32_t hash = 0;
+	int is_unsigned = version >= DX_HASH_UNSIGNED;
+
+	if (SB->hash_seed[0] | SB->hash_seed[1] | SB->hash_seed[2] | SB->hash_seed[3]) {
+		memcpy(buf, SB->hash_seed, sizeof(buf));
+	}
+
+	switch (version % DX_HASH_UNSIGNED) {
+		case DX_HASH_LEGACY: {
+			uint32_t hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+			for (int i = 0; i < len; ++i) {
+				int c = is_unsigned ? (int)(unsigned char)name[i] : (int)(signed char)name[i];
+				uint32_t h = hash1 + (hash0 ^ (c * 7152373));
+				if (h & 0x80000000) h -= 0x7fffffff;
+				hash1 = hash0;
+				hash0 = h;
+			}
+			hash = hash0 << 1;
+			break;
+		}
+		case DX_HASH_HALF_MD4:
+			for (const char * p = name; len > 0; len -= 32, p += 32) {
+				str2hashbuf(p, len, in, 8, is_unsigned);
+				half_md4_transform(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+			for (const char * p = name; len > 0; len -= 16, p += 16) {
+				str2hashbuf(p, len, in, 4, is_unsigned);
+				tea_transform(buf, in);
+			}
+			hash = buf[0];
+			break;
+	}
+
+	hash &= ~1;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+static struct ext2_dx_countlimit * dx_countlimit(struct ext2_dx_entry * entries) {
+	return (struct ext2_dx_countlimit *)entries;
+}
+
+static void dx_release(struct dx_frame * frames, int levels) {
+	for (int i = 0; i < levels; ++i) {
+		free(frames[i].buf);
+	}
+}
+
+/**
+ * ext2->dx_probe Walk the directory index down to the leaf that should hold @p hash.
+ *
+ * @param frames Filled in with each level walked through; release with dx_release()
+ * @param levels Set to the number of frames
+ * @param version Set to the hash version the directory uses
+ * @returns E_SUCCESS, or E_BADBLOCK if the directory has no usable index.
+ */
+static int dx_probe(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, const char * name, size_t len,
+		struct dx_frame * frames, int * levels, int * version, uint32_t * hash) {
+	*levels = 0;
+	if (!(SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) || !(inode->flags & EXT2_INDEX_FL)) return E_BADBLOCK;
+
+	uint8_t * buf = malloc(this->block_size);
+	if (!inode_read_block(this, inode, inode_no, 0, buf)) {
+		free(buf);
+		return E_BADBLOCK;
+	}
+
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(buf + DX_ROOT_INFO);
+	if (info->hash_version > DX_HASH_TEA || info->indirect_levels >= DX_MAX_LEVELS || info->unused_flags & 1) {
+		debug_print(WARNING, "Unsupported directory index on inode %u; searching it linearly.", inode_no);
+		free(buf);
+		return E_BADBLOCK;
+	}
+
+	*version = info->hash_version;
+	if (info->hash_version <= DX_HASH_TEA && (SB->flags & EXT2_FLAGS_UNSIGNED_HASH)) {
+		*version += DX_HASH_UNSIGNED;
+	}
+	*hash = dx_hash(this, *version, name, len);
+
+	int depth = info->indirect_levels;
+	uint32_t block = 0;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(buf + DX_ROOT_INFO + info->info_length);
+
+	while (1) {
+		struct ext2_dx_countlimit * cl = dx_countlimit(entries);
+		size_t max = (this->block_size - ((uint8_t *)entries - buf)) / sizeof(struct ext2_dx_entry);
+		if (!cl->count || cl->count > cl->limit || cl->limit > max) {
+			debug_print(WARNING, "Corrupt directory index on inode %u; searching it linearly.", inode_no);
+			free(buf);
+			dx_release(frames, *levels);
+			*levels = 0;
+			return E_BADBLOCK;
+		}
+
+		/* Find the last entry with a hash no greater than ours. */
+		struct ext2_dx_entry * p = entries + 1;
+		struct ext2_dx_entry * q = entries + cl->count - 1;
+		while (p <= q) {
+			struct ext2_dx_entry * m = p + (q - p) / 2;
+			if (m->hash > *hash) {
+				q = m - 1;
+			} else {
+				p = m + 1;
+			}
+		}
+
+		struct dx_frame * frame = &frames[(*levels)++];
+		frame->block = block;
+		frame->buf = buf;
+		frame->entries = entries;
+		frame->at = p - 1;
+
+		if (!depth--) return E_SUCCESS;
+
+		block = frame->at->block & DX_BLOCK_MASK;
+		buf = malloc(this->block_size);
+		if (!inode_read_block(this, inode, inode_no, block, buf)) {
+			free(buf);
+			dx_release(frames, *levels);
+			*levels = 0;
+			return E_BADBLOCK;
+		}
+		entries = (struct ext2_dx_entry *)(buf + DX_NODE_ENTRIES);
+	}
+}
+
+/**
+ * ext2->search_dirblock Look for a name in one directory block.
+ *
+ * @param limit How much of the block is part of the directory
+ * @param offset Set to where the entry is in the block
+ * @returns The entry, in @p block, or NULL.
+ */
+static ext2_dir_t * search_dirblock(ext2_fs_t * this, uint8_t * block, uint32_t limit, const char * name, size_t len, uint32_t * offset) {
+	uint32_t dir_offset = 0;
+	while (dir_offset + sizeof(ext2_dir_t) <= limit) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + dir_offset);
+		if (!dirent_valid(d_ent, dir_offset, limit)) break;
+		if (d_ent->inode && d_ent->name_len == len && !memcmp(d_ent->name, name, len)) {
+			if (offset) *offset = dir_offset;
+			return d_ent;
+		}
+		dir_offset += d_ent->rec_len;
+	}
+	return NULL;
+}
+
+/**
+ * ext2->find_entry Find the directory entry for a name.
+ *
+ * Uses the directory index if there is one, and otherwise searches
+ * every block of the directory.
+ *
+ * @param block  Holds the directory block with the entry when this returns
+ * @param block_nr Set to which block of the directory that is
+ * @returns The entry, in @p block, or NULL.
+ */
+static ext2_dir_t * find_entry(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, const char * name, uint8_t * block, uint32_t * block_nr) {
+	size_t len = strlen(name);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	int levels, version;
+	uint32_t hash;
+
+	if (dx_probe(this, inode, inode_no, name, len, frames, &levels, &version, &hash) == E_SUCCESS) {
+		struct dx_frame * frame = &frames[levels-1];
+		struct ext2_dx_entry * end = frame->entries + dx_countlimit(frame->entries)->count;
+		ext2_dir_t * found = NULL;
+		for (struct ext2_dx_entry * at = frame->at; at < end; ++at) {
+			/* Names with the same hash can carry on into the next block, which is marked by its low hash bit. */
+			if (at != frame->at && (at->hash & ~1) != hash) break;
+			*block_nr = at->block & DX_BLOCK_MASK;
+			inode_read_block(this, inode, inode_no, *block_nr, block);
+			found = search_dirblock(this, block, this->block_size, name, len, NULL);
+			if (found) break;
+		}
+		dx_release(frames, levels);
+		return found;
+	}
+
+	uint32_t blocks = (inode->size + this->block_size - 1) / this->block_size;
+	for (uint32_t i = 0; i < blocks; ++i) {
+		uint32_t limit = inode->size - i * this->block_size;
+		if (limit > this->block_size) limit = this->block_size;
+		inode_read_block(this, inode, inode_no, i, block);
+		ext2_dir_t * found = search_dirblock(this, block, limit, name, len, NULL);
+		if (found) {
+			*block_nr = i;
+			return found;
+		}
+	}
+	return NULL;
 }
 
-
 /**
- * ext2->allocate_inode_block Allocate a block in an inode.
+ * ext2->dirent_insert Put a new entry in a directory block if it has room.
  *
- * @param inode Inode to operate on
- * @param inode_no Number of the inode (this is not part of the struct)
- * @param block Block within inode to allocate
- * @returns Error code or E_SUCCESS
+ * @returns 1 if it fit, 0 if not.
  */
-static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
-	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
-
-	if (!block_no) return E_NOSPACE;
-
-	set_block_number(this, inode, inode_no, block, block_no);
+static int dirent_insert(ext2_fs_t * this, uint8_t * block, const char * name, size_t len, uint32_t inode) {
+	unsigned int needed = DIRENT_LEN(len);
+	uint32_t dir_offset = 0;
 
-	unsigned int t = (block + 1) * (this->block_size / 512);
-	if (inode->blocks < t) {
-		debug_print(NOTICE, "Setting inode->blocks to %d = (%d fs blocks)", t, t / (this->block_size / 512));
-		inode->blocks = t;
+	while (dir_offset + sizeof(ext2_dir_t) <= this->block_size) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + dir_offset);
+		if (!dirent_valid(d_ent, dir_offset, this->block_size)) break;
+		unsigned int used = d_ent->inode ? DIRENT_LEN(d_ent->name_len) : 0;
+		if (d_ent->rec_len - used >= needed) {
+			ext2_dir_t * new = d_ent;
+			if (used) {
+				new = (ext2_dir_t *)(block + dir_offset + used);
+				new->rec_len = d_ent->rec_len - used;
+				d_ent->rec_len = used;
+			}
+			new->inode = inode;
+			new->name_len = len;
+			new->file_type = 0; /* This is unused */
+			memcpy(new->name, name, len);
+			return 1;
+		}
+		dir_offset += d_ent->rec_len;
 	}
-	write_inode(this, inode, inode_no);
 
-	return E_SUCCESS;
+	return 0;
 }
 
 /**
- * ext2->inode_read_block
+ * ext2->dx_new_node Start an index block: an empty directory entry
+ * covering the whole block, followed by the table.
  *
- * @param inode
- * @param no
- * @param block
- * @parma buf
- * @returns Real block number for reference.
+ * @returns The table in @p block.
  */
-static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
-
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		memset(buf, 0x00, this->block_size);
-		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
-		return 0;
-	}
+static struct ext2_dx_entry * dx_new_node(ext2_fs_t * this, uint8_t * block) {
+	memset(block, 0, this->block_size);
+	ext2_dir_t * d_ent = (ext2_dir_t *)block;
+	d_ent->rec_len = this->block_size;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(block + DX_NODE_ENTRIES);
+	dx_countlimit(entries)->limit = (this->block_size - DX_NODE_ENTRIES) / sizeof(struct ext2_dx_entry);
+	return entries;
+}
 
-	unsigned int real_block = get_block_number(this, inode, block);
-	read_block(this, real_block, buf);
+/**
+ * ext2->dx_grow Make room in the index table the last probe ended in.
+ *
+ * A full root has its table moved into a new block below it, adding a
+ * level to the index. A full second level block is split in two, with
+ * the upper half added to the root.
+ *
+ * @returns E_SUCCESS, or E_NOSPACE if both levels are full.
+ */
+static int dx_grow(ext2_fs_t * this, ext2_inodetable_t * pinode, uint32_t pinode_no, struct dx_frame * frames, int levels) {
+	uint8_t * block = malloc(this->block_size);
+	struct ext2_dx_entry * node = dx_new_node(this, block);
+	uint32_t new_nr = pinode->size / this->block_size;
+	struct ext2_dx_entry * root = frames[0].entries;
+	struct ext2_dx_countlimit * root_cl = dx_countlimit(root);
+
+	if (levels == 1) {
+		/* Everything moves down a level; the root is left pointing at it. */
+		uint16_t limit = dx_countlimit(node)->limit;
+		memcpy(node, root, root_cl->count * sizeof(struct ext2_dx_entry));
+		dx_countlimit(node)->limit = limit;
+		root_cl->count = 1;
+		root->block = new_nr;
+		((struct ext2_dx_root_info *)(frames[0].buf + DX_ROOT_INFO))->indirect_levels = 1;
+	} else {
+		if (root_cl->count >= root_cl->limit) {
+			debug_print(WARNING, "Directory index of inode %u is full.", pinode_no);
+			free(block);
+			return E_NOSPACE;
+		}
 
-	return real_block;
+		/* The upper half of the full block moves to the new one, and the root gets an entry for it. */
+		struct ext2_dx_entry * entries = frames[1].entries;
+		struct ext2_dx_countlimit * cl = dx_countlimit(entries);
+		uint16_t moved = cl->count / 2;
+		uint16_t keep = cl->count - moved;
+		uint32_t split_hash = entries[keep].hash;
+		uint16_t limit = dx_countlimit(node)->limit;
+		memcpy(node, entries + keep, moved * sizeof(struct ext2_dx_entry));
+		dx_countlimit(node)->limit = limit;
+		dx_countlimit(node)->count = moved;
+		cl->count = keep;
+
+		struct ext2_dx_entry * at = frames[0].at + 1;
+		memmove(at + 1, at, (uint8_t *)(root + root_cl->count) - (uint8_t *)at);
+		at->hash = split_hash;
+		at->block = new_nr;
+		root_cl->count++;
+		inode_write_block(this, pinode, pinode_no, frames[1].block, frames[1].buf);
+	}
+
+	inode_write_block(this, pinode, pinode_no, new_nr, block);
+	pinode->size += this->block_size;
+	write_inode(this, pinode, pinode_no);
+	inode_write_block(this, pinode, pinode_no, frames[0].block, frames[0].buf);
+	free(block);
+	return E_SUCCESS;
 }
 
 /**
- * ext2->inode_write_block
+ * ext2->dx_add_entry Add a name to an indexed directory.
+ *
+ * The name goes in the leaf the index points to. If that is full, the
+ * leaf is split in two by hash and the new half added to the index,
+ * growing the index first if it has no room.
+ *
+ * @returns E_SUCCESS, E_BADBLOCK if the directory has no usable index,
+ *          or E_NOSPACE if the index can't grow any further.
  */
-static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		debug_print(WARNING, "Attempting to write beyond the existing allocated blocks for this inode.");
-		debug_print(WARNING, "Inode %d, Block %d", inode_no, block);
+static int dx_add_entry(ext2_fs_t * this, ext2_inodetable_t * pinode, uint32_t pinode_no, const char * name, uint32_t inode) {
+	size_t len = strlen(name);
+	struct dx_frame frames[DX_MAX_LEVELS];
+	int levels, version;
+	uint32_t hash;
+
+retry:
+	if (dx_probe(this, pinode, pinode_no, name, len, frames, &levels, &version, &hash) != E_SUCCESS) return E_BADBLOCK;
+
+	struct dx_frame * frame = &frames[levels-1];
+	uint32_t leaf_nr = frame->at->block & DX_BLOCK_MASK;
+	uint8_t * leaf = malloc(this->block_size);
+	inode_read_block(this, pinode, pinode_no, leaf_nr, leaf);
+
+	if (dirent_insert(this, leaf, name, len, inode)) {
+		inode_write_block(this, pinode, pinode_no, leaf_nr, leaf);
+		free(leaf);
+		dx_release(frames, levels);
+		return E_SUCCESS;
 	}
 
-	debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
-	char * empty = NULL;
-
-	while (block >= inode->blocks / (this->block_size / 512)) {
-		allocate_inode_block(this, inode, inode_no, inode->blocks / (this->block_size / 512));
-		refresh_inode(this, inode, inode_no);
+	struct ext2_dx_countlimit * cl = dx_countlimit(frame->entries);
+	if (cl->count >= cl->limit) {
+		free(leaf);
+		int status = dx_grow(this, pinode, pinode_no, frames, levels);
+		dx_release(frames, levels);
+		if (status != E_SUCCESS) return status;
+		goto retry;
 	}
-	if (empty) free(empty);
-	debug_print(WARNING, "... done");
-
-	unsigned int real_block = get_block_number(this, inode, block);
-	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
 
-	write_block(this, real_block, buf);
-	return real_block;
+	/* Sort the leaf's entries by hash and find the middle by size. */
+	struct dx_map { uint32_t hash; uint16_t offset; uint16_t size; } * map = malloc(sizeof(struct dx_map) * (this->block_size / sizeof(ext2_dir_t)));
+	int count = 0;
+	size_t total = 0;
+	for (uint32_t off = 0; off + sizeof(ext2_dir_t) <= this->block_size; ) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(leaf + off);
+		if (!dirent_valid(d_ent, off, this->block_size)) break;
+		if (d_ent->inode) {
+			struct dx_map m = {dx_hash(this, version, d_ent->name, d_ent->name_len), off, DIRENT_LEN(d_ent->name_len)};
+			int i = count++;
+			while (i > 0 && map[i-1].hash > m.hash) {
+				map[i] = map[i-1];
+				i--;
+			}
+			map[i] = m;
+			total += m.size;
+		}
+		off += d_ent->rec_len;
+	}
+
+	if (count < 2) {
+		/* Nothing to split; the one entry there fills the block. */
+		free(map);
+		free(leaf);
+		dx_release(frames, levels);
+		return E_NOSPACE;
+	}
+
+	int split = 0;
+	for (size_t size = 0; split < count - 1 && size + map[split].size <= total / 2; ++split) {
+		size += map[split].size;
+	}
+	if (split == 0) split = 1;
+	uint32_t split_hash = map[split].hash;
+	/* Same hash on both sides: flag the new block as a continuation. */
+	int continued = split_hash == map[split-1].hash;
+
+	uint8_t * lower = malloc(this->block_size);
+	uint8_t * upper = malloc(this->block_size);
+	memset(lower, 0, this->block_size);
+	memset(upper, 0, this->block_size);
+	for (int half = 0; half < 2; ++half) {
+		uint8_t * out = half ? upper : lower;
+		uint32_t off = 0;
+		ext2_dir_t * last = NULL;
+		for (int i = half ? split : 0; i < (half ? count : split); ++i) {
+			last = (ext2_dir_t *)(out + off);
+			memcpy(last, leaf + map[i].offset, map[i].size);
+			last->rec_len = map[i].size;
+			off += map[i].size;
+		}
+		if (last) last->rec_len += this->block_size - off;
+	}
+	free(map);
+
+	/* The new half goes on the end of the directory. */
+	uint32_t new_nr = pinode->size / this->block_size;
+	inode_write_block(this, pinode, pinode_no, new_nr, upper);
+	pinode->size += this->block_size;
+	write_inode(this, pinode, pinode_no);
+
+	struct ext2_dx_entry * at = frame->at + 1;
+	memmove(at + 1, at, (uint8_t *)(frame->entries + cl->count) - (uint8_t *)at);
+	at->hash = split_hash | continued;
+	at->block = new_nr;
+	cl->count++;
+	inode_write_block(this, pinode, pinode_no, frame->block, frame->buf);
+
+	int fit = dirent_insert(this, hash >= split_hash ? upper : lower, name, len, inode);
+	inode_write_block(this, pinode, pinode_no, leaf_nr, lower);
+	inode_write_block(this, pinode, pinode_no, new_nr, upper);
+
+	free(lower);
+	free(upper);
+	free(leaf);
+	dx_release(frames, levels);
+	return fit ? E_SUCCESS : E_NOSPACE;
 }
 
 /**
@@ -653,6 +1980,19 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 
 	debug_print(WARNING, "Creating a directory entry for %s pointing to inode %d.", name, inode);
 
+	if (pinode->flags & EXT2_INDEX_FL) {
+		int status = dx_add_entry(this, pinode, parent->inode, name, inode);
+		if (status != E_BADBLOCK) {
+			free(pinode);
+			return status;
+		}
+		/* The index is one we can't use; drop it, and the directory still works as a linear one. */
+		debug_print(WARNING, "Could not add %s to the directory index; removing it.", name);
+		refresh_inode(this, pinode, parent->inode);
+		pinode->flags &= ~EXT2_INDEX_FL;
+		write_inode(this, pinode, parent->inode);
+	}
+
 	/* okay, how big is it... */
 
 	debug_print(WARNING, "We need to append %zd bytes to the direcotry.", sizeof(ext2_dir_t) + strlen(name));
@@ -671,18 +2011,18 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	debug_print(WARNING, "Block size is %d", this->block_size);
 
 	uint8_t * block = malloc(this->block_size);
-	uint8_t block_nr = 0;
+	uint32_t block_nr = 0;
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 	int modify_or_replace = 0;
 	ext2_dir_t *previous;
 
-	inode_read_block(this, pinode, block_nr, block);
+	inode_read_block(this, pinode, parent->inode, block_nr, block);
 	while (total_offset < pinode->size) {
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, pinode, block_nr, block);
+			inode_read_block(this, pinode, parent->inode, block_nr, block);
 		}
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
@@ -761,72 +2101,49 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	free(block);
 	free(pinode);
 
-
-	return E_NOSPACE;
+	return E_SUCCESS;
 }
 
-static unsigned int allocate_inode(ext2_fs_t * this) {
-	uint32_t node_no     = 0;
-	uint32_t node_offset = 0;
-	uint32_t group       = 0;
-	uint8_t * bg_buffer  = malloc(this->block_size);
+/**
+ * ext2->allocate_inode Allocate an inode.
+ *
+ * Starts looking in the group of @p near, so files end up next to
+ * their directory.
+ *
+ * @returns Inode number, or 0 if there are none left.
+ */
+static unsigned int allocate_inode(ext2_fs_t * this, unsigned int near) {
+	uint32_t node_no = 0;
+	uint32_t first = near ? (near - 1) / this->inodes_per_group : 0;
 
 	mutex_acquire(this->mutex);
 
 	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_inodes_count > 0) {
-			debug_print(NOTICE, "Group %d has %d free inodes.", i, BGD[i].free_inodes_count);
-			read_block(this, BGD[i].inode_bitmap, (uint8_t *)bg_buffer);
-
-			/* Sorry for the weird loops */
-			while (1) {
-				while (BLOCKBIT(node_offset)) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-				}
-				node_no = node_offset + i * this->inodes_per_group + 1;
-				/* Is this a reserved inode? */
-				if (node_no <= 10) {
-					node_offset++;
-					if (node_offset == this->inodes_per_group) {
-						goto _next_block;
-					}
-					continue;
-				}
-				break;
-			}
-			if (node_offset == this->inodes_per_group) {
-				_next_block:
-				node_offset = 0;
-				continue;
-			}
-			group = i;
-			break;
-		}
-	}
-	if (!node_no) {
-		mutex_release(this->mutex);
-		dprintf("ext2: Out of inodes? node_no = 0\n");
-		return 0;
-	}
+		uint32_t group = (first + i) % BGDS;
+		if (!BGD[group].free_inodes_count) continue;
 
-	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
+		/* The first ten inodes are reserved. */
+		uint32_t start = group == 0 ? 10 : 0;
+		if (start >= this->inodes_per_group) continue;
+		uint8_t * map = group_bitmap(this, group, 1);
+		uint32_t bit = bitmap_find_zero(map, start, this->inodes_per_group);
+		if (bit == this->inodes_per_group) continue;
 
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
-	free(bg_buffer);
-
-	BGD[group].free_inodes_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		BITMAP_SET(map, bit);
+		this->groups[group].dirty |= GROUP_INODES_DIRTY;
+		BGD[group].free_inodes_count--;
+		SB->free_inodes_count--;
+		this->meta_dirty = 1;
+		node_no = group * this->inodes_per_group + bit + 1;
+		break;
 	}
 
-	SB->free_inodes_count--;
-	rewrite_superblock(this);
-
 	mutex_release(this->mutex);
 
+	if (!node_no) {
+		dprintf("ext2: Out of inodes? node_no = 0\n");
+	}
+
 	return node_no;
 }
 
@@ -849,7 +2166,8 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -887,7 +2205,10 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	write_inode(this, inode, inode_no);
 
 	/* Now append the entry to the parent */
-	create_entry(parent, name, inode_no);
+	if (create_entry(parent, name, inode_no) != E_SUCCESS) {
+		free(inode);
+		return -ENOSPC;
+	}
 
 	inode->size = this->block_size;
 	write_inode(this, inode, inode_no);
@@ -919,11 +2240,11 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	free(pinode);
 
 	/* Update directory count in block group descriptor */
-	uint32_t group = inode_no / this->inodes_per_group;
+	uint32_t group = (inode_no - 1) / this->inodes_per_group;
+	mutex_acquire(this->mutex);
 	BGD[group].used_dirs_count++;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
-	}
+	this->meta_dirty = 1;
+	mutex_release(this->mutex);
 
 	return 0;
 }
@@ -943,7 +2264,8 @@ static int create_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -981,7 +2303,10 @@ static int create_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	write_inode(this, inode, inode_no);
 
 	/* Now append the entry to the parent */
-	create_entry(parent, name, inode_no);
+	if (create_entry(parent, name, inode_no) != E_SUCCESS) {
+		free(inode);
+		return -ENOSPC;
+	}
 
 	free(inode);
 
@@ -1006,8 +2331,8 @@ static int chmod_ext2(fs_node_t * node, mode_t mode) {
  */
 static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index) {
 	uint8_t *block = malloc(this->block_size);
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
+	uint32_t block_nr = 0;
+	inode_read_block(this, inode, no, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 	uint32_t dir_index = 0;
@@ -1032,7 +2357,7 @@ static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, u
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+			inode_read_block(this, inode, no, block_nr, block);
 		}
 	}
 
@@ -1050,47 +2375,19 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
+	uint32_t block_nr;
 	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = malloc(d_ent->rec_len);
-			memcpy(direntry, d_ent, d_ent->rec_len);
-			break;
-		}
-		free(dname);
-
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
+	ext2_dir_t *d_ent = find_entry(this, inode, node->inode, name, block, &block_nr);
+	if (d_ent) {
+		direntry = malloc(d_ent->rec_len);
+		memcpy(direntry, d_ent, d_ent->rec_len);
 	}
 	free(inode);
 	if (!direntry) {
 		free(block);
 		return NULL;
 	}
-	fs_node_t *outnode = malloc(sizeof(fs_node_t));
+	fs_node_t *outnode = vfs_alloc_node();
 	memset(outnode, 0, sizeof(fs_node_t));
 
 	inode = read_inode(this, direntry->inode);
@@ -1113,40 +2410,8 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
-	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = d_ent;
-			break;
-		}
-		free(dname);
-
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
-	}
+	uint32_t block_nr;
+	ext2_dir_t *direntry = find_entry(this, inode, node->inode, name, block, &block_nr);
 	if (!direntry) {
 		free(inode);
 		free(block);
@@ -1177,33 +2442,6 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 }
 
 
-static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode) {
-	if (!inode) {
-		dprintf("ext2: Attempt to read inode 0\n");
-		return;
-	}
-	inode--;
-
-	uint32_t group = inode / this->inodes_per_group;
-	if (group > BGDS) {
-		return;
-	}
-	uint32_t inode_table_block = BGD[group].inode_table;
-	inode -= group * this->inodes_per_group;	// adjust index within group
-	uint32_t block_offset		= (inode * this->inode_size) / this->block_size;
-	uint32_t offset_in_block    = inode - block_offset * (this->block_size / this->inode_size);
-
-	uint8_t * buf = malloc(this->block_size);
-
-	read_block(this, inode_table_block + block_offset, buf);
-
-	ext2_inodetable_t *inodes = (ext2_inodetable_t *)buf;
-
-	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
-
-	free(buf);
-}
-
 /**
  * read_inode
  */
@@ -1213,9 +2451,7 @@ static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
 	return inodet;
 }
 
-static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	ext2_fs_t * this = (ext2_fs_t *)node->device;
-	ext2_inodetable_t * inode = read_inode(this, node->inode);
+static ssize_t read_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no, off_t offset, size_t size, uint8_t *buffer) {
 	uint32_t end;
 	if (inode->size == 0) return 0;
 	if (offset + size > inode->size) {
@@ -1223,35 +2459,51 @@ static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *bu
 	} else {
 		end = offset + size;
 	}
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
 	uint32_t size_to_read = end - offset;
-
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
+	uint32_t allocated = inode->blocks / (this->block_size / 512);
+
+	uint8_t * buf = NULL;
+	uint32_t done = 0;
+	ssize_t status = size_to_read;
+	while (done < size_to_read) {
+		uint32_t block = (offset + done) / this->block_size;
+		uint32_t in_block = (offset + done) % this->block_size;
+		uint32_t left = size_to_read - done;
+
+		if (in_block || left < this->block_size) {
+			/* Partial block at either end */
+			uint32_t count = this->block_size - in_block < left ? this->block_size - in_block : left;
+			if (!buf) buf = malloc(this->block_size);
+			if (!inode_read_block(this, inode, inode_no, block, buf) && block < allocated) {
+				status = -EIO;
+				break;
 			}
+			memcpy(buffer + done, buf + in_block, count);
+			done += count;
+			continue;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
+
+		/* Whole blocks: read as many as are contiguous on disk at once. */
+		unsigned int run = left / this->block_size;
+		unsigned int real = 0;
+		if (block < allocated) {
+			if (run > allocated - block) run = allocated - block;
+			real = map_block(this, inode, inode_no, block, &run);
 		}
+		if (real) {
+			if (read_fs(this->block_device, (uint64_t)real * this->block_size, run * this->block_size, buffer + done) < 0) {
+				status = -EIO;
+				break;
+			}
+		} else {
+			memset(buffer + done, 0, this->block_size);
+			run = 1;
+		}
+		done += run * this->block_size;
 	}
-	free(inode);
-	free(buf);
-	return size_to_read;
+
+	if (buf) free(buf);
+	return status;
 }
 
 static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
@@ -1266,49 +2518,193 @@ static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, u
 	uint32_t end_size     = end - end_block * this->block_size;
 	uint32_t size_to_read = end - offset;
 	uint8_t * buf = malloc(this->block_size);
+	ssize_t status = size_to_read;
 	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
+		inode_read_block(this, inode, inode_number, start_block, buf);
 		memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
-		inode_write_block(this, inode, inode_number, start_block, buf);
+		if (!inode_write_block(this, inode, inode_number, start_block, buf)) status = -EIO;
 	} else {
 		uint32_t block_offset;
 		uint32_t blocks_read = 0;
 		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
 			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				int b = inode_read_block(this, inode, inode_number, block_offset, buf);
 				memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
-				inode_write_block(this, inode, inode_number, block_offset, buf);
+				if (!inode_write_block(this, inode, inode_number, block_offset, buf)) status = -EIO;
 				if (!b) {
 					refresh_inode(this, inode, inode_number);
 				}
 			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
+				int b = inode_read_block(this, inode, inode_number, block_offset, buf);
 				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
-				inode_write_block(this, inode, inode_number, block_offset, buf);
+				if (!inode_write_block(this, inode, inode_number, block_offset, buf)) status = -EIO;
 				if (!b) {
 					refresh_inode(this, inode, inode_number);
 				}
 			}
 		}
 		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
+			inode_read_block(this, inode, inode_number, end_block, buf);
 			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
-			inode_write_block(this, inode, inode_number, end_block, buf);
+			if (!inode_write_block(this, inode, inode_number, end_block, buf)) status = -EIO;
 		}
 	}
 	free(buf);
-	return size_to_read;
+	return status;
+}
+
+/**
+ * ext2->write_limit How far the page cache may write an inode's data.
+ *
+ * That is the file's size, or further while a write that extends it is
+ * still being copied in; the size itself only changes once it is all
+ * there, so readers never see the new end before the data.
+ */
+static uint64_t write_limit(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_no) {
+	uint64_t limit = inode->size;
+	struct ext2_cached_inode * ci = iget(this, inode_no);
+	if (!ci) return limit;
+	spin_lock(this->icache_lock);
+	if (ci->write_end > limit) limit = ci->write_end;
+	spin_unlock(this->icache_lock);
+	iput(this, ci);
+	return limit;
+}
+
+/**
+ * Page cache callbacks. File data is read and written through the
+ * page cache; these move whole pages between it and the disk.
+ */
+static int readpage_ext2(void * device, uint64_t inode_no, uint64_t index, uint8_t * page) {
+	ext2_fs_t * this = device;
+	ext2_inodetable_t * inode = read_inode(this, inode_no);
+	uint64_t offset = index * PAGE_SIZE;
+
+	ssize_t status = 0;
+	memset(page, 0, PAGE_SIZE);
+	if (offset < inode->size) {
+		size_t size = inode->size - offset < PAGE_SIZE ? inode->size - offset : PAGE_SIZE;
+		status = read_inode_buffer(this, inode, inode_no, offset, size, page);
+	}
+
+	free(inode);
+	return status < 0 ? status : 0;
+}
+
+static int writepage_ext2(void * device, uint64_t inode_no, uint64_t index, uint8_t * page) {
+	ext2_fs_t * this = device;
+	ext2_inodetable_t * inode = read_inode(this, inode_no);
+	uint64_t offset = index * PAGE_SIZE;
+	uint64_t limit = write_limit(this, inode, inode_no);
+	ssize_t status = 0;
+
+	/* The file may have been truncated since the page was dirtied. */
+	if (offset < limit) {
+		size_t size = limit - offset < PAGE_SIZE ? limit - offset : PAGE_SIZE;
+		status = write_inode_buffer(this, inode, inode_no, offset, size, page);
+	}
+
+	free(inode);
+	return status < 0 ? status : 0;
+}
+
+/*
+ * Blocks are allocated in order from the start of the file, so this
+ * allocates any that are missing up to the end of the page, or of the
+ * file if that comes first, counting writes still extending it. Blocks
+ * in front of the page are cleared, as nothing else will write them.
+ */
+static int reserve_ext2(void * device, uint64_t inode_no, uint64_t index) {
+	ext2_fs_t * this = device;
+	ext2_inodetable_t * inode = read_inode(this, inode_no);
+	uint64_t offset = index * PAGE_SIZE;
+	uint64_t limit = write_limit(this, inode, inode_no);
+	int status = 0;
+
+	if (offset < limit) {
+		uint64_t end = limit - offset < PAGE_SIZE ? limit : offset + PAGE_SIZE;
+		unsigned int first = offset / this->block_size;
+		unsigned int last = (end - 1) / this->block_size;
+		uint8_t * empty = NULL;
+
+		while (last >= inode->blocks / (this->block_size / 512)) {
+			unsigned int next = inode->blocks / (this->block_size / 512);
+			if (allocate_inode_block(this, inode, inode_no, next) != E_SUCCESS) {
+				status = -ENOSPC;
+				break;
+			}
+			refresh_inode(this, inode, inode_no);
+			if (next < first) {
+				if (!empty) {
+					empty = malloc(this->block_size);
+					memset(empty, 0x00, this->block_size);
+				}
+				if (write_block(this, map_block(this, inode, inode_no, next, NULL), empty) != E_SUCCESS) {
+					status = -EIO;
+					break;
+				}
+			}
+		}
+		if (empty) free(empty);
+	}
+
+	free(inode);
+	return status;
+}
+
+static const pagecache_ops_t ext2_page_ops = {
+	.readpage = readpage_ext2,
+	.writepage = writepage_ext2,
+	.reserve = reserve_ext2,
+};
+
+static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	uint32_t file_size = inode->size;
+	free(inode);
+
+	if ((uint64_t)offset >= file_size) return 0;
+	if (offset + size > file_size) {
+		size = file_size - offset;
+	}
+
+	return pagecache_read(node, offset, size, buffer);
 }
 
 static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	if (!(this->flags & EXT2_FLAG_READWRITE)) return -EROFS;
 
-	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	/*
+	 * Data reaches the disk when the page cache writes it back. While it is being
+	 * copied in, space is reserved and pages written back up to the end of the
+	 * write (see write_limit); the size only grows by what made it in.
+	 */
+	struct ext2_cached_inode * ci = iget(this, node->inode);
+	if (!ci) return -EIO;
+	spin_lock(this->icache_lock);
+	ci->writers++;
+	if ((uint64_t)offset + size > ci->write_end) ci->write_end = offset + size;
+	spin_unlock(this->icache_lock);
+
+	ssize_t written = pagecache_write(node, offset, size, buffer);
+
+	if (written > 0) {
+		ext2_inodetable_t * inode = read_inode(this, node->inode);
+		if ((uint64_t)offset + written > inode->size) {
+			inode->size = offset + written;
+			write_inode(this, inode, node->inode);
+		}
+		free(inode);
+	}
 
-	ssize_t rv = write_inode_buffer(this, inode, node->inode, offset, size, buffer);
-	free(inode);
-	return rv;
+	spin_lock(this->icache_lock);
+	if (!--ci->writers) ci->write_end = 0;
+	spin_unlock(this->icache_lock);
+	iput(this, ci);
+
+	return written;
 }
 
 static int truncate_ext2(fs_node_t * node, size_t size) {
@@ -1319,6 +2715,9 @@ static int truncate_ext2(fs_node_t * node, size_t size) {
 	ext2_inodetable_t * inode = read_inode(this,node->inode);
 	inode->size = 0;
 	write_inode(this, inode, node->inode);
+	free(inode);
+
+	pagecache_truncate(this, node->inode, 0);
 	return 0;
 }
 
@@ -1369,7 +2768,8 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	}
 
 	/* Allocate an inode for it */
-	unsigned int inode_no = allocate_inode(this);
+	unsigned int inode_no = allocate_inode(this, parent->inode);
+	if (!inode_no) return -ENOSPC;
 	ext2_inodetable_t * inode = read_inode(this,inode_no);
 
 	/* Set the access and creation times to now */
@@ -1415,7 +2815,10 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	write_inode(this, inode, inode_no);
 
 	/* Now append the entry to the parent */
-	create_entry(parent, name, inode_no);
+	if (create_entry(parent, name, inode_no) != E_SUCCESS) {
+		free(inode);
+		return -ENOSPC;
+	}
 
 
 	/* If we didn't embed it in the inode just use write_inode_buffer to finish the job */
@@ -1432,7 +2835,7 @@ static ssize_t readlink_ext2(fs_node_t * node, char * buf, size_t size) {
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
 	size_t read_size = inode->size < size ? inode->size : size;
 	if (inode->size > 60) { //sizeof(_symlink(inode))) {
-		read_ext2(node, 0, read_size, (uint8_t *)buf);
+		read_inode_buffer(this, inode, node->inode, 0, read_size, (uint8_t *)buf);
 	} else {
 		memcpy(buf, _symlink(inode), read_size);
 	}
@@ -1450,8 +2853,12 @@ static int ioctl_ext2(fs_node_t * node, unsigned long request, void * argp) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 
 	switch (request) {
-		case IOCTLSYNC:
-			return ioctl_fs(this->block_device, IOCTLSYNC, NULL);
+		case IOCTLSYNC: {
+			int status = pagecache_sync(this);
+			icache_sync(this, 1);
+			int flushed = ioctl_fs(this->block_device, IOCTLSYNC, NULL);
+			return status ? status : flushed;
+		}
 
 		default:
 			return -EINVAL;
@@ -1496,6 +2903,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 		fnode->symlink  = symlink_ext2;
 		fnode->readdir  = readdir_ext2;
 		fnode->finddir  = finddir_ext2;
+		fnode->dcache   = &ext2_dcache;
 		fnode->write    = NULL;
 		fnode->readlink = NULL;
 	}
@@ -1591,6 +2999,7 @@ static int ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t *fnod
 	fnode->close   = close_ext2;
 	fnode->readdir = readdir_ext2;
 	fnode->finddir = finddir_ext2;
+	fnode->dcache = &ext2_dcache;
 	fnode->ioctl   = NULL;
 	fnode->create  = create_ext2;
 	fnode->mkdir   = mkdir_ext2;
@@ -1650,6 +3059,9 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 		read_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
 	}
 
+	this->groups = malloc(sizeof(struct ext2_group_cache) * BGDS);
+	memset(this->groups, 0, sizeof(struct ext2_group_cache) * BGDS);
+
 	dprintf("ext2: %u BGDs, %u inodes, %u inodes per group\n",
 		BGDS, SB->inodes_count, this->inodes_per_group);
 
@@ -1687,6 +3099,10 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	if (!ext2_root(this, root_inode, RN)) {
 		return NULL;
 	}
+	pagecache_register(this, &ext2_page_ops);
+	if ((this->flags & EXT2_FLAG_READWRITE) && ext2_flush_age) {
+		spawn_worker_thread(ext2_flusher, "[ext2 flush]", this);
+	}
 	debug_print(NOTICE, "Mounted EXT2 disk, root VFS node is at %#zx", (uintptr_t)RN);
 	return RN;
 }
@@ -1716,6 +3132,9 @@ fs_node_t * ext2_fs_mount(const char * device, const char * mount_path) {
 }
 
 static int init(int argc, char * argv[]) {
+	if (args_present("ext2_flush_age")) {
+		ext2_flush_age = atoi(args_value("ext2_flush_age"));
+	}
 	vfs_register("ext2", ext2_fs_mount);
 	return 0;
 }